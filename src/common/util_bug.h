@@ -74,6 +74,13 @@
 
 #define tor_assert_unreached() tor_assert(0)
 
+/** Fail to compile if the constant expression <b>x</b> is false. Usable
+ * wherever a declaration is. */
+#define CTASSERT(x) CTASSERT_EXPN_((x), __LINE__)
+#define CTASSERT_EXPN_(x, line) CTASSERT_DECL_(x, line)
+#define CTASSERT_DECL_(x, line) \
+  typedef char tor_ctassert_line_##line[(x) ? 1 : -1] ATTR_UNUSED
+
 /* Non-fatal bug assertions. The "unreached" variants mean "this line should
  * never be reached." The "once" variants mean "Don't log a warning more than
  * once".
@@ -324,6 +324,11 @@ struct channel_s {
   time_t timestamp_recv; /* Cell received from lower layer */
   time_t timestamp_xmit; /* Cell sent to lower layer */
 
+  /** Last time a cell of a paid (mt_priority) circuit was queued to or from
+   * this channel; while recent, its connection draws on the bandwidth
+   * reserved by MoneTorPremiumReserve. */
+  time_t timestamp_mt_priority;
+
   /** Timestamp for run_connection_housekeeping(). We update this once a
    * second when we run housekeeping and find a circuit on this channel, and
    * whenever we add a circuit to the channel. */
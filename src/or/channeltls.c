@@ -44,6 +44,7 @@
 #include "channeltls.h"
 #include "circuitmux.h"
 #include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
 #include "command.h"
 #include "config.h"
 #include "connection.h"
@@ -162,7 +163,9 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  if (cell_ewma_enabled()) {
+  if (get_options()->MoneTorWFQ) {
+    circuitmux_set_policy(chan->cmux, &wfq_policy);
+  } else if (cell_ewma_enabled()) {
     circuitmux_set_policy(chan->cmux, &ewma_policy);
   }
 }
@@ -50,6 +50,7 @@
 #include "main.h"
 #include "microdesc.h"
 #include "mt_common.h"
+#include "mt_paywindow.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -492,7 +493,7 @@ origin_circuit_init(uint8_t purpose, int flags)
       purpose == CIRCUIT_PURPOSE_I_LEDGER ||
       purpose == CIRCUIT_PURPOSE_R_INTERMEDIARY ||
       purpose == CIRCUIT_PURPOSE_R_LEDGER) {
-    circ->buf = buf_new_with_capacity(RELAY_PPAYLOAD_SIZE);
+    circ->buf = mt_msgreasm_new();
   }
   return circ;
 }
@@ -1391,11 +1392,9 @@ circuit_init_ppath(pay_path_t* prev) {
   ppath->window = get_options()->MoneTorInitialWindow;
   if (prev) {
     ppath->prev = prev;
-    ppath->buf = buf_new_with_capacity(RELAY_PPAYLOAD_SIZE);
-  }
-  else {
-    ppath->buf = buf_new_with_capacity(CELL_PPAYLOAD_SIZE);
   }
+  ppath->buf = mt_msgreasm_new();
+  ppath->pw = mt_paywindow_new();
   return ppath;
 }
 
@@ -186,12 +186,12 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (direction == CELL_DIRECTION_OUT) {
     chan_ptr = &circ->n_chan;
     circid_ptr = &circ->n_circ_id;
-    make_active = circ->n_chan_cells.n > 0;
+    make_active = circ->n_chan_cells.n + circ->n_chan_pcells.n > 0;
   } else {
     or_circuit_t *c = TO_OR_CIRCUIT(circ);
     chan_ptr = &c->p_chan;
     circid_ptr = &c->p_circ_id;
-    make_active = c->p_chan_cells.n > 0;
+    make_active = c->p_chan_cells.n + c->p_chan_pcells.n > 0;
   }
   old_chan = *chan_ptr;
   old_id = *circid_ptr;
@@ -399,7 +399,7 @@ circuit_set_p_circid_chan(or_circuit_t *or_circ, circid_t id,
   circuit_set_circid_chan_helper(circ, CELL_DIRECTION_IN, id, chan);
 
   if (chan) {
-    tor_assert(bool_eq(or_circ->p_chan_cells.n,
+    tor_assert(bool_eq(or_circ->p_chan_cells.n + or_circ->p_chan_pcells.n,
                        or_circ->next_active_on_p_chan));
 
     chan->timestamp_last_had_circuits = approx_time();
@@ -424,7 +424,8 @@ circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
   circuit_set_circid_chan_helper(circ, CELL_DIRECTION_OUT, id, chan);
 
   if (chan) {
-    tor_assert(bool_eq(circ->n_chan_cells.n, circ->next_active_on_n_chan));
+    tor_assert(bool_eq(circ->n_chan_cells.n + circ->n_chan_pcells.n,
+                       circ->next_active_on_n_chan));
 
     chan->timestamp_last_had_circuits = approx_time();
   }
@@ -862,6 +863,7 @@ init_circuit_base(circuit_t *circ)
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
   cell_queue_init(&circ->n_chan_cells);
+  cell_queue_init(&circ->n_chan_pcells);
 
   smartlist_add(circuit_get_global_list(), circ);
   circ->global_circuitlist_idx = smartlist_len(circuit_get_global_list()) - 1;
@@ -953,6 +955,7 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
 
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
   cell_queue_init(&circ->p_chan_cells);
+  cell_queue_init(&circ->p_chan_pcells);
 
   init_circuit_base(TO_CIRCUIT(circ));
 
@@ -1085,6 +1088,7 @@ circuit_free(circuit_t *circ)
     /* Clear cell queue _after_ removing it from the map.  Otherwise our
      * "active" checks will be violated. */
     cell_queue_clear(&ocirc->p_chan_cells);
+    cell_queue_clear(&ocirc->p_chan_pcells);
   }
 
   extend_info_free(circ->n_hop);
@@ -1107,6 +1111,7 @@ circuit_free(circuit_t *circ)
   /* Clear cell queue _after_ removing it from the map.  Otherwise our
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_chan_cells);
+  cell_queue_clear(&circ->n_chan_pcells);
 
   log_info(LD_CIRC, "Circuit %u (id: %" PRIu32 ") has been freed.",
            n_circ_id,
@@ -2251,11 +2256,13 @@ marked_circuit_free_cells(circuit_t *circ)
     return;
   }
   cell_queue_clear(&circ->n_chan_cells);
+  cell_queue_clear(&circ->n_chan_pcells);
   if (circ->n_mux)
     circuitmux_clear_num_cells(circ->n_mux, circ);
   if (! CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
     cell_queue_clear(&orcirc->p_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_pcells);
     if (orcirc->p_mux)
       circuitmux_clear_num_cells(orcirc->p_mux, circ);
   }
@@ -2317,10 +2324,11 @@ marked_circuit_free_stream_bytes(circuit_t *c)
 STATIC size_t
 n_cells_in_circ_queues(const circuit_t *c)
 {
-  size_t n = c->n_chan_cells.n;
+  size_t n = c->n_chan_cells.n + c->n_chan_pcells.n;
   if (! CIRCUIT_IS_ORIGIN(c)) {
     circuit_t *cc = (circuit_t *) c;
     n += TO_OR_CIRCUIT(cc)->p_chan_cells.n;
+    n += TO_OR_CIRCUIT(cc)->p_chan_pcells.n;
   }
   return n;
 }
@@ -2341,14 +2349,15 @@ circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 
   if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head)))
     age = now - cell->inserted_time;
+  if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_pcells.head)))
+    age = MAX(age, now - cell->inserted_time);
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
-    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
-      uint32_t age2 = now - cell->inserted_time;
-      if (age2 > age)
-        return age2;
-    }
+    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head)))
+      age = MAX(age, now - cell->inserted_time);
+    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_pcells.head)))
+      age = MAX(age, now - cell->inserted_time);
   }
   return age;
 }
@@ -49,6 +49,12 @@
  *     circuitmuc_clear_num_cells() or circuitmux_set_num_cells() MUST be
  *     called when the number of cells queued on a circuit changes.
  *
+ *   circuitmux_set_num_pcells():
+ *
+ *     Set how many of those cells are payment cells.  Circuits with a few
+ *     payment cells queued are picked ahead of every other circuit,
+ *     whatever the policy.
+ *
  * See circuitmux.h for the circuitmux_policy_t data structure, which contains
  * a table of function pointers implementing a circuit selection policy, and
  * circuitmux_ewma.c for an example of a circuitmux policy.  Circuitmux
@@ -73,6 +79,7 @@
 #include "channel.h"
 #include "circuitlist.h"
 #include "circuitmux.h"
+#include "config.h"
 #include "relay.h"
 
 /*
@@ -109,6 +116,17 @@ struct circuitmux_s {
   /* Total number of queued cells on all circuits */
   unsigned int n_cells;
 
+  /* Total number of queued payment cells on all circuits */
+  unsigned int n_pcells;
+
+  /*
+   * Circuits whose payment cells go out before anything else on this
+   * connection, in the order they get to send them.  A circuit stays here
+   * only while it has between one and MoneTorPaymentLaneMaxCells payment
+   * cells queued, so the lane can't carry bulk traffic.
+   */
+  smartlist_t *pcell_circuits;
+
   /*
    * Map from (channel ID, circuit ID) pairs to circuit_muxinfo_t
    */
@@ -156,12 +174,16 @@ struct circuitmux_s {
 struct circuit_muxinfo_s {
   /* Count of cells on this circuit at last update */
   unsigned int cell_count;
+  /* How many of those are payment cells */
+  unsigned int pcell_count;
   /* Direction of flow */
   cell_direction_t direction;
   /* Policy-specific data */
   circuitmux_policy_circ_data_t *policy_data;
   /* Mark bit for consistency checker */
   unsigned int mark:1;
+  /* True iff the circuit is in the cmux's pcell_circuits list */
+  unsigned int pcell_priority:1;
 };
 
 /*
@@ -387,6 +409,7 @@ circuitmux_alloc(void)
   rv->chanid_circid_map = tor_malloc_zero(sizeof(*( rv->chanid_circid_map)));
   HT_INIT(chanid_circid_muxinfo_map, rv->chanid_circid_map);
   destroy_cell_queue_init(&rv->destroy_cell_queue);
+  rv->pcell_circuits = smartlist_new();
 
   return rv;
 }
@@ -513,6 +536,8 @@ circuitmux_detach_all_circuits(circuitmux_t *cmux, smartlist_t *detached_out)
   cmux->n_circuits = 0;
   cmux->n_active_circuits = 0;
   cmux->n_cells = 0;
+  cmux->n_pcells = 0;
+  smartlist_clear(cmux->pcell_circuits);
 }
 
 /** Reclaim all circuit IDs currently marked as unusable on <b>chan</b> because
@@ -586,6 +611,7 @@ circuitmux_free(circuitmux_t *cmux)
   }
 
   destroy_cell_queue_clear(&cmux->destroy_cell_queue);
+  smartlist_free(cmux->pcell_circuits);
 
   tor_free(cmux);
 }
@@ -954,12 +980,13 @@ circuitmux_attach_circuit,(circuitmux_t *cmux, circuit_t *circ,
   if (direction == CELL_DIRECTION_OUT) {
     /* It's n_chan */
     chan = circ->n_chan;
-    cell_count = circ->n_chan_cells.n;
+    cell_count = circ->n_chan_cells.n + circ->n_chan_pcells.n;
     circ_id = circ->n_circ_id;
   } else {
     /* We want p_chan */
     chan = TO_OR_CIRCUIT(circ)->p_chan;
-    cell_count = TO_OR_CIRCUIT(circ)->p_chan_cells.n;
+    cell_count = TO_OR_CIRCUIT(circ)->p_chan_cells.n +
+      TO_OR_CIRCUIT(circ)->p_chan_pcells.n;
     circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
   }
   /* Assert that we did get a channel */
@@ -1136,6 +1163,9 @@ circuitmux_detach_circuit,(circuitmux_t *cmux, circuit_t *circ))
       circuitmux_make_circuit_inactive(cmux, circ, last_searched_direction);
     }
     cmux->n_cells -= hashent->muxinfo.cell_count;
+    cmux->n_pcells -= hashent->muxinfo.pcell_count;
+    if (hashent->muxinfo.pcell_priority)
+      smartlist_remove_keeporder(cmux->pcell_circuits, circ);
 
     /* Free policy-specific data if we have it */
     if (hashent->muxinfo.policy_data) {
@@ -1383,7 +1413,8 @@ circuitmux_make_circuit_inactive(circuitmux_t *cmux, circuit_t *circ,
 void
 circuitmux_clear_num_cells(circuitmux_t *cmux, circuit_t *circ)
 {
-  /* This is the same as setting the cell count to zero */
+  /* This is the same as setting the cell counts to zero */
+  circuitmux_set_num_pcells(cmux, circ, 0);
   circuitmux_set_num_cells(cmux, circ, 0);
 }
 
@@ -1445,6 +1476,50 @@ circuitmux_set_num_cells(circuitmux_t *cmux, circuit_t *circ,
   circuitmux_assert_okay_paranoid(cmux);
 }
 
+/**
+ * Set the payment cell counter for a circuit on a circuitmux; these cells
+ * are also counted by circuitmux_set_num_cells(). The circuit is moved to
+ * the back of the payment lane, or off it when it has no payment cells or
+ * more than MoneTorPaymentLaneMaxCells of them.
+ */
+
+void
+circuitmux_set_num_pcells(circuitmux_t *cmux, circuit_t *circ,
+                          unsigned int n_pcells)
+{
+  chanid_circid_muxinfo_t *hashent = NULL;
+  int max_pcells = MAX(get_options()->MoneTorPaymentLaneMaxCells, 1);
+
+  tor_assert(cmux);
+  tor_assert(circ);
+
+  hashent = circuitmux_find_map_entry(cmux, circ);
+  tor_assert(hashent);
+
+  cmux->n_pcells -= hashent->muxinfo.pcell_count;
+  cmux->n_pcells += n_pcells;
+  hashent->muxinfo.pcell_count = n_pcells;
+
+  if (hashent->muxinfo.pcell_priority)
+    smartlist_remove_keeporder(cmux->pcell_circuits, circ);
+  hashent->muxinfo.pcell_priority =
+    n_pcells > 0 && n_pcells <= (unsigned int) max_pcells;
+  if (hashent->muxinfo.pcell_priority)
+    smartlist_add(cmux->pcell_circuits, circ);
+}
+
+/**
+ * Return the number of payment cells queued on all circuits of a circuitmux
+ */
+
+unsigned int
+circuitmux_num_pcells(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  return cmux->n_pcells;
+}
+
 /*
  * Functions for channel code to call to get a circuit to transmit from or
  * notify that cells have been transmitted.
@@ -1454,6 +1529,9 @@ circuitmux_set_num_cells(circuitmux_t *cmux, circuit_t *circ,
  * Pick a circuit to send from, using the active circuits list or a
  * circuitmux policy if one is available.  This is called from channel.c.
  *
+ * Circuits on the payment lane come first, ahead of destroy cells and of
+ * whatever the policy would pick.
+ *
  * If we would rather send a destroy cell, return NULL and set
  * *<b>destroy_queue_out</b> to the destroy queue.
  *
@@ -1472,7 +1550,12 @@ circuitmux_get_first_active_circuit(circuitmux_t *cmux,
 
   *destroy_queue_out = NULL;
 
-  if (cmux->destroy_cell_queue.n &&
+  if (smartlist_len(cmux->pcell_circuits) > 0) {
+    /* A payment lane circuit is always active */
+    tor_assert(cmux->n_active_circuits > 0);
+    circ = smartlist_get(cmux->pcell_circuits, 0);
+    cmux->last_cell_was_destroy = 0;
+  } else if (cmux->destroy_cell_queue.n &&
         (!cmux->last_cell_was_destroy || cmux->n_active_circuits == 0)) {
     /* We have destroy cells to send, and either we just sent a relay cell,
      * or we have no relay cells to send. */
@@ -1957,6 +2040,15 @@ circuitmux_compare_muxes, (circuitmux_t *cmux_1, circuitmux_t *cmux_2))
     return 0;
   }
 
+  /* A cmux with payment cells to send on its lane goes first */
+  if (smartlist_len(cmux_1->pcell_circuits) > 0 &&
+      smartlist_len(cmux_2->pcell_circuits) == 0) {
+    return -1;
+  } else if (smartlist_len(cmux_1->pcell_circuits) == 0 &&
+             smartlist_len(cmux_2->pcell_circuits) > 0) {
+    return 1;
+  }
+
   if (cmux_1->policy && cmux_2->policy) {
     if (cmux_1->policy == cmux_2->policy) {
       policy = cmux_1->policy;
@@ -122,6 +122,7 @@ int circuitmux_is_circuit_active(circuitmux_t *cmux, circuit_t *circ);
 unsigned int circuitmux_num_cells_for_circuit(circuitmux_t *cmux,
                                               circuit_t *circ);
 MOCK_DECL(unsigned int, circuitmux_num_cells, (circuitmux_t *cmux));
+unsigned int circuitmux_num_pcells(circuitmux_t *cmux);
 unsigned int circuitmux_num_circuits(circuitmux_t *cmux);
 unsigned int circuitmux_num_active_circuits(circuitmux_t *cmux);
 
@@ -145,6 +146,8 @@ MOCK_DECL(void, circuitmux_detach_circuit,
 void circuitmux_clear_num_cells(circuitmux_t *cmux, circuit_t *circ);
 void circuitmux_set_num_cells(circuitmux_t *cmux, circuit_t *circ,
                               unsigned int n_cells);
+void circuitmux_set_num_pcells(circuitmux_t *cmux, circuit_t *circ,
+                               unsigned int n_pcells);
 
 void circuitmux_append_destroy_cell(channel_t *chan,
                                     circuitmux_t *cmux, circid_t circ_id,
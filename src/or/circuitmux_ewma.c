@@ -176,7 +176,6 @@ static unsigned cell_ewma_tick_from_timeval(const struct timeval *now,
                                             double *remainder_out);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
@@ -427,7 +426,7 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   double fractional_tick, ewma_increment;
   /* The current (hi-res) time */
   struct timeval now_hires;
-  cell_ewma_t *cell_ewma, *tmp;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -461,11 +460,11 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   cell_ewma->mt_priority = circ->mt_priority;
 
   /*
-   * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * We just sent on this circuit.  It is usually the head of the queue,
+   * but a circuit served from the payment cell lane can be anywhere in it,
+   * so remove it from its own position and re-add it.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
+  remove_cell_ewma(pol, cell_ewma);
   add_cell_ewma(pol, cell_ewma);
 }
 
@@ -647,6 +646,24 @@ cell_ewma_get_tick(void)
   return ((unsigned)approx_time() / EWMA_TICK_LEN);
 }
 
+/** Compute the current cell_ewma tick and the fraction of the tick that has
+ * elapsed.  Return the former and store the latter in
+ * *<b>remainder_out</b>. */
+unsigned int
+cell_ewma_get_current_tick_and_fraction(double *remainder_out)
+{
+  struct timeval now_hires;
+  tor_gettimeofday_cached(&now_hires);
+  return cell_ewma_tick_from_timeval(&now_hires, remainder_out);
+}
+
+/** Return the per-tick scale factor of cell count EWMAs. */
+double
+cell_ewma_get_scale_factor(void)
+{
+  return ewma_scale_factor;
+}
+
 /** Adjust the global cell scale factor based on <b>options</b> */
 void
 cell_ewma_set_scale_factor(const or_options_t *options,
@@ -771,15 +788,3 @@ remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
                           ewma);
 }
 
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
-
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
-}
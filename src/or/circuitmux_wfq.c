@@ -0,0 +1,594 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_wfq.c
+ * \brief Weighted fair queueing of paid circuits as a circuitmux_t policy
+ *
+ * This policy sells several service levels on one channel. Each circuit is
+ * put in a tier by its mt_priority, so unpaid circuits are in tier 0 and paid
+ * ones climb the tiers as their payments come in, up to the last tier that
+ * MoneTorWFQWeights defines. While they have cells to send, tiers share the
+ * channel in proportion to their weights: a tier of weight 4 sends four cells
+ * for every cell of a tier of weight 1, however many circuits either holds.
+ *
+ * Tiers are scheduled with start-time fair queueing. Each tier carries the
+ * virtual time at which its next cell starts; sending n cells moves it on by
+ * n / weight, and the tier with the earliest start goes next. A tier that
+ * becomes active starts no earlier than the current virtual time, so a tier
+ * cannot save up a share while it is idle.
+ *
+ * Within a tier, circuits are ordered by the EWMA of their cell counts
+ * exactly as with ewma_policy, using the same CircuitPriorityHalflife, so
+ * quiet circuits still go first. Each tier keeps its own heap: picking and
+ * sending are O(log n) in the number of active circuits, plus a scan over
+ * at most WFQ_MAX_TIERS tiers.
+ *
+ * This module should be used through the interfaces in circuitmux.c, which it
+ * implements.
+ *
+ **/
+
+#define TOR_CIRCUITMUX_WFQ_C_
+
+#include "orconfig.h"
+
+#include <math.h>
+
+#include "or.h"
+#include "config.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
+
+/*** WFQ structures ***/
+
+typedef struct wfq_tier_s wfq_tier_t;
+typedef struct wfq_policy_data_s wfq_policy_data_t;
+typedef struct wfq_policy_circ_data_s wfq_policy_circ_data_t;
+
+/**
+ * The active circuits of one tier on a circuitmux
+ */
+
+struct wfq_tier_s {
+  /** Priority queue of wfq_policy_circ_data_t, kept in heap order according
+   * to their EWMA cell counts */
+  smartlist_t *pqueue;
+  /** The tick the cell counts in pqueue are scaled to */
+  unsigned int last_recalibrated;
+  /** The virtual time at which the next cell of this tier starts */
+  double start_tag;
+};
+
+struct wfq_policy_data_s {
+  circuitmux_policy_data_t base_;
+
+  wfq_tier_t tiers[WFQ_MAX_TIERS];
+
+  /** The virtual time: the start tag of the last cell sent */
+  double vtime;
+};
+
+struct wfq_policy_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+
+  /** The EWMA of the number of cells flushed from this circuit, scaled to
+   * last_adjusted_tick as in cell_ewma_t */
+  double cell_count;
+  unsigned int last_adjusted_tick;
+
+  /** The tier the circuit is queued in while it is active */
+  int tier;
+  /** The position of the circuit within its tier's priority queue */
+  int heap_index;
+
+  /** Pointer back to the circuit_t this is for */
+  circuit_t *circ;
+};
+
+#define WFQ_POL_DATA_MAGIC 0x3c5a9e21U
+#define WFQ_POL_CIRC_DATA_MAGIC 0x5e07b4d3U
+
+/*** Downcasts for the above types ***/
+
+/**
+ * Downcast a circuitmux_policy_data_t to a wfq_policy_data_t and assert
+ * if the cast is impossible.
+ */
+
+static inline wfq_policy_data_t *
+TO_WFQ_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == WFQ_POL_DATA_MAGIC);
+    return DOWNCAST(wfq_policy_data_t, pol);
+  }
+}
+
+/**
+ * Downcast a circuitmux_policy_circ_data_t to a wfq_policy_circ_data_t
+ * and assert if the cast is impossible.
+ */
+
+static inline wfq_policy_circ_data_t *
+TO_WFQ_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == WFQ_POL_CIRC_DATA_MAGIC);
+    return DOWNCAST(wfq_policy_circ_data_t, pol);
+  }
+}
+
+/*** Static declarations for circuitmux_wfq.c ***/
+
+static void add_circ(wfq_policy_data_t *pol, wfq_policy_circ_data_t *cdata);
+static void remove_circ(wfq_policy_data_t *pol,
+                        wfq_policy_circ_data_t *cdata);
+static int compare_cell_counts(const void *p1, const void *p2);
+static int pick_tier(wfq_policy_data_t *pol);
+static void scale_tier(wfq_tier_t *tier, unsigned cur_tick);
+
+/*** Circuitmux policy methods ***/
+
+static circuitmux_policy_data_t * wfq_alloc_cmux_data(circuitmux_t *cmux);
+static void wfq_free_cmux_data(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data);
+static circuitmux_policy_circ_data_t *
+wfq_alloc_circ_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+                    circuit_t *circ, cell_direction_t direction,
+                    unsigned int cell_count);
+static void
+wfq_free_circ_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data,
+                   circuit_t *circ,
+                   circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+wfq_notify_circ_active(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+wfq_notify_circ_inactive(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+wfq_notify_xmit_cells(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      circuitmux_policy_circ_data_t *pol_circ_data,
+                      unsigned int n_cells);
+static circuit_t *
+wfq_pick_active_circuit(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data);
+static int
+wfq_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
+             circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2);
+
+/*** WFQ global variables ***/
+
+/** The weight of each tier, as set by MoneTorWFQWeights */
+static int wfq_weights[WFQ_MAX_TIERS] = { 1, 4 };
+/** The number of tiers in use */
+static int wfq_n_tiers = 2;
+
+/*** WFQ circuitmux_policy_t method table ***/
+
+circuitmux_policy_t wfq_policy = {
+  /*.alloc_cmux_data =*/ wfq_alloc_cmux_data,
+  /*.free_cmux_data =*/ wfq_free_cmux_data,
+  /*.alloc_circ_data =*/ wfq_alloc_circ_data,
+  /*.free_circ_data =*/ wfq_free_circ_data,
+  /*.notify_circ_active =*/ wfq_notify_circ_active,
+  /*.notify_circ_inactive =*/ wfq_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* WFQ doesn't need this */
+  /*.notify_xmit_cells =*/ wfq_notify_xmit_cells,
+  /*.pick_active_circuit =*/ wfq_pick_active_circuit,
+  /*.cmp_cmux =*/ wfq_cmp_cmux
+};
+
+/*** WFQ method implementations ***/
+
+/**
+ * Allocate a wfq_policy_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to wfq_policy.
+ */
+
+static circuitmux_policy_data_t *
+wfq_alloc_cmux_data(circuitmux_t *cmux)
+{
+  wfq_policy_data_t *pol = NULL;
+  unsigned int tick = cell_ewma_get_tick();
+  int i;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = WFQ_POL_DATA_MAGIC;
+  for (i = 0; i < WFQ_MAX_TIERS; ++i) {
+    pol->tiers[i].pqueue = smartlist_new();
+    pol->tiers[i].last_recalibrated = tick;
+  }
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free a wfq_policy_data_t allocated with wfq_alloc_cmux_data()
+ */
+
+static void
+wfq_free_cmux_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data)
+{
+  wfq_policy_data_t *pol = NULL;
+  int i;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+
+  for (i = 0; i < WFQ_MAX_TIERS; ++i)
+    smartlist_free(pol->tiers[i].pqueue);
+  tor_free(pol);
+}
+
+/**
+ * Allocate a wfq_policy_circ_data_t and upcast it to a
+ * circuitmux_policy_data_t; this is called when attaching a circuit to a
+ * circuitmux_t with wfq_policy.
+ */
+
+static circuitmux_policy_circ_data_t *
+wfq_alloc_circ_data(circuitmux_t *cmux,
+                    circuitmux_policy_data_t *pol_data,
+                    circuit_t *circ,
+                    cell_direction_t direction,
+                    unsigned int cell_count)
+{
+  wfq_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(direction == CELL_DIRECTION_OUT ||
+             direction == CELL_DIRECTION_IN);
+  /* Shut the compiler up without triggering -Wtautological-compare */
+  (void)cell_count;
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = WFQ_POL_CIRC_DATA_MAGIC;
+  cdata->circ = circ;
+  cdata->last_adjusted_tick = cell_ewma_get_tick();
+  cdata->cell_count = 0.0;
+  cdata->tier = circuitmux_wfq_get_tier(circ);
+  cdata->heap_index = -1;
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/**
+ * Free a wfq_policy_circ_data_t allocated with wfq_alloc_circ_data()
+ */
+
+static void
+wfq_free_circ_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data,
+                   circuit_t *circ,
+                   circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+
+  tor_free(cdata);
+}
+
+/**
+ * Handle circuit activation; this queues the circuit in the tier its
+ * mt_priority puts it in.
+ */
+
+static void
+wfq_notify_circ_active(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_data_t *pol = NULL;
+  wfq_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+
+  cdata->tier = circuitmux_wfq_get_tier(circ);
+  add_circ(pol, cdata);
+}
+
+/**
+ * Handle circuit deactivation; this takes the circuit out of its tier.
+ */
+
+static void
+wfq_notify_circ_inactive(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_data_t *pol = NULL;
+  wfq_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+
+  remove_circ(pol, cdata);
+}
+
+/**
+ * Charge the cells just sent on this circuit to its tier's virtual time and
+ * to its own EWMA count, then requeue it, moving it to another tier if its
+ * mt_priority changed.
+ */
+
+static void
+wfq_notify_xmit_cells(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      circuitmux_policy_circ_data_t *pol_circ_data,
+                      unsigned int n_cells)
+{
+  wfq_policy_data_t *pol = NULL;
+  wfq_policy_circ_data_t *cdata = NULL;
+  wfq_tier_t *tier;
+  unsigned int tick;
+  double fractional_tick;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+  tier = &pol->tiers[cdata->tier];
+
+  /* The circuit may have been sent out of policy order (e.g. through the
+   * payment lane), so take it out wherever it is in its queue */
+  remove_circ(pol, cdata);
+
+  /* Advance the virtual time and the tier's share */
+  pol->vtime = MAX(pol->vtime, tier->start_tag);
+  tier->start_tag = pol->vtime + ((double)n_cells) / wfq_weights[cdata->tier];
+
+  /* Rescale the tier's EWMAs if needed, then charge the circuit */
+  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  if (tick != tier->last_recalibrated)
+    scale_tier(tier, tick);
+  cdata->cell_count +=
+    ((double)(n_cells)) * pow(cell_ewma_get_scale_factor(), -fractional_tick);
+
+  cdata->tier = circuitmux_wfq_get_tier(circ);
+  add_circ(pol, cdata);
+}
+
+/**
+ * Pick the circuit to send from: the quietest circuit of the tier whose next
+ * cell has the earliest start.
+ */
+
+static circuit_t *
+wfq_pick_active_circuit(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data)
+{
+  wfq_policy_data_t *pol = NULL;
+  wfq_policy_circ_data_t *cdata = NULL;
+  int tier;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+
+  tier = pick_tier(pol);
+  if (tier < 0)
+    return NULL;
+
+  cdata = smartlist_get(pol->tiers[tier].pqueue, 0);
+  return cdata->circ;
+}
+
+/**
+ * Compare two WFQ cmuxes, and return -1, 0 or 1 to indicate which should
+ * be more preferred - see circuitmux_compare_muxes() of circuitmux.c. The
+ * one about to send from the heavier tier wins, then the one with the
+ * quieter circuit.
+ */
+
+static int
+wfq_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
+             circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
+{
+  wfq_policy_data_t *p1 = NULL, *p2 = NULL;
+  int t1, t2;
+
+  tor_assert(cmux_1);
+  tor_assert(pol_data_1);
+  tor_assert(cmux_2);
+  tor_assert(pol_data_2);
+
+  p1 = TO_WFQ_POL_DATA(pol_data_1);
+  p2 = TO_WFQ_POL_DATA(pol_data_2);
+
+  if (p1 == p2)
+    return 0;
+
+  t1 = pick_tier(p1);
+  t2 = pick_tier(p2);
+
+  if (t1 < 0 || t2 < 0) {
+    /* Prefer whichever has a circuit, if either */
+    return (t1 < 0) - (t2 < 0);
+  }
+
+  if (wfq_weights[t1] != wfq_weights[t2])
+    return wfq_weights[t1] > wfq_weights[t2] ? -1 : 1;
+
+  return compare_cell_counts(smartlist_get(p1->tiers[t1].pqueue, 0),
+                             smartlist_get(p2->tiers[t2].pqueue, 0));
+}
+
+/*** WFQ helper functions ***/
+
+/** Helper for sorting wfq_policy_circ_data_t values in their priority
+ * queue. */
+static int
+compare_cell_counts(const void *p1, const void *p2)
+{
+  const wfq_policy_circ_data_t *c1 = p1, *c2 = p2;
+
+  if (c1->cell_count < c2->cell_count)
+    return -1;
+  else if (c1->cell_count > c2->cell_count)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return the active tier of <b>pol</b> whose next cell starts first,
+ * heavier tiers winning ties, or -1 if no circuit is active. */
+static int
+pick_tier(wfq_policy_data_t *pol)
+{
+  int best = -1;
+  int i;
+
+  for (i = 0; i < WFQ_MAX_TIERS; ++i) {
+    if (smartlist_len(pol->tiers[i].pqueue) == 0)
+      continue;
+    if (best < 0 ||
+        pol->tiers[i].start_tag < pol->tiers[best].start_tag ||
+        (!(pol->tiers[i].start_tag > pol->tiers[best].start_tag) &&
+         wfq_weights[i] >= wfq_weights[best]))
+      best = i;
+  }
+
+  return best;
+}
+
+/** Adjust the cell count of every circuit of <b>tier</b> so that they are
+ * scaled with respect to <b>cur_tick</b> */
+static void
+scale_tier(wfq_tier_t *tier, unsigned cur_tick)
+{
+  double factor = pow(cell_ewma_get_scale_factor(),
+                      (int)(cur_tick - tier->last_recalibrated));
+
+  /* Scaling every count by the same factor preserves the heap order */
+  SMARTLIST_FOREACH(tier->pqueue, wfq_policy_circ_data_t *, c, {
+    c->cell_count *= factor;
+    c->last_adjusted_tick = cur_tick;
+  });
+  tier->last_recalibrated = cur_tick;
+}
+
+/** Rescale <b>cdata</b> to the scale of its tier and add it to the tier's
+ * priority queue, starting the tier at the current virtual time if it was
+ * idle */
+static void
+add_circ(wfq_policy_data_t *pol, wfq_policy_circ_data_t *cdata)
+{
+  wfq_tier_t *tier;
+
+  tor_assert(pol);
+  tor_assert(cdata);
+  tor_assert(cdata->heap_index == -1);
+
+  tier = &pol->tiers[cdata->tier];
+
+  if (smartlist_len(tier->pqueue) == 0)
+    tier->start_tag = MAX(tier->start_tag, pol->vtime);
+
+  cdata->cell_count *= pow(cell_ewma_get_scale_factor(),
+                           (int)(tier->last_recalibrated -
+                                 cdata->last_adjusted_tick));
+  cdata->last_adjusted_tick = tier->last_recalibrated;
+
+  smartlist_pqueue_add(tier->pqueue, compare_cell_counts,
+                       offsetof(wfq_policy_circ_data_t, heap_index), cdata);
+}
+
+/** Remove <b>cdata</b> from its tier's priority queue */
+static void
+remove_circ(wfq_policy_data_t *pol, wfq_policy_circ_data_t *cdata)
+{
+  tor_assert(pol);
+  tor_assert(cdata);
+  tor_assert(cdata->heap_index != -1);
+
+  smartlist_pqueue_remove(pol->tiers[cdata->tier].pqueue, compare_cell_counts,
+                          offsetof(wfq_policy_circ_data_t, heap_index), cdata);
+}
+
+/*** Externally visible functions ***/
+
+/** Return the tier <b>circ</b> is scheduled in: its mt_priority, capped by
+ * the number of tiers in use */
+int
+circuitmux_wfq_get_tier(const circuit_t *circ)
+{
+  tor_assert(circ);
+
+  if (circ->mt_priority >= (uint32_t)wfq_n_tiers)
+    return wfq_n_tiers - 1;
+  return (int)circ->mt_priority;
+}
+
+/** Parse <b>weights</b>, a list of positive integers from MoneTorWFQWeights
+ * with one entry per tier starting at tier 0. Return -1 if it is malformed.
+ * Unless <b>validate_only</b> is set, schedule every circuitmux using
+ * wfq_policy with these weights from now on. */
+int
+circuitmux_wfq_set_weights(const smartlist_t *weights, int validate_only)
+{
+  int parsed[WFQ_MAX_TIERS];
+  int n = 0, ok;
+
+  if (!weights || smartlist_len(weights) == 0 ||
+      smartlist_len(weights) > WFQ_MAX_TIERS)
+    return -1;
+
+  SMARTLIST_FOREACH_BEGIN(weights, const char *, cp) {
+    parsed[n] = (int)tor_parse_long(cp, 10, 1, 1000000, &ok, NULL);
+    if (!ok)
+      return -1;
+    n++;
+  } SMARTLIST_FOREACH_END(cp);
+
+  if (validate_only)
+    return 0;
+
+  memcpy(wfq_weights, parsed, n * sizeof(int));
+  wfq_n_tiers = n;
+  return 0;
+}
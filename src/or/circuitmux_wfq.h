@@ -0,0 +1,24 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_wfq.h
+ * \brief Header file for circuitmux_wfq.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_WFQ_H
+#define TOR_CIRCUITMUX_WFQ_H
+
+#include "or.h"
+#include "circuitmux.h"
+
+/** Most service tiers MoneTorWFQWeights can define */
+#define WFQ_MAX_TIERS 8
+
+extern circuitmux_policy_t wfq_policy;
+
+/* Externally visible WFQ functions */
+int circuitmux_wfq_set_weights(const smartlist_t *weights, int validate_only);
+int circuitmux_wfq_get_tier(const circuit_t *circ);
+
+#endif /* !defined(TOR_CIRCUITMUX_WFQ_H) */
@@ -68,6 +68,7 @@
 #include "circuitlist.h"
 #include "circuitmux.h"
 #include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
 #include "circuitstats.h"
 #include "compress.h"
 #include "config.h"
@@ -221,6 +222,30 @@ static config_var_t option_vars_[] = {
   V(MoneTorAcknowledge,          BOOL,     "1"),
   V(MoneTorInitialWindow,        INT,     "3000"),
   V(MoneTorPaymentRate,          INT,     "2000"),
+  V(MoneTorMaxVerifyInFlight,    UINT,    "16"),
+  V(MoneTorLedgerLogDir,         FILENAME, NULL),
+  V(MoneTorLedgerCommitBatch,    UINT,    "64"),
+  V(MoneTorLedgerCommitDelay,    MSEC_INTERVAL, "10 msec"),
+  V(MoneTorLedgerSnapshotInterval, UINT,  "10000"),
+  V(MoneTorMaxPaymentUnits,      UINT,    "16"),
+  V(MoneTorEd25519,              BOOL,    "0"),
+  V(MoneTorLedgerVerifyBatch,    UINT,    "32"),
+  V(MoneTorMsgBufMaxBytes,       MEMUNIT, "4 MB"),
+  V(MoneTorMsgBufPerDesc,        UINT,    "64"),
+  V(MoneTorMsgBufTTL,            INTERVAL, "5 minutes"),
+  V(MoneTorMsgBufReplayBurst,    UINT,    "16"),
+  V(MoneTorPaymentLaneMaxCells,  UINT,    "64"),
+  V(MoneTorChannelPool,          UINT,    "0"),
+  V(MoneTorAdaptiveWindow,       BOOL,    "0"),
+  V(MoneTorPaymentLatencyBudget, MSEC_INTERVAL, "2000 msec"),
+  V(MoneTorIntermediaryShards,   UINT,    "0"),
+  V(MoneTorIntermediaryShardsInFlight, UINT, "16"),
+  V(MoneTorLedgerReceiptBatch,   UINT,    "0"),
+  V(MoneTorReservoirSize,        UINT,    "8"),
+  V(MoneTorWFQ,                  BOOL,    "0"),
+  V(MoneTorWFQWeights,           CSV,     "1,4"),
+  V(MoneTorPremiumReserve,       DOUBLE,  "0.0"),
+  V(MoneTorPiggyback,            BOOL,    "0"),
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
   VAR("AccountingRule",          STRING,   AccountingRule_option,  "max"),
   V(AccountingStart,             STRING,   NULL),
@@ -1917,8 +1942,17 @@ options_act(const or_options_t *old_options)
   old_ewma_enabled = cell_ewma_enabled();
   /* Change the cell EWMA settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
+  if (options->MoneTorWFQWeights)
+    circuitmux_wfq_set_weights(options->MoneTorWFQWeights, 0);
+  /* WFQ replaces EWMA on every channel while it is set */
+  if (options->MoneTorWFQ) {
+    if (!old_options || !old_options->MoneTorWFQ)
+      channel_set_cmux_policy_everywhere(&wfq_policy);
+  } else if (old_options && old_options->MoneTorWFQ) {
+    channel_set_cmux_policy_everywhere(cell_ewma_enabled() ?
+                                       &ewma_policy : NULL);
   /* If we just enabled ewma, set the cmux policy on all active channels */
-  if (cell_ewma_enabled() && !old_ewma_enabled) {
+  } else if (cell_ewma_enabled() && !old_ewma_enabled) {
     channel_set_cmux_policy_everywhere(&ewma_policy);
   } else if (!cell_ewma_enabled() && old_ewma_enabled) {
     /* Turn it off everywhere */
@@ -3161,6 +3195,16 @@ options_validate(or_options_t *old_options, or_options_t *options,
     REJECT("MoneTorFlowMod should be a double between 0 and 1");
   }
 
+  if (options->MoneTorWFQWeights &&
+      circuitmux_wfq_set_weights(options->MoneTorWFQWeights, 1) < 0) {
+    REJECT("MoneTorWFQWeights should be a list of 1 to 8 positive integers");
+  }
+
+  if (options->MoneTorPremiumReserve < 0.0 ||
+      options->MoneTorPremiumReserve >= 1.0) {
+    REJECT("MoneTorPremiumReserve should be a double from 0 up to 1");
+  }
+
   if (parse_ports(options, 1, msg, &n_ports,
                   &world_writable_control_socket) < 0)
     return -1;
@@ -2842,6 +2842,72 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** Tokens reserved for relayed connections carrying paid circuits, and the
+ * rest of the relayed rate, when MoneTorPremiumReserve is set. Each class
+ * may always spend its own tokens, and may borrow from the global buckets
+ * like any other connection while those have tokens left. Every byte is
+ * charged to the global buckets too, so a class that keeps its share busy
+ * leaves nothing for the other to borrow. A class bucket is only charged
+ * for the tokens it had, so it never goes below zero, and it never holds
+ * more than the global relayed bucket, so a class that sat idle while the
+ * other borrowed the whole rate cannot spend that rate a second time. */
+static int premium_read_bucket, premium_write_bucket;
+static int standard_read_bucket, standard_write_bucket;
+
+/** How many seconds after its last paid cell does a channel leave the
+ * premium bandwidth class? */
+#define PREMIUM_CHANNEL_TIMEOUT 10
+
+/** Return 1 if <b>conn</b> is an OR connection whose channel queued a cell
+ * of a paid circuit in the last PREMIUM_CHANNEL_TIMEOUT seconds, else 0. */
+STATIC int
+connection_is_premium(connection_t *conn, time_t now)
+{
+  channel_t *chan;
+
+  if (conn->type != CONN_TYPE_OR || !TO_OR_CONN(conn)->chan)
+    return 0;
+  chan = TLS_CHAN_TO_BASE(TO_OR_CONN(conn)->chan);
+  return chan->timestamp_mt_priority &&
+    chan->timestamp_mt_priority + PREMIUM_CHANNEL_TIMEOUT >= now;
+}
+
+/** Return the premium or standard bucket that <b>conn</b> draws its
+ * reserved read (if <b>is_read</b>) or write tokens from, or NULL if no
+ * bandwidth is reserved or <b>conn</b> is not relayed traffic. */
+static int *
+connection_class_bucket(connection_t *conn, int is_read, time_t now)
+{
+  if (get_options()->MoneTorPremiumReserve <= 0.0 ||
+      !connection_counts_as_relayed_traffic(conn, now))
+    return NULL;
+  if (connection_is_premium(conn, now))
+    return is_read ? &premium_read_bucket : &premium_write_bucket;
+  return is_read ? &standard_read_bucket : &standard_write_bucket;
+}
+
+/** Charge <b>num</b> bytes to the class <b>bucket</b>, as far as it has
+ * tokens for them; the rest were borrowed from the global buckets. */
+static void
+connection_class_bucket_decrement(int *bucket, size_t num)
+{
+  if (*bucket <= 0)
+    return;
+  if (num >= (size_t)*bucket)
+    *bucket = 0;
+  else
+    *bucket -= (int)num;
+}
+
+/** Make sure the class <b>bucket</b> holds no more tokens than the global
+ * <b>relayed_bucket</b> it is carved from. */
+static void
+connection_class_bucket_clamp(int *bucket, int relayed_bucket)
+{
+  if (*bucket > relayed_bucket)
+    *bucket = relayed_bucket > 0 ? relayed_bucket : 0;
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -2877,13 +2943,14 @@ connection_bucket_round_robin(int base, int priority,
 }
 
 /** How many bytes at most can we read onto this connection? */
-static ssize_t
+STATIC ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = -1;
   int global_bucket = global_read_bucket;
+  int *class_bucket;
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -2901,6 +2968,11 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
       global_relayed_read_bucket <= global_read_bucket)
     global_bucket = global_relayed_read_bucket;
 
+  /* reserved tokens can be spent even when the shared ones are gone */
+  class_bucket = connection_class_bucket(conn, 1, now);
+  if (class_bucket && *class_bucket > global_bucket)
+    global_bucket = *class_bucket;
+
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
 }
@@ -2913,6 +2985,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = (int)conn->outbuf_flushlen;
   int global_bucket = global_write_bucket;
+  int *class_bucket;
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
@@ -2934,6 +3007,10 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
       global_relayed_write_bucket <= global_write_bucket)
     global_bucket = global_relayed_write_bucket;
 
+  class_bucket = connection_class_bucket(conn, 0, now);
+  if (class_bucket && *class_bucket > global_bucket)
+    global_bucket = *class_bucket;
+
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
 }
@@ -3073,10 +3150,12 @@ static uint32_t global_relayed_read_emptied = 0,
 
 /** We just read <b>num_read</b> and wrote <b>num_written</b> bytes
  * onto <b>conn</b>. Decrement buckets appropriately. */
-static void
+STATIC void
 connection_buckets_decrement(connection_t *conn, time_t now,
                              size_t num_read, size_t num_written)
 {
+  int *class_bucket;
+
   if (num_written >= INT_MAX || num_read >= INT_MAX) {
     log_err(LD_BUG, "Value out of range. num_read=%lu, num_written=%lu, "
              "connection type=%s, state=%s",
@@ -3125,6 +3204,10 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
   global_read_bucket -= (int)num_read;
   global_write_bucket -= (int)num_written;
+  if ((class_bucket = connection_class_bucket(conn, 1, now)))
+    connection_class_bucket_decrement(class_bucket, num_read);
+  if ((class_bucket = connection_class_bucket(conn, 0, now)))
+    connection_class_bucket_decrement(class_bucket, num_written);
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
     TO_OR_CONN(conn)->read_bucket -= (int)num_read;
     TO_OR_CONN(conn)->write_bucket -= (int)num_written;
@@ -3137,13 +3220,20 @@ static void
 connection_consider_empty_read_buckets(connection_t *conn)
 {
   const char *reason;
+  int *class_bucket;
+  int reserved;
 
   if (!connection_is_rate_limited(conn))
     return; /* Always okay. */
 
-  if (global_read_bucket <= 0) {
+  /* reserved tokens left make the global buckets irrelevant */
+  class_bucket = connection_class_bucket(conn, 1, approx_time());
+  reserved = class_bucket && *class_bucket > 0;
+
+  if (!reserved && global_read_bucket <= 0) {
     reason = "global read bucket exhausted. Pausing.";
-  } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
+  } else if (!reserved &&
+             connection_counts_as_relayed_traffic(conn, approx_time()) &&
              global_relayed_read_bucket <= 0) {
     reason = "global relayed read bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
@@ -3164,13 +3254,20 @@ static void
 connection_consider_empty_write_buckets(connection_t *conn)
 {
   const char *reason;
+  int *class_bucket;
+  int reserved;
 
   if (!connection_is_rate_limited(conn))
     return; /* Always okay. */
 
-  if (global_write_bucket <= 0) {
+  /* reserved tokens left make the global buckets irrelevant */
+  class_bucket = connection_class_bucket(conn, 0, approx_time());
+  reserved = class_bucket && *class_bucket > 0;
+
+  if (!reserved && global_write_bucket <= 0) {
     reason = "global write bucket exhausted. Pausing.";
-  } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
+  } else if (!reserved &&
+             connection_counts_as_relayed_traffic(conn, approx_time()) &&
              global_relayed_write_bucket <= 0) {
     reason = "global relayed write bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
@@ -3200,6 +3297,10 @@ connection_bucket_init(void)
     global_relayed_read_bucket = (int)options->BandwidthBurst;
     global_relayed_write_bucket = (int)options->BandwidthBurst;
   }
+  premium_read_bucket = premium_write_bucket = (int)
+    (global_relayed_read_bucket * options->MoneTorPremiumReserve);
+  standard_read_bucket = standard_write_bucket =
+    global_relayed_read_bucket - premium_read_bucket;
 }
 
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate per
@@ -3238,6 +3339,8 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
   const or_options_t *options = get_options();
   smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  int premiumrate, premiumburst;
+  int *class_bucket;
 
   int prev_global_read = global_read_bucket;
   int prev_global_write = global_write_bucket;
@@ -3256,6 +3359,9 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
     relayburst = bandwidthburst;
   }
 
+  premiumrate = (int)(relayrate * options->MoneTorPremiumReserve);
+  premiumburst = (int)(relayburst * options->MoneTorPremiumReserve);
+
   tor_assert(milliseconds_elapsed >= 0);
 
   write_buckets_empty_last_second =
@@ -3279,6 +3385,36 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
+  /* refill the reserved buckets */
+  if (options->MoneTorPremiumReserve > 0.0) {
+    connection_bucket_refill_helper(&premium_read_bucket,
+                                    premiumrate, premiumburst,
+                                    milliseconds_elapsed,
+                                    "premium_read_bucket");
+    connection_bucket_refill_helper(&premium_write_bucket,
+                                    premiumrate, premiumburst,
+                                    milliseconds_elapsed,
+                                    "premium_write_bucket");
+    connection_bucket_refill_helper(&standard_read_bucket,
+                                    relayrate - premiumrate,
+                                    relayburst - premiumburst,
+                                    milliseconds_elapsed,
+                                    "standard_read_bucket");
+    connection_bucket_refill_helper(&standard_write_bucket,
+                                    relayrate - premiumrate,
+                                    relayburst - premiumburst,
+                                    milliseconds_elapsed,
+                                    "standard_write_bucket");
+    connection_class_bucket_clamp(&premium_read_bucket,
+                                  global_relayed_read_bucket);
+    connection_class_bucket_clamp(&premium_write_bucket,
+                                  global_relayed_write_bucket);
+    connection_class_bucket_clamp(&standard_read_bucket,
+                                  global_relayed_read_bucket);
+    connection_class_bucket_clamp(&standard_write_bucket,
+                                  global_relayed_write_bucket);
+  }
+
   /* If buckets were empty before and have now been refilled, tell any
    * interested controllers. */
   if (get_options()->TestingEnableTbEmptyEvent) {
@@ -3352,10 +3488,12 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       }
     }
 
+    class_bucket = connection_class_bucket(conn, 1, now);
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
-        && global_read_bucket > 0 /* and we're allowed to read */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_read_bucket > 0) /* even if we're relayed traffic */
+        && ((class_bucket && *class_bucket > 0) /* reserved tokens, or */
+            || (global_read_bucket > 0 /* and we're allowed to read */
+                && (!connection_counts_as_relayed_traffic(conn, now) ||
+                    global_relayed_read_bucket > 0))) /* even if relayed */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
             TO_OR_CONN(conn)->read_bucket > 0)) {
@@ -3366,10 +3504,12 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       connection_start_reading(conn);
     }
 
+    class_bucket = connection_class_bucket(conn, 0, now);
     if (conn->write_blocked_on_bw == 1
-        && global_write_bucket > 0 /* and we're allowed to write */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_write_bucket > 0) /* even if it's relayed traffic */
+        && ((class_bucket && *class_bucket > 0)
+            || (global_write_bucket > 0 /* and we're allowed to write */
+                && (!connection_counts_as_relayed_traffic(conn, now) ||
+                    global_relayed_write_bucket > 0))) /* even if relayed */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
             TO_OR_CONN(conn)->write_bucket > 0)) {
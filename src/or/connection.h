@@ -276,6 +276,10 @@ void connection_buckets_note_empty_ts(uint32_t *timestamp_var,
                                       int tokens_before,
                                       size_t tokens_removed,
                                       const struct timeval *tvnow);
+STATIC int connection_is_premium(connection_t *conn, time_t now);
+STATIC ssize_t connection_bucket_read_limit(connection_t *conn, time_t now);
+STATIC void connection_buckets_decrement(connection_t *conn, time_t now,
+                                         size_t num_read, size_t num_written);
 MOCK_DECL(STATIC int,connection_connect_sockaddr,
                                             (connection_t *conn,
                                              const struct sockaddr *sa,
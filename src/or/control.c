@@ -61,6 +61,7 @@
 #include "hs_common.h"
 #include "main.h"
 #include "microdesc.h"
+#include "mt_stats.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "policies.h"
@@ -1176,6 +1177,8 @@ static const struct control_event_t control_event_table[] = {
   { EVENT_HS_DESC, "HS_DESC" },
   { EVENT_HS_DESC_CONTENT, "HS_DESC_CONTENT" },
   { EVENT_NETWORK_LIVENESS, "NETWORK_LIVENESS" },
+  { EVENT_MT_CHANNEL, "MT_CHANNEL" },
+  { EVENT_MT_STATS, "MT_STATS" },
   { 0, NULL },
 };
 
@@ -3134,6 +3137,23 @@ static const getinfo_item_t getinfo_items[] = {
        "Onion services detached from the control connection."),
   ITEM("sr/current", sr, "Get current shared random value."),
   ITEM("sr/previous", sr, "Get previous shared random value."),
+  ITEM("mt/latency/establish", mt,
+       "Histograms of nanopayment channel establishment times in ms, one "
+       "per role."),
+  ITEM("mt/latency/pay", mt,
+       "Histograms of nanopayment times in ms, one per role."),
+  ITEM("mt/latency/close", mt,
+       "Histograms of nanopayment channel close times in ms, one per role."),
+  ITEM("mt/channels", mt, "Payment channels held in each state."),
+  ITEM("mt/msgbuf", mt, "Depth and drop counters of the payment message "
+       "buffer."),
+  ITEM("mt/cpuworker", mt, "Payment jobs waiting on the cpuworker."),
+  ITEM("mt/pool", mt, "Hits, misses and size of the pool of set-up "
+       "nanopayment channels."),
+  ITEM("mt/reservoir", mt, "Stock and hit counters of the precomputed "
+       "payment keys and hash chains."),
+  ITEM("mt/intermediaries", mt,
+       "Completed and failed payment protocols per intermediary."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -6127,6 +6147,44 @@ control_event_network_liveness_update(int liveness)
   return 0;
 }
 
+/** A phase of a payment channel we hold as <b>role</b> with <b>peer</b>
+ * through <b>intermediary</b> has completed or failed: tell any interested
+ * control connection, along with the time it took in milliseconds if
+ * <b>latency</b> is not NULL. <b>intermediary</b> is NULL when we are the
+ * intermediary. */
+int
+control_event_mt_channel(const char *role, const char *peer,
+                         const char *intermediary, const char *phase,
+                         const char *status, const char *latency)
+{
+  if (!EVENT_IS_INTERESTING(EVENT_MT_CHANNEL))
+    return 0;
+
+  send_control_event(EVENT_MT_CHANNEL,
+                     "650 MT_CHANNEL %s %s PEER=%s%s%s %s%s%s\r\n",
+                     status, role, peer,
+                     intermediary ? " INTERMEDIARY=" : "",
+                     intermediary ? intermediary : "", phase,
+                     latency ? " LATENCY=" : "", latency ? latency : "");
+  return 0;
+}
+
+/** A second or more has elapsed: tell any interested control connection
+ * how many payment channels we hold in each state, how full the payment
+ * message buffer is, and how many payment jobs wait on the cpuworker. */
+int
+control_event_mt_stats(const char *channels, const char *msgbuf,
+                       int cpuworker_queued)
+{
+  if (!EVENT_IS_INTERESTING(EVENT_MT_STATS))
+    return 0;
+
+  send_control_event(EVENT_MT_STATS,
+                     "650 MT_STATS %s %s CPUWORKER-QUEUED=%d\r\n",
+                     channels, msgbuf, cpuworker_queued);
+  return 0;
+}
+
 /** Helper function for NS-style events. Constructs and sends an event
  * of type <b>event</b> with string <b>event_string</b> out of the set of
  * networkstatuses <b>statuses</b>. Currently it is used for NS events
@@ -34,6 +34,11 @@ void connection_control_closed(control_connection_t *conn);
 int connection_control_process_inbuf(control_connection_t *conn);
 
 #define EVENT_NS 0x000F
+/* The MoneTor events are public so that mt_stats.c can skip formatting its
+ * reports when no controller listens; their numbers continue the event list
+ * below. */
+#define EVENT_MT_CHANNEL 0x0024
+#define EVENT_MT_STATS 0x0025
 int control_event_is_interesting(int event);
 
 int control_event_circuit_status(origin_circuit_t *circ,
@@ -65,6 +70,11 @@ int control_event_address_mapped(const char *from, const char *to,
                                  const int cached);
 int control_event_my_descriptor_changed(void);
 int control_event_network_liveness_update(int liveness);
+int control_event_mt_channel(const char *role, const char *peer,
+                             const char *intermediary, const char *phase,
+                             const char *status, const char *latency);
+int control_event_mt_stats(const char *channels, const char *msgbuf,
+                           int cpuworker_queued);
 int control_event_networkstatus_changed(smartlist_t *statuses);
 
 int control_event_newconsensus(const networkstatus_t *consensus);
@@ -189,7 +199,8 @@ void control_free_all(void);
 #define EVENT_HS_DESC                 0x0021
 #define EVENT_HS_DESC_CONTENT         0x0022
 #define EVENT_NETWORK_LIVENESS        0x0023
-#define EVENT_MAX_                    0x0023
+/* 0x0024 and 0x0025 are the MoneTor events, defined above */
+#define EVENT_MAX_                    0x0025
 
 /* sizeof(control_connection_t.event_mask) in bits, currently a uint64_t */
 #define EVENT_CAPACITY_               0x0040
@@ -87,6 +87,8 @@
 #include "main.h"
 #include "microdesc.h"
 #include "mt_common.h"
+#include "mt_reservoir.h"
+#include "mt_stats.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "ntmain.h"
@@ -3180,7 +3182,10 @@ tor_init(int argc, char *argv[])
   }
 
   /* Initialize the payment subsystem */
-  mt_init();
+  if (mt_init() != MT_SUCCESS) {
+    log_err(LD_MT, "Unable to initialize the payment system. Exiting.");
+    return -1;
+  }
 
   /* Scan/clean unparseable descroptors; after reading config */
   routerparse_init();
@@ -3294,6 +3299,10 @@ tor_free_all(int postfork)
   consdiffmgr_free_all();
   hs_free_all();
   dos_free_all();
+  mt_crypt_free_all();
+  mt_msgpool_free_all();
+  mt_reservoir_clear();
+  mt_stats_clear();
   /*
    * XXX MoneTor - todo calling mt_cclient_free_all()
    * and others
@@ -0,0 +1,177 @@
+/**
+ * \file mt_acctable.c
+ *
+ * Store ledger accounts in a contiguous arena instead of one heap allocation
+ * per account behind a digestmap_t. The arena grows a chunk at a time and
+ * chunks never move, so an account keeps its address while the table grows.
+ * Lookups go through an open-addressing index of 32-bit handles with linear
+ * probing; the addresses themselves stay in the arena next to their accounts
+ * so the index can be rebuilt from it. Since the ledger never deletes an
+ * account the index needs no tombstones.
+ */
+
+#include "or.h"
+#include "container.h"
+#include "mt_common.h"
+#include "mt_acctable.h"
+
+/** Size of the index when the table is created; a power of two */
+#define MT_ACCTABLE_MIN_SLOTS 64
+
+/** Return a pointer to the start of the arena entry <b>h</b> */
+static inline byte*
+entry_at(const mt_acctable_t* table, mt_acctable_handle_t h){
+  return table->chunks[h / MT_ACCTABLE_CHUNK] + (h % MT_ACCTABLE_CHUNK) * table->ent_size;
+}
+
+static inline uint32_t
+slot_of(const mt_acctable_t* table, const byte* addr){
+  return (uint32_t)siphash24g(addr, MT_SZ_ADDR) & (table->n_slots - 1);
+}
+
+/** Put handle <b>h</b> in the first free slot of its probe sequence */
+static void
+index_insert(mt_acctable_t* table, mt_acctable_handle_t h){
+  uint32_t s = slot_of(table, mt_acctable_addr_at(table, h));
+  while(table->slots[s])
+    s = (s + 1) & (table->n_slots - 1);
+  table->slots[s] = h + 1;
+}
+
+/** Double the index and rehash every entry from the arena */
+static void
+index_grow(mt_acctable_t* table){
+  tor_free(table->slots);
+  table->n_slots *= 2;
+  table->slots = tor_calloc(table->n_slots, sizeof(uint32_t));
+  for(mt_acctable_handle_t h = 0; h < table->n_entries; h++)
+    index_insert(table, h);
+}
+
+mt_acctable_t* mt_acctable_new(size_t val_size){
+  mt_acctable_t* table = tor_calloc(1, sizeof(mt_acctable_t));
+  table->val_size = val_size;
+  // keep every entry 8-byte aligned with the address after the account
+  table->ent_size = (val_size + MT_SZ_ADDR + 7) & ~(size_t)7;
+  table->n_slots = MT_ACCTABLE_MIN_SLOTS;
+  table->slots = tor_calloc(table->n_slots, sizeof(uint32_t));
+  return table;
+}
+
+void mt_acctable_free(mt_acctable_t* table){
+
+  if(!table)
+    return;
+
+  for(int i = 0; i < table->n_chunks; i++)
+    tor_free(table->chunks[i]);
+  tor_free(table->chunks);
+  tor_free(table->slots);
+  tor_free(table);
+}
+
+mt_acctable_t* mt_acctable_copy(const mt_acctable_t* table){
+
+  mt_acctable_t* copy = tor_memdup(table, sizeof(mt_acctable_t));
+  copy->slots = tor_memdup(table->slots, table->n_slots * sizeof(uint32_t));
+  copy->chunks = tor_calloc(table->n_chunks, sizeof(byte*));
+  for(int i = 0; i < table->n_chunks; i++)
+    copy->chunks[i] = tor_memdup(table->chunks[i], MT_ACCTABLE_CHUNK * table->ent_size);
+  return copy;
+}
+
+mt_acctable_handle_t mt_acctable_lookup(const mt_acctable_t* table, const byte* addr){
+
+  uint32_t s = slot_of(table, addr);
+  while(table->slots[s]){
+    mt_acctable_handle_t h = table->slots[s] - 1;
+    if(tor_memeq(mt_acctable_addr_at(table, h), addr, MT_SZ_ADDR))
+      return h;
+    s = (s + 1) & (table->n_slots - 1);
+  }
+  return MT_ACCTABLE_NONE;
+}
+
+void* mt_acctable_get(const mt_acctable_t* table, const byte* addr){
+  mt_acctable_handle_t h = mt_acctable_lookup(table, addr);
+  return h == MT_ACCTABLE_NONE ? NULL : entry_at(table, h);
+}
+
+void* mt_acctable_add(mt_acctable_t* table, const byte* addr){
+
+  mt_acctable_handle_t h = mt_acctable_lookup(table, addr);
+  if(h != MT_ACCTABLE_NONE)
+    return entry_at(table, h);
+
+  tor_assert(table->n_entries < MT_ACCTABLE_NONE - 1);
+
+  h = table->n_entries;
+  if(h % MT_ACCTABLE_CHUNK == 0){
+    table->chunks = tor_reallocarray(table->chunks, table->n_chunks + 1, sizeof(byte*));
+    table->chunks[table->n_chunks++] = tor_calloc(MT_ACCTABLE_CHUNK, table->ent_size);
+  }
+  table->n_entries++;
+
+  byte* entry = entry_at(table, h);
+  memcpy(entry + table->val_size, addr, MT_SZ_ADDR);
+
+  // keep the index at most half full so probe sequences stay short
+  if(table->n_entries * 2 > table->n_slots)
+    index_grow(table);
+  else
+    index_insert(table, h);
+  return entry;
+}
+
+void* mt_acctable_at(const mt_acctable_t* table, mt_acctable_handle_t h){
+  tor_assert(h < table->n_entries);
+  return entry_at(table, h);
+}
+
+const byte* mt_acctable_addr_at(const mt_acctable_t* table, mt_acctable_handle_t h){
+  tor_assert(h < table->n_entries);
+  return entry_at(table, h) + table->val_size;
+}
+
+const byte* mt_acctable_chunk(const mt_acctable_t* table, int i, size_t* len_out){
+
+  tor_assert(i >= 0 && i < table->n_chunks);
+  size_t used = MIN(table->n_entries - (uint32_t)i * MT_ACCTABLE_CHUNK, MT_ACCTABLE_CHUNK);
+  *len_out = used * table->ent_size;
+  return table->chunks[i];
+}
+
+typedef struct {
+  const byte* addr;
+  mt_acctable_handle_t h;
+} sort_ent_t;
+
+static int
+compare_addrs(const void* a, const void* b){
+  return fast_memcmp(((const sort_ent_t*)a)->addr, ((const sort_ent_t*)b)->addr, MT_SZ_ADDR);
+}
+
+mt_acctable_handle_t* mt_acctable_sorted(const mt_acctable_t* table){
+
+  sort_ent_t* ents = tor_calloc(table->n_entries + 1, sizeof(sort_ent_t));
+  for(mt_acctable_handle_t h = 0; h < table->n_entries; h++){
+    ents[h].addr = mt_acctable_addr_at(table, h);
+    ents[h].h = h;
+  }
+  qsort(ents, table->n_entries, sizeof(sort_ent_t), compare_addrs);
+
+  mt_acctable_handle_t* handles = tor_calloc(table->n_entries + 1, sizeof(mt_acctable_handle_t));
+  for(uint32_t i = 0; i < table->n_entries; i++)
+    handles[i] = ents[i].h;
+  tor_free(ents);
+  return handles;
+}
+
+int mt_acctable_size(const mt_acctable_t* table){
+  return (int)table->n_entries;
+}
+
+size_t mt_acctable_memory(const mt_acctable_t* table){
+  return (size_t)table->n_chunks * MT_ACCTABLE_CHUNK * table->ent_size +
+    table->n_chunks * sizeof(byte*) + table->n_slots * sizeof(uint32_t);
+}
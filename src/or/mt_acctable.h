@@ -0,0 +1,127 @@
+/**
+ * \file mt_acctable.h
+ * \brief Header file for mt_acctable.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated.
+ **/
+
+#ifndef mt_acctable_h
+#define mt_acctable_h
+
+#include "or.h"
+
+/** Accounts per arena chunk; a power of two */
+#define MT_ACCTABLE_CHUNK 1024
+/** Handle that refers to no account */
+#define MT_ACCTABLE_NONE UINT32_MAX
+
+typedef uint32_t mt_acctable_handle_t;
+
+/**
+ * Fixed-size ledger accounts keyed by address. Accounts live back to back in
+ * an arena of chunks that never move, so pointers and handles stay valid for
+ * the life of the table; an open-addressing index over the arena maps an
+ * address to its handle. Accounts are never removed.
+ */
+typedef struct {
+  /* size of the caller's account record and of a whole arena entry */
+  size_t val_size;
+  size_t ent_size;
+  /* arena: entry h is at chunks[h / MT_ACCTABLE_CHUNK] */
+  byte** chunks;
+  int n_chunks;
+  uint32_t n_entries;
+  /* index: handle + 1 of the entry hashed there, or 0 if the slot is empty */
+  uint32_t* slots;
+  uint32_t n_slots;
+} mt_acctable_t;
+
+/**
+ * Return a new table for accounts of <b>val_size</b> bytes
+ */
+mt_acctable_t* mt_acctable_new(size_t val_size);
+
+void mt_acctable_free(mt_acctable_t* table);
+
+/**
+ * Return a copy of <b>table</b> that shares nothing with it. The arena and the
+ * index are copied as they are, without rehashing, so handles into the table
+ * are valid in the copy.
+ */
+mt_acctable_t* mt_acctable_copy(const mt_acctable_t* table);
+
+/**
+ * Return the account for <b>addr</b>, or NULL
+ */
+void* mt_acctable_get(const mt_acctable_t* table, const byte* addr);
+
+/**
+ * Return the account for <b>addr</b>, adding a zeroed one if there is none
+ */
+void* mt_acctable_add(mt_acctable_t* table, const byte* addr);
+
+/**
+ * Return the handle of the account for <b>addr</b>, or MT_ACCTABLE_NONE
+ */
+mt_acctable_handle_t mt_acctable_lookup(const mt_acctable_t* table, const byte* addr);
+
+/**
+ * Return the account and the address behind handle <b>h</b>
+ */
+void* mt_acctable_at(const mt_acctable_t* table, mt_acctable_handle_t h);
+const byte* mt_acctable_addr_at(const mt_acctable_t* table, mt_acctable_handle_t h);
+
+int mt_acctable_size(const mt_acctable_t* table);
+
+/**
+ * Return the number of bytes held by the arena and the index
+ */
+size_t mt_acctable_memory(const mt_acctable_t* table);
+
+/**
+ * Return chunk <b>i</b> of the arena, for i below n_chunks, and write the
+ * number of bytes in it that hold accounts to <b>len_out</b>. Each arena
+ * entry is the account followed by its address, padded to ent_size bytes.
+ */
+const byte* mt_acctable_chunk(const mt_acctable_t* table, int i, size_t* len_out);
+
+/**
+ * Return a new array of the handles of every account, sorted by address
+ */
+mt_acctable_handle_t* mt_acctable_sorted(const mt_acctable_t* table);
+
+/**
+ * Iterate over the accounts in arena order, which is the order they were
+ * added in. <b>addrvar</b> is a const byte* and <b>valvar</b> a
+ * <b>valtype</b>. Accounts must not be added during the loop.
+ */
+#define MT_ACCTABLE_FOREACH(table, addrvar, valtype, valvar)		\
+  STMT_BEGIN								\
+  for(mt_acctable_handle_t valvar##_h = 0;				\
+      valvar##_h < (table)->n_entries; valvar##_h++){			\
+    const byte* addrvar = mt_acctable_addr_at((table), valvar##_h);	\
+    valtype valvar = (valtype)mt_acctable_at((table), valvar##_h);	\
+    (void)addrvar;
+
+#define MT_ACCTABLE_FOREACH_END } STMT_END
+
+/**
+ * Like MT_ACCTABLE_FOREACH but in increasing address order, at the cost of
+ * sorting the handles first. End with MT_ACCTABLE_FOREACH_SORTED_END.
+ */
+#define MT_ACCTABLE_FOREACH_SORTED(table, addrvar, valtype, valvar)	\
+  STMT_BEGIN								\
+  mt_acctable_handle_t* acctable_sorted_ = mt_acctable_sorted(table);	\
+  for(int valvar##_i = 0; valvar##_i < mt_acctable_size(table);	\
+      valvar##_i++){							\
+    mt_acctable_handle_t valvar##_h = acctable_sorted_[valvar##_i];	\
+    const byte* addrvar = mt_acctable_addr_at((table), valvar##_h);	\
+    valtype valvar = (valtype)mt_acctable_at((table), valvar##_h);	\
+    (void)addrvar;
+
+#define MT_ACCTABLE_FOREACH_SORTED_END					\
+  }									\
+  tor_free(acctable_sorted_);						\
+  STMT_END
+
+#endif
@@ -21,8 +21,12 @@
 #define MT_CCLIENT_PRIVATE
 #include "mt_cclient.h"
 #include "mt_common.h"
+#include "mt_descmap.h"
 #include "mt_cpay.h"
 #include "mt_ipay.h"
+#include "mt_paywindow.h"
+#include "mt_reservoir.h"
+#include "mt_stats.h"
 #include "channel.h"
 #include "nodelist.h"
 #include "routerlist.h"
@@ -52,18 +56,27 @@ STATIC void run_cclient_build_circuit_event(time_t now);
 
 static void intermediary_free(intermediary_t *intermediary);
 
+static int payment_units(pay_path_t *ppath, int threshold);
+
 /*List of selected intermediaries */
 static smartlist_t *intermediaries = NULL;
 /*Contains which origin_circuit_t is related to desc
  *a get operation will need to be done at each payment callback call
  *- Is there enough performance?? */
-static digestmap_t* desc2circ = NULL; // mt_desc2digest => origin_circuit_t
+STATIC mt_descmap_t* desc2circ = NULL; // mt_desc_t => origin_circuit_t
 /*static counter of descriptors - also used as id*/
 static uint64_t count[2] =  {0, 0};
 /*static ledger */
 static ledger_t *ledger = NULL;
 /*list of circuits to the ledger */
 static smartlist_t *ledgercircs;
+/*circuit whose data cells are being packaged and may carry a payment to the
+ *exit, see mt_cclient_piggyback_begin() */
+static circuit_t *piggyback_circ = NULL;
+
+/** Largest payment message held for a data cell, so that a piggybacked
+ * payment never takes more than about a quarter of the cell */
+#define MT_PIGGYBACK_MAX_SIZE 128
 /**
  * Allocate on the heap a new intermediary and returns the pointer
  */
@@ -162,7 +175,7 @@ mt_cclient_init(void) {
   log_info(LD_MT, "MoneTor: initialization of controler client code");
   tor_assert(!intermediaries); //should never be called twice
   intermediaries = smartlist_new();
-  desc2circ = digestmap_new();
+  desc2circ = mt_descmap_new();
   ledgercircs = smartlist_new();
   count[0] = rand_uint64();
   count[1] = rand_uint64();
@@ -193,10 +206,8 @@ intermediary_need_cleanup(intermediary_t *intermediary, time_t now) {
         inter) {
       if (tor_memeq(intermediary->identity->identity,
             inter->identity->identity, DIGEST_LEN)){
-        byte id[DIGEST_LEN];
-        mt_desc2digest(&intermediary->desc, &id);
-        if (digestmap_get(desc2circ, (char*) id)) {
-          digestmap_remove(desc2circ, (char*) id);
+        if (mt_descmap_get(desc2circ, &intermediary->desc)) {
+          mt_descmap_remove(desc2circ, &intermediary->desc);
         }
         SMARTLIST_DEL_CURRENT(intermediaries, inter);
         intermediary_free(intermediary);
@@ -293,17 +304,13 @@ mt_cclient_launch_payment(origin_circuit_t* circ) {
   log_info(LD_MT, "MoneTor - Adding circ's descs %s to digestmap",
       mt_desc_describe(&circ->ppath->desc));
   /* Adding new elements to digestmap */
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->ppath->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &circ->ppath->desc, TO_CIRCUIT(circ));
   log_info(LD_MT, "MoneTor - Adding circ's descs %s to digestmap",
       mt_desc_describe(&middle->desc));
-  mt_desc2digest(&middle->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &middle->desc, TO_CIRCUIT(circ));
   log_info(LD_MT, "MoneTor - Adding circ's descs %s to digestmap",
       mt_desc_describe(&exit->desc));
-  mt_desc2digest(&exit->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &exit->desc, TO_CIRCUIT(circ));
   /*Now, notify payment module that we have to start a payment*/
   log_info(LD_MT, "MoneTor - Calling payment module for direct payment"
       " with param %s and %s", mt_desc_describe(&circ->ppath->desc),
@@ -415,6 +422,16 @@ choose_intermediaries(time_t now, smartlist_t *exclude_list) {
 STATIC void
 run_cclient_housekeeping_event(time_t now) {
 
+  /* The cpuworker is not up yet when the payment modules are initialized,
+   * so the reservoir is stocked from here */
+  mt_reservoir_fill();
+
+  /* Tell controllers about our payment channels */
+  mt_stats_send_event();
+
+  /* Drop payment messages that waited too long for their peer */
+  mt_cpay_housekeeping(now);
+
   /* Check intermediary health*/
   SMARTLIST_FOREACH_BEGIN(intermediaries, intermediary_t *,
       intermediary) {
@@ -428,8 +445,8 @@ run_cclient_housekeeping_event(time_t now) {
     }
   } SMARTLIST_FOREACH_END(intermediary);
 
-  log_info(LD_MT, "MoneTor: relay digestmap length: %d", digestmap_size(desc2circ));
-  DIGESTMAP_FOREACH_MODIFY(desc2circ, key, circuit_t *, circ) {
+  log_info(LD_MT, "MoneTor: relay digestmap length: %d", mt_descmap_size(desc2circ));
+  MT_DESCMAP_FOREACH_MODIFY(desc2circ, key, circuit_t *, circ) {
 
     /************************************************************************/
     // XXX moneTor: very temporary measure until we find freed pointer
@@ -475,16 +492,20 @@ run_cclient_housekeeping_event(time_t now) {
           intermediary = get_intermediary_by_role(ppath_tmp->position);
         log_info(LD_MT, "MoneTor: Calling mt_cpay_pay because window is %d", ppath_tmp->window);
         ppath_tmp->payment_is_processing = 1;
+        mt_paywindow_note_pay_start(ppath_tmp->pw, monotime_coarse_absolute_msec());
+        ppath_tmp->payment_units = payment_units(ppath_tmp, LIMIT_PAYMENT_WINDOW);
         if (hop == 1) {
           /*[>* We must do a direct payment, using same descriptor <]*/
-          if (mt_cpay_pay(&ppath_tmp->desc, &ppath_tmp->desc) < 0) {
+          if (mt_cpay_pay_units(&ppath_tmp->desc, &ppath_tmp->desc,
+                ppath_tmp->payment_units) < 0) {
             log_warn(LD_MT, "MoneTor: direct payment mt_cpay_pay failed");
             ppath_tmp->p_marked_for_close = 1;
             ppath_tmp->last_mt_cpay_succeeded = 0;
           }
         }
         else {
-          if (mt_cpay_pay(&ppath_tmp->desc, &intermediary->desc) < 0) {
+          if (mt_cpay_pay_units(&ppath_tmp->desc, &intermediary->desc,
+                ppath_tmp->payment_units) < 0) {
             log_warn(LD_MT, "MoneTor: mt_cpay_pay failed");
             ppath_tmp->p_marked_for_close = 1;
             ppath_tmp->last_mt_cpay_succeeded = 0;
@@ -497,7 +518,7 @@ run_cclient_housekeeping_event(time_t now) {
       ppath_tmp = ppath_tmp->next;
       hop++;
     }
-  } DIGESTMAP_FOREACH_END;
+  } MT_DESCMAP_FOREACH_END;
 }
 
 /*
@@ -651,12 +672,10 @@ void mt_cclient_ledger_circ_has_closed(origin_circuit_t *circ) {
     return;
   }
   smartlist_remove(ledgercircs, circ);
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
+  if (mt_descmap_get(desc2circ, &ledger->desc)) {
     log_info(LD_MT, "MoneTor: ledger circ has closed. Removed %s from our internal structure",
       mt_desc_describe(&ledger->desc));
-    digestmap_remove(desc2circ, (char*) id);
+    mt_descmap_remove(desc2circ, &ledger->desc);
   }
   else {
     log_warn(LD_MT, "MoneTor: in ledger_circ_has_closed, looks like we didn't have this desc in our map %s", mt_desc_describe(&ledger->desc));
@@ -668,15 +687,83 @@ void mt_cclient_ledger_circ_has_closed(origin_circuit_t *circ) {
  * stop_hop means that we decrease payment window until hop stop_hop.
  */
 
+/** Return the pay path of the exit of <b>circ</b>, or NULL if it has none */
+static pay_path_t*
+exit_ppath(origin_circuit_t *circ) {
+  pay_path_t *ppath = circ->ppath;
+  while (ppath && ppath->next)
+    ppath = ppath->next;
+  return ppath;
+}
+
+/** Return 1 if the exit of <b>circ</b> advertises that it takes payments
+ * from the spare room of data cells, else 0 */
+static int
+exit_supports_piggyback(origin_circuit_t *circ) {
+  crypt_path_t *exit = circ->cpath ? circ->cpath->prev : NULL;
+  const node_t *node;
+  if (!exit || !exit->extend_info)
+    return 0;
+  node = node_get_by_id(exit->extend_info->identity_digest);
+  return node && node_supports_pay_piggyback(node);
+}
+
+void mt_cclient_piggyback_begin(circuit_t *circ) {
+  if (get_options()->EnablePayment && get_options()->MoneTorPiggyback &&
+      CIRCUIT_IS_ORIGIN(circ) &&
+      circ->purpose == CIRCUIT_PURPOSE_C_GENERAL_PAYMENT &&
+      TO_ORIGIN_CIRCUIT(circ)->ppath &&
+      exit_supports_piggyback(TO_ORIGIN_CIRCUIT(circ)))
+    piggyback_circ = circ;
+}
+
+size_t mt_cclient_piggyback_size(circuit_t *circ, crypt_path_t *layer) {
+  if (circ != piggyback_circ || layer != TO_ORIGIN_CIRCUIT(circ)->cpath->prev)
+    return 0;
+  pay_path_t *ppath = exit_ppath(TO_ORIGIN_CIRCUIT(circ));
+  if (!ppath || !ppath->piggyback)
+    return 0;
+  return RELAY_PHEADER_SIZE + ppath->piggyback_size;
+}
+
+void mt_cclient_piggyback_take(circuit_t *circ, uint8_t *dest) {
+  pay_path_t *ppath = exit_ppath(TO_ORIGIN_CIRCUIT(circ));
+  relay_pheader_t rph;
+  tor_assert(ppath && ppath->piggyback);
+  rph.pcommand = MT_NTYPE_NAN_CLI_PAY1;
+  rph.length = ppath->piggyback_size;
+  direct_pheader_pack(dest, &rph);
+  memcpy(dest+RELAY_PHEADER_SIZE, ppath->piggyback, ppath->piggyback_size);
+  tor_free(ppath->piggyback);
+}
+
+void mt_cclient_piggyback_end(circuit_t *circ) {
+  if (circ != piggyback_circ)
+    return;
+  piggyback_circ = NULL;
+  pay_path_t *ppath = exit_ppath(TO_ORIGIN_CIRCUIT(circ));
+  if (!ppath || !ppath->piggyback)
+    return;
+  /* no data cell followed the payment; send it on its own */
+  uint8_t *msg = ppath->piggyback;
+  ppath->piggyback = NULL;
+  mt_cclient_send_message(&ppath->desc, RELAY_COMMAND_MT, MT_NTYPE_NAN_CLI_PAY1,
+      msg, ppath->piggyback_size);
+  tor_free(msg);
+}
+
 void mt_cclient_update_payment_window(circuit_t *circ, int stop_hop) {
   if (get_options()->EnablePayment && CIRCUIT_IS_ORIGIN(circ) &&
       circ->purpose == CIRCUIT_PURPOSE_C_GENERAL_PAYMENT) {
     pay_path_t *ppath_tmp = TO_ORIGIN_CIRCUIT(circ)->ppath;
+    uint64_t now = monotime_coarse_absolute_msec();
     int hop = 1;
     while(ppath_tmp) {
       if (hop == stop_hop) // we don't remove anything from exit
         break;
-      if (--ppath_tmp->window  < (get_options()->MoneTorInitialWindow-get_options()->MoneTorPaymentRate)
+      ppath_tmp->window--;
+      mt_paywindow_note_cell(ppath_tmp->pw, now);
+      if (ppath_tmp->window < mt_paywindow_low(ppath_tmp->pw)
           && !ppath_tmp->payment_is_processing &&
           !ppath_tmp->p_marked_for_close &&
           ppath_tmp->establish_succeeded) {
@@ -691,21 +778,27 @@ void mt_cclient_update_payment_window(circuit_t *circ, int stop_hop) {
           if (hop > 1)
             break;
         }
-        while (ppath_tmp->window < (get_options()->MoneTorInitialWindow-get_options()->MoneTorPaymentRate) &&
+        while (ppath_tmp->window < mt_paywindow_low(ppath_tmp->pw) &&
             !ppath_tmp->payment_is_processing) {
           log_info(LD_MT, "MoneTor: Calling mt_cpay_pay because window is %d on hop %d with on desc: %s",
               ppath_tmp->window, hop, mt_desc_describe(&intermediary->desc));
           ppath_tmp->payment_is_processing = 1;
+          mt_paywindow_note_pay_start(ppath_tmp->pw, now);
+          /** Catch up on the whole deficit with a single message */
+          ppath_tmp->payment_units = payment_units(ppath_tmp,
+              mt_paywindow_high(ppath_tmp->pw));
           if (hop == 1) {
             /** We must do a direct payment, using same descriptor */
-            if (mt_cpay_pay(&ppath_tmp->desc, &ppath_tmp->desc) < 0) {
+            if (mt_cpay_pay_units(&ppath_tmp->desc, &ppath_tmp->desc,
+                  ppath_tmp->payment_units) < 0) {
               log_warn(LD_MT, "MoneTor: direct payment mt_cpay_pay failed");
               ppath_tmp->p_marked_for_close = 1;
               ppath_tmp->last_mt_cpay_succeeded = 0;
             }
           }
           else {
-            if (mt_cpay_pay(&ppath_tmp->desc, &intermediary->desc) < 0) {
+            if (mt_cpay_pay_units(&ppath_tmp->desc, &intermediary->desc,
+                  ppath_tmp->payment_units) < 0) {
               log_warn(LD_MT, "MoneTor: mt_cpay_pay failed");
               ppath_tmp->p_marked_for_close = 1;
               ppath_tmp->last_mt_cpay_succeeded = 0;
@@ -732,9 +825,7 @@ void mt_cclient_update_payment_window(circuit_t *circ, int stop_hop) {
 
 int mt_cclient_paymod_signal(mt_signal_t signal, mt_desc_t *desc) {
 
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   origin_circuit_t *oricirc = NULL;
   if (!circ) {
     log_info(LD_MT, "MoneTor: received a signal linked to a desc "
@@ -760,9 +851,12 @@ int mt_cclient_paymod_signal(mt_signal_t signal, mt_desc_t *desc) {
           log_info(LD_MT, "MoneTor: Yay! First payment succeeded for hop %d", hop);
           ppath_tmp->first_payment_succeeded = 1;
         }
-        ppath_tmp->window += get_options()->MoneTorPaymentRate;
+        ppath_tmp->window += MAX(ppath_tmp->payment_units, 1) *
+          get_options()->MoneTorPaymentRate;
         ppath_tmp->last_mt_cpay_succeeded = 1;
         ppath_tmp->payment_is_processing = 0;
+        mt_paywindow_note_pay_done(ppath_tmp->pw,
+            monotime_coarse_absolute_msec());
         log_info(LD_MT, "MoneTor: payment succeeded for hop %d :)", hop);
         break;
       }
@@ -829,12 +923,10 @@ int mt_cclient_paymod_signal(mt_signal_t signal, mt_desc_t *desc) {
 void mt_cclient_general_circ_has_closed(origin_circuit_t *oricirc) {
   if (oricirc->ppath) {
     log_info(LD_MT, "MoneTor: a general circuit has closed");
-    byte id[DIGEST_LEN];
     pay_path_t *ppath_tmp = oricirc->ppath;
     while (ppath_tmp) {
-      mt_desc2digest(&ppath_tmp->desc, &id);
-      if (digestmap_get(desc2circ, (char*) id)) {
-        digestmap_remove(desc2circ, (char*) id);
+      if (mt_descmap_get(desc2circ, &ppath_tmp->desc)) {
+        mt_descmap_remove(desc2circ, &ppath_tmp->desc);
       }
       else {
         log_warn(LD_MT, "MoneTor: A descriptor is missing from our map?");
@@ -882,10 +974,8 @@ void mt_cclient_intermediary_circ_has_closed(origin_circuit_t *circ) {
     intermediary->ei = ei;
     return;
   }
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&intermediary->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &intermediary->desc)) {
+    mt_descmap_remove(desc2circ, &intermediary->desc);
     log_info(LD_MT, "MoneTor: removing desc %s linked to an interemdiary circuit",
         mt_desc_describe(&intermediary->desc));
   }
@@ -912,9 +1002,7 @@ mt_cclient_ledger_circ_has_opened(origin_circuit_t *circ) {
   /*circ->desc.id[0] = count[0]; // To change later */
   /*circ->desc.id[1] = count[1];*/
   /*circ->desc.party = MT_PARTY_LED;*/
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &ledger->desc, TO_CIRCUIT(circ));
   mt_cpay_set_status(&ledger->desc, 1);
 }
 
@@ -931,10 +1019,10 @@ mt_cclient_intermediary_circ_has_opened(origin_circuit_t *circ) {
   }
   /* reset circuit_retries counter */
   intermediary->circuit_retries = 0;
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&intermediary->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &intermediary->desc, TO_CIRCUIT(circ));
   mt_cpay_set_status(&intermediary->desc, 1);
+  /* Get channels ready before the first circuit needs to pay */
+  mt_cpay_fill_pool(&intermediary->desc);
   /*XXX MoneTor - What do we do? notify payment, wait to full establishement of all circuits?*/
 }
 
@@ -999,11 +1087,9 @@ int
 mt_cclient_send_message(mt_desc_t* desc, uint8_t command, mt_ntype_t type,
     byte* msg, int size) {
   /* init and stuff */
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   if (!circ) {
-    log_warn(LD_MT, "MoneTor: in mt_cclient_send_message, digestmap_get failed to return a circ for descriptor"
+    log_warn(LD_MT, "MoneTor: in mt_cclient_send_message, mt_descmap_get failed to return a circ for descriptor"
         " %s", mt_desc_describe(desc));
     return -1;
   }
@@ -1048,6 +1134,17 @@ mt_cclient_send_message(mt_desc_t* desc, uint8_t command, mt_ntype_t type,
       } while(layer_start != TO_ORIGIN_CIRCUIT(circ)->cpath && ppath_tmp);
       if (BUG(!found))
         return -2;
+      /* a payment to the exit made while packaging data rides the next data
+       * cell instead, so the hops before it carry no extra cell */
+      if (type == MT_NTYPE_NAN_CLI_PAY1 && circ == piggyback_circ &&
+          layer_start == TO_ORIGIN_CIRCUIT(circ)->cpath->prev &&
+          !ppath_tmp->piggyback && size <= MT_PIGGYBACK_MAX_SIZE) {
+        log_debug(LD_MT, "MoneTor: holding %s for the next data cell to hop %d",
+            mt_token_describe(type), hop);
+        ppath_tmp->piggyback = tor_memdup(msg, size);
+        ppath_tmp->piggyback_size = size;
+        return 0;
+      }
       if (hop > 1) {
         for (int i=0; i < (int)size/RELAY_PPAYLOAD_SIZE+1; i++) {
           mt_cclient_update_payment_window(circ, hop);
@@ -1075,13 +1172,11 @@ mt_cclient_send_message(mt_desc_t* desc, uint8_t command, mt_ntype_t type,
 int
 mt_cclient_send_message_multidesc(mt_desc_t *desc1, mt_desc_t *desc2,
     mt_ntype_t type, byte* msg, int size) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc1, &id);
   crypt_path_t *layer_start;
   pay_path_t *ppath_tmp;
-  circuit_t *circ = digestmap_get(desc2circ, (char *) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc1);
   if (!circ) {
-    log_warn(LD_MT, "MoneTor: digestmap_get failed to return a circ for descriptor"
+    log_warn(LD_MT, "MoneTor: mt_descmap_get failed to return a circ for descriptor"
         " %s", mt_desc_describe(desc1));
     return -2;
   }
@@ -1190,6 +1285,20 @@ mt_cclient_process_received_msg, (origin_circuit_t *circ, crypt_path_t *layer_hi
   }
 }
 
+/**
+ * Number of payment units needed to bring the window of <b>ppath</b> back up
+ * to <b>threshold</b>, capped by MoneTorMaxPaymentUnits
+ */
+static int
+payment_units(pay_path_t *ppath, int threshold) {
+  int rate = get_options()->MoneTorPaymentRate;
+  int max_units = get_options()->MoneTorMaxPaymentUnits;
+  if (rate <= 0 || ppath->window >= threshold)
+    return 1;
+  int units = (threshold - ppath->window + rate - 1) / rate;
+  return MAX(1, MIN(units, max_units));
+}
+
 /*************************** Object creation and cleanup *******************************/
 
 
@@ -1198,7 +1307,9 @@ pay_path_free(pay_path_t* ppath) {
   if (!ppath)
     return;
   tor_free(ppath->inter_ident);
-  buf_free(ppath->buf);
+  tor_free(ppath->piggyback);
+  mt_msgreasm_free(ppath->buf);
+  mt_paywindow_free(ppath->pw);
   /* Recursive call to explore the linked list */
   pay_path_free(ppath->next);
 }
@@ -1211,20 +1322,18 @@ mt_cclient_general_circuit_free(origin_circuit_t* circ) {
   if (!circ)
     return;
   /** Should we check again if the map contains the circ? */
-  byte digest[DIGEST_LEN];
   pay_path_t *ppath_tmp = circ->ppath;
   int hop = 1;
   while (ppath_tmp) {
-    mt_desc2digest(&ppath_tmp->desc, &digest);
-    if (digestmap_get(desc2circ, (char*)digest)) {
+    if (mt_descmap_get(desc2circ, &ppath_tmp->desc)) {
       log_warn(LD_MT, "MoneTor: Wut hop %d should have been already removed :/", hop);
-      digestmap_remove(desc2circ, (char*) digest);
+      mt_descmap_remove(desc2circ, &ppath_tmp->desc);
     }
     ppath_tmp = ppath_tmp->next;
     hop++;
   }
   pay_path_free(circ->ppath);
-  buf_free(circ->buf); //normally untouched
+  mt_msgreasm_free(circ->buf); //normally untouched
 }
 
 void
@@ -1232,17 +1341,15 @@ mt_cclient_intermediary_circuit_free(origin_circuit_t* circ) {
   if (!circ)
     return;
   tor_free(circ->inter_ident);
-  buf_free(circ->buf);
+  mt_msgreasm_free(circ->buf);
 }
 
 /************************** Informational (Logging purposes) ***************************/
 
 MOCK_IMPL(int, mt_cclient_relay_type,(mt_desc_t *desc)){
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
 
   circuit_t* circ;
-  if(!(circ = digestmap_get(desc2circ, (char*)digest)))
+  if(!(circ = mt_descmap_get(desc2circ, desc)))
     return -1;
 
   pay_path_t* current;
@@ -2,6 +2,7 @@
 #define mt_cclient_h
 
 #include "mt_common.h"
+#include "mt_descmap.h"
 /**
  * Controller moneTor client part
  */
@@ -28,6 +29,9 @@ void mt_cclient_mark_payment_channel_for_close(circuit_t *circ, int abort, int r
 
 #ifdef MT_CCLIENT_PRIVATE
 STATIC intermediary_t* intermediary_new(const node_t *node, extend_info_t *ei, time_t now);
+#ifdef TOR_UNIT_TESTS
+extern mt_descmap_t* desc2circ;
+#endif
 #endif
 /** Gets called every second, job:
  */
@@ -36,6 +40,32 @@ void run_cclient_scheduled_events(time_t now);
 int mt_cclient_paymod_signal(mt_signal_t signal, mt_desc_t *desc);
 
 void mt_cclient_update_payment_window(circuit_t *circ, int sendme);
+
+/**
+ * Nanopayments to the exit of <b>circ</b> made from now until
+ * mt_cclient_piggyback_end() wait for the next data cell packaged on it
+ * rather than going out in a cell of their own. Does nothing unless
+ * MoneTorPiggyback is set and the exit advertises Pay=1.
+ */
+void mt_cclient_piggyback_begin(circuit_t *circ);
+
+/**
+ * Return how many bytes at the end of the next data cell to <b>layer</b> of
+ * <b>circ</b> are needed by a waiting payment, or 0 if none is waiting
+ */
+size_t mt_cclient_piggyback_size(circuit_t *circ, crypt_path_t *layer);
+
+/**
+ * Write the waiting payment of <b>circ</b> to <b>dest</b> as a payment header
+ * extension of mt_cclient_piggyback_size() bytes and forget it
+ */
+void mt_cclient_piggyback_take(circuit_t *circ, uint8_t *dest);
+
+/**
+ * Stop holding payments for <b>circ</b> and send one still waiting in a cell
+ * of its own
+ */
+void mt_cclient_piggyback_end(circuit_t *circ);
 //handle intermediaries
 //XXX MoneTor maybe all of intermediary-handling
 //    function need to be in a separate file?
@@ -0,0 +1,106 @@
+/**
+ * \file mt_chntable.c
+ *
+ * Index payment channels by their state and the descriptor that identifies
+ * them in that state. Payment modules used to keep one smartlist per state and
+ * find a channel by scanning it; here every lookup and state transition is a
+ * single map operation regardless of how many channels are open.
+ */
+
+#include "or.h"
+#include "container.h"
+#include "mt_common.h"
+#include "mt_descmap.h"
+#include "mt_chntable.h"
+
+mt_chntable_t* mt_chntable_new(void){
+  mt_chntable_t* table = tor_calloc(1, sizeof(mt_chntable_t));
+  for(int i = 0; i < MT_CHNTABLE_MAX_STATES; i++)
+    table->buckets[i] = mt_descmap_new();
+  return table;
+}
+
+void mt_chntable_free(mt_chntable_t* table, void (*free_fn)(void*)){
+
+  if(!table)
+    return;
+
+  for(int i = 0; i < MT_CHNTABLE_MAX_STATES; i++){
+    MT_DESCMAP_FOREACH_MODIFY(table->buckets[i], desc, smartlist_t*, bucket){
+      if(free_fn)
+	SMARTLIST_FOREACH(bucket, void*, chn, free_fn(chn));
+      smartlist_free(bucket);
+      MAP_DEL_CURRENT(desc);
+    } MT_DESCMAP_FOREACH_END;
+    mt_descmap_free(table->buckets[i], NULL);
+  }
+  tor_free(table);
+}
+
+void mt_chntable_add(mt_chntable_t* table, int state, mt_desc_t* desc, void* chn){
+
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+
+  smartlist_t* bucket = mt_descmap_get(table->buckets[state], desc);
+  if(!bucket){
+    bucket = smartlist_new();
+    mt_descmap_set(table->buckets[state], desc, bucket);
+  }
+  smartlist_add(bucket, chn);
+  table->counts[state]++;
+}
+
+void* mt_chntable_get(mt_chntable_t* table, int state, mt_desc_t* desc){
+
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+
+  smartlist_t* bucket = mt_descmap_get(table->buckets[state], desc);
+  if(!bucket)
+    return NULL;
+  return smartlist_get(bucket, 0);
+}
+
+void* mt_chntable_take(mt_chntable_t* table, int state, mt_desc_t* desc){
+
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+
+  smartlist_t* bucket = mt_descmap_get(table->buckets[state], desc);
+  if(!bucket)
+    return NULL;
+
+  // take the oldest channel, as the list scan this replaced did; buckets
+  // hold one descriptor's channels so they stay short
+  void* chn = smartlist_get(bucket, 0);
+  smartlist_del_keeporder(bucket, 0);
+
+  // empty buckets are dropped so every bucket in the map holds a channel
+  if(smartlist_len(bucket) == 0){
+    mt_descmap_remove(table->buckets[state], desc);
+    smartlist_free(bucket);
+  }
+  table->counts[state]--;
+  return chn;
+}
+
+int mt_chntable_count(mt_chntable_t* table, int state){
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+  return table->counts[state];
+}
+
+int mt_chntable_count_desc(mt_chntable_t* table, int state, mt_desc_t* desc){
+
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+
+  smartlist_t* bucket = mt_descmap_get(table->buckets[state], desc);
+  return bucket ? smartlist_len(bucket) : 0;
+}
+
+void mt_chntable_sort(mt_chntable_t* table, int state,
+		      int (*cmp)(const void** a, const void** b)){
+
+  tor_assert(state >= 0 && state < MT_CHNTABLE_MAX_STATES);
+
+  MT_DESCMAP_FOREACH(table->buckets[state], desc, smartlist_t*, bucket){
+    smartlist_sort(bucket, cmp);
+  } MT_DESCMAP_FOREACH_END;
+}
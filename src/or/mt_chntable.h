@@ -0,0 +1,71 @@
+/**
+ * \file mt_chntable.h
+ * \brief Header file for mt_chntable.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated.
+ **/
+
+#ifndef mt_chntable_h
+#define mt_chntable_h
+
+#include "or.h"
+#include "mt_descmap.h"
+
+/** Most channel states a single table can index */
+#define MT_CHNTABLE_MAX_STATES 8
+
+/**
+ * Payment channels indexed by (state, descriptor). The descriptor is
+ * whichever one identifies a channel in that state, e.g. the intermediary
+ * before a nanopayment channel is established and the relay afterwards.
+ */
+typedef struct {
+  /* per state: desc -> smartlist_t* of channels */
+  mt_descmap_t* buckets[MT_CHNTABLE_MAX_STATES];
+  int counts[MT_CHNTABLE_MAX_STATES];
+} mt_chntable_t;
+
+mt_chntable_t* mt_chntable_new(void);
+
+/**
+ * Free the table, calling <b>free_fn</b> on every channel it still holds if
+ * it is not NULL
+ */
+void mt_chntable_free(mt_chntable_t* table, void (*free_fn)(void*));
+
+/**
+ * Record that <b>chn</b> is in <b>state</b> and is identified there by
+ * <b>desc</b>
+ */
+void mt_chntable_add(mt_chntable_t* table, int state, mt_desc_t* desc, void* chn);
+
+/**
+ * Return the channel that mt_chntable_take() would return without removing
+ * it, or NULL
+ */
+void* mt_chntable_get(mt_chntable_t* table, int state, mt_desc_t* desc);
+
+/**
+ * Remove and return a channel in <b>state</b> identified by <b>desc</b>, or
+ * NULL if there is none. The channel added or sorted first is taken first.
+ */
+void* mt_chntable_take(mt_chntable_t* table, int state, mt_desc_t* desc);
+
+/**
+ * Return the number of channels in <b>state</b>
+ */
+int mt_chntable_count(mt_chntable_t* table, int state);
+
+/**
+ * Return the number of channels in <b>state</b> identified by <b>desc</b>
+ */
+int mt_chntable_count_desc(mt_chntable_t* table, int state, mt_desc_t* desc);
+
+/**
+ * Sort the channels of every descriptor in <b>state</b> in ascending order of
+ * <b>cmp</b>, so that the least one is taken first
+ */
+void mt_chntable_sort(mt_chntable_t* table, int state,
+		      int (*cmp)(const void** a, const void** b));
+
+#endif
@@ -2,6 +2,7 @@
 #include "buffers.h"
 #include "mt_cintermediary.h"
 #include "mt_common.h"
+#include "mt_descmap.h"
 #include "mt_ipay.h"
 #include "container.h"
 #include "circuitbuild.h"
@@ -18,7 +19,7 @@
 STATIC void run_cintermediary_housekeeping_event(time_t now);
 STATIC void run_cintermediary_build_circuit_event(time_t now);
 
-static digestmap_t *desc2circ = NULL;
+static mt_descmap_t* desc2circ = NULL;
 
 static smartlist_t *ledgercircs = NULL;
 static ledger_t *ledger = NULL;
@@ -28,7 +29,8 @@ static uint64_t count[2] = {0, 0};
 
 STATIC void
 run_cintermediary_housekeeping_event(time_t now) {
-  (void) now;
+  /* Drop payment messages that waited too long for their peer */
+  mt_ipay_housekeeping(now);
 }
 
 /**
@@ -95,7 +97,6 @@ void
 run_cintermediary_scheduled_events(time_t now) {
   if (!intermediary_mode(get_options()))
     return;
-  /** uselss right now */
   run_cintermediary_housekeeping_event(now);
 
   run_cintermediary_build_circuit_event(now);
@@ -112,9 +113,7 @@ void mt_cintermediary_ledger_circ_has_opened(origin_circuit_t *circ) {
   /*circ->desc.id[0] = count[0];*/
   /*circ->desc.id[1] = count[1];*/
   /*circ->desc.party = MT_PARTY_LED;*/
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &ledger->desc, TO_CIRCUIT(circ));
   mt_ipay_set_status(&ledger->desc, 1);
 }
 
@@ -132,10 +131,8 @@ void mt_cintermediary_ledger_circ_has_closed(circuit_t *circ) {
   }
   smartlist_remove(ledgercircs, circ);
   /* XXX Todo should also remove from desc2circ */
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &ledger->desc)) {
+    mt_descmap_remove(desc2circ, &ledger->desc);
     log_info(LD_MT, "MoneTor: ledger circ has closed. Removed %s from our internal structure",
         mt_desc_describe(&TO_ORIGIN_CIRCUIT(circ)->desc));
   }
@@ -147,10 +144,8 @@ void mt_cintermediary_ledger_circ_has_closed(circuit_t *circ) {
 }
 
 void mt_cintermediary_orcirc_has_closed(or_circuit_t *circ) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &circ->desc)) {
+    mt_descmap_remove(desc2circ, &circ->desc);
     log_info(LD_MT, "MoneTor: orcirc circ has closed. Removed %s from our internal structure",
         mt_desc_describe(&circ->desc));
   }
@@ -175,9 +170,7 @@ void mt_cintermediary_init_desc_and_add(or_circuit_t *circ, mt_party_t party) {
   /*Cell received has been sent either by a relay or by a client */
   // XXX must be REL or CLI but IDK :/
   circ->desc.party = party; 
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &circ->desc, TO_CIRCUIT(circ));
   log_info(LD_MT, "New circuit connected to us received a payment cell."
       " Adding it to the map: %s", mt_desc_describe(&circ->desc));
 }
@@ -234,9 +227,7 @@ ledger_t *mt_cintermediary_get_ledger(void) {
 int
 mt_cintermediary_send_message(mt_desc_t *desc, mt_ntype_t pcommand,
     byte *msg, int size) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   crypt_path_t *layer_start = NULL;
   /** Might happen if the circuit has been closed */
   // We can go a bit further and re-send the command for 
@@ -291,7 +282,7 @@ mt_cintermediary_process_received_msg(circuit_t *circ, mt_ntype_t pcommand,
 
 void mt_cintermediary_init(void) {
   log_info(LD_MT, "MoneTor: Initialization of the intermediary controller module");
-  desc2circ = digestmap_new();
+  desc2circ = mt_descmap_new();
   ledgercircs = smartlist_new();
   count[0] = rand_uint64();
   count[1] = rand_uint64();
@@ -300,5 +291,5 @@ void mt_cintermediary_init(void) {
 }
 
 void mt_cintermediary_orcirc_free(or_circuit_t *circ) {
-  buf_free(circ->buf);
+  mt_msgreasm_free(circ->buf);
 }
@@ -6,6 +6,7 @@
 #include "buffers.h"
 #include "config.h"
 #include "mt_common.h"
+#include "mt_descmap.h"
 #include "mt_cledger.h"
 #include "mt_lpay.h"
 #include "main.h"
@@ -15,19 +16,27 @@
 #include "circuitlist.h"
 #include "relay.h"
 
-static digestmap_t *desc2circ = NULL;
+/** How often (in seconds) to log the ledger pipeline statistics */
+#define MT_LPAY_STATS_INTERVAL 60
+
+static mt_descmap_t* desc2circ = NULL;
 static uint64_t count[2] = {0, 0};
 
-void
+int
 mt_cledger_init(void) {
   log_info(LD_MT, "MoneTor: initialization of the ledger controller module");
-  desc2circ = digestmap_new();
+  desc2circ = mt_descmap_new();
   count[0] = rand_uint64();
   count[1] = rand_uint64();
   // XXX check with Thien-Nam wheter I am responsible
   // to init.
   log_info(LD_MT, "MoneTor: initialization of the ledger payment module");
-  mt_lpay_init();
+  if (mt_lpay_init() != MT_SUCCESS) {
+    log_err(LD_MT, "MoneTor: could not restore the ledger from disk; "
+        "refusing to run as a ledger with lost balances");
+    return MT_ERROR;
+  }
+  return MT_SUCCESS;
 }
 
 /**
@@ -40,16 +49,28 @@ void mt_cledger_init_desc_and_add(or_circuit_t *circ, mt_party_t party) {
   circ->desc.id[0] = count[0];
   circ->desc.id[1] = count[1];
   circ->desc.party = party;
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &circ->desc, TO_CIRCUIT(circ));
 }
 
 /**********************Events************************/
 
 static void
 run_cledger_housekeeping_event(time_t now) {
-  (void) now;
+  mt_lpay_pipeline_tick(now);
+
+  if (mt_lpay_checkpoint(0) != MT_SUCCESS) {
+    log_warn(LD_MT, "MoneTor: could not write ledger snapshot");
+  }
+
+  if (now % MT_LPAY_STATS_INTERVAL == 0) {
+    mt_lpay_pipeline_stats_t stats;
+    mt_lpay_pipeline_stats(&stats);
+    log_info(LD_MT, "MoneTor: ledger pipeline depth verify %d apply %d sign %d; "
+        "rate verify %.1f/s apply %.1f/s sign %.1f/s",
+        stats.depth[MT_LPAY_STAGE_VERIFY], stats.depth[MT_LPAY_STAGE_APPLY],
+        stats.depth[MT_LPAY_STAGE_SIGN], stats.rate[MT_LPAY_STAGE_VERIFY],
+        stats.rate[MT_LPAY_STAGE_APPLY], stats.rate[MT_LPAY_STAGE_SIGN]);
+  }
 }
 
 
@@ -63,10 +84,8 @@ void run_cledger_scheduled_events(time_t now) {
  * the function in circuit_about_to_free*/
 void
 mt_cledger_orcirc_has_closed(or_circuit_t *circ) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &circ->desc)) {
+    mt_descmap_remove(desc2circ, &circ->desc);
   }
   else {
     log_info(LD_MT, "MoneTor: desc %s not found in our map", mt_desc_describe(&circ->desc));
@@ -106,9 +125,7 @@ void mt_cledger_mark_payment_channel_for_close(circuit_t *circ, int abort, int r
 
 int
 mt_cledger_send_message(mt_desc_t* desc, mt_ntype_t type, byte *msg, int msg_len) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   if (!circ) {
     log_info(LD_MT, "MoneTor: Looks like %s is not in our map", mt_desc_describe(desc));
     return -2;
@@ -149,5 +166,5 @@ void mt_cledger_process_received_msg(circuit_t *circ, mt_ntype_t type,
 }
 
 void mt_cledger_orcirc_free(or_circuit_t *circ) {
-  buf_free(circ->buf);
+  mt_msgreasm_free(circ->buf);
 }
@@ -8,7 +8,12 @@
 #include "or.h"
 #include "mt_common.h"
 
-void mt_cledger_init(void);
+/**
+ * Initialize the ledger controller and payment module. Return MT_ERROR if
+ * the ledger could not be restored from MoneTorLedgerLogDir, in which case
+ * the ledger must not run.
+ */
+int mt_cledger_init(void);
 
 
 void run_cledger_scheduled_events(time_t now);
@@ -31,6 +31,7 @@
 #include "router.h"
 #include "relay.h"
 #include "scheduler.h"
+#include "trace/events.h"
 #include <time.h>
 
 static uint64_t count[2] = {0, 0};
@@ -57,7 +58,8 @@ void mt_bytes2digest(byte* str, int str_size, byte (*digest_out)[DIGEST_LEN]){
 
 /**
  * Converts an mt_desc_t into an address for use in digestmaps. The output is
- * a hash of the mt_desc_t contents truncated to 20 bytes
+ * a hash of the mt_desc_t contents truncated to 20 bytes. Maps keyed only by
+ * descriptor should use mt_descmap_t, which avoids hashing on every lookup.
  */
 void mt_desc2digest(mt_desc_t* desc, byte (*digest_out)[DIGEST_LEN]){
   byte hash[MT_SZ_HASH];
@@ -134,6 +136,66 @@ int mt_hc_create(int size, byte (*head)[MT_SZ_HASH], byte (*hc_out)[][MT_SZ_HASH
   return MT_SUCCESS;
 }
 
+/**
+ * Initialize a pebbled hash chain. The chain is walked once from head to tail
+ * to produce the tail; pebbles are dropped at the halfway points along the way
+ * so that the first elements requested by mt_hc_get() are already available.
+ */
+int mt_hc_init(mt_hc_t* hc, int size, byte (*head)[MT_SZ_HASH], byte (*tail_out)[MT_SZ_HASH]){
+  if(size < 1)
+    return MT_ERROR;
+
+  memset(hc, 0, sizeof(mt_hc_t));
+  hc->size = size;
+  hc->num_pebbles = 1;
+  hc->pos[0] = 0;
+  memcpy(hc->val[0], *head, MT_SZ_HASH);
+
+  return mt_hc_get(hc, 0, tail_out);
+}
+
+/**
+ * Produce the kth element from the tail, which sits size - 1 - k hashes away
+ * from the head. Pebbles beyond the target are no longer needed and are
+ * discarded. From the closest remaining pebble we then repeatedly hash halfway
+ * to the target and drop a new pebble there. Requesting elements in increasing
+ * order of k therefore keeps at most log2(size) + 1 pebbles and costs amortized
+ * O(log size) hashes. Any other order is still correct but may cost up to
+ * O(size) hashes for a single call.
+ */
+int mt_hc_get(mt_hc_t* hc, int k, byte (*preimage_out)[MT_SZ_HASH]){
+  if(k < 0 || k >= hc->size || hc->num_pebbles < 1)
+    return MT_ERROR;
+
+  int target = hc->size - 1 - k;
+  byte temp[MT_SZ_HASH];
+
+  while(hc->pos[hc->num_pebbles - 1] > target)
+    hc->num_pebbles--;
+
+  while(hc->pos[hc->num_pebbles - 1] < target){
+
+    // only reachable with out of order requests; restart from the head
+    if(hc->num_pebbles == MT_HC_PEBBLES)
+      hc->num_pebbles = 1;
+
+    int top = hc->num_pebbles - 1;
+    int steps = (target - hc->pos[top] + 1) / 2;
+
+    memcpy(hc->val[top + 1], hc->val[top], MT_SZ_HASH);
+    for(int i = 0; i < steps; i++){
+      if(mt_crypt_hash(hc->val[top + 1], MT_SZ_HASH, &temp) != MT_SUCCESS)
+        return MT_ERROR;
+      memcpy(hc->val[top + 1], temp, MT_SZ_HASH);
+    }
+    hc->pos[top + 1] = hc->pos[top] + steps;
+    hc->num_pebbles++;
+  }
+
+  memcpy(*preimage_out, hc->val[hc->num_pebbles - 1], MT_SZ_HASH);
+  return MT_SUCCESS;
+}
+
 /**
  * Verifies the claim that a given preimage is in fact the kth element on a hash
  * chain starting at the given tail.
@@ -200,6 +262,8 @@ const char* mt_party_describe(mt_party_t party){
  */
 int mt_receipt_sign(any_led_receipt_t* rec, byte (*sk)[MT_SZ_SK]){
 
+  rec->batch_size = 0;
+
   // construct the packed string
   int str_size = sizeof(mt_ntype_t) + sizeof(int) + MT_SZ_ADDR + MT_SZ_ADDR;
   byte str[str_size];
@@ -212,11 +276,16 @@ int mt_receipt_sign(any_led_receipt_t* rec, byte (*sk)[MT_SZ_SK]){
   return mt_sig_sign(str, str_size, sk, &rec->sig);
 }
 
+static int receipt_verify_batch(any_led_receipt_t* rec, byte (*pk)[MT_SZ_PK]);
+
 /**
  * Verify the receipt of a ledger transaction
  */
 int mt_receipt_verify(any_led_receipt_t* rec, byte (*pk)[MT_SZ_PK]){
 
+  if(rec->batch_size)
+    return receipt_verify_batch(rec, pk);
+
   // construct the packed string
   int str_size = sizeof(mt_ntype_t) + sizeof(int) + MT_SZ_ADDR + MT_SZ_ADDR;
   byte str[str_size];
@@ -229,6 +298,175 @@ int mt_receipt_verify(any_led_receipt_t* rec, byte (*pk)[MT_SZ_PK]){
   return mt_sig_verify(str, str_size, pk, &rec->sig);
 }
 
+/**
+ * Hash the signed fields of a receipt into a Merkle leaf
+ */
+static void receipt_leaf(any_led_receipt_t* rec, byte (*hash_out)[MT_SZ_HASH]){
+
+  // leaves and inner nodes are prefixed differently so one cannot pass for
+  // the other
+  int str_size = 1 + sizeof(mt_ntype_t) + sizeof(int) + MT_SZ_ADDR + MT_SZ_ADDR;
+  byte str[str_size];
+
+  str[0] = 0;
+  memcpy(str + 1, &rec->type, sizeof(mt_ntype_t));
+  memcpy(str + 1 + sizeof(mt_ntype_t), &rec->val, sizeof(int));
+  memcpy(str + 1 + sizeof(mt_ntype_t) + sizeof(int), rec->from, MT_SZ_ADDR);
+  memcpy(str + 1 + sizeof(mt_ntype_t) + sizeof(int) + MT_SZ_ADDR, rec->to, MT_SZ_ADDR);
+
+  mt_crypt_hash(str, str_size, hash_out);
+}
+
+static void receipt_node(byte (*left)[MT_SZ_HASH], byte (*right)[MT_SZ_HASH],
+			 byte (*hash_out)[MT_SZ_HASH]){
+  byte str[1 + 2 * MT_SZ_HASH];
+  str[0] = 1;
+  memcpy(str + 1, *left, MT_SZ_HASH);
+  memcpy(str + 1 + MT_SZ_HASH, *right, MT_SZ_HASH);
+  mt_crypt_hash(str, sizeof(str), hash_out);
+}
+
+/**
+ * Pack the Merkle root of a batch together with the size of the batch; this is
+ * the string the ledger signs
+ */
+static void receipt_root_str(byte (*root)[MT_SZ_HASH], int batch_size,
+			     byte (*str_out)[MT_SZ_HASH + sizeof(int)]){
+  memcpy(*str_out, *root, MT_SZ_HASH);
+  memcpy(*str_out + MT_SZ_HASH, &batch_size, sizeof(int));
+}
+
+int mt_receipt_sign_batch(int n, any_led_receipt_t** recs, byte (*sk)[MT_SZ_SK]){
+
+  if(n < 1 || n > MT_RECEIPT_MAX_BATCH)
+    return MT_ERROR;
+
+  // hash the tree level by level; a node without a sibling moves up unchanged
+  byte (*level)[MT_SZ_HASH] = tor_calloc(n, MT_SZ_HASH);
+  for(int i = 0; i < n; i++){
+    receipt_leaf(recs[i], &level[i]);
+    recs[i]->batch_size = n;
+    recs[i]->index = i;
+    memset(recs[i]->path, 0, sizeof(recs[i]->path));
+  }
+
+  int width = n;
+  for(int depth = 0; width > 1; depth++){
+    for(int i = 0; i < n; i++){
+      int sibling = (i >> depth) ^ 1;
+      if(sibling < width)
+	memcpy(recs[i]->path[depth], level[sibling], MT_SZ_HASH);
+    }
+    for(int j = 0; j < width; j += 2){
+      if(j + 1 < width)
+	receipt_node(&level[j], &level[j + 1], &level[j / 2]);
+      else
+	memcpy(level[j / 2], level[j], MT_SZ_HASH);
+    }
+    width = (width + 1) / 2;
+  }
+
+  byte str[MT_SZ_HASH + sizeof(int)];
+  receipt_root_str(&level[0], n, &str);
+  tor_free(level);
+
+  byte sig[MT_SZ_SIG];
+  if(mt_sig_sign(str, sizeof(str), sk, &sig) != MT_SUCCESS)
+    return MT_ERROR;
+  for(int i = 0; i < n; i++)
+    memcpy(recs[i]->sig, sig, MT_SZ_SIG);
+  return MT_SUCCESS;
+}
+
+/** Root signatures that have already been checked, keyed by a digest of the
+ * key, root and signature. Intermediary shards verify receipts on the
+ * cpuworker, so the cache and its counter are guarded by a lock. */
+static digestmap_t* verified_roots = NULL;
+static uint64_t root_checks = 0;
+static tor_mutex_t verified_roots_lock;
+static int verified_roots_lock_initialized = 0;
+
+/**
+ * Initialize the receipt root cache. Called from mt_init() on the main thread
+ * before any worker thread can verify a receipt; later calls are no-ops.
+ */
+void mt_receipt_init(void){
+  if(verified_roots_lock_initialized)
+    return;
+  tor_mutex_init_nonrecursive(&verified_roots_lock);
+  verified_roots_lock_initialized = 1;
+}
+
+/** Forget every checked root once this many have accumulated */
+#define MT_RECEIPT_ROOT_CACHE 1024
+
+static int receipt_verify_batch(any_led_receipt_t* rec, byte (*pk)[MT_SZ_PK]){
+
+  if(rec->batch_size < 1 || rec->batch_size > MT_RECEIPT_MAX_BATCH ||
+     rec->index < 0 || rec->index >= rec->batch_size)
+    return MT_ERROR;
+
+  // recompute the root from the leaf and its path
+  byte hash[MT_SZ_HASH];
+  receipt_leaf(rec, &hash);
+
+  int pos = rec->index;
+  int width = rec->batch_size;
+  for(int depth = 0; width > 1; depth++){
+    if((pos ^ 1) < width){
+      byte (*sibling)[MT_SZ_HASH] = &rec->path[depth];
+      if(pos & 1)
+	receipt_node(sibling, &hash, &hash);
+      else
+	receipt_node(&hash, sibling, &hash);
+    }
+    pos >>= 1;
+    width = (width + 1) / 2;
+  }
+
+  byte str[MT_SZ_HASH + sizeof(int)];
+  receipt_root_str(&hash, rec->batch_size, &str);
+
+  byte key_str[MT_SZ_PK + sizeof(str) + MT_SZ_SIG];
+  memcpy(key_str, *pk, MT_SZ_PK);
+  memcpy(key_str + MT_SZ_PK, str, sizeof(str));
+  memcpy(key_str + MT_SZ_PK + sizeof(str), rec->sig, MT_SZ_SIG);
+  byte key[DIGEST_LEN];
+  mt_bytes2digest(key_str, sizeof(key_str), &key);
+
+  mt_receipt_init();
+  tor_mutex_acquire(&verified_roots_lock);
+  if(!verified_roots)
+    verified_roots = digestmap_new();
+  int cached = digestmap_get(verified_roots, (char*)key) != NULL;
+  if(!cached)
+    root_checks++;
+  tor_mutex_release(&verified_roots_lock);
+  if(cached)
+    return MT_SUCCESS;
+
+  // checked without the lock so that other shards are not held up
+  if(mt_sig_verify(str, sizeof(str), pk, &rec->sig) != MT_SUCCESS)
+    return MT_ERROR;
+
+  tor_mutex_acquire(&verified_roots_lock);
+  if(digestmap_size(verified_roots) >= MT_RECEIPT_ROOT_CACHE){
+    digestmap_free(verified_roots, NULL);
+    verified_roots = digestmap_new();
+  }
+  digestmap_set(verified_roots, (char*)key, (void*)1);
+  tor_mutex_release(&verified_roots_lock);
+  return MT_SUCCESS;
+}
+
+uint64_t mt_receipt_root_checks(void){
+  mt_receipt_init();
+  tor_mutex_acquire(&verified_roots_lock);
+  uint64_t checks = root_checks;
+  tor_mutex_release(&verified_roots_lock);
+  return checks;
+}
+
 /**
  * Populates the unsigned fields of a new micropayment wallet using a given old
  * wallet and a desired value change
@@ -244,7 +482,9 @@ int mt_wallet_create(byte (*pp)[MT_SZ_PP], int value, chn_end_wallet_t* wal_old,
   memcpy(wal_new->int_pk, wal_old->int_pk, MT_SZ_PK);
   memcpy(wal_new->csk, wal_old->csk, MT_SZ_SK);
 
-  errors += mt_crypt_keygen(pp, &wal_new->wpk, &wal_new->wsk);
+  // keep the signature scheme of the channel; this may run on the cpuworker
+  mt_key_type_t key_type = mt_crypt_is_ed25519(wal_old->wpk) ? MT_KEY_ED25519 : MT_KEY_RSA;
+  errors += mt_crypt_keygen(pp, key_type, &wal_new->wpk, &wal_new->wsk);
   errors += mt_crypt_rand(MT_SZ_HASH, wal_new->rand);
 
   // generate wallet commitment
@@ -303,13 +543,16 @@ uint64_t rand_uint64(void) {
  * for the payment system
  * XXX TODO
  */
-void mt_init(void){
+int mt_init(void){
   log_info(LD_MT, "MoneTor: Initializing the payment system");
+  mt_crypt_init();
+  mt_receipt_init();
   count[0] = rand_uint64();
   count[1] = rand_uint64();
   /** Only one should properly complete */
   if (ledger_mode(get_options())) {
-    mt_cledger_init();
+    if (mt_cledger_init() != MT_SUCCESS)
+      return MT_ERROR;
   }
   else if (intermediary_mode(get_options())) {
     mt_cintermediary_init();
@@ -320,6 +563,7 @@ void mt_init(void){
   else {
     mt_cclient_init();
   }
+  return MT_SUCCESS;
 }
 /**
  * Initialize ledger info
@@ -408,16 +652,12 @@ const char* mt_desc_describe(mt_desc_t* desc) {
 }
 
 /**
- * Returns 1 if both structure have the same digest
+ * Returns 1 if both structure describe the same party
  * 0 otherwise
  */
 
 int mt_desc_eq(mt_desc_t* desc1, mt_desc_t* desc2) {
-  byte id1[DIGEST_LEN];
-  byte id2[DIGEST_LEN];
-  mt_desc2digest(desc1, &id1);
-  mt_desc2digest(desc2, &id2);
-  return tor_memeq(id1, id2, DIGEST_LEN);
+  return mt_desc_comp(desc1, desc2) == 0;
 }
 
 const char* mt_signal_describe(mt_signal_t signal) {
@@ -492,6 +732,130 @@ void mt_update_payment_window(circuit_t *circ) {
   }
 }
 
+/********************** Message reassembly ***********************/
+
+/** Free list of idle message buffers that all have the same size */
+typedef struct mt_msgpool_t {
+  size_t size;
+  smartlist_t* free;
+} mt_msgpool_t;
+
+/** One free list per message size; there are only a handful of token sizes */
+static smartlist_t* msgpools = NULL;
+
+static mt_msgpool_t* msgpool_find(size_t size, int create) {
+  if (!msgpools) {
+    if (!create)
+      return NULL;
+    msgpools = smartlist_new();
+  }
+  SMARTLIST_FOREACH(msgpools, mt_msgpool_t*, pool,
+      if (pool->size == size) return pool);
+  if (!create)
+    return NULL;
+  mt_msgpool_t* pool = tor_malloc_zero(sizeof(mt_msgpool_t));
+  pool->size = size;
+  pool->free = smartlist_new();
+  smartlist_add(msgpools, pool);
+  return pool;
+}
+
+byte* mt_msgpool_get(size_t size) {
+  mt_msgpool_t* pool = msgpool_find(size, 0);
+  if (pool && smartlist_len(pool->free) > 0)
+    return smartlist_pop_last(pool->free);
+  return tor_malloc(size);
+}
+
+void mt_msgpool_put(byte* msg, size_t size) {
+  if (!msg)
+    return;
+  mt_msgpool_t* pool = msgpool_find(size, 1);
+  if (smartlist_len(pool->free) >= MT_MSGPOOL_MAX_FREE) {
+    tor_free(msg);
+    return;
+  }
+  smartlist_add(pool->free, msg);
+}
+
+int mt_msgpool_idle(size_t size) {
+  mt_msgpool_t* pool = msgpool_find(size, 0);
+  return pool ? smartlist_len(pool->free) : 0;
+}
+
+void mt_msgpool_free_all(void) {
+  if (!msgpools)
+    return;
+  SMARTLIST_FOREACH_BEGIN(msgpools, mt_msgpool_t*, pool) {
+    SMARTLIST_FOREACH(pool->free, byte*, msg, tor_free(msg));
+    smartlist_free(pool->free);
+    tor_free(pool);
+  } SMARTLIST_FOREACH_END(pool);
+  smartlist_free(msgpools);
+  msgpools = NULL;
+}
+
+mt_msgreasm_t* mt_msgreasm_new(void) {
+  return tor_malloc_zero(sizeof(mt_msgreasm_t));
+}
+
+void mt_msgreasm_free(mt_msgreasm_t* mb) {
+  if (!mb)
+    return;
+  mt_msgpool_put(mb->msg, mb->size);
+  tor_free(mb);
+}
+
+size_t mt_msgreasm_datalen(const mt_msgreasm_t* mb) {
+  return mb ? mb->len : 0;
+}
+
+byte* mt_msgreasm_add(mt_msgreasm_t* mb, mt_ntype_t type, const byte* data, size_t len,
+                      size_t* size_out) {
+
+  if (mb->msg && mb->type != type) {
+    log_info(LD_MT, "MoneTor: dropping a partial %s after receiving a %s fragment",
+        mt_token_describe(mb->type), mt_token_describe(type));
+    mt_msgpool_put(mb->msg, mb->size);
+    mb->msg = NULL;
+  }
+
+  // the first fragment tells us how large the whole message is
+  if (!mb->msg) {
+    size_t size = mt_token_get_size_of_msg(type, data, len);
+    if (size == 0) {
+      log_warn(LD_MT, "MoneTor: dropping a %s that starts with a bad fragment",
+          mt_token_describe(type));
+      return NULL;
+    }
+    mb->type = type;
+    mb->size = size;
+    mb->len = 0;
+    mb->msg = mt_msgpool_get(mb->size);
+  }
+
+  if (mb->len + len > mb->size) {
+    log_warn(LD_MT, "MoneTor: %s fragment overflows the expected message size %lu",
+        mt_token_describe(type), mb->size);
+    mt_msgpool_put(mb->msg, mb->size);
+    mb->msg = NULL;
+    mb->len = 0;
+    return NULL;
+  }
+
+  memcpy(mb->msg + mb->len, data, len);
+  mb->len += len;
+  if (mb->len < mb->size)
+    return NULL;
+
+  // complete: the caller now owns the buffer
+  byte* msg = mb->msg;
+  *size_out = mb->size;
+  mb->msg = NULL;
+  mb->len = 0;
+  return msg;
+}
+
 static mt_party_t
 mt_common_whose_other_edge(mt_ntype_t pcommand) {
   switch (pcommand) {
@@ -568,6 +932,7 @@ MOCK_IMPL(void,
   size_t msg_len = mt_token_get_size_of(rph->pcommand);
   log_debug(LD_MT, "MoneTor: Received cell for token %s with payload length of %d "
       " total message size expected: %ld", mt_token_describe(rph->pcommand), rph->length, msg_len);
+  tor_trace(mt, recv_relaycell, (int)rph->pcommand, (int)rph->length, (int)msg_len);
   if(ledger_mode(get_options()) || intermediary_mode(get_options()) ||
       server_mode(get_options())) {
     /**
@@ -597,17 +962,15 @@ MOCK_IMPL(void,
         else {
           mt_crelay_init_desc_and_add(orcirc, party);
         }
-        orcirc->buf = buf_new_with_capacity(RELAY_PPAYLOAD_SIZE);
+        orcirc->buf = mt_msgreasm_new();
         orcirc->circuit_received_first_payment_cell = 1;
       }
       /*buffer data if necessary*/
       if (msg_len > RELAY_PPAYLOAD_SIZE) {
-        buf_add(orcirc->buf, (char*) payload, rph->length);
-        if (buf_datalen(orcirc->buf) == msg_len) {
+        byte *msg = mt_msgreasm_add(orcirc->buf, rph->pcommand, payload, rph->length,
+            &msg_len);
+        if (msg) {
           /** We now have the full message */
-          byte *msg = tor_malloc(msg_len);
-          buf_get_bytes(orcirc->buf, (char*) msg, msg_len);
-          buf_clear(orcirc->buf);
           if (ledger_mode(get_options())) {
             mt_cledger_process_received_msg(circ, rph->pcommand, msg, msg_len);
           }
@@ -617,17 +980,19 @@ MOCK_IMPL(void,
           else {
             mt_crelay_process_received_msg(circ, rph->pcommand, msg, msg_len);
           }
-          tor_free(msg);
+          mt_msgpool_put(msg, msg_len);
         }
         else {
           log_info(LD_MT, "Buffering one received payment cell of type %s"
-              " current buf datlen %lu", mt_token_describe(rph->pcommand), buf_datalen(orcirc->buf));
+              " current buf datlen %lu", mt_token_describe(rph->pcommand),
+              mt_msgreasm_datalen(orcirc->buf));
           return;
         }
       }
       else {
         /** No need to buffer */
-        tor_assert(rph->length == msg_len);
+        tor_assert(rph->length ==
+            mt_token_get_size_of_msg(rph->pcommand, payload, rph->length));
         if (ledger_mode(get_options())) {
           mt_cledger_process_received_msg(circ, rph->pcommand, payload, rph->length);
         }
@@ -644,28 +1009,27 @@ MOCK_IMPL(void,
       // should be a ledger circuit
       origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
       if (msg_len > RELAY_PPAYLOAD_SIZE) {
-        buf_add(ocirc->buf, (char*) payload, rph->length);
-        if (buf_datalen(ocirc->buf) == msg_len) {
-          byte *msg = tor_malloc(msg_len);
-          buf_get_bytes(ocirc->buf, (char*) msg, msg_len);
-          buf_clear(ocirc->buf);
+        byte *msg = mt_msgreasm_add(ocirc->buf, rph->pcommand, payload, rph->length,
+            &msg_len);
+        if (msg) {
           if (intermediary_mode(get_options())) {
             mt_cintermediary_process_received_msg(circ, rph->pcommand, msg, msg_len);
           }
           else {
             mt_crelay_process_received_msg(circ, rph->pcommand, msg, msg_len);
           }
-          tor_free(msg);
+          mt_msgpool_put(msg, msg_len);
         }
         else {
           log_info(LD_MT, "Buffering one received payment cell of type %hhx"
-              " current buf datlen %lu", rph->pcommand, buf_datalen(ocirc->buf));
+              " current buf datlen %lu", rph->pcommand, mt_msgreasm_datalen(ocirc->buf));
           return;
         }
       }
       else {
         /** No need to buffer */
-        tor_assert(rph->length == msg_len);
+        tor_assert(rph->length ==
+            mt_token_get_size_of_msg(rph->pcommand, payload, rph->length));
         if (ledger_mode(get_options())) {
           mt_cledger_process_received_msg(circ, rph->pcommand, payload,
               rph->length);
@@ -695,35 +1059,31 @@ MOCK_IMPL(void,
             ppath = ppath->next;
           } while (cpath != layer_hint);
           /* We have the right hop  -- get the buffer */
-          buf_add(ppath->buf, (char*) payload, rph->length);
-          if (buf_datalen(ppath->buf) == msg_len) {
+          byte *msg = mt_msgreasm_add(ppath->buf, rph->pcommand, payload, rph->length,
+            &msg_len);
+          if (msg) {
             /*We can now process the received message*/
-            byte *msg = tor_malloc(msg_len);
-            buf_get_bytes(ppath->buf, (char*) msg, msg_len);
-            buf_clear(ppath->buf);
             mt_cclient_process_received_msg(ocirc, layer_hint, rph->pcommand, msg, msg_len);
-            tor_free(msg);
+            mt_msgpool_put(msg, msg_len);
           }
           else {
             log_info(LD_MT, "Buffering one received payment cell of type %hhx"
-                " current buf datalen: %lu", rph->pcommand, buf_datalen(ppath->buf));
+                " current buf datalen: %lu", rph->pcommand, mt_msgreasm_datalen(ppath->buf));
             return;
           }
         }
         else if (circ->purpose == CIRCUIT_PURPOSE_C_INTERMEDIARY ||
             circ->purpose == CIRCUIT_PURPOSE_C_LEDGER) {
-          buf_add(ocirc->buf, (char*) payload, rph->length);
-          if (buf_datalen(ocirc->buf) == msg_len) {
-            byte *msg = tor_malloc(msg_len);
-            buf_get_bytes(ocirc->buf, (char*) msg, msg_len);
-            buf_clear(ocirc->buf);
+          byte *msg = mt_msgreasm_add(ocirc->buf, rph->pcommand, payload, rph->length,
+            &msg_len);
+          if (msg) {
             mt_cclient_process_received_msg(ocirc, layer_hint, rph->pcommand, msg, msg_len);
-            tor_free(msg);
+            mt_msgpool_put(msg, msg_len);
           }
           else {
             log_info(LD_MT, "MoneTor: Buffering one received payment cell of type %hhx"
                 " current buf datalen on the intermediary: %lu",
-                rph->pcommand, buf_datalen(ocirc->buf));
+                rph->pcommand, mt_msgreasm_datalen(ocirc->buf));
             return;
           }
         }
@@ -734,7 +1094,8 @@ MOCK_IMPL(void,
       }
       else {
         /* Yay no need to buffer */
-        tor_assert(rph->length == msg_len);
+        tor_assert(rph->length ==
+            mt_token_get_size_of_msg(rph->pcommand, payload, rph->length));
         mt_cclient_process_received_msg(TO_ORIGIN_CIRCUIT(circ), layer_hint, rph->pcommand,
             payload, rph->length);
       }
@@ -746,6 +1107,28 @@ MOCK_IMPL(void,
   }
 }
 
+void mt_process_piggyback(circuit_t *circ, relay_header_t* rh, uint8_t* body) {
+
+  relay_pheader_t rph;
+
+  if (!get_options()->EnablePayment || !CIRCUIT_IS_ORCIRC(circ) ||
+      rh->length + RELAY_PHEADER_SIZE > RELAY_PAYLOAD_SIZE)
+    return;
+
+  relay_pheader_unpack(&rph, body+rh->length);
+  if (rph.pcommand != MT_NTYPE_NAN_CLI_PAY1)
+    return;
+  if (rph.length != mt_token_get_size_of(rph.pcommand) ||
+      rh->length + RELAY_PHEADER_SIZE + rph.length > RELAY_PAYLOAD_SIZE) {
+    log_fn(LOG_PROTOCOL_WARN, LD_MT, "MoneTor: piggybacked %s of bad length %d",
+        mt_token_describe(rph.pcommand), rph.length);
+    return;
+  }
+  log_debug(LD_MT, "MoneTor: data cell carries a %s", mt_token_describe(rph.pcommand));
+  mt_process_received_relaycell(circ, rh, &rph, NULL,
+      body+rh->length+RELAY_PHEADER_SIZE);
+}
+
 /*
  * Called when we got a peer-level MoneTor cell on this circ. No onion-decryption
  * had to be performed.  cell must contain the plaintext
@@ -764,29 +1147,27 @@ int mt_process_received_directpaymentcell(circuit_t *circ, cell_t *cell) {
     if (!orcirc->circuit_received_first_payment_cell) {
         mt_party_t party = mt_common_whose_other_edge(rph.pcommand);
         mt_crelay_init_desc_and_add(orcirc, party);
-        orcirc->buf = buf_new_with_capacity(CELL_PPAYLOAD_SIZE);
+        orcirc->buf = mt_msgreasm_new();
         orcirc->circuit_received_first_payment_cell = 1;
     }
     if (msg_len > CELL_PPAYLOAD_SIZE) {
-      buf_add(orcirc->buf,
-          (char*)cell->payload+RELAY_PHEADER_SIZE, rph.length);
-      if (buf_datalen(orcirc->buf) == msg_len) {
+      byte *msg = mt_msgreasm_add(orcirc->buf, rph.pcommand,
+          cell->payload+RELAY_PHEADER_SIZE, rph.length, &msg_len);
+      if (msg) {
         /** We now have the full message */
-        byte *msg = tor_malloc_zero(msg_len);
-        buf_get_bytes(orcirc->buf, (char*) msg, msg_len);
-        buf_clear(orcirc->buf);
         mt_crelay_process_received_msg(circ, rph.pcommand, msg, msg_len);
-        tor_free(msg);
+        mt_msgpool_put(msg, msg_len);
       }
       else {
         log_info(LD_MT, "Buffering one received payment cell of type %hhx"
-            " current buf datlen %lu", rph.pcommand, buf_datalen(orcirc->buf));
+            " current buf datlen %lu", rph.pcommand, mt_msgreasm_datalen(orcirc->buf));
         return 0;
       }
     }
     else {
       /** No need to buffer */
-      tor_assert(rph.length == msg_len);
+      tor_assert(rph.length == mt_token_get_size_of_msg(rph.pcommand,
+          cell->payload+RELAY_PHEADER_SIZE, rph.length));
       mt_crelay_process_received_msg(circ, rph.pcommand,
           cell->payload+RELAY_PHEADER_SIZE, rph.length);
     }
@@ -797,25 +1178,24 @@ int mt_process_received_directpaymentcell(circuit_t *circ, cell_t *cell) {
       /* everything's ok, let's proceed */
       oricirc = TO_ORIGIN_CIRCUIT(circ);
       if (msg_len > CELL_PPAYLOAD_SIZE){
-        buf_add(oricirc->ppath->buf,
-            (char*)cell->payload+RELAY_PHEADER_SIZE, rph.length);
-        if (buf_datalen(oricirc->buf) == msg_len) {
-          byte *msg = tor_malloc_zero(msg_len);
-          buf_get_bytes(oricirc->ppath->buf, (char*) msg, msg_len);
-          buf_clear(oricirc->ppath->buf);
+        byte *msg = mt_msgreasm_add(oricirc->ppath->buf, rph.pcommand,
+            cell->payload+RELAY_PHEADER_SIZE, rph.length, &msg_len);
+        if (msg) {
           mt_cclient_process_received_msg(oricirc, oricirc->cpath, rph.pcommand,
               msg, msg_len);
-          tor_free(msg);
+          mt_msgpool_put(msg, msg_len);
         }
         else {
           log_info(LD_MT, "Buffering one received payment cell of type %hhx"
-              " current buf datlen %lu", rph.pcommand, buf_datalen(oricirc->buf));
+              " current buf datlen %lu", rph.pcommand,
+              mt_msgreasm_datalen(oricirc->ppath->buf));
           return 0;
         }
       }
       else {
         /** No need to buffer */
-        tor_assert(rph.length == msg_len);
+        tor_assert(rph.length == mt_token_get_size_of_msg(rph.pcommand,
+          cell->payload+RELAY_PHEADER_SIZE, rph.length));
         mt_cclient_process_received_msg(oricirc, oricirc->cpath, rph.pcommand,
             cell->payload+RELAY_PHEADER_SIZE, rph.length);
       }
@@ -835,9 +1215,10 @@ int mt_process_received_directpaymentcell(circuit_t *circ, cell_t *cell) {
 MOCK_IMPL(int, mt_send_message, (mt_desc_t *desc, mt_ntype_t type,
       byte* msg, int size)) {
 
-  log_info(LD_MT, "MoneTor: (msg) --------- send %s %" PRIu64 ".%" PRIu64 ", %s",
+  log_debug(LD_MT, "MoneTor: (msg) --------- send %s %" PRIu64 ".%" PRIu64 ", %s",
 	   mt_party_describe(desc->party), desc->id[0], desc->id[1],
 	   mt_token_describe(type));
+  tor_trace(mt, send_message, desc->id[0], desc->id[1], (int)desc->party, (int)type, size);
 
   switch (type) {
     uint8_t command;
@@ -972,17 +1353,22 @@ MOCK_IMPL(int, mt_send_message, (mt_desc_t *desc, mt_ntype_t type,
 int mt_common_send_direct_cell_payment(circuit_t *circ, mt_ntype_t type,
     byte *msg, int size, cell_direction_t direction) {
 
-  or_circuit_t *orcirc = NULL;
+  channel_t *chan = NULL;
   cell_t cell;
   relay_pheader_t rph;
   memset(&cell, 0, sizeof(cell_t));
   memset(&rph, 0, sizeof(relay_pheader_t));
   if (direction == CELL_DIRECTION_OUT) {
     cell.circ_id = circ->n_circ_id;
+    chan = circ->n_chan;
   }
   else {
-    orcirc = TO_OR_CIRCUIT(circ);
-    cell.circ_id = orcirc->p_circ_id;
+    cell.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    chan = TO_OR_CIRCUIT(circ)->p_chan;
+  }
+  if (!chan) {
+    log_warn(LD_MT, "MoneTor: circ->n_chan or orcirc->p_chan is null?");
+    return -1;
   }
   cell.command = CELL_PAYMENT;
   rph.pcommand = type;
@@ -992,6 +1378,8 @@ int mt_common_send_direct_cell_payment(circuit_t *circ, mt_ntype_t type,
   else
     nbr_cells = size/CELL_PPAYLOAD_SIZE + 1;
   int remaining_payload = size;
+  if (direction == CELL_DIRECTION_OUT)
+    circuit_log_path(LOG_INFO, LD_MT, TO_ORIGIN_CIRCUIT(circ));
   for (int i = 0; i < nbr_cells; i++) {
     if (remaining_payload <= CELL_PPAYLOAD_SIZE) {
       rph.length = remaining_payload;
@@ -1003,27 +1391,10 @@ int mt_common_send_direct_cell_payment(circuit_t *circ, mt_ntype_t type,
     memcpy(cell.payload+RELAY_PHEADER_SIZE, msg+i*CELL_PPAYLOAD_SIZE, rph.length);
     remaining_payload -= rph.length;
     log_info(LD_MT, "MoneTor: Adding cell payment %s to queue", mt_token_describe(rph.pcommand));
-    if (direction == CELL_DIRECTION_OUT) {
-      circuit_log_path(LOG_INFO, LD_MT, TO_ORIGIN_CIRCUIT(circ));
-      cell_queue_append_packed_copy(NULL, &circ->n_chan_cells, 0, &cell,
-          circ->n_chan->wide_circ_ids, 0);
-    }
-    else {
-      cell_queue_append_packed_copy(NULL, &orcirc->p_chan_cells, 0, &cell,
-          orcirc->p_chan->wide_circ_ids, 0);
-    }
+    // payment cells skip ahead of the circuit's data cells
+    append_pcell_to_circuit_queue(circ, chan, &cell, direction);
   }
   tor_assert(remaining_payload == 0);
-  update_circuit_on_cmux(circ, direction);
-  if (direction == CELL_DIRECTION_OUT && circ->n_chan) {
-    scheduler_channel_has_waiting_cells(circ->n_chan);
-  }
-  else if (orcirc->p_chan){
-    scheduler_channel_has_waiting_cells(orcirc->p_chan);
-  }
-  else {
-    log_warn(LD_MT, "MoneTor: circ->n_chan or orcirc->p_chan is null?");
-  }
   return 0;
 }
 
@@ -1040,9 +1411,10 @@ MOCK_IMPL(int, mt_send_message_multidesc, (mt_desc_t *desc1, mt_desc_t* desc2,
     return -1;
   }
 
-  log_info(LD_MT, "MoneTor: (msg) send %s %" PRIu64 ".%" PRIu64 ", %s, %" PRIu64 ".%" PRIu64 "",
+  log_debug(LD_MT, "MoneTor: (msg) send %s %" PRIu64 ".%" PRIu64 ", %s, %" PRIu64 ".%" PRIu64 "",
 	   mt_party_describe(desc1->party), desc1->id[0], desc1->id[1],
 	   mt_token_describe(type), desc2->id[0], desc2->id[1]);
+  tor_trace(mt, send_message, desc1->id[0], desc1->id[1], (int)desc1->party, (int)type, size);
 
   return mt_cclient_send_message_multidesc(desc1, desc2, type, msg, size);
 }
@@ -104,6 +104,19 @@ int mt_hex2bytes(const char* hex, byte** bytes_out);
  */
 int mt_hc_create(int size, byte (*head)[MT_SZ_HASH], byte (*hc_out)[][MT_SZ_HASH]);
 
+/**
+ * Initialize a pebbled hash chain of the given size using the given head and
+ * write out its tail. Only O(log size) hashes are kept in memory.
+ */
+int mt_hc_init(mt_hc_t* hc, int size, byte (*head)[MT_SZ_HASH], byte (*tail_out)[MT_SZ_HASH]);
+
+/**
+ * Write out the kth element of a pebbled hash chain, counting from the tail
+ * (equivalent to hc_out[k] of mt_hc_create()). Walking k upwards costs
+ * amortized O(log size) hashes per element.
+ */
+int mt_hc_get(mt_hc_t* hc, int k, byte (*preimage_out)[MT_SZ_HASH]);
+
 /**
  * Verify that a given preimage is indeed the kth preimage of the
  * given hash chain tail
@@ -127,10 +140,31 @@ const char* mt_party_describe(mt_party_t party);
 int mt_receipt_sign(any_led_receipt_t* rec, byte (*sk)[MT_SZ_SK]);
 
 /**
- * Verify the receipt of a ledger transaction
+ * Sign a batch of <b>n</b> receipts with a single signature over the Merkle
+ * root of the batch. Every receipt carries that signature along with the path
+ * from its own leaf to the root. At most MT_RECEIPT_MAX_BATCH receipts may be
+ * signed at once.
+ */
+int mt_receipt_sign_batch(int n, any_led_receipt_t** recs, byte (*sk)[MT_SZ_SK]);
+
+/**
+ * Initialize the cache of verified receipt roots
+ */
+void mt_receipt_init(void);
+
+/**
+ * Verify the receipt of a ledger transaction. For a receipt from a batch, the
+ * root signature is only checked the first time a root is seen; later receipts
+ * from the same batch just recompute the root from their path. Safe to call
+ * from worker threads once mt_receipt_init() has run.
  */
 int mt_receipt_verify(any_led_receipt_t* rec, byte (*pk)[MT_SZ_PK]);
 
+/**
+ * Return the number of batch root signatures mt_receipt_verify() has checked
+ */
+uint64_t mt_receipt_root_checks(void);
+
 /**
  * Populates the unsigned fields of a new micropayment wallet using a given old
  * wallet and a desired value change
@@ -150,7 +184,7 @@ int mt_circuit_launch_intermediary(extend_info_t* ei);
  */
 void mt_circuit_intermediary_has_opened(origin_circuit_t* circuit);
 
-void mt_init(void);
+int mt_init(void);
 
 void ledger_init(ledger_t **ledger, const node_t *node, extend_info_t *ei,
     time_t now);
@@ -195,7 +229,7 @@ void unpack_int_id(byte *str, int_id_t* ind_id_out);
 const char* mt_desc_describe(mt_desc_t *desc);
 
 /**
- * Returns 1 if both structure have the same digest
+ * Returns 1 if both structure describe the same party
  * 0 otherwise
  */
 
@@ -213,12 +247,82 @@ void increment(long unsigned *id);
 /** randomize a 64 bit uint by 3 call to rand() */
 uint64_t rand_uint64(void);
 
+/********************* Message reassembly ************************/
+
+/** Most idle buffers kept on the free list of each message size */
+#define MT_MSGPOOL_MAX_FREE 64
+
+/**
+ * Reassembly state for a payment message that spans several cells. Fragments
+ * are copied straight into a pooled buffer sized for the whole message.
+ */
+typedef struct mt_msgreasm_t {
+  /* buffer for the message being reassembled, NULL between messages */
+  byte* msg;
+  /* expected size of the whole message, known from the first fragment */
+  size_t size;
+  /* number of bytes received so far */
+  size_t len;
+  mt_ntype_t type;
+} mt_msgreasm_t;
+
+/**
+ * Return a buffer of <b>size</b> bytes, reusing an idle one if possible. The
+ * pool is only used from the main thread.
+ */
+byte* mt_msgpool_get(size_t size);
+
+/**
+ * Return a buffer obtained from mt_msgpool_get() to the free list of its size
+ */
+void mt_msgpool_put(byte* msg, size_t size);
+
+/**
+ * Return the number of idle buffers of <b>size</b> bytes
+ */
+int mt_msgpool_idle(size_t size);
+
+/**
+ * Release every idle buffer
+ */
+void mt_msgpool_free_all(void);
+
+mt_msgreasm_t* mt_msgreasm_new(void);
+
+/**
+ * Free the reassembly state along with any partially received message
+ */
+void mt_msgreasm_free(mt_msgreasm_t* mb);
+
+/**
+ * Return the number of bytes received so far for the current message
+ */
+size_t mt_msgreasm_datalen(const mt_msgreasm_t* mb);
+
+/**
+ * Append one fragment of a message of <b>type</b>. Once the message is
+ * complete, return its buffer and write its size to <b>size_out</b>; the
+ * caller owns it and gives it back with mt_msgpool_put(). Return NULL while
+ * more fragments are expected.
+ */
+byte* mt_msgreasm_add(mt_msgreasm_t* mb, mt_ntype_t type, const byte* data, size_t len,
+                      size_t* size_out);
+
 /** Interface to the payment module to send a payment cell.
  *  This function dispaches to the right controller.
  */
 MOCK_DECL(void, mt_process_received_relaycell, (circuit_t *circ, relay_header_t* rh,
     relay_pheader_t *rph, crypt_path_t* layer_hint, uint8_t* payload));
 
+/**
+ * Called on every RELAY_DATA cell for us on an or circuit. If the spare room
+ * after its <b>rh</b>->length bytes of data at <b>body</b> starts with a
+ * payment header extension carrying a nanopayment, process that payment as
+ * if it had come in a RELAY_COMMAND_MT cell. Unused room is zeroed by the
+ * sender, so cells without an extension are left alone.
+ */
+void mt_process_piggyback(circuit_t *circ, relay_header_t* rh, uint8_t* body);
+
 /** Interface to the payment module
  * Dispatches to client controller or Intermediary controller
  */
@@ -15,6 +15,8 @@
  * The following interface is made available to the controller:
  *   <ul>
  *     <li>mt_cpay_init();
+ *     <li>mt_cpay_establish()
+ *     <li>mt_cpay_fill_pool()
  *     <li>mt_cpay_pay()
  *     <li>mt_cpay_close()
  *     <li>mt_cpay_recv()
@@ -50,12 +52,39 @@
 #include "workqueue.h"
 #include "cpuworker.h"
 #include "mt_messagebuffer.h"
+#include "mt_chntable.h"
+#include "mt_descmap.h"
 #include "mt_common.h"
+#include "mt_reservoir.h"
+#include "mt_stats.h"
 #include "mt_cpay.h"
 #include "mt_cclient.h"
+#include "trace/events.h"
 
 #define NON_NULL 1
 
+/**
+ * States of a channel in between protocols. Each state notes the descriptor
+ * that identifies the channel in the channel table.
+ */
+typedef enum {
+  CPAY_CHN_SETUP,          // idesc
+  CPAY_CHN_ESTAB,          // idesc
+  CPAY_NAN_SETUP,          // idesc
+  CPAY_NAN_ESTAB,          // rdesc
+  CPAY_NAN_DESTAB,         // rdesc
+  CPAY_NAN_REQCLOSED,      // rdesc
+  CPAY_CHN_SPENT,          // idesc
+} cpay_chn_state_t;
+
+CTASSERT(CPAY_CHN_SPENT + 1 == MT_CPAY_NUM_STATES);
+
+/** Names of the channel states as shown to controllers */
+static const char* state_names[MT_CPAY_NUM_STATES] = {
+  "CHN-SETUP", "CHN-ESTAB", "NAN-SETUP", "NAN-ESTAB", "NAN-DESTAB",
+  "NAN-REQCLOSED", "CHN-SPENT",
+};
+
 /**
  * Prototype for multi-thread function used to generate the expensive zkp proof
  */
@@ -86,6 +115,9 @@ typedef struct {
   struct timeval start_pay;
   struct timeval end_pay;
   struct timeval start_close;
+
+  // start of the payment still waiting for an acknowledgement
+  struct timeval last_pay;
 } mt_log_info_t;
 
 /**
@@ -118,6 +150,9 @@ typedef struct {
 typedef struct {
   mt_channel_t* chn;
   byte pid[DIGEST_LEN];
+
+  // called back on the main thread once the cpuworker is done
+  int (*reply)(void*);
 } mt_zkp_args_t;
 
 /**
@@ -139,14 +174,8 @@ typedef struct {
   int fee;
   int tax;
 
-  // channel states are encoded by which of these containers they are held
-  smartlist_t* chns_setup;
-  smartlist_t* chns_estab;
-  smartlist_t* nans_setup;
-  digestmap_t* nans_estab;        // digest(rdesc) -> channel
-  digestmap_t* nans_destab;       // digest(rdesc) -> channel
-  digestmap_t* nans_reqclosed;    // digest(rdesc) -> channel
-  smartlist_t* chns_spent;
+  // channels in between protocols indexed by (cpay_chn_state_t, desc)
+  mt_chntable_t* chns;
 
   // special container to hold channels in the middle of a protocol
   digestmap_t* chns_transition;   // pid -> channel
@@ -155,7 +184,17 @@ typedef struct {
   mt_msgbuf_t* msgbuf;
 
   // used for logging first payment call
-  digestmap_t* log_first_paycall;
+  mt_descmap_t* log_first_paycall;
+
+  // units still to be paid by the outstanding payment call
+  mt_descmap_t* pay_units;        // rdesc -> int
+
+  // channels on their way to CPAY_NAN_SETUP for the pool
+  mt_descmap_t* pool_pending;     // idesc -> int
+  mt_cpay_pool_stats_t pool_stats;
+
+  // jobs handed to the cpuworker whose reply has not come back yet
+  int cpuworker_queued;
 
 } mt_cpay_t;
 
@@ -164,9 +203,9 @@ static int init_chn_end_setup(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
 static int init_chn_end_estab1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
 static int init_nan_cli_setup1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
 static int init_nan_cli_estab1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
-static int init_nan_cli_pay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
+static int init_nan_cli_pay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN], int units);
 static int init_nan_cli_destab1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
-static int init_nan_cli_dpay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
+static int init_nan_cli_dpay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN], int units);
 static int init_nan_cli_reqclose1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
 static int init_nan_end_close1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]);
 
@@ -192,17 +231,26 @@ static int help_chn_end_estab1(void* args);
 static int help_chn_int_estab4(void* args);
 static int help_nan_end_close1(void* args);
 static int help_nan_int_close8(void* args);
+static int run_zkp_task(workqueue_reply_t (*task)(void*, void*), int (*reply)(void*),
+			mt_zkp_args_t* args);
+static int help_zkp_reply(void* args);
 
 // miscallaneous helper functions
+static int mt_cpay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size);
 static int pay_helper(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int dpay_helper(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int estab_helper(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int destab_helper(mt_desc_t* rdesc, mt_desc_t* idesc);
+static int pool_helper(mt_desc_t* rdesc, mt_desc_t* idesc);
+static int pool_advance(mt_desc_t* rdesc, mt_desc_t* idesc);
+static void pool_abort(mt_channel_t* chn);
 static double timeval_diff(struct timeval t1, struct timeval t2);
+static uint64_t timeval_usec_since(struct timeval start);
 
 static mt_channel_t* new_channel(void);
+static int take_pay_units(mt_desc_t* rdesc, mt_channel_t* chn, int* left_out);
+static void log_paycall(mt_desc_t* rdesc);
 static int compare_chn_end_data(const void** a, const void** b);
-static mt_channel_t* smartlist_idesc_remove(smartlist_t* list, mt_desc_t* desc);
 static workqueue_reply_t cpu_task_estab(void* thread, void* arg);
 static workqueue_reply_t cpu_task_nanestab(void* thread, void* arg);
 static workqueue_reply_t cpu_task_nanclose(void* thread, void* arg);
@@ -210,6 +258,7 @@ static workqueue_reply_t cpu_task_nanclose(void* thread, void* arg);
 static int pay_finish(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int estab_finish(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int close_finish(mt_desc_t* rdesc, mt_desc_t* idesc);
+static int pool_finish(mt_desc_t* rdesc, mt_desc_t* idesc);
 static int recv_local(void* args);
 
 static mt_cpay_t client;
@@ -236,7 +285,7 @@ int mt_cpay_init(void){
   tor_free(led_pk_temp);
 
   // setup crypto keys
-  mt_crypt_keygen(&client.pp, &client.pk, &client.sk);
+  mt_crypt_keygen(&client.pp, mt_crypt_key_type(), &client.pk, &client.sk);
   mt_pk2addr(&client.pk, &client.addr);
 
   // set ledger
@@ -252,16 +301,12 @@ int mt_cpay_init(void){
   client.chn_number = 0;
 
   // initialize channel containers
-  client.chns_setup = smartlist_new();
-  client.chns_estab = smartlist_new();
-  client.nans_setup = smartlist_new();
-  client.nans_estab = digestmap_new();
-  client.nans_destab = digestmap_new();
-  client.nans_reqclosed = digestmap_new();
-  client.chns_spent = smartlist_new();
+  client.chns = mt_chntable_new();
   client.chns_transition = digestmap_new();
 
-  client.log_first_paycall = digestmap_new();
+  client.log_first_paycall = mt_descmap_new();
+  client.pay_units = mt_descmap_new();
+  client.pool_pending = mt_descmap_new();
 
   return MT_SUCCESS;
 }
@@ -273,16 +318,80 @@ int mt_cpay_init(void){
  */
 int mt_cpay_establish(mt_desc_t* rdesc, mt_desc_t* idesc){
 
-  // determine whether this is a standard or direct payment
-  if(mt_desc_comp(rdesc, idesc) != 0){
-    return estab_helper(rdesc, idesc);
-  }
-  else{
+  // direct channels are keyed on a fresh relay descriptor and can't be pooled
+  if(mt_desc_comp(rdesc, idesc) == 0){
     return destab_helper(rdesc, idesc);
   }
+
+  if(mt_chntable_get(client.chns, CPAY_NAN_SETUP, idesc))
+    client.pool_stats.hits++;
+  else
+    client.pool_stats.misses++;
+  log_info(LD_MT, "MoneTor: channel pool hits %" PRIu64 ", misses %" PRIu64,
+	   client.pool_stats.hits, client.pool_stats.misses);
+
+  int result = estab_helper(rdesc, idesc);
+  if(result == MT_SUCCESS)
+    mt_cpay_fill_pool(idesc);
+  return result;
+}
+
+/**
+ * Set up nanopayment channels with the intermediary <b>idesc</b> in the
+ * background until MoneTorChannelPool of them are ready or on their way
+ */
+int mt_cpay_fill_pool(mt_desc_t* idesc){
+
+  int* pending = mt_descmap_get(client.pool_pending, idesc);
+  if(!pending){
+    pending = tor_malloc_zero(sizeof(int));
+    mt_descmap_set(client.pool_pending, idesc, pending);
+  }
+
+  while(mt_chntable_count_desc(client.chns, CPAY_NAN_SETUP, idesc) + *pending <
+	get_options()->MoneTorChannelPool){
+    (*pending)++;
+    client.pool_stats.pending++;
+    if(pool_helper(idesc, idesc) != MT_SUCCESS)
+      return MT_ERROR;
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Write the current channel pool counters to <b>stats_out</b>
+ */
+void mt_cpay_pool_stats(mt_cpay_pool_stats_t* stats_out){
+  *stats_out = client.pool_stats;
+  stats_out->ready = client.chns ? mt_chntable_count(client.chns, CPAY_NAN_SETUP) : 0;
 }
 
 
+/**
+ * Write the current channel, message buffer and cpuworker gauges to
+ * <b>stats_out</b>; all zero if the module is not initialized
+ */
+void mt_cpay_chn_stats(mt_cpay_chn_stats_t* stats_out){
+
+  memset(stats_out, 0, sizeof(mt_cpay_chn_stats_t));
+  if(!client.chns)
+    return;
+
+  for(int i = 0; i < MT_CPAY_NUM_STATES; i++)
+    stats_out->states[i] = mt_chntable_count(client.chns, i);
+  stats_out->transition = digestmap_size(client.chns_transition);
+  stats_out->cpuworker_queued = client.cpuworker_queued;
+  mt_messagebuffer_stats(client.msgbuf, &stats_out->msgbuf);
+}
+
+/**
+ * Return the name of channel state <b>state</b> as shown to controllers
+ */
+const char* mt_cpay_state_name(int state){
+  tor_assert(state >= 0 && state < MT_CPAY_NUM_STATES);
+  return state_names[state];
+}
+
 /**
  * Send a single payment to the relay through a given intermediary. If
  * <b>rdesc<\b> and <b>idesc<\b> are equal, then the payment module will make a
@@ -292,15 +401,29 @@ int mt_cpay_establish(mt_desc_t* rdesc, mt_desc_t* idesc){
  * error.
  */
 int mt_cpay_pay(mt_desc_t* rdesc, mt_desc_t* idesc){
+  return mt_cpay_pay_units(rdesc, idesc, 1);
+}
+
+/**
+ * Send <b>units</b> payments to the relay through a given intermediary using
+ * as few messages as possible
+ */
+int mt_cpay_pay_units(mt_desc_t* rdesc, mt_desc_t* idesc, int units){
+
+  if(units < 1){
+    log_warn(LD_MT, "MoneTor: cannot pay %d units", units);
+    return MT_ERROR;
+  }
 
   // If this is the first payment to rdesc then record the time for logging
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
-  if(!digestmap_get(client.log_first_paycall, (char*)digest)){
-    struct timeval* paycall = tor_malloc(sizeof(struct timeval));
-    tor_gettimeofday(paycall);
-    digestmap_set(client.log_first_paycall, (char*)digest, paycall);
+  log_paycall(rdesc);
+
+  int* remaining = mt_descmap_get(client.pay_units, rdesc);
+  if(!remaining){
+    remaining = tor_malloc(sizeof(int));
+    mt_descmap_set(client.pay_units, rdesc, remaining);
   }
+  *remaining = units;
 
    // determine whether this is a standard or direct payment
   if(mt_desc_comp(rdesc, idesc) != 0){
@@ -317,13 +440,11 @@ int mt_cpay_pay(mt_desc_t* rdesc, mt_desc_t* idesc){
  */
 static int estab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   mt_channel_t* chn;
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
   byte pid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, pid);
 
   // establish nanopayment channel if possible; callback pay_helper
-  if((chn = smartlist_idesc_remove(client.nans_setup, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_SETUP, idesc))){
     log_info(LD_MT, "MoneTor: Trying to establish a nanopayment channel ~ Callback estab_finish");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->rdesc = *rdesc;
@@ -332,7 +453,7 @@ static int estab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // set up nanopayment channel if possible; callback estab_helper
-  if((chn = smartlist_idesc_remove(client.chns_estab, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_ESTAB, idesc))){
     log_info(LD_MT, "MoneTor: Trying to set up the nanopayment channel ~ Callback estab_helper");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = estab_helper, .dref1 = *rdesc, .dref2 = *idesc};
@@ -340,7 +461,7 @@ static int estab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // establish channel if possible; callback estab_helper
-  if((chn = smartlist_idesc_remove(client.chns_setup, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_SETUP, idesc))){
     log_info(LD_MT, "MoneTor: Trying to establish a channel ~ Callback estab_helper");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = estab_helper, .dref1 = *rdesc, .dref2 = *idesc};
@@ -367,13 +488,11 @@ static int estab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
  */
 static int destab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   mt_channel_t* chn;
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
   byte pid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, pid);
 
   // establish nanopayment channel if possible; callback destab_finish
-  if((chn = smartlist_idesc_remove(client.nans_setup, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_SETUP, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->rdesc = *rdesc;
     chn->callback = (mt_callback_t){.fn = estab_finish, .dref1 = *rdesc, .dref2 = *idesc};
@@ -381,14 +500,14 @@ static int destab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // set up nanopayment channel if possible; callback destab_helper
-  if((chn = smartlist_idesc_remove(client.chns_estab, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_ESTAB, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = destab_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_cli_setup1(chn, &pid);
   }
 
   // establish channel if possible; callback destab_helper
-  if((chn = smartlist_idesc_remove(client.chns_setup, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_SETUP, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = destab_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_chn_end_estab1(chn, &pid);
@@ -407,44 +526,92 @@ static int destab_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   return MT_ERROR;
 }
 
+/**
+ * Bring a channel with the intermediary up to CPAY_NAN_SETUP for the pool.
+ * Re-enter this function again and again until pool_finish is called. A step
+ * that fails ends the attempt so that it no longer counts as pending.
+ */
+static int pool_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
+  if(pool_advance(rdesc, idesc) != MT_SUCCESS){
+    pool_finish(rdesc, idesc);
+    return MT_ERROR;
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Start the next step of a pool channel's setup
+ */
+static int pool_advance(mt_desc_t* rdesc, mt_desc_t* idesc){
+  mt_channel_t* chn;
+  byte pid[DIGEST_LEN];
+  mt_crypt_rand(DIGEST_LEN, pid);
+
+  // set up nanopayment channel if possible; callback pool_finish
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_ESTAB, idesc))){
+    digestmap_set(client.chns_transition, (char*)pid, chn);
+    chn->callback = (mt_callback_t){.fn = pool_finish, .dref1 = *rdesc, .dref2 = *idesc};
+    return init_nan_cli_setup1(chn, &pid);
+  }
+
+  // establish channel if possible; callback pool_helper
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_SETUP, idesc))){
+    digestmap_set(client.chns_transition, (char*)pid, chn);
+    chn->callback = (mt_callback_t){.fn = pool_helper, .dref1 = *rdesc, .dref2 = *idesc};
+    return init_chn_end_estab1(chn, &pid);
+  }
+
+  // set up channel if possible; callback pool_helper
+  if((client.mac_bal >= MT_CHN_VAL_CLI + client.fee) || get_options()->MoneTorPublicMint){
+    chn = new_channel();
+    digestmap_set(client.chns_transition, (char*)pid, chn);
+    chn->idesc = *idesc;
+    chn->callback = (mt_callback_t){.fn = pool_helper, .dref1 = *rdesc, .dref2 = *idesc};
+    return init_chn_end_setup(chn, &pid);
+  }
+
+  log_info(LD_MT, "MoneTor: insufficient funds to fill the channel pool");
+  return MT_ERROR;
+}
+
 /**
  * Handle standard payments from mt_cpay_pay(). Re-enter this payment again and
  * again until the payment is successful and pay_finish is called.
  */
 static int pay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   mt_channel_t* chn;
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
   byte pid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, pid);
 
   // close the standard nanopayment channel if possible; callback close_finish
-  if((chn = digestmap_remove(client.nans_reqclosed, (char*)digest))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_REQCLOSED, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = pay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_end_close1(chn, &pid);
   }
 
   // if maximum payments reached then close the current channel
-  if((chn = digestmap_get(client.nans_estab, (char*)digest)) &&
+  if((chn = mt_chntable_get(client.chns, CPAY_NAN_ESTAB, rdesc)) &&
      chn->data.nan_state.num_payments == chn->data.nan_public.num_payments){
     log_info(LD_MT, "MoneTor: Maximum payments reached, we close the channel");
-    digestmap_remove(client.nans_estab, (char*)digest);
+    mt_chntable_take(client.chns, CPAY_NAN_ESTAB, rdesc);
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = pay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_cli_reqclose1(chn, &pid);
   }
 
-  // make payment if possible; callback pay_finish
-  if((chn = digestmap_remove(client.nans_estab, (char*)digest))){
+  // make payment if possible; callback pay_finish once every unit is paid
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_ESTAB, rdesc))){
     log_info(LD_MT, "MoneTor: Trying to make the payment and set pay_finish as callback");
+    int left;
+    int units = take_pay_units(rdesc, chn, &left);
     digestmap_set(client.chns_transition, (char*)pid, chn);
-    chn->callback = (mt_callback_t){.fn = pay_finish, .dref1 = *rdesc, .dref2 = *idesc};
-    return init_nan_cli_pay1(chn, &pid);
+    chn->callback = (mt_callback_t){.fn = left ? pay_helper : pay_finish, .dref1 = *rdesc, .dref2 = *idesc};
+    return init_nan_cli_pay1(chn, &pid, units);
   }
 
   // establish nanopayment channel if possible; callback pay_helper
-  if((chn = smartlist_idesc_remove(client.nans_setup, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_SETUP, idesc))){
     log_info(LD_MT, "MoneTor: Trying to establish a nanopayment channel ~ Callback pay_helper");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->rdesc = *rdesc;
@@ -453,7 +620,7 @@ static int pay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // set up nanopayment channel if possible; callback pay_helper
-  if((chn = smartlist_idesc_remove(client.chns_estab, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_ESTAB, idesc))){
     log_info(LD_MT, "MoneTor: Trying to set up the nanopayment channel ~ Callback pay_helper");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = pay_helper, .dref1 = *rdesc, .dref2 = *idesc};
@@ -461,7 +628,7 @@ static int pay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // establish channel if possible; callback pay_helper
-  if((chn = smartlist_idesc_remove(client.chns_setup, idesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_SETUP, idesc))){
     log_info(LD_MT, "MoneTor: Trying to establish a channel ~ Callback pay_helper");
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = pay_helper, .dref1 = *rdesc, .dref2 = *idesc};
@@ -488,38 +655,38 @@ static int pay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
  */
 static int dpay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   mt_channel_t* chn;
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
   byte pid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, pid);
 
   // if maximum payments reached then close the current channel
-  if((chn = digestmap_get(client.nans_destab, (char*)digest)) &&
+  if((chn = mt_chntable_get(client.chns, CPAY_NAN_DESTAB, rdesc)) &&
      chn->data.nan_state.num_payments == chn->data.nan_public.num_payments){
-    digestmap_remove(client.nans_destab, (char*)digest);
+    mt_chntable_take(client.chns, CPAY_NAN_DESTAB, rdesc);
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = dpay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_end_close1(chn, &pid);
   }
 
   // if maximum payments reached then close the current channel
-  if((chn = digestmap_remove(client.nans_estab, (char*)digest)) &&
+  if((chn = mt_chntable_get(client.chns, CPAY_NAN_ESTAB, rdesc)) &&
      chn->data.nan_state.num_payments == chn->data.nan_public.num_payments){
-    digestmap_remove(client.nans_estab, (char*)digest);
+    mt_chntable_take(client.chns, CPAY_NAN_ESTAB, rdesc);
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = dpay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_cli_reqclose1(chn, &pid);
   }
 
-  // make direct payment if possible; callback pay_finish
-  if((chn = digestmap_remove(client.nans_destab, (char*)digest))){
+  // make direct payment if possible; callback pay_finish once every unit is paid
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_DESTAB, rdesc))){
+    int left;
+    int units = take_pay_units(rdesc, chn, &left);
     digestmap_set(client.chns_transition, (char*)pid, chn);
-    chn->callback = (mt_callback_t){.fn = pay_finish, .dref1 = *rdesc, .dref2 = *idesc};
-    return init_nan_cli_dpay1(chn, &pid);
+    chn->callback = (mt_callback_t){.fn = left ? dpay_helper : pay_finish, .dref1 = *rdesc, .dref2 = *idesc};
+    return init_nan_cli_dpay1(chn, &pid, units);
   }
 
   // establish nanopayment channel if possible; callback dpay_helper
-  if((chn = smartlist_idesc_remove(client.nans_setup, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_SETUP, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->rdesc = *rdesc;
     chn->callback = (mt_callback_t){.fn = dpay_helper, .dref1 = *rdesc, .dref2 = *idesc};
@@ -527,14 +694,14 @@ static int dpay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
   }
 
   // set up nanopayment channel if possible; callback dpay_helper
-  if((chn = smartlist_idesc_remove(client.chns_estab, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_ESTAB, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = dpay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_cli_setup1(chn, &pid);
   }
 
   // establish channel if possible; callback dpay_helper
-  if((chn = smartlist_idesc_remove(client.chns_setup, rdesc))){
+  if((chn = mt_chntable_take(client.chns, CPAY_CHN_SETUP, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = dpay_helper, .dref1 = *rdesc, .dref2 = *idesc};
     return init_chn_end_estab1(chn, &pid);
@@ -557,30 +724,27 @@ static int dpay_helper(mt_desc_t* rdesc, mt_desc_t* idesc){
  * Close an existing payment channel with the given relay/intermediary pair
  */
 int mt_cpay_close(mt_desc_t* rdesc, mt_desc_t* idesc){
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(rdesc, &digest);
-
   byte pid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, pid);
 
   mt_channel_t* chn;
 
   // close the standard nanopayment channel if possible; callback close_finish
-  if((chn = digestmap_remove(client.nans_reqclosed, (char*)digest))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_REQCLOSED, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = close_finish, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_end_close1(chn, &pid);
   }
 
   // send a request to close the channel if possible; callback close_helper
-  if((chn = digestmap_remove(client.nans_estab, (char*)digest))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_ESTAB, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = mt_cpay_close, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_cli_reqclose1(chn, &pid);
   }
 
   // close the direct nanopayment channel if possible; callback close_finish
-  if((chn = digestmap_remove(client.nans_destab, (char*)digest))){
+  if((chn = mt_chntable_take(client.chns, CPAY_NAN_DESTAB, rdesc))){
     digestmap_set(client.chns_transition, (char*)pid, chn);
     chn->callback = (mt_callback_t){.fn = close_finish, .dref1 = *rdesc, .dref2 = *idesc};
     return init_nan_end_close1(chn, &pid);
@@ -595,11 +759,20 @@ int mt_cpay_close(mt_desc_t* rdesc, mt_desc_t* idesc){
  */
 int mt_cpay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
 
-  log_info(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
+  log_debug(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
 	   mt_party_describe(desc->party), desc->id[0], desc->id[1], mt_token_describe(type));
+  tor_trace(mt, recv_begin, MT_PARTY_CLI, desc->id[0], desc->id[1], (int)desc->party,
+	    (int)type, size);
+
+  int result = mt_cpay_recv_helper(desc, type, msg, size);
+  tor_trace(mt, recv_end, MT_PARTY_CLI, desc->id[0], desc->id[1], (int)type, result);
+  return result;
+}
+
+static int mt_cpay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
 
   int result;
-  byte pid[DIGEST_LEN];
+  byte pid[DIGEST_LEN] = {0};
 
   // unpack the token and delegate to appropriate handler
   switch(type){
@@ -714,6 +887,13 @@ int mt_cpay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
 
   if(result == MT_ERROR){
     log_warn(LD_MT, "MoneTor: protocoal error processing message");
+    mt_channel_t* chn = digestmap_get(client.chns_transition, (char*)pid);
+    if(chn){
+      mt_stats_note_failed(MT_STATS_CLIENT, mt_stats_phase_of(type), &chn->rdesc,
+			   &chn->idesc);
+      if(chn->callback.fn == pool_helper || chn->callback.fn == pool_finish)
+	pool_abort(chn);
+    }
   }
   return result;
 }
@@ -746,10 +926,23 @@ int mt_cpay_set_status(mt_desc_t* desc, int status){
   return mt_set_desc_status(client.msgbuf, desc, status);
 }
 
+/**
+ * Drop held messages that have outlived MoneTorMsgBufTTL
+ */
+void mt_cpay_housekeeping(time_t now){
+  if(client.msgbuf)
+    mt_messagebuffer_expire(client.msgbuf, now);
+}
+
 /**
  * Delete the state of the payment module
  */
 int mt_cpay_clear(void){
+  mt_messagebuffer_free(client.msgbuf);
+  client.msgbuf = NULL;
+  mt_descmap_free(client.pool_pending, tor_free_);
+  client.pool_pending = NULL;
+  memset(&client.pool_stats, 0, sizeof(client.pool_stats));
   // Need to implement
   return MT_ERROR;
 }
@@ -826,7 +1019,7 @@ static int handle_any_led_confirm(mt_desc_t* desc, any_led_confirm_t* token, byt
   }
 
   digestmap_remove(client.chns_transition, (char*)*pid);
-  smartlist_add(client.chns_setup, chn);
+  mt_chntable_add(client.chns, CPAY_CHN_SETUP, &chn->idesc, chn);
 
   if(chn->callback.fn){
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -843,21 +1036,7 @@ static int init_chn_end_estab1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
   args->chn = chn;
   memcpy(args->pid, *pid, DIGEST_LEN);
 
-  // if single threaded then just call procedures in series
-  if(get_options()->MoneTorSingleThread){
-    if(cpu_task_estab(NULL, args) != WQ_RPL_REPLY){
-      log_warn(LD_MT, "MoneTor: cpu task returned error");
-       return MT_ERROR;
-    }
-    return help_chn_end_estab1(args);
-  }
-
-  // if not single threaded then offload task to a different cpu task/reply flow
-  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_estab, (work_task)help_chn_end_estab1, args)){
-    log_warn(LD_MT, "MoneTor: cpu task returned error");
-    return MT_ERROR;
-  }
-  return MT_SUCCESS;
+  return run_zkp_task(cpu_task_estab, help_chn_end_estab1, args);
 }
 
 static int help_chn_end_estab1(void* args){
@@ -949,21 +1128,7 @@ static int handle_chn_int_estab4(mt_desc_t* desc, chn_int_estab4_t* token, byte
   args->chn = chn;
   memcpy(args->pid, *pid, DIGEST_LEN);
 
-  // if single threaded then just call procedures in series
-  if(get_options()->MoneTorSingleThread){
-    if(cpu_task_nanestab(NULL, args) != WQ_RPL_REPLY){
-      log_warn(LD_MT, "MoneTor: cpu task returned error");
-       return MT_ERROR;
-    }
-    return help_chn_int_estab4(args);
-  }
-
-  // if not single threaded then offload task to a different cpu task/reply flow
-  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_nanestab, (work_task)help_chn_int_estab4, args)){
-    log_warn(LD_MT, "MoneTor: cpu task returned error");
-    return MT_ERROR;
-  }
-  return MT_SUCCESS;
+  return run_zkp_task(cpu_task_nanestab, help_chn_int_estab4, args);
 }
 
 static int help_chn_int_estab4(void* args){
@@ -976,7 +1141,7 @@ static int help_chn_int_estab4(void* args){
 
   // save token to channel
   digestmap_remove(client.chns_transition, (char*)pid);
-  smartlist_add(client.chns_estab, chn);
+  mt_chntable_add(client.chns, CPAY_CHN_ESTAB, &chn->idesc, chn);
 
   if(chn->callback.fn)
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -988,15 +1153,14 @@ static int help_chn_int_estab4(void* args){
 static int init_nan_cli_setup1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
 
   // create hash chain and save it to local state
-  byte hc_head[MT_SZ_HASH];
-  mt_crypt_rand(MT_SZ_HASH, hc_head);
-  mt_hc_create(MT_NAN_LEN, &hc_head, &chn->data.nan_wallet.hc);
+  byte hc_tail[MT_SZ_HASH];
+  mt_reservoir_hc(&chn->data.nan_wallet.hc, MT_NAN_LEN, &hc_tail);
 
   // define nanopayment parameters in local state
   chn->data.nan_public.val_from = MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100;
   chn->data.nan_public.val_to = MT_NAN_VAL;
   chn->data.nan_public.num_payments = MT_NAN_LEN;
-  memcpy(chn->data.nan_public.hash_tail, chn->data.nan_wallet.hc[0], MT_SZ_HASH);
+  memcpy(chn->data.nan_public.hash_tail, hc_tail, MT_SZ_HASH);
 
   // make token
   nan_cli_setup1_t token;
@@ -1008,7 +1172,7 @@ static int init_nan_cli_setup1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
 
   // update channel data
   memcpy(&chn->data.nan_public, &token.nan_public, sizeof(nan_any_public_t));
-  memcpy(chn->data.nan_state.last_hash, chn->data.nan_wallet.hc[0], MT_SZ_HASH);
+  memcpy(chn->data.nan_state.last_hash, hc_tail, MT_SZ_HASH);
   chn->data.nan_state.num_payments = 0;
 
   // send message
@@ -1106,7 +1270,7 @@ static int handle_nan_int_setup6(mt_desc_t* desc, nan_int_setup6_t* token, byte
   }
 
   digestmap_remove(client.chns_transition, (char*)*pid);
-  smartlist_add(client.nans_setup, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_SETUP, &chn->idesc, chn);
 
   if(chn->callback.fn){
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -1158,13 +1322,13 @@ static int handle_nan_rel_estab6(mt_desc_t* desc, nan_rel_estab6_t* token, byte
   chn->data.nan_state.num_payments = 0;
   memcpy(chn->data.nan_state.last_hash, chn->data.nan_public.hash_tail, MT_SZ_HASH);
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
   digestmap_remove(client.chns_transition, (char*)*pid);
-  digestmap_set(client.nans_estab, (char*)digest, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_ESTAB, desc, chn);
 
   // record start of nanopayment channel for log
   tor_gettimeofday(&chn->log.end_estab);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_ESTAB, &chn->rdesc, &chn->idesc,
+		     timeval_usec_since(chn->log.start_estab));
 
   if(chn->callback.fn)
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -1173,21 +1337,25 @@ static int handle_nan_rel_estab6(mt_desc_t* desc, nan_rel_estab6_t* token, byte
 
 /******************************* Nano Pay *******************************/
 
-static int init_nan_cli_pay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
+static int init_nan_cli_pay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN], int units){
 
   // record logging info
   if(!chn->log.start_pay.tv_sec && !chn->log.start_pay.tv_usec)
     tor_gettimeofday(&chn->log.start_pay);
+  tor_gettimeofday(&chn->log.last_pay);
 
   // make token
   nan_cli_pay1_t token;
   memcpy(&token.nan_public, &chn->data.nan_public, sizeof(nan_any_public_t));
-  memcpy(token.preimage, &chn->data.nan_wallet.hc[chn->data.nan_state.num_payments], MT_SZ_HASH);
+  token.num_units = units;
+  if(mt_hc_get(&chn->data.nan_wallet.hc, chn->data.nan_state.num_payments + units - 1,
+	       &token.preimage) != MT_SUCCESS)
+    return MT_ERROR;
 
   // update channel data
-  client.chn_bal -= chn->data.nan_public.val_from;
-  chn->data.wallet.end_bal -= chn->data.nan_public.val_from;
-  chn->data.nan_state.num_payments ++;
+  client.chn_bal -= units * chn->data.nan_public.val_from;
+  chn->data.wallet.end_bal -= units * chn->data.nan_public.val_from;
+  chn->data.nan_state.num_payments += units;
   memcpy(chn->data.nan_state.last_hash, token.preimage, MT_SZ_HASH);
 
   // send message
@@ -1224,16 +1392,16 @@ static int handle_nan_rel_pay2(mt_desc_t* desc, nan_rel_pay2_t* token, byte (*pi
     return MT_ERROR;
   }
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
   digestmap_remove(client.chns_transition, (char*)*pid);
-  digestmap_set(client.nans_estab, (char*)digest, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_ESTAB, desc, chn);
 
   // record logging info
   if(!chn->log.end_pay.tv_sec && !chn->log.end_pay.tv_usec){
     tor_gettimeofday(&chn->log.end_pay);
   }
   chn->log.num_payments++;
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &chn->rdesc, &chn->idesc,
+		     timeval_usec_since(chn->log.last_pay));
 
   if(chn->callback.fn)
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -1278,12 +1446,12 @@ static int handle_nan_int_destab2(mt_desc_t* desc, nan_int_destab2_t* token, byt
     return MT_ERROR;
   }
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
   digestmap_remove(client.chns_transition, (char*)*pid);
-  digestmap_set(client.nans_destab, (char*)digest, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_DESTAB, desc, chn);
 
   tor_gettimeofday(&chn->log.end_estab);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_ESTAB, &chn->rdesc, &chn->idesc,
+		     timeval_usec_since(chn->log.start_estab));
 
   if(chn->callback.fn)
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -1292,21 +1460,25 @@ static int handle_nan_int_destab2(mt_desc_t* desc, nan_int_destab2_t* token, byt
 
 /**************************** Nano Direct Pay ***************************/
 
-static int init_nan_cli_dpay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
+static int init_nan_cli_dpay1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN], int units){
 
   // record logging info
   if(!chn->log.start_pay.tv_sec && !chn->log.start_pay.tv_usec)
     tor_gettimeofday(&chn->log.start_pay);
+  tor_gettimeofday(&chn->log.last_pay);
 
   // intiate token
   nan_cli_dpay1_t token;
   memcpy(&token.nan_public, &chn->data.nan_public, sizeof(nan_any_public_t));
-  memcpy(token.preimage, chn->data.nan_wallet.hc[chn->data.nan_state.num_payments], MT_SZ_HASH);
+  token.num_units = units;
+  if(mt_hc_get(&chn->data.nan_wallet.hc, chn->data.nan_state.num_payments + units - 1,
+	       &token.preimage) != MT_SUCCESS)
+    return MT_ERROR;
 
   // update balances
-  client.chn_bal -= chn->data.nan_public.val_from;
-  chn->data.wallet.end_bal -= chn->data.nan_public.val_from;
-  chn->data.nan_state.num_payments ++;
+  client.chn_bal -= units * chn->data.nan_public.val_from;
+  chn->data.wallet.end_bal -= units * chn->data.nan_public.val_from;
+  chn->data.nan_state.num_payments += units;
   memcpy(chn->data.nan_state.last_hash, token.preimage, MT_SZ_HASH);
 
   // send message
@@ -1343,15 +1515,15 @@ static int handle_nan_int_dpay2(mt_desc_t* desc, nan_int_dpay2_t* token, byte (*
     return MT_ERROR;
   }
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
   digestmap_remove(client.chns_transition, (char*)*pid);
-  digestmap_set(client.nans_destab, (char*)digest, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_DESTAB, desc, chn);
 
   // record logging info
   if(!chn->log.end_pay.tv_sec && !chn->log.end_pay.tv_usec)
     tor_gettimeofday(&chn->log.end_pay);
   chn->log.num_payments++;
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &chn->rdesc, &chn->idesc,
+		     timeval_usec_since(chn->log.last_pay));
 
   if(chn->callback.fn){
     return chn->callback.fn(&chn->callback.dref1, &chn->callback.dref2);
@@ -1392,10 +1564,8 @@ static int handle_nan_rel_reqclose2(mt_desc_t* desc, nan_rel_reqclose2_t* token,
     return MT_ERROR;
   }
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
   digestmap_remove(client.chns_transition, (char*)*pid);
-  digestmap_set(client.nans_reqclosed, (char*)digest, chn);
+  mt_chntable_add(client.chns, CPAY_NAN_REQCLOSED, desc, chn);
 
   // check validity incoming message
   if(chn->callback.fn)
@@ -1415,21 +1585,7 @@ static int init_nan_end_close1(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
   args->chn = chn;
   memcpy(args->pid, *pid, DIGEST_LEN);
 
-  // if single threaded then just call procedures in series
-  if(get_options()->MoneTorSingleThread){
-    if(cpu_task_nanclose(NULL, args) != WQ_RPL_REPLY){
-      log_warn(LD_MT, "MoneTor: cpu task returned error");
-       return MT_ERROR;
-    }
-    return help_nan_end_close1(args);
-  }
-
-  // if not single threaded then offload task to a different cpu task/reply flow
-  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_nanclose, (work_task)help_nan_end_close1, args)){
-    log_warn(LD_MT, "MoneTor: cpu task returned error");
-    return MT_ERROR;
-  }
-  return MT_SUCCESS;
+  return run_zkp_task(cpu_task_nanclose, help_nan_end_close1, args);
 }
 
 static int help_nan_end_close1(void* args){
@@ -1576,21 +1732,7 @@ static int handle_nan_int_close8(mt_desc_t* desc, nan_int_close8_t* token, byte
   args->chn = chn;
   memcpy(args->pid, *pid, DIGEST_LEN);
 
-  // if single threaded then just call procedures in series
-  if(get_options()->MoneTorSingleThread){
-    if(cpu_task_nanestab(NULL, args) != WQ_RPL_REPLY){
-      log_warn(LD_MT, "MoneTor: cpu task returned error");
-       return MT_ERROR;
-    }
-    return help_nan_int_close8(args);
-  }
-
-  // if not single threaded then offload task to a different cpu task/reply flow
-  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_nanestab, (work_task)help_nan_int_close8, args)){
-    log_warn(LD_MT, "MoneTor: cpu task returned error");
-    return MT_ERROR;
-  }
-  return MT_SUCCESS;
+  return run_zkp_task(cpu_task_nanestab, help_nan_int_close8, args);
 }
 
 static int help_nan_int_close8(void* args){
@@ -1602,10 +1744,10 @@ static int help_nan_int_close8(void* args){
 
   // if sufficient funds left then move channel to establish state, otherwise move to spent
   if(chn->data.wallet.end_bal >= MT_NAN_LEN * (MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100)){
-    smartlist_add(client.chns_estab, chn);
+    mt_chntable_add(client.chns, CPAY_CHN_ESTAB, &chn->idesc, chn);
   }
   else{
-    smartlist_add(client.chns_spent, chn);
+    mt_chntable_add(client.chns, CPAY_CHN_SPENT, &chn->idesc, chn);
   }
 
   // log nanopayment channel statistics for analysis
@@ -1626,19 +1768,19 @@ static int help_nan_int_close8(void* args){
   double tt_establish = timeval_diff(chn->log.end_estab, chn->log.start_estab);
   double tt_payment = timeval_diff(chn->log.end_pay, chn->log.start_pay);
   double tt_close = timeval_diff(now, chn->log.start_close);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_CLOSE, &chn->rdesc, &chn->idesc,
+		     timeval_usec_since(chn->log.start_close));
 
   double tt_paysuccess = 0.0;
-  byte rdigest[DIGEST_LEN];
   struct timeval* paycall;
-  mt_desc2digest(&chn->rdesc, &rdigest);
 
   if(chn->log.num_payments){
-    if((paycall = digestmap_get(client.log_first_paycall, (char*)rdigest))){
+    if((paycall = mt_descmap_get(client.log_first_paycall, &chn->rdesc))){
       // take the later of the first payment call and the first channel establishment
       double diff = timeval_diff(*paycall, chn->log.start_estab);
       tt_paysuccess = timeval_diff(chn->log.end_pay, diff > 0 ? *paycall : chn->log.start_estab);
       free(paycall);
-      digestmap_remove(client.log_first_paycall, (char*)rdigest);
+      mt_descmap_remove(client.log_first_paycall, &chn->rdesc);
     }
     else{
       log_warn(LD_MT, "MoneTor: couldn't find first payment time for %s. This should not happen",
@@ -1679,7 +1821,7 @@ static mt_channel_t* new_channel(void){
   chn->data.wallet.end_bal = MT_CHN_VAL_CLI;
   chn->data.wallet.int_bal = 0;
   memcpy(chn->data.wallet.csk, client.sk, MT_SZ_SK);
-  mt_crypt_keygen(&client.pp, &chn->data.wallet.wpk, &chn->data.wallet.wsk);
+  mt_reservoir_keygen(&client.pp, &chn->data.wallet.wpk, &chn->data.wallet.wsk);
   mt_crypt_rand(MT_SZ_HASH, chn->data.wallet.rand);
 
   // initialize channel public info
@@ -1707,6 +1849,42 @@ static mt_channel_t* new_channel(void){
   return chn;
 }
 
+/**
+ * Decide how many of the units still owed to <b>rdesc</b> are paid on
+ * <b>chn</b>. The count is capped by the payments left on the
+ * channel; the number of units that still remain afterwards is written to
+ * <b>left_out</b>.
+ */
+static int take_pay_units(mt_desc_t* rdesc, mt_channel_t* chn, int* left_out){
+
+  int* remaining = mt_descmap_get(client.pay_units, rdesc);
+  int wanted = remaining ? *remaining : 1;
+  int units = MIN(wanted, chn->data.nan_public.num_payments - chn->data.nan_state.num_payments);
+
+  if(remaining)
+    *remaining -= units;
+  *left_out = wanted - units;
+
+  // units carried over from an exhausted channel count as a new payment call
+  log_paycall(rdesc);
+  return units;
+}
+
+/**
+ * Record the time of the first payment call to <b>rdesc</b>
+ */
+static void log_paycall(mt_desc_t* rdesc){
+  if(!mt_descmap_get(client.log_first_paycall, rdesc)){
+    struct timeval* paycall = tor_malloc(sizeof(struct timeval));
+    tor_gettimeofday(paycall);
+    mt_descmap_set(client.log_first_paycall, rdesc, paycall);
+  }
+}
+
+/**
+ * Order channels by descending balance so that the channel table hands out the
+ * richest channel first
+ */
 static int compare_chn_end_data(const void** a, const void** b){
 
   if(((mt_channel_t*)(*a))->data.wallet.end_bal > ((mt_channel_t*)(*b))->data.wallet.end_bal)
@@ -1723,6 +1901,7 @@ static workqueue_reply_t cpu_task_estab(void* thread, void* args){
 
   mt_zkp_args_t* zkp_args = (mt_zkp_args_t*)args;
   mt_channel_t* chn = zkp_args->chn;
+  tor_trace(mt, zkp_begin, MT_PARTY_CLI, "estab", chn->idesc.id[0], chn->idesc.id[1]);
 
   // public zkp parameters
   int public_size = sizeof(int) + MT_SZ_COM;
@@ -1738,8 +1917,11 @@ static workqueue_reply_t cpu_task_estab(void* thread, void* args){
   memcpy(hidden + MT_SZ_PK + MT_SZ_SK, chn->data.wallet.rand, MT_SZ_HASH);
 
   // record zkp
-  mt_zkp_prove(MT_ZKP_TYPE_1, &client.pp, public, public_size,
-	       hidden, hidden_size, &chn->data.wallet.zkp);
+  int result = mt_zkp_prove(MT_ZKP_TYPE_1, &client.pp, public, public_size,
+			    hidden, hidden_size, &chn->data.wallet.zkp);
+  tor_trace(mt, zkp_end, MT_PARTY_CLI, "estab", chn->idesc.id[0], chn->idesc.id[1], result);
+  if(result != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: could not prove knowledge of the channel wallet");
 
   return WQ_RPL_REPLY;
 }
@@ -1748,11 +1930,13 @@ static workqueue_reply_t cpu_task_nanestab(void* thread, void* args){
   (void)thread;
 
   mt_channel_t* chn = ((mt_zkp_args_t*)args)->chn;
+  tor_trace(mt, zkp_begin, MT_PARTY_CLI, "nanestab", chn->idesc.id[0], chn->idesc.id[1]);
 
-  if(mt_wallet_create(&client.pp, -(MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100),
-		      &chn->data.wallet, &chn->data.wallet_nan) != MT_SUCCESS)
-    return WQ_RPL_ERROR;
-  return WQ_RPL_REPLY;
+  int result = mt_wallet_create(&client.pp, -(MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100),
+				&chn->data.wallet, &chn->data.wallet_nan);
+  tor_trace(mt, zkp_end, MT_PARTY_CLI, "nanestab", chn->idesc.id[0], chn->idesc.id[1], result);
+
+  return result == MT_SUCCESS ? WQ_RPL_REPLY : WQ_RPL_ERROR;
 }
 
 static workqueue_reply_t cpu_task_nanclose(void* thread, void* args){
@@ -1760,10 +1944,13 @@ static workqueue_reply_t cpu_task_nanclose(void* thread, void* args){
 
   // extract parameters
   mt_channel_t* chn = ((mt_zkp_args_t*)args)->chn;
-  if(mt_wallet_create(&client.pp, -(MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100),
-		      &chn->data.wallet, &chn->data.wallet_new) != MT_SUCCESS)
-    return WQ_RPL_ERROR;
-  return WQ_RPL_REPLY;
+  tor_trace(mt, zkp_begin, MT_PARTY_CLI, "nanclose", chn->idesc.id[0], chn->idesc.id[1]);
+
+  int result = mt_wallet_create(&client.pp, -(MT_NAN_VAL + (MT_NAN_VAL * client.tax) / 100),
+				&chn->data.wallet, &chn->data.wallet_new);
+  tor_trace(mt, zkp_end, MT_PARTY_CLI, "nanclose", chn->idesc.id[0], chn->idesc.id[1], result);
+
+  return result == MT_SUCCESS ? WQ_RPL_REPLY : WQ_RPL_ERROR;
 }
 
 /* Do nothing; used to three events back onto the queue */
@@ -1778,37 +1965,90 @@ static int estab_finish(mt_desc_t* rdesc, mt_desc_t* idesc){
   return mt_paymod_signal(MT_SIGNAL_ESTABLISH_SUCCESS, rdesc);
 }
 
+static int pool_finish(mt_desc_t* rdesc, mt_desc_t* idesc){
+  (void)rdesc;
+
+  int* pending = mt_descmap_get(client.pool_pending, idesc);
+  if(pending && *pending > 0){
+    (*pending)--;
+    client.pool_stats.pending--;
+  }
+
+  // intermediaries come and go so don't keep an entry for every one seen
+  if(pending && *pending == 0)
+    tor_free_(mt_descmap_remove(client.pool_pending, idesc));
+  return MT_SUCCESS;
+}
+
+/**
+ * Give up on a pool channel whose setup failed after it went out to a peer
+ */
+static void pool_abort(mt_channel_t* chn){
+  chn->callback.fn = NULL;
+  pool_finish(&chn->callback.dref1, &chn->callback.dref2);
+}
+
 static int pay_finish(mt_desc_t* rdesc, mt_desc_t* idesc){
   (void)idesc;
+
+  tor_free_(mt_descmap_remove(client.pay_units, rdesc));
+
   return mt_paymod_signal(MT_SIGNAL_PAYMENT_SUCCESS, rdesc);
 }
 
 static int close_finish(mt_desc_t* rdesc, mt_desc_t* idesc){
   (void)idesc;
 
-  smartlist_sort(client.nans_setup, compare_chn_end_data);
+  mt_chntable_sort(client.chns, CPAY_NAN_SETUP, compare_chn_end_data);
   //return mt_close_success(rdesc, idesc, MT_SUCCESS);
   return mt_paymod_signal(MT_SIGNAL_CLOSE_SUCCESS, rdesc);
 }
 
-static mt_channel_t* smartlist_idesc_remove(smartlist_t* list, mt_desc_t* desc){
-
-  SMARTLIST_FOREACH_BEGIN(list, mt_channel_t*, elm){
-    if(mt_desc_comp(&elm->idesc, desc) == 0){
-      smartlist_remove(list, elm);
-      elm_sl_len--;
-      return elm;
-    }
-  } SMARTLIST_FOREACH_END(elm);
-  return NULL;
-}
-
 static double timeval_diff(struct timeval t1, struct timeval t2){
   time_t sec_diff = t1.tv_sec - t2.tv_sec;
   long usec_diff = t1.tv_usec - t2.tv_usec;
   return (sec_diff * 1000000.0 + usec_diff) / 1000000.0;
 }
 
+static uint64_t timeval_usec_since(struct timeval start){
+  struct timeval now;
+  tor_gettimeofday(&now);
+  double diff = timeval_diff(now, start);
+  return diff > 0 ? (uint64_t)(diff * 1000000.0) : 0;
+}
+
+/**
+ * Run the expensive <b>task</b> for <b>args</b> on the cpuworker and call
+ * <b>reply</b> back on the main thread once it is done, or call both in series
+ * in single-threaded mode
+ */
+static int run_zkp_task(workqueue_reply_t (*task)(void*, void*), int (*reply)(void*),
+			mt_zkp_args_t* args){
+
+  // if single threaded then just call procedures in series
+  if(get_options()->MoneTorSingleThread){
+    if(task(NULL, args) != WQ_RPL_REPLY){
+      log_warn(LD_MT, "MoneTor: cpu task returned error");
+       return MT_ERROR;
+    }
+    return reply(args);
+  }
+
+  // if not single threaded then offload task to a different cpu task/reply flow
+  args->reply = reply;
+  if(!cpuworker_queue_work(WQ_PRI_HIGH, task, (work_task)help_zkp_reply, args)){
+    log_warn(LD_MT, "MoneTor: cpu task returned error");
+    return MT_ERROR;
+  }
+  client.cpuworker_queued++;
+  return MT_SUCCESS;
+}
+
+static int help_zkp_reply(void* args){
+  client.cpuworker_queued--;
+  return ((mt_zkp_args_t*)args)->reply(args);
+}
+
 static int recv_local(void* args){
   mt_recv_args* recv_args = (mt_recv_args*)args;
   int result = mt_cpay_recv(&recv_args->desc, recv_args->type, recv_args->msg, recv_args->size);
@@ -9,11 +9,42 @@
 #define mt_cpay_h
 
 #include "or.h"
+#include "mt_messagebuffer.h"
 
 #define MT_CPAY_GUARD 1
 #define MT_CPAY_MIDDLE 2
 #define MT_CPAY_EXIT 3
 
+/**
+ * Counters describing the pool of nanopayment channels set up ahead of time
+ */
+typedef struct {
+  /* establish calls that found a set-up channel waiting */
+  uint64_t hits;
+  /* establish calls that had to set up a channel from scratch */
+  uint64_t misses;
+  /* set-up channels waiting to be established */
+  int ready;
+  /* channels being set up for the pool */
+  int pending;
+} mt_cpay_pool_stats_t;
+
+/** Number of states a channel can rest in between protocols */
+#define MT_CPAY_NUM_STATES 7
+
+/**
+ * Gauges describing the channels of the client payment module
+ */
+typedef struct {
+  /* channels resting in each state, see mt_cpay_state_name() */
+  int states[MT_CPAY_NUM_STATES];
+  /* channels in the middle of a protocol */
+  int transition;
+  /* expensive crypto jobs handed to the cpuworker whose reply is not back */
+  int cpuworker_queued;
+  mt_msgbuf_stats_t msgbuf;
+} mt_cpay_chn_stats_t;
+
 /**
  * Initialize the module; should only be called once. All necessary variables
  * will be loaded from the torrc configuration file.
@@ -37,6 +68,14 @@ int mt_cpay_establish(mt_desc_t* rdesc, mt_desc_t* idesc);
  */
 int mt_cpay_pay(mt_desc_t* rdesc, mt_desc_t* idesc);
 
+/**
+ * Same as mt_cpay_pay() but pay for <b>units</b> nanopayments at once. Units
+ * are revealed together in a single message per nanopayment channel; if the
+ * current channel runs out then the rest are paid on a fresh one. The
+ * payment success signal is raised once all units have been paid.
+ */
+int mt_cpay_pay_units(mt_desc_t* rdesc, mt_desc_t* idesc, int units);
+
 /**
  * Close an existing payment channel with the given relay/intermediary pair
  */
@@ -67,6 +106,36 @@ int mt_cpay_chn_number(void);
  */
 int mt_cpay_set_status(mt_desc_t* desc, int status);
 
+/**
+ * Set up nanopayment channels with the intermediary <b>idesc</b> in the
+ * background until MoneTorChannelPool of them are ready or on their way, so
+ * that establishing a channel with a relay only needs the relay-side steps
+ */
+int mt_cpay_fill_pool(mt_desc_t* idesc);
+
+/**
+ * Write the current channel pool counters to <b>stats_out</b>; all zero if
+ * the module is not initialized
+ */
+void mt_cpay_pool_stats(mt_cpay_pool_stats_t* stats_out);
+
+/**
+ * Write the current channel, message buffer and cpuworker gauges to
+ * <b>stats_out</b>; all zero if the module is not initialized
+ */
+void mt_cpay_chn_stats(mt_cpay_chn_stats_t* stats_out);
+
+/**
+ * Return the name of channel state <b>state</b> as shown to controllers
+ */
+const char* mt_cpay_state_name(int state);
+
+/**
+ * Periodic upkeep; called once a second by the controller. Drops held
+ * messages that have been waiting longer than MoneTorMsgBufTTL.
+ */
+void mt_cpay_housekeeping(time_t now);
+
 /********************** Instance Management ***********************/
 
 /**
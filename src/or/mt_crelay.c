@@ -4,9 +4,11 @@
 #include "container.h"
 #include "config.h"
 #include "mt_common.h"
+#include "mt_descmap.h"
 #include "mt_crelay.h"
 #include "mt_rpay.h"
 #include "mt_ipay.h"
+#include "mt_reservoir.h"
 #include "router.h"
 #include "nodelist.h"
 #include "circuitbuild.h"
@@ -16,7 +18,7 @@
 #include "main.h"
 
 static uint64_t count[2] = {0, 0};
-static digestmap_t  *desc2circ = NULL;
+static mt_descmap_t* desc2circ = NULL;
 static ledger_t *ledger = NULL;
 static smartlist_t *ledgercircs = NULL;
 static smartlist_t *intercircs = NULL;
@@ -29,7 +31,7 @@ void
 mt_crelay_init(void) {
   log_info(LD_MT, "MoneTor: initialization of controler relay code");
   ledgercircs = smartlist_new();
-  desc2circ = digestmap_new();
+  desc2circ = mt_descmap_new();
   intercircs = smartlist_new();
   count[0] = rand_uint64();
   count[1] = rand_uint64();
@@ -50,11 +52,9 @@ void mt_crelay_init_desc_and_add(or_circuit_t *circ, mt_party_t party) {
   circ->desc.id[0] = count[0];
   circ->desc.id[1] = count[1];
   circ->desc.party = party; // Should always be CLI
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
   /* when it reaches 1000, it should receive
    * a payment from the client */
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(circ));
+  mt_descmap_set(desc2circ, &circ->desc, TO_CIRCUIT(circ));
   mt_rpay_set_status(&circ->desc, 1);
 }
 
@@ -77,9 +77,7 @@ mt_crelay_ledger_circ_has_opened(origin_circuit_t *ocirc) {
   /*ocirc->desc.id[0] = count[0];*/
   /*ocirc->desc.id[1] = count[1];*/
   /*ocirc->desc.party = MT_PARTY_LED;*/
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  digestmap_set(desc2circ, (char*) id, TO_CIRCUIT(ocirc));
+  mt_descmap_set(desc2circ, &ledger->desc, TO_CIRCUIT(ocirc));
   mt_rpay_set_status(&ledger->desc, 1);
   if (intermediary_role_initiated) {
     mt_ipay_set_status(&ledger->desc, 1);
@@ -98,10 +96,8 @@ void mt_crelay_ledger_circ_has_closed(origin_circuit_t *circ) {
     ledger->circuit_retries++;
   }
   smartlist_remove(ledgercircs, circ);
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&ledger->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &ledger->desc)) {
+    mt_descmap_remove(desc2circ, &ledger->desc);
     log_info(LD_MT, "MoneTor: ledger circ has closed. Removed %s from our internal structure",
         mt_desc_describe(&ledger->desc));
   }
@@ -129,8 +125,6 @@ mt_crelay_intermediary_circ_has_closed(origin_circuit_t* ocirc) {
    * the digestmap ~ or whatever logic which makes us certain that the channe
    * is open; launch again one circuit toward the intermediary */
   log_info(LD_MT, "MoneTor: Intermediary circ has closed");
-  byte id[DIGEST_LEN];
-  mt_desc2digest(ocirc->desci, &id);
   mt_rpay_set_status(ocirc->desci, 0);
   smartlist_remove(intercircs, ocirc);
   if (TO_CIRCUIT(ocirc)->state != CIRCUIT_STATE_OPEN) {
@@ -139,8 +133,8 @@ mt_crelay_intermediary_circ_has_closed(origin_circuit_t* ocirc) {
     tor_assert(ocirc->cpath->prev);
     tor_assert(ocirc->cpath->prev->extend_info);
     /** Special case where it's already in the digestmap */
-    if (digestmap_get(desc2circ, (char*) id)) {
-      digestmap_remove(desc2circ, (char*) id);
+    if (mt_descmap_get(desc2circ, ocirc->desci)) {
+      mt_descmap_remove(desc2circ, ocirc->desci);
     }
     else {
       log_info(LD_MT, "MoneTor: tried to remove the desc but it seems that this desc was not in our map anymore ~ bug?");
@@ -167,7 +161,7 @@ mt_crelay_intermediary_circ_has_closed(origin_circuit_t* ocirc) {
       /** We should not keep the same pointer*/
       circ->desci = tor_malloc_zero(sizeof(mt_desc_t));
       memcpy(circ->desci, ocirc->desci, sizeof(mt_desc_t));
-      digestmap_set(desc2circ, (char*) id, circ);
+      mt_descmap_set(desc2circ, ocirc->desci, circ);
       circ->inter_ident = tor_malloc_zero(sizeof(intermediary_identity_t));
       memcpy(circ->inter_ident->identity, ocirc->inter_ident->identity, DIGEST_LEN);
       smartlist_add(intercircs, circ);
@@ -179,7 +173,7 @@ mt_crelay_intermediary_circ_has_closed(origin_circuit_t* ocirc) {
     }
     return;
   }
-  if (!digestmap_get(desc2circ, (char*) id)) {
+  if (!mt_descmap_get(desc2circ, ocirc->desci)) {
     // then its find
     log_warn(LD_MT, "MoneTor: Our intermerdiary circuit closed but it looks"
         " it has already been removed from our map => all payment channel should"
@@ -187,7 +181,7 @@ mt_crelay_intermediary_circ_has_closed(origin_circuit_t* ocirc) {
     return;
   }
   else { //XXX TODO
-    digestmap_remove(desc2circ, (char*) id);
+    mt_descmap_remove(desc2circ, ocirc->desci);
   /** The circuit was open; so it was intentially closed by our side or someone in the path*/
     log_info(LD_MT, "MoneTor: an intermediary on the relay side has closed. Several possibilities:"
         " The circuit might have expired. The payment channel closed and made us closed this"
@@ -223,10 +217,8 @@ mt_crelay_intermediary_circ_has_opened(origin_circuit_t* ocirc) {
 void
 mt_crelay_orcirc_has_closed(or_circuit_t *circ) {
   mt_rpay_set_status(&circ->desc, 0);
-  byte id[DIGEST_LEN];
-  mt_desc2digest(&circ->desc, &id);
-  if (digestmap_get(desc2circ, (char*) id)) {
-    digestmap_remove(desc2circ, (char*) id);
+  if (mt_descmap_get(desc2circ, &circ->desc)) {
+    mt_descmap_remove(desc2circ, &circ->desc);
   }
   else {
     log_warn(LD_MT, "MoneTor: desc %s not found in our map", mt_desc_describe(&circ->desc));
@@ -258,6 +250,13 @@ mt_crelay_orcirc_has_closed(or_circuit_t *circ) {
 static void
 run_crelay_housekeeping_event(time_t now) {
 
+  /* The cpuworker is not up yet when the payment modules are initialized,
+   * so the reservoir is stocked from here */
+  mt_reservoir_fill();
+
+  /* Drop payment messages that waited too long for their peer */
+  mt_rpay_housekeeping(now);
+
   /** Checks whether we might be an intermediary
    *  we need the guard flag, though */
   /*if (!intermediary_role_initiated) {*/
@@ -275,14 +274,14 @@ run_crelay_housekeeping_event(time_t now) {
    * are in a correct state => Do we received our payment, etc?
    */
   log_info(LD_MT, "MoneTor: relay digestmap length: %d at time %lld",
-      digestmap_size(desc2circ), (long long) now);
-  DIGESTMAP_FOREACH(desc2circ, key, circuit_t *, circ) {
+      mt_descmap_size(desc2circ), (long long) now);
+  MT_DESCMAP_FOREACH(desc2circ, key, circuit_t *, circ) {
     if (CIRCUIT_IS_ORCIRC(circ) && circ->mt_priority && circ->payment_window < 0) {
       /*tor_assert_nonfatal(circ->payment_window > 0);*/
       log_warn(LD_MT, "MoneTor: this circuit has negative window, this should not happen! window: %d linked to desc %s", circ->payment_window,
           mt_desc_describe(&TO_OR_CIRCUIT(circ)->desc));
     }
-  } DIGESTMAP_FOREACH_END;
+  } MT_DESCMAP_FOREACH_END;
 }
 
 /**
@@ -367,9 +366,7 @@ run_crelay_scheduled_events(time_t now) {
 int
 mt_crelay_send_message(mt_desc_t* desc, uint8_t command, mt_ntype_t type,
     byte* msg, int size) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   crypt_path_t *layer_start = NULL;
 
   if (!circ) {
@@ -534,10 +531,8 @@ mt_crelay_process_received_msg(circuit_t *circ, mt_ntype_t pcommand,
 
       /** adding to digestmap desci => oricirc */
       if (!can_free_desci) {
-        byte id[DIGEST_LEN];
-        mt_desc2digest(desci, &id);
-        if (!digestmap_get(desc2circ, (char*) id)) {
-          digestmap_set(desc2circ, (char*) id, oricirc);
+        if (!mt_descmap_get(desc2circ, desci)) {
+          mt_descmap_set(desc2circ, desci, oricirc);
         }
       }
       else {
@@ -594,9 +589,7 @@ void mt_crelay_update_payment_window(circuit_t *circ) {
  */
 
 int mt_crelay_paymod_signal(mt_signal_t signal, mt_desc_t *desc) {
-  byte id[DIGEST_LEN];
-  mt_desc2digest(desc, &id);
-  circuit_t *circ = digestmap_get(desc2circ, (char*) id);
+  circuit_t *circ = mt_descmap_get(desc2circ, desc);
   if (!circ) {
     log_info(LD_MT, "MoneTor: looks like desc %s is not within our map", mt_desc_describe(desc));
     return -1;
@@ -610,7 +603,7 @@ int mt_crelay_paymod_signal(mt_signal_t signal, mt_desc_t *desc) {
     }
     else {
       log_warn(LD_MT, "MoneTor: Seems that the circuit has been closed");
-      digestmap_remove(desc2circ, (char*) id);
+      mt_descmap_remove(desc2circ, desc);
       return -1;
     }
   }
@@ -679,7 +672,7 @@ mt_crelay_intermediary_circuit_free(origin_circuit_t *oricirc) {
   if (oricirc->inter_ident) {
     tor_free(oricirc->inter_ident);
   }
-  buf_free(oricirc->buf);
+  mt_msgreasm_free(oricirc->buf);
 }
 
 void mt_crelay_orcirc_free(or_circuit_t* circ) {
@@ -695,5 +688,5 @@ void mt_crelay_orcirc_free(or_circuit_t* circ) {
     /*if (can_free)*/
       /*tor_free(*circ->desci);*/
   /*}*/
-  buf_free(circ->buf);
+  mt_msgreasm_free(circ->buf);
 }
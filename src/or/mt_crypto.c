@@ -15,10 +15,14 @@
  * size.
  *
  * - KeyGen (RSA): Openssl; fully functional. Keys are imported and exported as
- *   PEM formatted c-strings
+ *   PEM formatted c-strings. Parsed key objects are kept in a bounded cache so
+ *   that each PEM string is only decoded once
+ * - KeyGen (Ed25519): Tor's ed25519 backend; fully functional. Selected with
+ *   MoneTorEd25519; keys are stored raw behind MT_ED25519_TAG
  * - Hash Function: Openssl; fully functional
  * - Random Function: Openssl; fully functional
- * - Message Signing: Openssl; fully functional
+ * - Message Signing: Openssl or ed25519 depending on the key; fully
+ *   functional. Ed25519 signatures can be verified in batches
  *
  * - Commitment: Simulation; messages are committed using a naive one-step
  *   hashing scheme that is incompatible with the final system requirements
@@ -29,6 +33,8 @@
 
 #pragma GCC diagnostic ignored "-Wmissing-prototypes"
 
+#define MT_CRYPTO_PRIVATE
+
 #include <string.h>
 #include <time.h>
 
@@ -42,6 +48,9 @@
 
 #include "or.h"
 #include "config.h"
+#include "compat_threads.h"
+#include "compat_openssl.h"
+#include "crypto_ed25519.h"
 #include "mt_crypto.h"
 
 /*************** Crytpographic Simulaed Delays (microsec) ***************/
@@ -88,6 +97,40 @@ static const char* exp_str = "65537";
 // random byte string used to simulate a "blinder" for bsig operations
 static byte* bsig_fake_blinder = (byte*)"1234567812345678123456781234567812345678";
 
+/******************************* Key Cache ******************************/
+
+/**
+ * Parsed RSA key object along with its place in the recency order. The cache
+ * holds one reference to <b>rsa</b>; borrowers take their own reference so
+ * that an eviction never frees a key that is still in use on another thread.
+ */
+typedef struct mt_key_cache_ent_t {
+  RSA* rsa;
+  int is_private;
+  char digest[DIGEST_LEN];
+  TOR_TAILQ_ENTRY(mt_key_cache_ent_t) lru;
+} mt_key_cache_ent_t;
+
+// digest(PEM string) -> mt_key_cache_ent_t
+static digestmap_t* key_cache = NULL;
+// cached entries from least to most recently used
+static TOR_TAILQ_HEAD(mt_key_cache_lru_t, mt_key_cache_ent_t) key_cache_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(key_cache_lru);
+static tor_mutex_t key_cache_lock;
+static int key_cache_lock_initialized = 0;
+
+/** Maximum number of parsed keys held by the cache at any time */
+STATIC int mt_key_cache_max = MT_KEY_CACHE_MAX;
+
+static RSA* key_cache_get(byte* pem, int is_private);
+static void key_cache_evict_lru(void);
+static void rsa_up_ref(RSA* rsa);
+static void rsa_wipe_private(RSA* rsa);
+
+static int keygen_ed25519(byte (*pk_out)[MT_SZ_PK], byte (*sk_out)[MT_SZ_SK]);
+static int sign_ed25519(byte* msg, int msg_size, byte (*sk)[MT_SZ_SK], byte (*sig_out)[MT_SZ_SIG]);
+static int verify_ed25519(byte* msg, int msg_size, byte (*pk)[MT_SZ_PK], byte (*sig)[MT_SZ_SIG]);
+
 /**
  * Called at system setup to obtain public parameters
  */
@@ -99,14 +142,22 @@ int mt_crypt_setup(byte (*pp_out)[MT_SZ_PP]){
   return mt_crypt_rand(MT_SZ_PP, *pp_out);
 }
 
+mt_key_type_t mt_crypt_key_type(void){
+  return get_options()->MoneTorEd25519 ? MT_KEY_ED25519 : MT_KEY_RSA;
+}
+
 /**
  * Generate a public and private keypair outputted as RSA PEM c-strings. For
  * simulation purposes, keys are simply RSA keys. In the final implementation,
  * it may be necessary for the keys to carry extra information for ZKP scheme
  */
-int mt_crypt_keygen(byte (*pp)[MT_SZ_PP], byte (*pk_out)[MT_SZ_PK], byte  (*sk_out)[MT_SZ_SK]){
+int mt_crypt_keygen(byte (*pp)[MT_SZ_PP], mt_key_type_t type, byte (*pk_out)[MT_SZ_PK],
+		    byte (*sk_out)[MT_SZ_SK]){
   (void)pp;
 
+    if(type == MT_KEY_ED25519)
+      return keygen_ed25519(pk_out, sk_out);
+
     // generate the rsa struct
     BIGNUM *exponent = BN_new();
     BN_dec2bn(&exponent, exp_str);
@@ -181,26 +232,24 @@ int mt_crypt_hash(byte* msg, int msg_size, byte (*hash_out)[MT_SZ_HASH]){
  */
 int mt_sig_sign(byte* msg, int msg_size, byte (*sk)[MT_SZ_SK], byte (*sig_out)[MT_SZ_SIG]){
 
-    BIO* bio = BIO_new_mem_buf(sk, strlen((char*)*sk));
-    RSA* rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
+    if(mt_crypt_is_ed25519(*sk))
+      return sign_ed25519(msg, msg_size, sk, sig_out);
 
-    if(bio == NULL || rsa == NULL)
+    RSA* rsa = key_cache_get(*sk, 1);
+    if(rsa == NULL)
 	return MT_ERROR;
 
+    int result = MT_ERROR;
     byte digest[MT_SZ_HASH];
-    if(mt_crypt_hash(msg, msg_size, &digest) != 0)
-	return MT_ERROR;
-
     uint sig_len;
-    if(RSA_sign(NID_sha256, digest, MT_SZ_HASH, *sig_out, &sig_len, rsa) != 1)
-	return MT_ERROR;
 
-    if(sig_len != MT_SZ_SIG)
-	return MT_ERROR;
+    if(mt_crypt_hash(msg, msg_size, &digest) == MT_SUCCESS &&
+       RSA_sign(NID_sha256, digest, MT_SZ_HASH, *sig_out, &sig_len, rsa) == 1 &&
+       sig_len == MT_SZ_SIG)
+	result = MT_SUCCESS;
 
     RSA_free(rsa);
-    BIO_free(bio);
-    return MT_SUCCESS;
+    return result;
 }
 
 /**
@@ -209,23 +258,304 @@ int mt_sig_sign(byte* msg, int msg_size, byte (*sk)[MT_SZ_SK], byte (*sig_out)[M
  */
 int mt_sig_verify(byte* msg, int msg_size, byte (*pk)[MT_SZ_PK], byte   (*sig)[MT_SZ_SIG]){
 
-    BIO* bio = BIO_new_mem_buf(pk, strlen((char*)*pk));
-    RSA* rsa = PEM_read_bio_RSA_PUBKEY(bio, NULL, NULL, NULL);
+    if(mt_crypt_is_ed25519(*pk))
+      return verify_ed25519(msg, msg_size, pk, sig);
 
-    if(bio == NULL || rsa == NULL)
+    RSA* rsa = key_cache_get(*pk, 0);
+    if(rsa == NULL)
 	return MT_ERROR;
 
+    int result = MT_ERROR;
     byte digest[MT_SZ_HASH];
-    if(mt_crypt_hash(msg, msg_size, &digest) != MT_SUCCESS)
-	return MT_ERROR;
 
     // signature did not verify
-    if(RSA_verify(NID_sha256, digest, MT_SZ_HASH, *sig, MT_SZ_SIG, rsa) != 1)
-	return MT_ERROR;
+    if(mt_crypt_hash(msg, msg_size, &digest) == MT_SUCCESS &&
+       RSA_verify(NID_sha256, digest, MT_SZ_HASH, *sig, MT_SZ_SIG, rsa) == 1)
+	result = MT_SUCCESS;
 
     RSA_free(rsa);
-    BIO_free(bio);
-    return MT_SUCCESS;
+    return result;
+}
+
+/**
+ * Verify a batch of signatures. Ed25519 signatures are handed to the ed25519
+ * batch verifier together; any others are checked one at a time.
+ */
+int mt_sig_verify_batch(mt_sig_checkable_t* checks, int n, int* ok_out){
+
+  int result = MT_SUCCESS;
+  ed25519_checkable_t* ed_checks = tor_calloc(n, sizeof(ed25519_checkable_t));
+  ed25519_public_key_t* ed_pks = tor_calloc(n, sizeof(ed25519_public_key_t));
+  int* ed_index = tor_calloc(n, sizeof(int));
+  int* ed_ok = tor_calloc(n, sizeof(int));
+  int num_ed = 0;
+
+  for(int i = 0; i < n; i++){
+    if(!mt_crypt_is_ed25519(*checks[i].pk)){
+      ok_out[i] = mt_sig_verify(checks[i].msg, checks[i].msg_size, checks[i].pk,
+				checks[i].sig) == MT_SUCCESS;
+      if(!ok_out[i])
+	result = MT_ERROR;
+      continue;
+    }
+
+    // the padding after an Ed25519 signature is not covered by the check
+    if(!tor_mem_is_zero((const char*)*checks[i].sig + ED25519_SIG_LEN,
+			MT_SZ_SIG - ED25519_SIG_LEN)){
+      ok_out[i] = 0;
+      result = MT_ERROR;
+      continue;
+    }
+
+    memcpy(ed_pks[num_ed].pubkey, *checks[i].pk + MT_SZ_ED25519_TAG, ED25519_PUBKEY_LEN);
+    ed_checks[num_ed].pubkey = &ed_pks[num_ed];
+    memcpy(ed_checks[num_ed].signature.sig, *checks[i].sig, ED25519_SIG_LEN);
+    ed_checks[num_ed].msg = checks[i].msg;
+    ed_checks[num_ed].len = checks[i].msg_size;
+    ed_index[num_ed++] = i;
+  }
+
+  if(num_ed > 0 && ed25519_checksig_batch(ed_ok, ed_checks, num_ed) != 0)
+    result = MT_ERROR;
+  for(int j = 0; j < num_ed; j++)
+    ok_out[ed_index[j]] = ed_ok[j];
+
+  tor_free(ed_checks);
+  tor_free(ed_pks);
+  tor_free(ed_index);
+  tor_free(ed_ok);
+  return result;
+}
+
+int mt_crypt_is_ed25519(const byte* k){
+  return fast_memeq(k, MT_ED25519_TAG, MT_SZ_ED25519_TAG);
+}
+
+/**
+ * Generate an Ed25519 keypair in the tagged layout described in mt_crypto.h
+ */
+static int keygen_ed25519(byte (*pk_out)[MT_SZ_PK], byte (*sk_out)[MT_SZ_SK]){
+
+  ed25519_keypair_t keypair;
+  if(ed25519_keypair_generate(&keypair, 0) < 0)
+    return MT_ERROR;
+
+  memset(*pk_out, 0, MT_SZ_PK);
+  memcpy(*pk_out, MT_ED25519_TAG, MT_SZ_ED25519_TAG);
+  memcpy(*pk_out + MT_SZ_ED25519_TAG, keypair.pubkey.pubkey, ED25519_PUBKEY_LEN);
+
+  memset(*sk_out, 0, MT_SZ_SK);
+  memcpy(*sk_out, MT_ED25519_TAG, MT_SZ_ED25519_TAG);
+  memcpy(*sk_out + MT_SZ_ED25519_TAG, keypair.seckey.seckey, ED25519_SECKEY_LEN);
+  memcpy(*sk_out + MT_SZ_ED25519_TAG + ED25519_SECKEY_LEN, keypair.pubkey.pubkey,
+	 ED25519_PUBKEY_LEN);
+
+  memwipe(&keypair, 0, sizeof(keypair));
+  return MT_SUCCESS;
+}
+
+/**
+ * Sign with an Ed25519 secret key; the signature fills the first
+ * ED25519_SIG_LEN bytes of <b>sig_out</b> and the rest is zero
+ */
+static int sign_ed25519(byte* msg, int msg_size, byte (*sk)[MT_SZ_SK], byte (*sig_out)[MT_SZ_SIG]){
+
+  ed25519_keypair_t keypair;
+  ed25519_signature_t sig;
+  memcpy(keypair.seckey.seckey, *sk + MT_SZ_ED25519_TAG, ED25519_SECKEY_LEN);
+  memcpy(keypair.pubkey.pubkey, *sk + MT_SZ_ED25519_TAG + ED25519_SECKEY_LEN,
+	 ED25519_PUBKEY_LEN);
+
+  int result = ed25519_sign(&sig, msg, msg_size, &keypair);
+  memwipe(&keypair, 0, sizeof(keypair));
+  if(result < 0)
+    return MT_ERROR;
+
+  memset(*sig_out, 0, MT_SZ_SIG);
+  memcpy(*sig_out, sig.sig, ED25519_SIG_LEN);
+  return MT_SUCCESS;
+}
+
+/**
+ * Verify an Ed25519 signature laid out as by sign_ed25519(). Signatures with
+ * anything but zeros after the first ED25519_SIG_LEN bytes are rejected, so
+ * that every valid signature has exactly one encoding.
+ */
+static int verify_ed25519(byte* msg, int msg_size, byte (*pk)[MT_SZ_PK], byte (*sig)[MT_SZ_SIG]){
+
+  if(!tor_mem_is_zero((const char*)*sig + ED25519_SIG_LEN, MT_SZ_SIG - ED25519_SIG_LEN))
+    return MT_ERROR;
+
+  ed25519_public_key_t pubkey;
+  ed25519_signature_t ed_sig;
+  memcpy(pubkey.pubkey, *pk + MT_SZ_ED25519_TAG, ED25519_PUBKEY_LEN);
+  memcpy(ed_sig.sig, *sig, ED25519_SIG_LEN);
+
+  if(ed25519_checksig(&ed_sig, msg, msg_size, &pubkey) < 0)
+    return MT_ERROR;
+  return MT_SUCCESS;
+}
+
+/**
+ * Return a new reference to the parsed RSA object for the given PEM c-string,
+ * decoding and caching it on a miss. The caller must RSA_free() the result.
+ * Returns NULL if the string is not a valid key.
+ */
+static RSA* key_cache_get(byte* pem, int is_private){
+
+  char digest[DIGEST_LEN];
+  size_t pem_len = strlen((char*)pem);
+  crypto_digest(digest, (char*)pem, pem_len);
+
+  mt_crypt_init();
+  tor_mutex_acquire(&key_cache_lock);
+
+  if(key_cache == NULL)
+    key_cache = digestmap_new();
+
+  mt_key_cache_ent_t* ent = digestmap_get(key_cache, digest);
+  if(ent){
+    TOR_TAILQ_REMOVE(&key_cache_lru, ent, lru);
+    TOR_TAILQ_INSERT_TAIL(&key_cache_lru, ent, lru);
+    rsa_up_ref(ent->rsa);
+    tor_mutex_release(&key_cache_lock);
+    return ent->rsa;
+  }
+
+  tor_mutex_release(&key_cache_lock);
+
+  // parse outside of the lock; a concurrent miss on the same key is harmless
+  BIO* bio = BIO_new_mem_buf(pem, pem_len);
+  if(bio == NULL)
+    return NULL;
+  RSA* rsa = is_private ? PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL) :
+    PEM_read_bio_RSA_PUBKEY(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+  if(rsa == NULL)
+    return NULL;
+
+  tor_mutex_acquire(&key_cache_lock);
+
+  ent = digestmap_get(key_cache, digest);
+  if(ent){
+    // somebody beat us to it; keep theirs
+    RSA_free(rsa);
+    rsa = ent->rsa;
+    TOR_TAILQ_REMOVE(&key_cache_lru, ent, lru);
+  }
+  else{
+    if(digestmap_size(key_cache) >= mt_key_cache_max)
+      key_cache_evict_lru();
+    ent = tor_malloc_zero(sizeof(mt_key_cache_ent_t));
+    ent->rsa = rsa;
+    ent->is_private = is_private;
+    memcpy(ent->digest, digest, DIGEST_LEN);
+    digestmap_set(key_cache, digest, ent);
+  }
+  TOR_TAILQ_INSERT_TAIL(&key_cache_lru, ent, lru);
+  rsa_up_ref(rsa);
+
+  tor_mutex_release(&key_cache_lock);
+  return rsa;
+}
+
+/**
+ * Drop the least recently used key from the cache. Must be called with
+ * key_cache_lock held.
+ */
+static void key_cache_evict_lru(void){
+
+  mt_key_cache_ent_t* lru_ent = TOR_TAILQ_FIRST(&key_cache_lru);
+  if(!lru_ent)
+    return;
+
+  TOR_TAILQ_REMOVE(&key_cache_lru, lru_ent, lru);
+  digestmap_remove(key_cache, lru_ent->digest);
+  RSA_free(lru_ent->rsa);
+  tor_free(lru_ent);
+}
+
+/**
+ * Take a new reference to <b>rsa</b>; RSA_up_ref() only appeared in OpenSSL
+ * 1.1 so older versions bump the count by hand
+ */
+static void rsa_up_ref(RSA* rsa){
+#ifdef OPENSSL_1_1_API
+  RSA_up_ref(rsa);
+#else
+  CRYPTO_add(&rsa->references, 1, CRYPTO_LOCK_RSA);
+#endif
+}
+
+/**
+ * Zero the private components of <b>rsa</b> in place. Only safe once nobody
+ * else holds a reference to it.
+ */
+static void rsa_wipe_private(RSA* rsa){
+#ifdef OPENSSL_1_1_API
+  const BIGNUM *n, *e, *d, *p, *q, *dmp1, *dmq1, *iqmp;
+  RSA_get0_key(rsa, &n, &e, &d);
+  RSA_get0_factors(rsa, &p, &q);
+  RSA_get0_crt_params(rsa, &dmp1, &dmq1, &iqmp);
+#else
+  BIGNUM *d = rsa->d, *p = rsa->p, *q = rsa->q;
+  BIGNUM *dmp1 = rsa->dmp1, *dmq1 = rsa->dmq1, *iqmp = rsa->iqmp;
+#endif
+  const BIGNUM* parts[] = {d, p, q, dmp1, dmq1, iqmp};
+  for(size_t i = 0; i < ARRAY_LENGTH(parts); i++){
+    if(parts[i])
+      BN_clear((BIGNUM*)parts[i]);
+  }
+}
+
+/**
+ * Return the number of parsed keys currently held in the key cache
+ */
+int mt_crypt_key_cache_size(void){
+  mt_crypt_init();
+  tor_mutex_acquire(&key_cache_lock);
+  int size = key_cache ? digestmap_size(key_cache) : 0;
+  tor_mutex_release(&key_cache_lock);
+  return size;
+}
+
+/**
+ * Initialize module-wide state. Called from mt_init() on the main thread
+ * before any worker thread can sign or verify; later calls are no-ops.
+ */
+void mt_crypt_init(void){
+  if(key_cache_lock_initialized)
+    return;
+  tor_mutex_init_nonrecursive(&key_cache_lock);
+  key_cache_lock_initialized = 1;
+}
+
+/**
+ * Release all cached key objects, wiping the private key material, and the
+ * cache lock. Called at shutdown once no worker thread can still hold a key;
+ * the next use of the cache initializes it again.
+ */
+void mt_crypt_free_all(void){
+  if(!key_cache_lock_initialized)
+    return;
+
+  tor_mutex_acquire(&key_cache_lock);
+  if(key_cache){
+    DIGESTMAP_FOREACH_MODIFY(key_cache, k, mt_key_cache_ent_t*, ent){
+      TOR_TAILQ_REMOVE(&key_cache_lru, ent, lru);
+      if(ent->is_private)
+        rsa_wipe_private(ent->rsa);
+      RSA_free(ent->rsa);
+      memwipe(ent, 0, sizeof(mt_key_cache_ent_t));
+      tor_free(ent);
+      MAP_DEL_CURRENT(k);
+    } DIGESTMAP_FOREACH_END;
+    digestmap_free(key_cache, NULL);
+    key_cache = NULL;
+  }
+  tor_mutex_release(&key_cache_lock);
+  tor_mutex_uninit(&key_cache_lock);
+  key_cache_lock_initialized = 0;
 }
 
 /**
@@ -24,22 +24,62 @@
 
 /************************************************************************/
 
+/** Default bound on the number of parsed keys kept by the key cache */
+#define MT_KEY_CACHE_MAX 1024
+
+/**
+ * Ed25519 keys share the MT_SZ_PK/MT_SZ_SK buffers with RSA PEM keys and are
+ * told apart by this tag. A public key is the tag followed by the 32-byte
+ * Ed25519 key; a secret key is the tag followed by the 64-byte expanded
+ * secret key and the public key. The rest of the buffer is zero.
+ */
+#define MT_ED25519_TAG "ed25519:"
+#define MT_SZ_ED25519_TAG 8
+
 typedef enum {
   MT_ZKP_TYPE_1,
   MT_ZKP_TYPE_2,
   MT_ZKP_TYPE_3,
 } mt_zkp_type_t;
 
+/**
+ * Initialize module-wide state (key cache lock)
+ */
+void mt_crypt_init(void);
+
+/**
+ * Release all cached key objects and wipe private key material
+ */
+void mt_crypt_free_all(void);
+
+/**
+ * Return the number of parsed keys currently held in the key cache
+ */
+int mt_crypt_key_cache_size(void);
+
 /**
  * Generate the public parameters needed to run the
  * commitment/zero-knowledge proof schemes
  */
 int mt_crypt_setup(byte (*pp_out)[MT_SZ_PP]);
 
+/** Signature schemes a keypair can be generated for */
+typedef enum {
+  MT_KEY_RSA,
+  MT_KEY_ED25519,
+} mt_key_type_t;
+
 /**
- * Generate a public/private RSA keypair given public parameters
+ * Return the key type selected by MoneTorEd25519. This reads the options, so
+ * call it on the main thread and hand the result to any worker thread.
  */
-int mt_crypt_keygen(byte (*pp)[MT_SZ_PP], byte (*pk_out)[MT_SZ_PK], byte (*sk_out)[MT_SZ_SK]);
+mt_key_type_t mt_crypt_key_type(void);
+
+/**
+ * Generate a public/private keypair of <b>type</b> given public parameters
+ */
+int mt_crypt_keygen(byte (*pp)[MT_SZ_PP], mt_key_type_t type, byte (*pk_out)[MT_SZ_PK],
+		    byte (*sk_out)[MT_SZ_SK]);
 
 /**
  * Fill the given byte string with cryptographically secure random
@@ -64,6 +104,28 @@ int mt_sig_sign(byte* msg, int msg_size, byte (*sk)[MT_SZ_SK], byte (*sig_out)[M
  */
 int mt_sig_verify(byte* msg, int msg_size, byte (*pk)[MT_SZ_PK], byte (*sig)[MT_SZ_SIG]);
 
+/**
+ * A single signature check handed to mt_sig_verify_batch()
+ */
+typedef struct {
+  byte* msg;
+  int msg_size;
+  byte (*pk)[MT_SZ_PK];
+  byte (*sig)[MT_SZ_SIG];
+} mt_sig_checkable_t;
+
+/**
+ * Verify <b>n</b> signatures at once and set <b>ok_out</b>[i] to 1 for each
+ * one that is valid. Ed25519 signatures are checked together in a single
+ * batch. Return MT_SUCCESS only if every signature is valid.
+ */
+int mt_sig_verify_batch(mt_sig_checkable_t* checks, int n, int* ok_out);
+
+/**
+ * Return 1 if the key buffer holds an Ed25519 key and 0 otherwise
+ */
+int mt_crypt_is_ed25519(const byte* k);
+
 /******************************* Committment ****************************/
 
 /**
@@ -126,5 +188,11 @@ MOCK_DECL(void, mt_micro_sleep, (uint microsecs));
  */
 void mock_micro_sleep(uint microsecs);
 
+#ifdef MT_CRYPTO_PRIVATE
+#ifdef TOR_UNIT_TESTS
+extern int mt_key_cache_max;
+#endif
+#endif
+
 
 #endif
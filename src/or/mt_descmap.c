@@ -0,0 +1,150 @@
+/**
+ * \file mt_descmap.c
+ *
+ * Hash table keyed directly on mt_desc_t. Payment modules used to key
+ * digestmaps by mt_desc2digest(), which runs the descriptor through SHA-256
+ * on every lookup; this map hashes the two ids and the party with siphash
+ * instead and compares keys field by field.
+ */
+
+#include "or.h"
+#include "container.h"
+#include "ht.h"
+#include "mt_descmap.h"
+
+typedef struct mt_descmap_entry_t {
+  HT_ENTRY(mt_descmap_entry_t) node;
+  void* val;
+  mt_desc_t key;
+} mt_descmap_entry_t;
+
+struct mt_descmap_t {
+  HT_HEAD(mt_descmap_impl, mt_descmap_entry_t) head;
+};
+
+static inline int descmap_entries_eq(const mt_descmap_entry_t* a,
+				     const mt_descmap_entry_t* b){
+  return a->key.id[0] == b->key.id[0] && a->key.id[1] == b->key.id[1] &&
+    a->key.party == b->key.party;
+}
+
+static inline unsigned int descmap_entry_hash(const mt_descmap_entry_t* a){
+  // pack the fields so that struct padding never reaches the hash
+  uint64_t words[3] = {a->key.id[0], a->key.id[1], (uint64_t)a->key.party};
+  return (unsigned)siphash24g(words, sizeof(words));
+}
+
+HT_PROTOTYPE(mt_descmap_impl, mt_descmap_entry_t, node, descmap_entry_hash,
+	     descmap_entries_eq)
+HT_GENERATE2(mt_descmap_impl, mt_descmap_entry_t, node, descmap_entry_hash,
+	     descmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
+
+mt_descmap_t* mt_descmap_new(void){
+  mt_descmap_t* map = tor_malloc(sizeof(mt_descmap_t));
+  HT_INIT(mt_descmap_impl, &map->head);
+  return map;
+}
+
+void* mt_descmap_set(mt_descmap_t* map, const mt_desc_t* desc, void* val){
+  tor_assert(map);
+  tor_assert(desc);
+  tor_assert(val);
+
+  mt_descmap_entry_t search;
+  search.key = *desc;
+
+  mt_descmap_entry_t* found = HT_FIND(mt_descmap_impl, &map->head, &search);
+  if(found){
+    void* old = found->val;
+    found->val = val;
+    return old;
+  }
+
+  mt_descmap_entry_t* ent = tor_malloc_zero(sizeof(mt_descmap_entry_t));
+  ent->key = *desc;
+  ent->val = val;
+  HT_INSERT(mt_descmap_impl, &map->head, ent);
+  return NULL;
+}
+
+void* mt_descmap_get(const mt_descmap_t* map, const mt_desc_t* desc){
+  tor_assert(map);
+  tor_assert(desc);
+
+  mt_descmap_entry_t search;
+  search.key = *desc;
+  mt_descmap_entry_t* found = HT_FIND(mt_descmap_impl, &map->head, &search);
+  return found ? found->val : NULL;
+}
+
+void* mt_descmap_remove(mt_descmap_t* map, const mt_desc_t* desc){
+  tor_assert(map);
+  tor_assert(desc);
+
+  mt_descmap_entry_t search;
+  search.key = *desc;
+  mt_descmap_entry_t* found = HT_REMOVE(mt_descmap_impl, &map->head, &search);
+  if(!found)
+    return NULL;
+
+  void* val = found->val;
+  tor_free(found);
+  return val;
+}
+
+void mt_descmap_free(mt_descmap_t* map, void (*free_val)(void*)){
+  if(!map)
+    return;
+
+  mt_descmap_entry_t **ent, **next, *this;
+  for(ent = HT_START(mt_descmap_impl, &map->head); ent != NULL; ent = next){
+    this = *ent;
+    next = HT_NEXT_RMV(mt_descmap_impl, &map->head, ent);
+    if(free_val)
+      free_val(this->val);
+    tor_free(this);
+  }
+  HT_CLEAR(mt_descmap_impl, &map->head);
+  tor_free(map);
+}
+
+int mt_descmap_size(const mt_descmap_t* map){
+  return HT_SIZE(&map->head);
+}
+
+int mt_descmap_isempty(const mt_descmap_t* map){
+  return HT_EMPTY(&map->head);
+}
+
+mt_descmap_iter_t* mt_descmap_iter_init(mt_descmap_t* map){
+  tor_assert(map);
+  return HT_START(mt_descmap_impl, &map->head);
+}
+
+mt_descmap_iter_t* mt_descmap_iter_next(mt_descmap_t* map, mt_descmap_iter_t* iter){
+  tor_assert(map);
+  tor_assert(iter);
+  return HT_NEXT(mt_descmap_impl, &map->head, iter);
+}
+
+mt_descmap_iter_t* mt_descmap_iter_next_rmv(mt_descmap_t* map, mt_descmap_iter_t* iter){
+  tor_assert(map);
+  tor_assert(iter);
+  tor_assert(*iter);
+
+  mt_descmap_entry_t* rmv = *iter;
+  iter = HT_NEXT_RMV(mt_descmap_impl, &map->head, iter);
+  tor_free(rmv);
+  return iter;
+}
+
+void mt_descmap_iter_get(mt_descmap_iter_t* iter, const mt_desc_t** keyp, void** valp){
+  tor_assert(iter);
+  tor_assert(*iter);
+  *keyp = &(*iter)->key;
+  *valp = (*iter)->val;
+}
+
+int mt_descmap_iter_done(mt_descmap_iter_t* iter){
+  return iter == NULL;
+}
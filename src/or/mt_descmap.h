@@ -0,0 +1,62 @@
+/**
+ * \file mt_descmap.h
+ * \brief Header file for mt_descmap.c
+ *
+ * Map from mt_desc_t to void*, with the same interface as digestmap_t.
+ **/
+
+#ifndef mt_descmap_h
+#define mt_descmap_h
+
+#include "or.h"
+
+typedef struct mt_descmap_t mt_descmap_t;
+typedef struct mt_descmap_entry_t *mt_descmap_iter_t;
+
+mt_descmap_t* mt_descmap_new(void);
+
+/**
+ * Map <b>desc</b> to <b>val</b> and return the previous value, or NULL. The
+ * descriptor is copied so the caller keeps ownership of <b>desc</b>.
+ */
+void* mt_descmap_set(mt_descmap_t* map, const mt_desc_t* desc, void* val);
+
+/**
+ * Return the value mapped to <b>desc</b>, or NULL
+ */
+void* mt_descmap_get(const mt_descmap_t* map, const mt_desc_t* desc);
+
+/**
+ * Remove <b>desc</b> from the map and return its value, or NULL
+ */
+void* mt_descmap_remove(mt_descmap_t* map, const mt_desc_t* desc);
+
+/**
+ * Free the map, calling <b>free_val</b> on every value if it is not NULL
+ */
+void mt_descmap_free(mt_descmap_t* map, void (*free_val)(void*));
+
+int mt_descmap_size(const mt_descmap_t* map);
+int mt_descmap_isempty(const mt_descmap_t* map);
+
+mt_descmap_iter_t* mt_descmap_iter_init(mt_descmap_t* map);
+mt_descmap_iter_t* mt_descmap_iter_next(mt_descmap_t* map, mt_descmap_iter_t* iter);
+mt_descmap_iter_t* mt_descmap_iter_next_rmv(mt_descmap_t* map, mt_descmap_iter_t* iter);
+void mt_descmap_iter_get(mt_descmap_iter_t* iter, const mt_desc_t** keyp, void** valp);
+int mt_descmap_iter_done(mt_descmap_iter_t* iter);
+
+/**
+ * As DIGESTMAP_FOREACH, with <b>keyvar</b> a const mt_desc_t*
+ */
+#define MT_DESCMAP_FOREACH(map, keyvar, valtype, valvar)		\
+  MAP_FOREACH(mt_descmap_, map, const mt_desc_t*, keyvar, valtype, valvar)
+
+/**
+ * As DIGESTMAP_FOREACH_MODIFY, with <b>keyvar</b> a const mt_desc_t*
+ */
+#define MT_DESCMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)		\
+  MAP_FOREACH_MODIFY(mt_descmap_, map, const mt_desc_t*, keyvar, valtype, valvar)
+
+#define MT_DESCMAP_FOREACH_END MAP_FOREACH_END
+
+#endif
@@ -32,6 +32,19 @@
  * The code features a "re-entrancy" pattern whereby the same function is called
  * again and again via callbacks until the channel is in the right state to
  * complete the task.
+ *
+ * Channel state is split over MoneTorIntermediaryShards shards. Every incoming
+ * message is routed to the shard that owns the channel it refers to: macro
+ * channels by the descriptor of their end user and nanopayment channels by the
+ * digest of their public values. The routing key is read straight from the
+ * packed message without unpacking it. Each shard handles its messages one at a time
+ * in arrival order on the cpuworker threadpool, so separate shards make
+ * progress on separate cores. Wallet records are looked up from any shard and
+ * are guarded by the lock of the shard they hash to. Messages and signals
+ * produced by a handler are collected and released on the main thread in the
+ * order in which their triggering messages arrived from each descriptor.
+ * Handlers never read the global options; the few they need are copied into
+ * the job on the main thread.
  */
 
 #pragma GCC diagnostic ignored "-Wswitch-enum"
@@ -39,11 +52,24 @@
 
 #include "or.h"
 #include "config.h"
+#include "compat_threads.h"
 #include "workqueue.h"
 #include "cpuworker.h"
+#include "siphash.h"
 #include "mt_common.h"
 #include "mt_messagebuffer.h"
+#include "mt_descmap.h"
 #include "mt_ipay.h"
+#include "mt_stats.h"
+#include "trace/events.h"
+
+/** Most shards the intermediary splits its channels over */
+#define MT_IPAY_MAX_SHARDS 64
+
+/**
+ * Prototype for multi-thread function used to run a shard job
+ */
+typedef void (*work_task)(void*);
 
 /**
  * Hold function and arguments necessary to execute callbacks on a channel once
@@ -66,6 +92,111 @@ typedef struct {
   mt_callback_t callback;
 } mt_channel_t;
 
+/**
+ * Hold arguments needed to verify a zkp on the cpuworker threadpool and to
+ * resume the interrupted protocol once the result is known
+ */
+typedef struct {
+  mt_desc_t desc;
+  mt_ntype_t type;
+  byte pid[DIGEST_LEN];
+
+  byte pp[MT_SZ_PP];
+  mt_zkp_type_t zkp_type;
+  byte public[MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM];
+  int public_size;
+  byte zkp[MT_SZ_ZKP];
+  int verified;
+
+  union {
+    chn_end_estab1_t chn_end_estab1;
+    nan_cli_setup1_t nan_cli_setup1;
+    nan_rel_estab2_t nan_rel_estab2;
+    nan_end_close1_t nan_end_close1;
+  } token;
+} mt_zkp_args_t;
+
+/**
+ * Part of the channel state along with the messages waiting for it. Only the
+ * job that is currently running on the shard touches its maps, except for
+ * chn_states which any shard may read or write while holding <b>lock</b>.
+ */
+typedef struct {
+  int idx;
+
+  mt_descmap_t* chns_setup;      // edesc -> chn
+  mt_descmap_t* chns_estab;      // edesc -> chn
+  digestmap_t* chns_transition;  // proto_id -> chn
+  digestmap_t* nan_states;       // nan public digest -> nan_int_state_t*
+
+  tor_mutex_t* lock;
+  digestmap_t* chn_states;       // wallet digest -> chn_int_state_t*
+
+  // jobs waiting for the shard, whether one is running and whether the shard
+  // is waiting for a free cpuworker slot
+  smartlist_t* queue;
+  int busy;
+  int runnable;
+} mt_ipay_shard_t;
+
+/**
+ * Options read by the message handlers, copied when a message is received
+ */
+typedef struct {
+  int public_mint;
+  int acknowledge;
+} mt_ipay_opts_t;
+
+/**
+ * A message handled by a shard. Messages and signals produced while handling
+ * it are held in <b>outbox</b> until it is released on the main thread.
+ */
+typedef struct {
+  mt_desc_t desc;
+  mt_ntype_t type;
+  byte* msg;
+  int size;
+  byte pid[DIGEST_LEN];
+  int has_pid;
+  uint64_t seq;
+  mt_ipay_opts_t opts;
+  mt_ipay_shard_t* shard;
+  smartlist_t* outbox;
+  int result;
+} mt_ipay_job_t;
+
+/**
+ * Message or signal produced by a job
+ */
+typedef struct {
+  mt_desc_t desc;
+  int is_signal;
+  mt_signal_t signal;
+  mt_ntype_t type;
+  byte* msg;
+  int size;
+} mt_ipay_out_t;
+
+/**
+ * Jobs from one descriptor that have finished but must wait for an earlier
+ * job from the same descriptor before they are released
+ */
+typedef struct {
+  uint64_t next_seq;
+  uint64_t next_release;
+  smartlist_t* done;
+} mt_ipay_order_t;
+
+/**
+ * A protocol being timed for mt_stats, from the arrival of its first message
+ * to the release of the answer to its last
+ */
+typedef struct {
+  mt_stats_phase_t phase;
+  mt_desc_t peer;
+  uint64_t start;
+} mt_ipay_timing_t;
+
 /**
  * Single instance of an intermediary payment object
  */
@@ -84,13 +215,20 @@ typedef struct {
   int fee;
   int tax;
 
-  digestmap_t* chn_states;
-  digestmap_t* nan_states;
+  // guards the balances above once shards run on the cpuworker
+  tor_mutex_t* lock;
 
-  digestmap_t* chns_setup;       // digest(edesc) -> chn
-  digestmap_t* chns_estab;       // digest(edesc) -> chn
+  int num_shards;
+  mt_ipay_shard_t* shards;
 
-  digestmap_t* chns_transition;  // proto_id -> chn
+  // shard jobs handed to the cpuworker, how many of them verify a zkp, and
+  // shards waiting for a slot
+  int jobs_inflight;
+  int verifies_inflight;
+  smartlist_t* runnable;
+
+  mt_descmap_t* orders;          // desc -> mt_ipay_order_t*
+  digestmap_t* timings;          // pid -> mt_ipay_timing_t*
 
   // structure to run message buffering functionality
   mt_msgbuf_t* msgbuf;
@@ -116,12 +254,54 @@ static int handle_nan_end_close3(mt_desc_t* desc, nan_end_close3_t* token, byte
 static int handle_nan_end_close5(mt_desc_t* desc, nan_end_close5_t* token, byte (*pid)[DIGEST_LEN]);
 static int handle_nan_end_close7(mt_desc_t* desc, nan_end_close7_t* token, byte (*pid)[DIGEST_LEN]);
 
+// functions to resume protocols once a zkp has been verified
+static int finish_chn_end_estab1(mt_desc_t* desc, chn_end_estab1_t* token, byte (*pid)[DIGEST_LEN]);
+static int finish_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte (*pid)[DIGEST_LEN]);
+static int finish_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte (*pid)[DIGEST_LEN]);
+static int finish_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte (*pid)[DIGEST_LEN]);
+
+// functions to verify zkps
+static mt_zkp_args_t* new_zkp_args(mt_desc_t* desc, mt_ntype_t type, byte (*pid)[DIGEST_LEN],
+				   mt_zkp_type_t zkp_type, byte (*zkp)[MT_SZ_ZKP]);
+static int verify_zkp(mt_zkp_args_t* args);
+static int finish_zkp(mt_zkp_args_t* args);
+static workqueue_reply_t cpu_task_verify(void* thread, void* args);
+
+// functions to run messages on the shard that owns their channel
+static mt_ipay_shard_t* shard_by_digest(const byte* digest);
+static mt_ipay_shard_t* shard_by_desc(mt_desc_t* desc);
+static mt_ipay_shard_t* route(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size);
+static mt_ipay_shard_t* route_by_nan_public(mt_ntype_t type, byte* msg, int size, size_t offset);
+static int job_verifies_zkp(mt_ipay_job_t* job);
+static int job_can_start(mt_ipay_job_t* job);
+static const mt_ipay_opts_t* job_opts(void);
+static int schedule_shard(mt_ipay_shard_t* shard);
+static int dispatch_job(mt_ipay_job_t* job);
+static int help_job(void* args);
+static int finish_job(mt_ipay_job_t* job);
+static workqueue_reply_t cpu_task_job(void* thread, void* args);
+static int send_message(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size);
+static void start_timing(mt_ipay_job_t* job);
+static void finish_timing(mt_ipay_job_t* job);
+static void send_signal(mt_signal_t signal, mt_desc_t* desc);
+
+// functions to access wallet and nanopayment channel state of any shard
+static int wallet_used(byte (*digest)[DIGEST_LEN]);
+static int claim_wallet(byte (*digest)[DIGEST_LEN], nan_any_public_t* nan_public);
+static int wallet_nan_public(byte (*digest)[DIGEST_LEN], nan_any_public_t* nan_public_out);
+static int wallet_revoke(byte (*digest)[DIGEST_LEN], chn_end_revocation_t* revocation);
+static nan_int_state_t* nan_state_get(const byte* digest);
+
 // miscallaneous helper functions
 static int mt_ipay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size);
 static mt_channel_t* new_channel(byte (*chn_addr)[MT_SZ_ADDR]);
 
 static mt_ipay_t intermediary;
 
+// job running on the current thread, if any
+static tor_threadlocal_t current_job;
+static int current_job_initialized = 0;
+
 /**
  * Initialize the module; should only be called once. All necessary variables
  * will be loaded from the torrc configuration file.
@@ -144,7 +324,7 @@ int mt_ipay_init(void){
   tor_free(led_pk_temp);
 
   // setup crypto keys
-  mt_crypt_keygen(&intermediary.pp, &intermediary.pk, &intermediary.sk);
+  mt_crypt_keygen(&intermediary.pp, mt_crypt_key_type(), &intermediary.pk, &intermediary.sk);
   mt_pk2addr(&intermediary.pk, &intermediary.addr);
 
   // set ledger
@@ -159,12 +339,37 @@ int mt_ipay_init(void){
   intermediary.chn_bal = 0;
   intermediary.chn_number = 0;
 
-  // initialize channel containers
-  intermediary.chns_setup = digestmap_new();
-  intermediary.chns_estab = digestmap_new();
-  intermediary.chns_transition = digestmap_new();
-  intermediary.chn_states = digestmap_new();
-  intermediary.nan_states = digestmap_new();
+  intermediary.lock = tor_mutex_new();
+
+  // initialize channel containers, one set per shard
+  int num_shards = get_options()->MoneTorIntermediaryShards;
+  if(num_shards == 0)
+    num_shards = compute_num_cpus();
+  intermediary.num_shards = MAX(1, MIN(num_shards, MT_IPAY_MAX_SHARDS));
+  intermediary.shards = tor_calloc(intermediary.num_shards, sizeof(mt_ipay_shard_t));
+
+  for(int i = 0; i < intermediary.num_shards; i++){
+    mt_ipay_shard_t* shard = &intermediary.shards[i];
+    shard->idx = i;
+    shard->chns_setup = mt_descmap_new();
+    shard->chns_estab = mt_descmap_new();
+    shard->chns_transition = digestmap_new();
+    shard->nan_states = digestmap_new();
+    shard->lock = tor_mutex_new();
+    shard->chn_states = digestmap_new();
+    shard->queue = smartlist_new();
+  }
+
+  intermediary.jobs_inflight = 0;
+  intermediary.verifies_inflight = 0;
+  intermediary.runnable = smartlist_new();
+  intermediary.orders = mt_descmap_new();
+  intermediary.timings = digestmap_new();
+
+  if(!current_job_initialized){
+    tor_threadlocal_init(&current_job);
+    current_job_initialized = 1;
+  }
   return MT_SUCCESS;
 }
 
@@ -173,10 +378,34 @@ int mt_ipay_init(void){
  */
 int mt_ipay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
 
-  log_info(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
+  log_debug(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
 	   mt_party_describe(desc->party), desc->id[0], desc->id[1], mt_token_describe(type));
+  tor_trace(mt, recv_begin, MT_PARTY_INT, desc->id[0], desc->id[1], (int)desc->party,
+	    (int)type, size);
+
+  mt_ipay_job_t* job = tor_calloc(1, sizeof(mt_ipay_job_t));
+  job->desc = *desc;
+  job->type = type;
+  job->size = size;
+  job->msg = tor_memdup(msg, size);
+  job->outbox = smartlist_new();
+  job->shard = route(desc, type, msg, size);
+  job->has_pid = mt_token_peek_pid(type, msg, size, &job->pid) == MT_SUCCESS;
+  job->opts.public_mint = get_options()->MoneTorPublicMint;
+  job->opts.acknowledge = get_options()->MoneTorAcknowledge;
+
+  // number the job so that its output can be released in arrival order
+  mt_ipay_order_t* order = mt_descmap_get(intermediary.orders, desc);
+  if(!order){
+    order = tor_calloc(1, sizeof(mt_ipay_order_t));
+    order->done = smartlist_new();
+    mt_descmap_set(intermediary.orders, desc, order);
+  }
+  job->seq = order->next_seq++;
+  start_timing(job);
 
-  return mt_ipay_recv_helper(desc, type, msg, size);
+  smartlist_add(job->shard->queue, job);
+  return schedule_shard(job->shard);
 }
 
 static int mt_ipay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
@@ -298,21 +527,30 @@ static int mt_ipay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int
  * Return the balance of available money to spend as macropayments
  */
 int mt_ipay_mac_bal(void){
-  return intermediary.mac_bal;
+  tor_mutex_acquire(intermediary.lock);
+  int result = intermediary.mac_bal;
+  tor_mutex_release(intermediary.lock);
+  return result;
 }
 
 /**
  * Return the balance of money locked up in channels
  */
 int mt_ipay_chn_bal(void){
-  return intermediary.chn_bal;
+  tor_mutex_acquire(intermediary.lock);
+  int result = intermediary.chn_bal;
+  tor_mutex_release(intermediary.lock);
+  return result;
 }
 
 /**
  * Return the number of channels currently open
  */
 int mt_ipay_chn_number(void){
-  return intermediary.chn_number;
+  tor_mutex_acquire(intermediary.lock);
+  int result = intermediary.chn_number;
+  tor_mutex_release(intermediary.lock);
+  return result;
 }
 
 /**
@@ -323,10 +561,33 @@ int mt_ipay_set_status(mt_desc_t* desc, int status){
 }
 
 
+/**
+ * Drop held messages that have outlived MoneTorMsgBufTTL
+ */
+void mt_ipay_housekeeping(time_t now){
+  if(intermediary.msgbuf)
+    mt_messagebuffer_expire(intermediary.msgbuf, now);
+
+  // protocols that outlive their held messages are not coming back
+  if(!intermediary.timings)
+    return;
+  uint64_t now_usec = monotime_absolute_usec();
+  uint64_t ttl_usec = get_options()->MoneTorMsgBufTTL * 1000000ULL;
+  DIGESTMAP_FOREACH_MODIFY(intermediary.timings, pid, mt_ipay_timing_t*, timing){
+    if(now_usec - timing->start > ttl_usec){
+      mt_stats_note_failed(MT_STATS_INTERMEDIARY, timing->phase, &timing->peer, NULL);
+      tor_free(timing);
+      MAP_DEL_CURRENT(pid);
+    }
+  } DIGESTMAP_FOREACH_END;
+}
+
 /**
  * Delete the state of the payment module
  */
 int mt_ipay_clear(void){
+  mt_messagebuffer_free(intermediary.msgbuf);
+  intermediary.msgbuf = NULL;
   // Need to implement
   return MT_ERROR;
 }
@@ -361,8 +622,10 @@ static int init_chn_int_setup(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
   memcpy(&token.chn_public, &chn->data.public, sizeof(chn_int_public_t));
 
   // update local data;
-  intermediary.mac_bal -= get_options()->MoneTorPublicMint ? 0 : token.val_from;
+  tor_mutex_acquire(intermediary.lock);
+  intermediary.mac_bal -= job_opts()->public_mint ? 0 : token.val_from;
   intermediary.chn_bal += token.val_to;
+  tor_mutex_release(intermediary.lock);
 
   // send setup message
   byte* msg;
@@ -370,8 +633,8 @@ static int init_chn_int_setup(mt_channel_t* chn, byte (*pid)[DIGEST_LEN]){
   int msg_size = pack_chn_int_setup(&token, pid, &msg);
   int signed_msg_size = mt_create_signed_msg(msg, msg_size,
 					     &intermediary.pk, &intermediary.sk, &signed_msg);
-  int result = mt_buffer_message(intermediary.msgbuf, &intermediary.led_desc, MT_NTYPE_CHN_INT_SETUP,
-				 signed_msg, signed_msg_size);
+  int result = send_message(&intermediary.led_desc, MT_NTYPE_CHN_INT_SETUP,
+			    signed_msg, signed_msg_size);
   tor_free(msg);
   tor_free(signed_msg);
   return result;
@@ -391,7 +654,8 @@ static int handle_any_led_confirm(mt_desc_t* desc, any_led_confirm_t* token, byt
   }
 
   // if this is confirmation of mac_any_trans call then ignore and return success
-  mt_channel_t* chn = digestmap_get(intermediary.chns_transition, (char*)*pid);
+  mt_ipay_shard_t* shard = shard_by_digest(*pid);
+  mt_channel_t* chn = digestmap_get(shard->chns_transition, (char*)*pid);
   if(chn == NULL){
     log_warn(LD_MT, "protocol id not recognized");
     return MT_ERROR;
@@ -402,14 +666,24 @@ static int handle_any_led_confirm(mt_desc_t* desc, any_led_confirm_t* token, byt
     return MT_ERROR;
   }
 
+  // verify receipt to make sure the ledger recorded the channel we set up
+  if(mt_receipt_verify(&token->receipt, &intermediary.led_pk) != MT_SUCCESS ||
+     token->receipt.type != MT_NTYPE_CHN_INT_SETUP ||
+     token->receipt.val != chn->data.public.int_bal ||
+     memcmp(token->receipt.from, intermediary.addr, MT_SZ_ADDR) != 0 ||
+     memcmp(token->receipt.to, chn->data.public.addr, MT_SZ_ADDR) != 0){
+    log_warn(LD_MT, "MoneTor: receipt did not verify");
+    return MT_ERROR;
+  }
+
+  tor_mutex_acquire(intermediary.lock);
   intermediary.chn_number++;
+  tor_mutex_release(intermediary.lock);
   memcpy(&chn->data.wallet.receipt, &token->receipt, sizeof(any_led_receipt_t));
 
   // move channel to chns_setup
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(&chn->edesc, &digest);
-  digestmap_remove(intermediary.chns_transition, (char*)*pid);
-  digestmap_set(intermediary.chns_setup, (char*)digest, chn);
+  digestmap_remove(shard->chns_transition, (char*)*pid);
+  mt_descmap_set(shard->chns_setup, &chn->edesc, chn);
 
   if(chn->callback.fn){
     mt_callback_t cb = chn->callback;
@@ -426,13 +700,12 @@ static int handle_chn_end_estab1(mt_desc_t* desc, chn_end_estab1_t* token, byte
 
   // setup chn
   mt_channel_t* chn;
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
+  mt_ipay_shard_t* shard = shard_by_desc(desc);
 
   // if existing channel is setup with this address then start establish protocol
-  if((chn = digestmap_remove(intermediary.chns_setup, (char*)digest))){
+  if((chn = mt_descmap_remove(shard->chns_setup, desc))){
 
-    digestmap_set(intermediary.chns_transition, (char*)pid, chn);
+    digestmap_set(shard->chns_transition, (char*)pid, chn);
     chn->callback.fn = NULL;
 
     chn_int_estab2_t reply;
@@ -445,46 +718,64 @@ static int handle_chn_end_estab1(mt_desc_t* desc, chn_end_estab1_t* token, byte
     // send reply token
     byte* msg;
     int msg_size = pack_chn_int_estab2(&reply, pid, &msg);
-    int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_CHN_INT_ESTAB2, msg, msg_size);
+    int result = send_message(desc, MT_NTYPE_CHN_INT_ESTAB2, msg, msg_size);
     tor_free(msg);
     return result;
   }
 
-  // setup new channel at requested address
-  if((intermediary.mac_bal >= intermediary.fee) || get_options()->MoneTorPublicMint){
+  // setup new channel at requested address once the zkp has been verified
+  if((mt_ipay_mac_bal() >= intermediary.fee) || job_opts()->public_mint){
 
-    int public_size = sizeof(int) + MT_SZ_COM;
-    byte public[public_size];
-    memcpy(public, &token->end_bal, sizeof(int));
-    memcpy(public + sizeof(int), token->wcom, MT_SZ_COM);
+    mt_zkp_args_t* args = new_zkp_args(desc, MT_NTYPE_CHN_END_ESTAB1, pid, MT_ZKP_TYPE_1, &token->zkp);
+    args->public_size = sizeof(int) + MT_SZ_COM;
+    memcpy(args->public, &token->end_bal, sizeof(int));
+    memcpy(args->public + sizeof(int), token->wcom, MT_SZ_COM);
+    args->token.chn_end_estab1 = *token;
+    return verify_zkp(args);
+  }
 
-    if(mt_zkp_verify(MT_ZKP_TYPE_1, &intermediary.pp, public, public_size, &token->zkp) != MT_SUCCESS){
-      log_warn(LD_MT, "MoneTor: zkp did not verify");
-      return MT_ERROR;
-    }
+  log_warn(LD_MT, "insufficient funds to start channel\n");
+  return MT_ERROR;
+}
 
-    byte ipid[DIGEST_LEN];
-    mt_crypt_rand(DIGEST_LEN, ipid);
+static int finish_chn_end_estab1(mt_desc_t* desc, chn_end_estab1_t* token, byte (*pid)[DIGEST_LEN]){
 
-    chn = new_channel(&token->addr);
-    chn->edesc = *desc;
-    chn->data.public.end_bal = token->end_bal;
-    chn->data.public.int_bal = token->int_bal;
-    // save wcom
-    chn->callback = (mt_callback_t){.fn = mt_ipay_recv_helper, .dref1 = *desc,
-				    .arg2 = MT_NTYPE_CHN_END_ESTAB1};
-    chn->callback.arg4 = pack_chn_end_estab1(token, pid, &chn->callback.arg3);
-    digestmap_set(intermediary.chns_transition, (char*)ipid, chn);
-    return init_chn_int_setup(chn, &ipid);
+  // funds may have been spent while the zkp was being verified
+  if((mt_ipay_mac_bal() < intermediary.fee) && !job_opts()->public_mint){
+    log_warn(LD_MT, "insufficient funds to start channel\n");
+    return MT_ERROR;
   }
 
-  log_warn(LD_MT, "insufficient funds to start channel\n");
-  return MT_ERROR;
+  // repack the request so it can be replayed once the channel is set up
+  byte* estab1_msg;
+  int estab1_size = pack_chn_end_estab1(token, pid, &estab1_msg);
+  if(estab1_size < 0)
+    return MT_ERROR;
+
+  // the ledger confirmation is routed by protocol id so pick one that lands on
+  // the shard of this channel
+  mt_ipay_shard_t* shard = shard_by_desc(desc);
+  byte ipid[DIGEST_LEN];
+  mt_crypt_rand(DIGEST_LEN, ipid);
+  uint32_t span = UINT32_MAX / intermediary.num_shards;
+  set_uint32(ipid, shard->idx + intermediary.num_shards * (get_uint32(ipid) % span));
+
+  mt_channel_t* chn = new_channel(&token->addr);
+  chn->edesc = *desc;
+  chn->data.public.end_bal = token->end_bal;
+  chn->data.public.int_bal = token->int_bal;
+  // save wcom
+  chn->callback = (mt_callback_t){.fn = mt_ipay_recv_helper, .dref1 = *desc,
+				  .arg2 = MT_NTYPE_CHN_END_ESTAB1, .arg3 = estab1_msg,
+				  .arg4 = estab1_size};
+  digestmap_set(shard->chns_transition, (char*)ipid, chn);
+  return init_chn_int_setup(chn, &ipid);
 }
 
 static int handle_chn_end_estab3(mt_desc_t* desc, chn_end_estab3_t* token, byte (*pid)[DIGEST_LEN]){
 
-  mt_channel_t* chn = digestmap_get(intermediary.chns_transition, (char*)*pid);
+  mt_ipay_shard_t* shard = shard_by_desc(desc);
+  mt_channel_t* chn = digestmap_get(shard->chns_transition, (char*)*pid);
   if(chn == NULL){
     log_warn(LD_MT, "protocol id not recognized");
     return MT_ERROR;
@@ -492,10 +783,8 @@ static int handle_chn_end_estab3(mt_desc_t* desc, chn_end_estab3_t* token, byte
 
   // verify wcom == wcom
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
-  digestmap_remove(intermediary.chns_transition, (char*)*pid);
-  digestmap_set(intermediary.chns_estab, (char*)digest, chn);
+  digestmap_remove(shard->chns_transition, (char*)*pid);
+  mt_descmap_set(shard->chns_estab, desc, chn);
 
   // fill out token
   chn_int_estab4_t reply;
@@ -507,7 +796,7 @@ static int handle_chn_end_estab3(mt_desc_t* desc, chn_end_estab3_t* token, byte
 
   byte* msg;
   int msg_size = pack_chn_int_estab4(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_CHN_INT_ESTAB4, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_CHN_INT_ESTAB4, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -520,7 +809,7 @@ static int handle_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte
   byte wpk_digest[DIGEST_LEN];
   mt_bytes2digest(token->wpk, MT_SZ_PK, &wpk_digest);
 
-  if(digestmap_get(intermediary.chn_states, (char*)wpk_digest)){
+  if(wallet_used(&wpk_digest)){
     log_warn(LD_MT, "MoneTor: wallet has already been used");
     return MT_ERROR;
   }
@@ -538,17 +827,21 @@ static int handle_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte
 
   // public zkp parameters
   int cli_val = -token->nan_public.val_from;
-  int public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
-  byte public[public_size];
-  memcpy(public, intermediary.pk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK, &cli_val, sizeof(int));
-  memcpy(public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom, MT_SZ_COM);
-
-  if(mt_zkp_verify(MT_ZKP_TYPE_2, &intermediary.pp, public, public_size, &token->zkp) != MT_SUCCESS){
-    log_warn(LD_MT, "MoneTor: zkp did not verify");
-    return MT_ERROR;
-  }
+  mt_zkp_args_t* args = new_zkp_args(desc, MT_NTYPE_NAN_CLI_SETUP1, pid, MT_ZKP_TYPE_2, &token->zkp);
+  args->public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
+  memcpy(args->public, intermediary.pk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK, &cli_val, sizeof(int));
+  memcpy(args->public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom, MT_SZ_COM);
+  args->token.nan_cli_setup1 = *token;
+  return verify_zkp(args);
+}
+
+static int finish_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte (*pid)[DIGEST_LEN]){
+
+  // the wallet may have been claimed while the zkp was being verified
+  byte wpk_digest[DIGEST_LEN];
+  mt_bytes2digest(token->wpk, MT_SZ_PK, &wpk_digest);
 
   byte wpk_nan_digest[DIGEST_LEN];
   mt_bytes2digest(token->wpk_nan, MT_SZ_PK, &wpk_nan_digest);
@@ -557,17 +850,16 @@ static int handle_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte
   mt_nanpub2digest(&token->nan_public, &nan_digest);
 
   // update local intermediary state
-  chn_int_state_t* chn_state = tor_calloc(1, sizeof(chn_int_state_t));
-  chn_state->nan_public = token->nan_public;
-  digestmap_set(intermediary.chn_states, (char*)wpk_digest, chn_state);
-
-  chn_int_state_t* nchn_state = tor_calloc(1, sizeof(chn_int_state_t));
-  digestmap_set(intermediary.chn_states, (char*)wpk_nan_digest, nchn_state);
+  if(claim_wallet(&wpk_digest, &token->nan_public) != MT_SUCCESS){
+    log_warn(LD_MT, "MoneTor: wallet has already been used");
+    return MT_ERROR;
+  }
+  claim_wallet(&wpk_nan_digest, NULL);
 
   nan_int_state_t* nan_state = tor_calloc(1, sizeof(nan_int_state_t));
   memcpy(nan_state->wcom, token->wcom, MT_SZ_COM);
   memcpy(&nan_state->nan_public, &token->nan_public, sizeof(token->nan_public));
-  digestmap_set(intermediary.nan_states, (char*)nan_digest, nan_state);
+  digestmap_set(shard_by_digest(nan_digest)->nan_states, (char*)nan_digest, nan_state);
 
   // create and send reply token
   nan_int_setup2_t reply;
@@ -575,7 +867,7 @@ static int handle_nan_cli_setup1(mt_desc_t* desc, nan_cli_setup1_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_setup2(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_SETUP2, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_SETUP2, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -588,8 +880,7 @@ static int handle_nan_cli_setup3(mt_desc_t* desc, nan_cli_setup3_t* token, byte
     return MT_ERROR;
   }
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states,
-					 (char*)(token->refund_msg + sizeof(byte)));
+  nan_int_state_t* nan_state = nan_state_get((token->refund_msg + sizeof(byte)));
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -612,7 +903,7 @@ static int handle_nan_cli_setup3(mt_desc_t* desc, nan_cli_setup3_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_setup4(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_SETUP4, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_SETUP4, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -624,8 +915,8 @@ static int handle_nan_cli_setup5(mt_desc_t* desc, nan_cli_setup5_t* token, byte
   byte wpk_digest[DIGEST_LEN];
   mt_bytes2digest(token->revocation.msg + sizeof(byte), MT_SZ_PK, &wpk_digest);
 
-  chn_int_state_t* chn_state = digestmap_get(intermediary.chn_states, (char*)wpk_digest);
-  if(!chn_state){
+  nan_any_public_t nan_public;
+  if(wallet_nan_public(&wpk_digest, &nan_public) != MT_SUCCESS){
     log_warn(LD_MT, "micropayment channel not recognized");
     return MT_ERROR;
   }
@@ -638,14 +929,14 @@ static int handle_nan_cli_setup5(mt_desc_t* desc, nan_cli_setup5_t* token, byte
 
   // update local data
   byte nan_digest[DIGEST_LEN];
-  mt_nanpub2digest(&chn_state->nan_public, &nan_digest);
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)nan_digest);
+  mt_nanpub2digest(&nan_public, &nan_digest);
+  nan_int_state_t* nan_state = nan_state_get(nan_digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
   }
 
-  chn_state->revocation = token->revocation;
+  wallet_revoke(&wpk_digest, &token->revocation);
   nan_state->status = MT_CODE_READY;
 
   // create and fill out token
@@ -654,7 +945,7 @@ static int handle_nan_cli_setup5(mt_desc_t* desc, nan_cli_setup5_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_setup6(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_SETUP6, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_SETUP6, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -667,7 +958,7 @@ static int handle_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte
   byte wpk_digest[DIGEST_LEN];
   mt_bytes2digest(token->wpk, MT_SZ_PK, &wpk_digest);
 
-  if(digestmap_get(intermediary.chn_states, (char*)wpk_digest)){
+  if(wallet_used(&wpk_digest)){
     log_warn(LD_MT, "MoneTor: wallet has already been used");
     return MT_ERROR;
   }
@@ -675,7 +966,7 @@ static int handle_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte
   // make sure nanopayment channel was already initialized by the client
   byte nan_digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &nan_digest);
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)nan_digest);
+  nan_int_state_t* nan_state = nan_state_get(nan_digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -689,25 +980,44 @@ static int handle_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte
 
   // public zkp parameters
   int rel_val = token->nan_public.val_to;
-  int public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
-  byte public[public_size];
-  memcpy(public, intermediary.pk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK, &rel_val, sizeof(int));
-  memcpy(public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom, MT_SZ_COM);
-  if(mt_zkp_verify(MT_ZKP_TYPE_2, &intermediary.pp, public, public_size, &token->zkp) != MT_SUCCESS){
-    log_warn(LD_MT, "MoneTor: zkp did not verify");
+  mt_zkp_args_t* args = new_zkp_args(desc, MT_NTYPE_NAN_REL_ESTAB2, pid, MT_ZKP_TYPE_2, &token->zkp);
+  args->public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
+  memcpy(args->public, intermediary.pk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK, &rel_val, sizeof(int));
+  memcpy(args->public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom, MT_SZ_COM);
+  args->token.nan_rel_estab2 = *token;
+  return verify_zkp(args);
+}
+
+static int finish_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte (*pid)[DIGEST_LEN]){
+
+  // wallet and channel state may have changed while the zkp was being verified
+  byte wpk_digest[DIGEST_LEN];
+  mt_bytes2digest(token->wpk, MT_SZ_PK, &wpk_digest);
+
+  if(wallet_used(&wpk_digest)){
+    log_warn(LD_MT, "MoneTor: wallet has already been used");
+    return MT_ERROR;
+  }
+
+  byte nan_digest[DIGEST_LEN];
+  mt_nanpub2digest(&token->nan_public, &nan_digest);
+  nan_int_state_t* nan_state = nan_state_get(nan_digest);
+  if(!nan_state || nan_state->status != MT_CODE_READY){
+    log_warn(LD_MT, "nanopayment channel is not accepting connections");
     return MT_ERROR;
   }
+
   byte wpk_nan_digest[DIGEST_LEN];
   mt_bytes2digest(token->wpk_nan, MT_SZ_PK, &wpk_nan_digest);
 
   // update local intermediary state
-  chn_int_state_t* chn_state = tor_calloc(1, sizeof(chn_int_state_t));
-  digestmap_set(intermediary.chn_states, (char*)wpk_digest, chn_state);
-
-  chn_int_state_t* nchn_state = tor_calloc(1, sizeof(chn_int_state_t));
-  digestmap_set(intermediary.chn_states, (char*)wpk_nan_digest, nchn_state);
+  if(claim_wallet(&wpk_digest, NULL) != MT_SUCCESS){
+    log_warn(LD_MT, "MoneTor: wallet has already been used");
+    return MT_ERROR;
+  }
+  claim_wallet(&wpk_nan_digest, NULL);
 
   memcpy(nan_state->wcom, token->wcom, MT_SZ_COM);
 
@@ -717,7 +1027,7 @@ static int handle_nan_rel_estab2(mt_desc_t* desc, nan_rel_estab2_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_estab3(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_ESTAB3, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_ESTAB3, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -731,8 +1041,7 @@ static int handle_nan_rel_estab4(mt_desc_t* desc, nan_rel_estab4_t* token, byte
     return MT_ERROR;
   }
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states,
-					 (char*)(token->refund_msg + sizeof(byte)));
+  nan_int_state_t* nan_state = nan_state_get((token->refund_msg + sizeof(byte)));
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -751,7 +1060,7 @@ static int handle_nan_rel_estab4(mt_desc_t* desc, nan_rel_estab4_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_estab5(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_ESTAB5, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_ESTAB5, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -765,7 +1074,7 @@ static int handle_nan_cli_destab1(mt_desc_t* desc, nan_cli_destab1_t* token, byt
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)digest);
+  nan_int_state_t* nan_state = nan_state_get(digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -788,7 +1097,7 @@ static int handle_nan_cli_destab1(mt_desc_t* desc, nan_cli_destab1_t* token, byt
 
   byte* msg;
   int msg_size = pack_nan_int_destab2(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_DESTAB2, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_DESTAB2, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -800,39 +1109,49 @@ static int handle_nan_cli_dpay1(mt_desc_t* desc, nan_cli_dpay1_t* token, byte (*
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)digest);
+  nan_int_state_t* nan_state = nan_state_get(digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
   }
 
-  // if the payment number > 0 then need to check hashes
+  // a payment may cover several units as long as the channel has room for them
+  int units = token->num_units;
+  if(units < 1 || units > nan_state->nan_public.num_payments - nan_state->end_state.num_payments){
+    log_warn(LD_MT, "MoneTor: bad number of payment units %d", units);
+    return MT_ERROR;
+  }
+
+  // the preimage sits units steps behind the last one (units - 1 behind the tail)
   if(nan_state->end_state.num_payments &&
-     mt_hc_verify(&nan_state->end_state.last_hash, &token->preimage, 1)){
+     mt_hc_verify(&nan_state->end_state.last_hash, &token->preimage, units)){
     log_warn(LD_MT, "MoneTor: preimage did not verify (not first payment)");
     return MT_ERROR;
   }
   else if(!nan_state->end_state.num_payments &&
-	  memcmp(token->preimage, token->nan_public.hash_tail, MT_SZ_HASH) != 0){
+	  mt_hc_verify(&token->nan_public.hash_tail, &token->preimage, units - 1)){
     log_warn(LD_MT, "MoneTor: preimage did not verify (first payment)");
     return MT_ERROR;
   }
 
   // update local information
-  intermediary.chn_bal += token->nan_public.val_from;
-  nan_state->end_state.num_payments ++;
+  tor_mutex_acquire(intermediary.lock);
+  intermediary.chn_bal += units * token->nan_public.val_from;
+  tor_mutex_release(intermediary.lock);
+  nan_state->end_state.num_payments += units;
   memcpy(nan_state->end_state.last_hash, token->preimage, MT_SZ_HASH);
 
   nan_int_dpay2_t reply;
   reply.success = MT_CODE_SUCCESS;
 
-  //mt_alert_payment(desc);
-  mt_paymod_signal(MT_SIGNAL_PAYMENT_RECEIVED, desc);
+  // the controller credits one payment rate per signal
+  for(int i = 0; i < units; i++)
+    send_signal(MT_SIGNAL_PAYMENT_RECEIVED, desc);
 
-  if(get_options()->MoneTorAcknowledge){
+  if(job_opts()->acknowledge){
     byte* msg;
     int msg_size = pack_nan_int_dpay2(&reply, pid, &msg);
-    int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_DPAY2, msg, msg_size);
+    int result = send_message(desc, MT_NTYPE_NAN_INT_DPAY2, msg, msg_size);
     tor_free(msg);
     return result;
   }
@@ -847,7 +1166,7 @@ static int handle_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)digest);
+  nan_int_state_t* nan_state = nan_state_get(digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -862,20 +1181,6 @@ static int handle_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte
     return MT_ERROR;
   }
 
-  // public zkp parameters
-  int val = token->total_val > 0 ? -token->nan_public.val_from : token->nan_public.val_to;
-  int public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
-  byte public[public_size];
-  memcpy(public, intermediary.pk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK, &val, sizeof(int));
-  memcpy(public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
-  memcpy(public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom_new, MT_SZ_COM);
-
-  if(mt_zkp_verify(MT_ZKP_TYPE_2, &intermediary.pp, public, public_size, &token->zkp_new) != MT_SUCCESS){
-    log_warn(LD_MT, "MoneTor: zkp did not verify");
-    return MT_ERROR;
-  }
-
   // verify hash chain
   if(token->num_payments && mt_hc_verify(&token->nan_public.hash_tail, &token->preimage,
 		  token->num_payments - 1) != MT_SUCCESS){
@@ -883,11 +1188,41 @@ static int handle_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte
     return MT_ERROR;
   }
 
-  // update local data
+  // public zkp parameters
+  int val = token->total_val > 0 ? -token->nan_public.val_from : token->nan_public.val_to;
+  mt_zkp_args_t* args = new_zkp_args(desc, MT_NTYPE_NAN_END_CLOSE1, pid, MT_ZKP_TYPE_2, &token->zkp_new);
+  args->public_size = MT_SZ_PK + sizeof(int) + MT_SZ_PK + MT_SZ_COM;
+  memcpy(args->public, intermediary.pk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK, &val, sizeof(int));
+  memcpy(args->public + MT_SZ_PK + sizeof(int), token->wpk, MT_SZ_PK);
+  memcpy(args->public + MT_SZ_PK + sizeof(int) + MT_SZ_PK, token->wcom_new, MT_SZ_COM);
+  args->token.nan_end_close1 = *token;
+  return verify_zkp(args);
+}
+
+static int finish_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte (*pid)[DIGEST_LEN]){
+
+  // channel state may have changed while the zkp was being verified
+  byte digest[DIGEST_LEN];
+  mt_nanpub2digest(&token->nan_public, &digest);
+
+  nan_int_state_t* nan_state = nan_state_get(digest);
+  if(!nan_state){
+    log_warn(LD_MT, "nanopayment channel not recognized");
+    return MT_ERROR;
+  }
+
+  if(nan_state->status != MT_CODE_DESTABLISHED &&
+     token->total_val > 0 && nan_state->status != MT_CODE_CLOSED){
+    log_warn(LD_MT, "client attempting to close channel before relay");
+    return MT_ERROR;
+  }
 
   // if channel was NOT a direct payment then update balance
   if(nan_state->status != MT_CODE_DESTABLISHED){
+    tor_mutex_acquire(intermediary.lock);
     intermediary.chn_bal += token->total_val;
+    tor_mutex_release(intermediary.lock);
   }
 
   // update local information
@@ -899,7 +1234,7 @@ static int handle_nan_end_close1(mt_desc_t* desc, nan_end_close1_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_close2(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_CLOSE2, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_CLOSE2, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -909,7 +1244,7 @@ static int handle_nan_end_close3(mt_desc_t* desc, nan_end_close3_t* token, byte
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)digest);
+  nan_int_state_t* nan_state = nan_state_get(digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -930,7 +1265,7 @@ static int handle_nan_end_close3(mt_desc_t* desc, nan_end_close3_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_close4(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_CLOSE4, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_CLOSE4, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -948,15 +1283,17 @@ static int handle_nan_end_close5(mt_desc_t* desc, nan_end_close5_t* token, byte
   // update local channel information
   byte wpk_nan_digest[DIGEST_LEN];
   mt_bytes2digest(token->wpk_nan, MT_SZ_PK, &wpk_nan_digest);
-  chn_int_state_t* chn_state = digestmap_get(intermediary.chn_states, (char*)wpk_nan_digest);
-  memcpy(&chn_state->revocation, &token->revocation, sizeof(chn_state->revocation));
+  if(wallet_revoke(&wpk_nan_digest, &token->revocation) != MT_SUCCESS){
+    log_warn(LD_MT, "micropayment channel not recognized");
+    return MT_ERROR;
+  }
 
   nan_int_close6_t reply;
   reply.verified = MT_CODE_VERIFIED;
 
   byte* msg;
   int msg_size = pack_nan_int_close6(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_CLOSE6, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_CLOSE6, msg, msg_size);
   tor_free(msg);
   return result;
 }
@@ -966,7 +1303,7 @@ static int handle_nan_end_close7(mt_desc_t* desc, nan_end_close7_t* token, byte
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  nan_int_state_t* nan_state = digestmap_get(intermediary.nan_states, (char*)digest);
+  nan_int_state_t* nan_state = nan_state_get(digest);
   if(!nan_state){
     log_warn(LD_MT, "nanopayment channel not recognized");
     return MT_ERROR;
@@ -983,13 +1320,83 @@ static int handle_nan_end_close7(mt_desc_t* desc, nan_end_close7_t* token, byte
 
   byte* msg;
   int msg_size = pack_nan_int_close8(&reply, pid, &msg);
-  int result = mt_buffer_message(intermediary.msgbuf, desc, MT_NTYPE_NAN_INT_CLOSE8, msg, msg_size);
+  int result = send_message(desc, MT_NTYPE_NAN_INT_CLOSE8, msg, msg_size);
   tor_free(msg);
   return result;
 }
 
 /*************************** Helper Functions ***************************/
 
+/**
+ * Allocate the arguments for a zkp verification; the caller fills out the
+ * public inputs and the token needed to resume the protocol
+ */
+static mt_zkp_args_t* new_zkp_args(mt_desc_t* desc, mt_ntype_t type, byte (*pid)[DIGEST_LEN],
+				   mt_zkp_type_t zkp_type, byte (*zkp)[MT_SZ_ZKP]){
+
+  mt_zkp_args_t* args = tor_calloc(1, sizeof(mt_zkp_args_t));
+  args->desc = *desc;
+  args->type = type;
+  memcpy(args->pid, *pid, DIGEST_LEN);
+  memcpy(args->pp, intermediary.pp, MT_SZ_PP);
+  args->zkp_type = zkp_type;
+  memcpy(args->zkp, *zkp, MT_SZ_ZKP);
+  return args;
+}
+
+/**
+ * Verify the zkp described by <b>args</b> and then resume the protocol. This
+ * runs within a shard job, which is already off the main thread unless
+ * MoneTorSingleThread is set.
+ */
+static int verify_zkp(mt_zkp_args_t* args){
+  cpu_task_verify(NULL, args);
+  return finish_zkp(args);
+}
+
+/**
+ * Resume the protocol that was interrupted to verify a zkp; frees <b>args</b>
+ */
+static int finish_zkp(mt_zkp_args_t* args){
+
+  int result;
+
+  if(!args->verified){
+    log_warn(LD_MT, "MoneTor: zkp did not verify");
+    tor_free(args);
+    return MT_ERROR;
+  }
+
+  switch(args->type){
+    case MT_NTYPE_CHN_END_ESTAB1:
+      result = finish_chn_end_estab1(&args->desc, &args->token.chn_end_estab1, &args->pid);
+      break;
+    case MT_NTYPE_NAN_CLI_SETUP1:
+      result = finish_nan_cli_setup1(&args->desc, &args->token.nan_cli_setup1, &args->pid);
+      break;
+    case MT_NTYPE_NAN_REL_ESTAB2:
+      result = finish_nan_rel_estab2(&args->desc, &args->token.nan_rel_estab2, &args->pid);
+      break;
+    case MT_NTYPE_NAN_END_CLOSE1:
+      result = finish_nan_end_close1(&args->desc, &args->token.nan_end_close1, &args->pid);
+      break;
+    default:
+      result = MT_ERROR;
+  }
+
+  tor_free(args);
+  return result;
+}
+
+static workqueue_reply_t cpu_task_verify(void* thread, void* args){
+  (void)thread;
+
+  mt_zkp_args_t* zkp_args = (mt_zkp_args_t*)args;
+  zkp_args->verified = mt_zkp_verify(zkp_args->zkp_type, &zkp_args->pp, zkp_args->public,
+				     zkp_args->public_size, &zkp_args->zkp) == MT_SUCCESS;
+  return WQ_RPL_REPLY;
+}
+
 static mt_channel_t* new_channel(byte (*chn_addr)[MT_SZ_ADDR]){
 
   mt_channel_t* chn = tor_malloc(sizeof(mt_channel_t));
@@ -1004,3 +1411,472 @@ static mt_channel_t* new_channel(byte (*chn_addr)[MT_SZ_ADDR]){
   memcpy(chn->data.public.addr, *chn_addr, MT_SZ_ADDR);
   return chn;
 }
+
+/***************************** Shard Engine *****************************/
+
+static mt_ipay_shard_t* shard_by_digest(const byte* digest){
+  return &intermediary.shards[get_uint32(digest) % intermediary.num_shards];
+}
+
+static mt_ipay_shard_t* shard_by_desc(mt_desc_t* desc){
+  return &intermediary.shards[siphash24g(desc->id, sizeof(desc->id)) % intermediary.num_shards];
+}
+
+/**
+ * Return the shard that owns the nanopayment channel whose public values sit
+ * at <b>offset</b> of the token packed in <b>msg</b>
+ */
+static mt_ipay_shard_t* route_by_nan_public(mt_ntype_t type, byte* msg, int size, size_t offset){
+  nan_any_public_t nan_public;
+  byte digest[DIGEST_LEN];
+
+  if(mt_token_peek(type, msg, size, offset, sizeof(nan_public), &nan_public) != MT_SUCCESS)
+    return &intermediary.shards[0];
+  mt_nanpub2digest(&nan_public, &digest);
+  return shard_by_digest(digest);
+}
+
+/**
+ * Return the shard that owns the channel a message refers to. Only the field
+ * holding the routing key is read from the packed message; messages that are
+ * malformed go to the first shard, whose handler rejects them.
+ */
+static mt_ipay_shard_t* route(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
+
+  byte pid[DIGEST_LEN];
+  byte digest[DIGEST_LEN];
+  byte pk[MT_SZ_PK];
+
+  switch(type){
+    case MT_NTYPE_ANY_LED_CONFIRM:
+      if(mt_token_peek_pid(type, msg, size, &pid) != MT_SUCCESS)
+	break;
+      return shard_by_digest(pid);
+
+    case MT_NTYPE_CHN_END_ESTAB1:
+    case MT_NTYPE_CHN_END_ESTAB3:
+      return shard_by_desc(desc);
+
+    case MT_NTYPE_NAN_CLI_SETUP1:
+      return route_by_nan_public(type, msg, size, offsetof(nan_cli_setup1_t, nan_public));
+    case MT_NTYPE_NAN_REL_ESTAB2:
+      return route_by_nan_public(type, msg, size, offsetof(nan_rel_estab2_t, nan_public));
+    case MT_NTYPE_NAN_CLI_DESTAB1:
+      return route_by_nan_public(type, msg, size, offsetof(nan_cli_destab1_t, nan_public));
+    case MT_NTYPE_NAN_CLI_DPAY1:
+      return route_by_nan_public(type, msg, size, offsetof(nan_cli_dpay1_t, nan_public));
+    case MT_NTYPE_NAN_END_CLOSE1:
+      return route_by_nan_public(type, msg, size, offsetof(nan_end_close1_t, nan_public));
+    case MT_NTYPE_NAN_END_CLOSE3:
+      return route_by_nan_public(type, msg, size, offsetof(nan_end_close3_t, nan_public));
+    case MT_NTYPE_NAN_END_CLOSE7:
+      return route_by_nan_public(type, msg, size, offsetof(nan_end_close7_t, nan_public));
+
+    case MT_NTYPE_NAN_CLI_SETUP3:
+      if(mt_token_peek(type, msg, size, offsetof(nan_cli_setup3_t, refund_msg) + sizeof(byte),
+		       DIGEST_LEN, digest) != MT_SUCCESS)
+	break;
+      return shard_by_digest(digest);
+
+    case MT_NTYPE_NAN_REL_ESTAB4:
+      if(mt_token_peek(type, msg, size, offsetof(nan_rel_estab4_t, refund_msg) + sizeof(byte),
+		       DIGEST_LEN, digest) != MT_SUCCESS)
+	break;
+      return shard_by_digest(digest);
+
+    case MT_NTYPE_NAN_CLI_SETUP5:;
+      nan_any_public_t nan_public;
+      if(mt_token_peek(type, msg, size, offsetof(nan_cli_setup5_t, revocation) +
+		       offsetof(chn_end_revocation_t, msg) + sizeof(byte), MT_SZ_PK, pk) != MT_SUCCESS)
+	break;
+      mt_bytes2digest(pk, MT_SZ_PK, &digest);
+      if(wallet_nan_public(&digest, &nan_public) != MT_SUCCESS)
+	break;
+      mt_nanpub2digest(&nan_public, &digest);
+      return shard_by_digest(digest);
+
+    case MT_NTYPE_NAN_END_CLOSE5:
+      // only touches the wallet record, which any shard can reach
+      if(mt_token_peek(type, msg, size, offsetof(nan_end_close5_t, wpk_nan), MT_SZ_PK,
+		       pk) != MT_SUCCESS)
+	break;
+      mt_bytes2digest(pk, MT_SZ_PK, &digest);
+      return shard_by_digest(digest);
+
+    default:
+      break;
+  }
+
+  return &intermediary.shards[0];
+}
+
+/**
+ * Return true if handling <b>job</b> verifies a zkp
+ */
+static int job_verifies_zkp(mt_ipay_job_t* job){
+  switch(job->type){
+    case MT_NTYPE_CHN_END_ESTAB1:
+    case MT_NTYPE_NAN_CLI_SETUP1:
+    case MT_NTYPE_NAN_REL_ESTAB2:
+    case MT_NTYPE_NAN_END_CLOSE1:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Return true if <b>job</b> may be handed to the cpuworker without exceeding
+ * MoneTorIntermediaryShardsInFlight or MoneTorMaxVerifyInFlight
+ */
+static int job_can_start(mt_ipay_job_t* job){
+  int max_shards = get_options()->MoneTorIntermediaryShardsInFlight;
+  int max_verifies = get_options()->MoneTorMaxVerifyInFlight;
+
+  if(max_shards && intermediary.jobs_inflight >= max_shards)
+    return 0;
+  if(max_verifies && job_verifies_zkp(job) && intermediary.verifies_inflight >= max_verifies)
+    return 0;
+  return 1;
+}
+
+/**
+ * Return the options snapshot of the job being handled
+ */
+static const mt_ipay_opts_t* job_opts(void){
+  mt_ipay_job_t* job = tor_threadlocal_get(&current_job);
+  tor_assert(job);
+  return &job->opts;
+}
+
+/**
+ * Start the next job of <b>shard</b> unless one is already running. Unless
+ * MoneTorSingleThread is set, the job runs on the cpuworker within the limits
+ * of job_can_start(); shards that are over them wait for a slot in arrival
+ * order.
+ */
+static int schedule_shard(mt_ipay_shard_t* shard){
+
+  // if single threaded then just run the jobs in series
+  if(get_options()->MoneTorSingleThread){
+    int result = MT_SUCCESS;
+    while(!shard->busy && smartlist_len(shard->queue) > 0){
+      mt_ipay_job_t* job = smartlist_get(shard->queue, 0);
+      smartlist_del_keeporder(shard->queue, 0);
+      shard->busy = 1;
+      cpu_task_job(NULL, job);
+      shard->busy = 0;
+      result = finish_job(job);
+    }
+    return result;
+  }
+
+  // a job that could not be queued ran inline, so go on to the next one
+  int result = MT_SUCCESS;
+  while(!shard->busy && !shard->runnable && smartlist_len(shard->queue) > 0){
+
+    mt_ipay_job_t* job = smartlist_get(shard->queue, 0);
+    if(!job_can_start(job)){
+      shard->runnable = 1;
+      smartlist_add(intermediary.runnable, shard);
+      break;
+    }
+
+    smartlist_del_keeporder(shard->queue, 0);
+    result = dispatch_job(job);
+  }
+  return result;
+}
+
+/**
+ * Hand a shard job to the cpuworker threadpool. If it cannot be queued then
+ * run it on the main thread instead so that the protocol it belongs to does
+ * not stall, and return its result.
+ */
+static int dispatch_job(mt_ipay_job_t* job){
+
+  job->shard->busy = 1;
+  intermediary.jobs_inflight++;
+  intermediary.verifies_inflight += job_verifies_zkp(job);
+  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_job, (work_task)help_job, job)){
+    log_warn(LD_MT, "MoneTor: cpu task returned error; handling %s inline",
+	     mt_token_describe(job->type));
+    intermediary.jobs_inflight--;
+    intermediary.verifies_inflight -= job_verifies_zkp(job);
+    cpu_task_job(NULL, job);
+    job->shard->busy = 0;
+    return finish_job(job);
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Called on the main thread once the cpuworker has run a shard job
+ */
+static int help_job(void* args){
+
+  mt_ipay_job_t* job = args;
+  mt_ipay_shard_t* shard = job->shard;
+
+  intermediary.jobs_inflight--;
+  intermediary.verifies_inflight -= job_verifies_zkp(job);
+  shard->busy = 0;
+  mt_ntype_t type = job->type;
+  int result = finish_job(job);
+
+  // nobody is waiting on the return value here, so report failures now
+  if(result != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: Payment module returned -1 for %s", mt_token_describe(type));
+
+  // refill the freed slot from the waiting shards before continuing this one
+  while(smartlist_len(intermediary.runnable) > 0){
+    mt_ipay_shard_t* next = smartlist_get(intermediary.runnable, 0);
+    if(!job_can_start(smartlist_get(next->queue, 0)))
+      break;
+    smartlist_del_keeporder(intermediary.runnable, 0);
+    next->runnable = 0;
+    if(schedule_shard(next) != MT_SUCCESS)
+      log_warn(LD_MT, "MoneTor: Payment module returned -1 for a job run inline");
+  }
+  if(schedule_shard(shard) != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: Payment module returned -1 for a job run inline");
+
+  return result;
+}
+
+/**
+ * Release the output of <b>job</b> and of any later jobs from the same
+ * descriptor that were only waiting for it; frees the released jobs. Returns
+ * the result of handling <b>job</b>.
+ */
+static int finish_job(mt_ipay_job_t* job){
+
+  int result = job->result;
+  mt_desc_t desc = job->desc;
+
+  mt_ipay_order_t* order = mt_descmap_get(intermediary.orders, &desc);
+  tor_assert(order);
+  smartlist_add(order->done, job);
+
+  int released = 1;
+  while(released){
+    released = 0;
+    SMARTLIST_FOREACH_BEGIN(order->done, mt_ipay_job_t*, done){
+      if(done->seq != order->next_release)
+	continue;
+      finish_timing(done);
+      SMARTLIST_FOREACH_BEGIN(done->outbox, mt_ipay_out_t*, out){
+	if(out->is_signal)
+	  mt_paymod_signal(out->signal, &out->desc);
+	else if(mt_buffer_message(intermediary.msgbuf, &out->desc, out->type,
+				  out->msg, out->size) != MT_SUCCESS)
+	  log_warn(LD_MT, "MoneTor: could not send %s", mt_token_describe(out->type));
+	tor_free(out->msg);
+	tor_free(out);
+      } SMARTLIST_FOREACH_END(out);
+      smartlist_free(done->outbox);
+      tor_free(done->msg);
+      tor_free(done);
+      SMARTLIST_DEL_CURRENT(order->done, done);
+      order->next_release++;
+      released = 1;
+      break;
+    } SMARTLIST_FOREACH_END(done);
+  }
+
+  // forget descriptors with nothing outstanding
+  if(order->next_release == order->next_seq){
+    mt_descmap_remove(intermediary.orders, &desc);
+    smartlist_free(order->done);
+    tor_free(order);
+  }
+  return result;
+}
+
+static workqueue_reply_t cpu_task_job(void* thread, void* args){
+  (void)thread;
+
+  mt_ipay_job_t* job = args;
+  tor_threadlocal_set(&current_job, job);
+  job->result = mt_ipay_recv_helper(&job->desc, job->type, job->msg, job->size);
+  tor_trace(mt, recv_end, MT_PARTY_INT, job->desc.id[0], job->desc.id[1], (int)job->type,
+	    job->result);
+  tor_threadlocal_set(&current_job, NULL);
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Send a message, holding it until the current job is released if there is
+ * one
+ */
+static int send_message(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
+
+  if(size < 0)
+    return MT_ERROR;
+
+  mt_ipay_job_t* job = tor_threadlocal_get(&current_job);
+  if(!job)
+    return mt_buffer_message(intermediary.msgbuf, desc, type, msg, size);
+
+  mt_ipay_out_t* out = tor_calloc(1, sizeof(mt_ipay_out_t));
+  out->desc = *desc;
+  out->type = type;
+  out->msg = tor_memdup(msg, size);
+  out->size = size;
+  smartlist_add(job->outbox, out);
+  return MT_SUCCESS;
+}
+
+/**
+ * Start timing the protocol of <b>job</b> if it is the first message of an
+ * establish, direct pay or close
+ */
+static void start_timing(mt_ipay_job_t* job){
+
+  switch(job->type){
+    case MT_NTYPE_NAN_CLI_SETUP1:
+    case MT_NTYPE_NAN_REL_ESTAB2:
+    case MT_NTYPE_NAN_CLI_DESTAB1:
+    case MT_NTYPE_NAN_CLI_DPAY1:
+    case MT_NTYPE_NAN_END_CLOSE1:
+      break;
+    default:
+      return;
+  }
+
+  if(!job->has_pid || digestmap_get(intermediary.timings, (char*)job->pid))
+    return;
+
+  mt_ipay_timing_t* timing = tor_malloc(sizeof(mt_ipay_timing_t));
+  timing->phase = mt_stats_phase_of(job->type);
+  timing->peer = job->desc;
+  timing->start = monotime_absolute_usec();
+  digestmap_set(intermediary.timings, (char*)job->pid, timing);
+}
+
+/**
+ * Record the protocol of <b>job</b> with mt_stats if the job, which is being
+ * released, failed it or was its last message
+ */
+static void finish_timing(mt_ipay_job_t* job){
+
+  if(!job->has_pid)
+    return;
+  mt_ipay_timing_t* timing = digestmap_get(intermediary.timings, (char*)job->pid);
+  if(!timing)
+    return;
+
+  if(job->result != MT_SUCCESS){
+    mt_stats_note_failed(MT_STATS_INTERMEDIARY, timing->phase, &timing->peer, NULL);
+  }
+  else{
+    switch(job->type){
+      case MT_NTYPE_NAN_CLI_SETUP5:
+      case MT_NTYPE_NAN_REL_ESTAB4:
+      case MT_NTYPE_NAN_CLI_DESTAB1:
+      case MT_NTYPE_NAN_CLI_DPAY1:
+      case MT_NTYPE_NAN_END_CLOSE7:
+	mt_stats_note_done(MT_STATS_INTERMEDIARY, timing->phase, &timing->peer, NULL,
+			   monotime_absolute_usec() - timing->start);
+	break;
+      default:
+	return;
+    }
+  }
+
+  digestmap_remove(intermediary.timings, (char*)job->pid);
+  tor_free(timing);
+}
+
+/**
+ * Signal the controller, holding the signal until the current job is
+ * released if there is one
+ */
+static void send_signal(mt_signal_t signal, mt_desc_t* desc){
+
+  mt_ipay_job_t* job = tor_threadlocal_get(&current_job);
+  if(!job){
+    mt_paymod_signal(signal, desc);
+    return;
+  }
+
+  mt_ipay_out_t* out = tor_calloc(1, sizeof(mt_ipay_out_t));
+  out->desc = *desc;
+  out->is_signal = 1;
+  out->signal = signal;
+  smartlist_add(job->outbox, out);
+}
+
+/**
+ * Return whether the wallet with <b>digest</b> has been used before
+ */
+static int wallet_used(byte (*digest)[DIGEST_LEN]){
+  mt_ipay_shard_t* shard = shard_by_digest(*digest);
+  tor_mutex_acquire(shard->lock);
+  int result = digestmap_get(shard->chn_states, (char*)*digest) != NULL;
+  tor_mutex_release(shard->lock);
+  return result;
+}
+
+/**
+ * Record the wallet with <b>digest</b> as used, along with the nanopayment
+ * channel it funds if <b>nan_public</b> is not NULL. Fails if the wallet was
+ * already used.
+ */
+static int claim_wallet(byte (*digest)[DIGEST_LEN], nan_any_public_t* nan_public){
+
+  mt_ipay_shard_t* shard = shard_by_digest(*digest);
+  int result = MT_ERROR;
+
+  tor_mutex_acquire(shard->lock);
+  if(!digestmap_get(shard->chn_states, (char*)*digest)){
+    chn_int_state_t* chn_state = tor_calloc(1, sizeof(chn_int_state_t));
+    if(nan_public)
+      chn_state->nan_public = *nan_public;
+    digestmap_set(shard->chn_states, (char*)*digest, chn_state);
+    result = MT_SUCCESS;
+  }
+  tor_mutex_release(shard->lock);
+  return result;
+}
+
+/**
+ * Write the nanopayment channel funded by the wallet with <b>digest</b> to
+ * <b>nan_public_out</b>
+ */
+static int wallet_nan_public(byte (*digest)[DIGEST_LEN], nan_any_public_t* nan_public_out){
+
+  mt_ipay_shard_t* shard = shard_by_digest(*digest);
+  int result = MT_ERROR;
+
+  tor_mutex_acquire(shard->lock);
+  chn_int_state_t* chn_state = digestmap_get(shard->chn_states, (char*)*digest);
+  if(chn_state){
+    *nan_public_out = chn_state->nan_public;
+    result = MT_SUCCESS;
+  }
+  tor_mutex_release(shard->lock);
+  return result;
+}
+
+/**
+ * Store the revocation of the wallet with <b>digest</b>
+ */
+static int wallet_revoke(byte (*digest)[DIGEST_LEN], chn_end_revocation_t* revocation){
+
+  mt_ipay_shard_t* shard = shard_by_digest(*digest);
+  int result = MT_ERROR;
+
+  tor_mutex_acquire(shard->lock);
+  chn_int_state_t* chn_state = digestmap_get(shard->chn_states, (char*)*digest);
+  if(chn_state){
+    chn_state->revocation = *revocation;
+    result = MT_SUCCESS;
+  }
+  tor_mutex_release(shard->lock);
+  return result;
+}
+
+static nan_int_state_t* nan_state_get(const byte* digest){
+  return digestmap_get(shard_by_digest(digest)->nan_states, (const char*)digest);
+}
@@ -15,7 +15,9 @@
 int mt_ipay_init(void);
 
 /**
- * Handle an incoming message from the given descriptor
+ * Handle an incoming message from the given descriptor. The message is passed
+ * to the shard that owns its channel; unless MoneTorSingleThread is set it is
+ * handled later on the cpuworker and protocol errors are only logged.
  */
 int mt_ipay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size);
 
@@ -39,6 +41,12 @@ int mt_ipay_chn_number(void);
  */
 int mt_ipay_set_status(mt_desc_t* desc, int status);
 
+/**
+ * Periodic upkeep; called once a second by the controller. Drops held
+ * messages that have been waiting longer than MoneTorMsgBufTTL.
+ */
+void mt_ipay_housekeeping(time_t now);
+
 /********************** Instance Management ***********************/
 
 /**
@@ -0,0 +1,508 @@
+/**
+ * \file mt_ledgerlog.c
+ *
+ * Provide durable storage for the moneTor ledger. Every transaction applied by
+ * mt_lpay is appended to a checksummed, append-only log. Records are
+ * buffered in memory and written out in groups so that a single fsync covers
+ * many transactions (group commit). Periodically the full set of mac and
+ * channel accounts is written to a compact snapshot and the log is truncated,
+ * so that restart time depends on the length of the log tail rather than on
+ * the full history of the ledger.
+ *
+ * Log record layout (host byte order):
+ *
+ *     mt_ledgerlog_rec_t header | msg (header.size bytes) | SHA1(header|msg)
+ *
+ * Snapshot layout (host byte order):
+ *
+ *     mt_ledgerlog_snap_t header
+ *     n_mac * mac_ent bytes: (mac_led_data_t | addr | padding)
+ *     n_chn * chn_ent bytes: (chn_led_data_t | addr | padding)
+ *     SHA1(everything above)
+ *
+ * The entries are the arenas of the account tables (see mt_acctable.h),
+ * written chunk by chunk in the order the accounts were added, so taking a
+ * snapshot does no per-account work. Version 1 snapshots, whose entries are
+ * (addr | data) without padding, can still be loaded.
+ *
+ * All snapshot entries are fixed size so the file is read in place through
+ * tor_mmap_file(). Both formats record the sizes they were written with and are
+ * rejected if they do not match the running binary.
+ */
+
+#include "or.h"
+#include "container.h"
+#include "mt_common.h"
+#include "mt_acctable.h"
+#include "mt_ledgerlog.h"
+
+#define MT_LEDGERLOG_REC_MAGIC 0x4d544c52       // "MTLR"
+#define MT_LEDGERLOG_SNAP_MAGIC 0x4d544c53      // "MTLS"
+#define MT_LEDGERLOG_SNAP_VERSION 2
+
+/** Refuse to parse log records larger than this */
+#define MT_LEDGERLOG_MAX_MSG (1 << 20)
+
+/**
+ * Header preceding every log record
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t seq;
+  uint32_t type;
+  byte addr[MT_SZ_ADDR];
+} mt_ledgerlog_rec_t;
+
+/**
+ * Header at the start of a snapshot file
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;
+  uint32_t mac_size;
+  uint32_t chn_size;
+  uint64_t n_mac;
+  uint64_t n_chn;
+  // arena entry sizes; not present in version 1
+  uint32_t mac_ent;
+  uint32_t chn_ent;
+} mt_ledgerlog_snap_t;
+
+/** Size of the shorter header of a version 1 snapshot */
+#define MT_LEDGERLOG_SNAP_V1_SIZE offsetof(mt_ledgerlog_snap_t, mac_ent)
+
+/**
+ * Single instance of the ledger log
+ */
+typedef struct {
+  char* log_fname;
+  char* snap_fname;
+  int fd;
+
+  // end of the last successful commit and whether data may follow it
+  off_t durable_off;
+  int torn;
+
+  uint64_t next_seq;
+  uint64_t durable_seq;
+  uint64_t since_snapshot;
+
+  // records waiting for the next group commit
+  byte* buf;
+  size_t buf_len;
+  size_t buf_cap;
+  int pending;
+} mt_ledgerlog_t;
+
+static mt_ledgerlog_t ledgerlog = {.fd = -1};
+
+static int load_snapshot(mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts, uint64_t* seq_out);
+static int replay_log(uint64_t snap_seq, mt_ledgerlog_replay_fn replay, uint64_t* seq_out);
+static void buf_append(const void* data, size_t size);
+static int sync_fd(int fd);
+static int rewind_log(void);
+static int write_arena(int fd, crypto_digest_t* d, const mt_acctable_t* table);
+
+/**
+ * Open the log in <b>dir</b>, load the latest snapshot, and replay the log
+ */
+int mt_ledgerlog_open(const char* dir, mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts,
+		      mt_ledgerlog_replay_fn replay){
+
+  tor_assert(ledgerlog.fd < 0);
+
+  if(check_private_dir(dir, CPD_CREATE, NULL) < 0){
+    log_warn(LD_MT, "MoneTor: could not create ledger log directory %s", dir);
+    return MT_ERROR;
+  }
+
+  tor_asprintf(&ledgerlog.log_fname, "%s"PATH_SEPARATOR"%s", dir, MT_LEDGERLOG_LOG_FNAME);
+  tor_asprintf(&ledgerlog.snap_fname, "%s"PATH_SEPARATOR"%s", dir, MT_LEDGERLOG_SNAPSHOT_FNAME);
+
+  uint64_t snap_seq = 0;
+  uint64_t log_seq = 0;
+
+  if(load_snapshot(mac_accounts, chn_accounts, &snap_seq) != MT_SUCCESS ||
+     replay_log(snap_seq, replay, &log_seq) != MT_SUCCESS){
+    mt_ledgerlog_close();
+    return MT_ERROR;
+  }
+
+  ledgerlog.fd = tor_open_cloexec(ledgerlog.log_fname, O_WRONLY|O_CREAT|O_BINARY, 0600);
+  if(ledgerlog.fd < 0 || tor_fd_seekend(ledgerlog.fd) < 0 ||
+     (ledgerlog.durable_off = tor_fd_getpos(ledgerlog.fd)) < 0){
+    log_warn(LD_MT, "MoneTor: could not open ledger log %s: %s", ledgerlog.log_fname,
+	     strerror(errno));
+    mt_ledgerlog_close();
+    return MT_ERROR;
+  }
+
+  ledgerlog.durable_seq = MAX(snap_seq, log_seq);
+  ledgerlog.next_seq = ledgerlog.durable_seq + 1;
+
+  log_info(LD_MT, "MoneTor: ledger restored to sequence %" PRIu64 " (snapshot %" PRIu64 ")",
+	   ledgerlog.durable_seq, snap_seq);
+  return MT_SUCCESS;
+}
+
+/**
+ * Return 1 if a log is currently open and 0 otherwise
+ */
+int mt_ledgerlog_is_open(void){
+  return ledgerlog.fd >= 0;
+}
+
+/**
+ * Buffer a log record for an applied transaction
+ */
+MOCK_IMPL(int, mt_ledgerlog_append, (mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg,
+				     int size, uint64_t* seq_out)){
+
+  if(ledgerlog.fd < 0 || size < 0 || size > MT_LEDGERLOG_MAX_MSG)
+    return MT_ERROR;
+
+  mt_ledgerlog_rec_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = MT_LEDGERLOG_REC_MAGIC;
+  rec.size = (uint32_t)size;
+  rec.seq = ledgerlog.next_seq++;
+  rec.type = (uint32_t)type;
+  memcpy(rec.addr, *addr, MT_SZ_ADDR);
+
+  crypto_digest_t* d = crypto_digest_new();
+  crypto_digest_add_bytes(d, (const char*)&rec, sizeof(rec));
+  crypto_digest_add_bytes(d, (const char*)msg, size);
+  byte check[DIGEST_LEN];
+  crypto_digest_get_digest(d, (char*)check, DIGEST_LEN);
+  crypto_digest_free(d);
+
+  buf_append(&rec, sizeof(rec));
+  buf_append(msg, size);
+  buf_append(check, DIGEST_LEN);
+  ledgerlog.pending++;
+  ledgerlog.since_snapshot++;
+
+  *seq_out = rec.seq;
+  return MT_SUCCESS;
+}
+
+/**
+ * Write all buffered records to disk with a single fsync. A failed write is
+ * cut back to the last durable offset before the next attempt; a failed fsync
+ * leaves the state of the file unknown and is fatal.
+ */
+int mt_ledgerlog_commit(void){
+
+  if(ledgerlog.fd < 0)
+    return MT_ERROR;
+  if(ledgerlog.pending == 0)
+    return MT_SUCCESS;
+
+  if(ledgerlog.torn && rewind_log() < 0){
+    log_warn(LD_MT, "MoneTor: could not rewind ledger log %s: %s", ledgerlog.log_fname,
+	     strerror(errno));
+    return MT_ERROR;
+  }
+
+  if(write_all(ledgerlog.fd, (const char*)ledgerlog.buf, ledgerlog.buf_len, 0) < 0){
+    log_warn(LD_MT, "MoneTor: could not write ledger log %s: %s", ledgerlog.log_fname,
+	     strerror(errno));
+    ledgerlog.torn = 1;
+    return MT_ERROR;
+  }
+
+  if(sync_fd(ledgerlog.fd) < 0){
+    log_err(LD_MT, "MoneTor: could not sync ledger log %s: %s. Exiting.", ledgerlog.log_fname,
+	    strerror(errno));
+    exit(1);
+  }
+
+  ledgerlog.durable_off += ledgerlog.buf_len;
+  ledgerlog.buf_len = 0;
+  ledgerlog.pending = 0;
+  ledgerlog.durable_seq = ledgerlog.next_seq - 1;
+  return MT_SUCCESS;
+}
+
+/**
+ * Return the number of records buffered since the last commit
+ */
+int mt_ledgerlog_pending(void){
+  return ledgerlog.pending;
+}
+
+/**
+ * Return the highest sequence number known to be on stable storage
+ */
+uint64_t mt_ledgerlog_durable_seq(void){
+  return ledgerlog.durable_seq;
+}
+
+/**
+ * Return the number of records written since the last snapshot
+ */
+uint64_t mt_ledgerlog_since_snapshot(void){
+  return ledgerlog.since_snapshot;
+}
+
+/**
+ * Replace the snapshot with the current account tables and truncate the log
+ */
+int mt_ledgerlog_snapshot(mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts){
+
+  if(mt_ledgerlog_commit() != MT_SUCCESS)
+    return MT_ERROR;
+
+  mt_ledgerlog_snap_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = MT_LEDGERLOG_SNAP_MAGIC;
+  header.version = MT_LEDGERLOG_SNAP_VERSION;
+  header.seq = ledgerlog.durable_seq;
+  header.mac_size = sizeof(mac_led_data_t);
+  header.chn_size = sizeof(chn_led_data_t);
+  header.n_mac = mt_acctable_size(mac_accounts);
+  header.n_chn = mt_acctable_size(chn_accounts);
+  header.mac_ent = mac_accounts->ent_size;
+  header.chn_ent = chn_accounts->ent_size;
+
+  // write to a temporary file, sync it, then rename over the old snapshot
+  open_file_t* file;
+  int fd = start_writing_to_file(ledgerlog.snap_fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,
+				 0600, &file);
+  if(fd < 0)
+    return MT_ERROR;
+
+  byte check[DIGEST_LEN];
+  crypto_digest_t* d = crypto_digest_new();
+  crypto_digest_add_bytes(d, (const char*)&header, sizeof(header));
+  int failed = write_all(fd, (const char*)&header, sizeof(header), 0) < 0 ||
+    write_arena(fd, d, mac_accounts) < 0 || write_arena(fd, d, chn_accounts) < 0;
+  crypto_digest_get_digest(d, (char*)check, DIGEST_LEN);
+  crypto_digest_free(d);
+
+  if(failed || write_all(fd, (const char*)check, DIGEST_LEN, 0) < 0 || sync_fd(fd) < 0){
+    log_warn(LD_MT, "MoneTor: could not write ledger snapshot: %s", strerror(errno));
+    abort_writing_to_file(file);
+    return MT_ERROR;
+  }
+
+  if(finish_writing_to_file(file) < 0)
+    return MT_ERROR;
+
+  // every record in the log is now covered by the snapshot
+  if(tor_ftruncate(ledgerlog.fd) < 0){
+    log_warn(LD_MT, "MoneTor: could not truncate ledger log: %s", strerror(errno));
+    ledgerlog.torn = 1;
+    return MT_ERROR;
+  }
+  if(sync_fd(ledgerlog.fd) < 0){
+    log_err(LD_MT, "MoneTor: could not sync ledger log %s: %s. Exiting.", ledgerlog.log_fname,
+	    strerror(errno));
+    exit(1);
+  }
+  ledgerlog.durable_off = 0;
+
+  ledgerlog.since_snapshot = 0;
+  log_info(LD_MT, "MoneTor: wrote ledger snapshot at sequence %" PRIu64 " (%" PRIu64
+	   " mac, %" PRIu64 " chn)", header.seq, header.n_mac, header.n_chn);
+  return MT_SUCCESS;
+}
+
+/**
+ * Commit any buffered records and close the log
+ */
+void mt_ledgerlog_close(void){
+
+  if(ledgerlog.fd >= 0){
+    mt_ledgerlog_commit();
+    close(ledgerlog.fd);
+  }
+
+  tor_free(ledgerlog.log_fname);
+  tor_free(ledgerlog.snap_fname);
+  tor_free(ledgerlog.buf);
+  memset(&ledgerlog, 0, sizeof(ledgerlog));
+  ledgerlog.fd = -1;
+}
+
+/*************************** Helper Functions ***************************/
+
+/**
+ * Load the snapshot (if any) into the account tables and return its sequence
+ * number in <b>seq_out</b>
+ */
+static int load_snapshot(mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts, uint64_t* seq_out){
+
+  *seq_out = 0;
+
+  tor_mmap_t* map = tor_mmap_file(ledgerlog.snap_fname);
+  if(!map)
+    return errno == ENOENT ? MT_SUCCESS : MT_ERROR;
+
+  const byte* data = (const byte*)map->data;
+  mt_ledgerlog_snap_t header;
+  memset(&header, 0, sizeof(header));
+
+  if(map->size < MT_LEDGERLOG_SNAP_V1_SIZE + DIGEST_LEN)
+    goto err;
+  memcpy(&header, data, MT_LEDGERLOG_SNAP_V1_SIZE);
+
+  if(header.magic != MT_LEDGERLOG_SNAP_MAGIC ||
+     header.mac_size != sizeof(mac_led_data_t) || header.chn_size != sizeof(chn_led_data_t))
+    goto err;
+
+  // where the address and the account sit in each entry
+  size_t header_size, mac_ent, chn_ent, mac_addr, chn_addr, mac_val, chn_val;
+  if(header.version == 1){
+    header_size = MT_LEDGERLOG_SNAP_V1_SIZE;
+    mac_ent = MT_SZ_ADDR + sizeof(mac_led_data_t);
+    chn_ent = MT_SZ_ADDR + sizeof(chn_led_data_t);
+    mac_addr = chn_addr = 0;
+    mac_val = chn_val = MT_SZ_ADDR;
+  }
+  else if(header.version == MT_LEDGERLOG_SNAP_VERSION && map->size >= sizeof(header) + DIGEST_LEN){
+    memcpy(&header, data, sizeof(header));
+    header_size = sizeof(header);
+    mac_ent = header.mac_ent;
+    chn_ent = header.chn_ent;
+    mac_addr = sizeof(mac_led_data_t);
+    chn_addr = sizeof(chn_led_data_t);
+    mac_val = chn_val = 0;
+    if(mac_ent < mac_addr + MT_SZ_ADDR || chn_ent < chn_addr + MT_SZ_ADDR)
+      goto err;
+  }
+  else {
+    goto err;
+  }
+
+  if(header.n_mac > map->size / mac_ent || header.n_chn > map->size / chn_ent ||
+     map->size != header_size + header.n_mac * mac_ent + header.n_chn * chn_ent + DIGEST_LEN)
+    goto err;
+
+  byte check[DIGEST_LEN];
+  crypto_digest((char*)check, (const char*)data, map->size - DIGEST_LEN);
+  if(tor_memneq(check, data + map->size - DIGEST_LEN, DIGEST_LEN))
+    goto err;
+
+  const byte* ptr = data + header_size;
+  for(uint64_t i = 0; i < header.n_mac; i++, ptr += mac_ent)
+    memcpy(mt_acctable_add(mac_accounts, ptr + mac_addr), ptr + mac_val, sizeof(mac_led_data_t));
+  for(uint64_t i = 0; i < header.n_chn; i++, ptr += chn_ent)
+    memcpy(mt_acctable_add(chn_accounts, ptr + chn_addr), ptr + chn_val, sizeof(chn_led_data_t));
+
+  *seq_out = header.seq;
+  tor_munmap_file(map);
+  return MT_SUCCESS;
+
+ err:
+  log_warn(LD_MT, "MoneTor: ledger snapshot %s is corrupt or incompatible", ledgerlog.snap_fname);
+  tor_munmap_file(map);
+  return MT_ERROR;
+}
+
+/**
+ * Replay every intact log record newer than <b>snap_seq</b>. If the log ends in
+ * a torn or corrupt record then the log is rewritten without it.
+ */
+static int replay_log(uint64_t snap_seq, mt_ledgerlog_replay_fn replay, uint64_t* seq_out){
+
+  *seq_out = 0;
+
+  struct stat st;
+  char* contents = read_file_to_str(ledgerlog.log_fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if(!contents)
+    return MT_SUCCESS;
+
+  size_t size = (size_t)st.st_size;
+  size_t offset = 0;
+  uint64_t last = snap_seq;
+
+  while(offset + sizeof(mt_ledgerlog_rec_t) + DIGEST_LEN <= size){
+
+    mt_ledgerlog_rec_t rec;
+    memcpy(&rec, contents + offset, sizeof(rec));
+    if(rec.magic != MT_LEDGERLOG_REC_MAGIC || rec.size > MT_LEDGERLOG_MAX_MSG)
+      break;
+
+    size_t rec_size = sizeof(rec) + rec.size + DIGEST_LEN;
+    if(offset + rec_size > size)
+      break;
+
+    byte check[DIGEST_LEN];
+    crypto_digest((char*)check, contents + offset, sizeof(rec) + rec.size);
+    if(tor_memneq(check, contents + offset + sizeof(rec) + rec.size, DIGEST_LEN))
+      break;
+
+    // records already folded into the snapshot are skipped
+    if(rec.seq > last){
+      replay((mt_ntype_t)rec.type, &rec.addr, (byte*)contents + offset + sizeof(rec), rec.size);
+      last = rec.seq;
+      ledgerlog.since_snapshot++;
+    }
+    offset += rec_size;
+  }
+
+  if(offset != size){
+    log_warn(LD_MT, "MoneTor: discarding %lu bytes of torn ledger log", (unsigned long)(size - offset));
+    if(write_bytes_to_file(ledgerlog.log_fname, contents, offset, 1) < 0){
+      tor_free(contents);
+      return MT_ERROR;
+    }
+  }
+
+  *seq_out = last;
+  tor_free(contents);
+  return MT_SUCCESS;
+}
+
+static void buf_append(const void* data, size_t size){
+  if(ledgerlog.buf_len + size > ledgerlog.buf_cap){
+    ledgerlog.buf_cap = MAX(ledgerlog.buf_cap * 2, ledgerlog.buf_len + size);
+    ledgerlog.buf = tor_realloc(ledgerlog.buf, ledgerlog.buf_cap);
+  }
+  memcpy(ledgerlog.buf + ledgerlog.buf_len, data, size);
+  ledgerlog.buf_len += size;
+}
+
+/**
+ * Write the arena of <b>table</b> to <b>fd</b> and add it to the digest
+ * <b>d</b>
+ */
+static int write_arena(int fd, crypto_digest_t* d, const mt_acctable_t* table){
+  for(int i = 0; i < table->n_chunks; i++){
+    size_t len;
+    const byte* chunk = mt_acctable_chunk(table, i, &len);
+    crypto_digest_add_bytes(d, (const char*)chunk, len);
+    if(write_all(fd, (const char*)chunk, len, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Drop anything written after the last successful commit and move the file
+ * position back to it
+ */
+static int rewind_log(void){
+#ifdef _WIN32
+  if(_chsize(ledgerlog.fd, (long)ledgerlog.durable_off) < 0)
+    return -1;
+#else
+  if(ftruncate(ledgerlog.fd, ledgerlog.durable_off) < 0)
+    return -1;
+#endif
+  if(tor_fd_setpos(ledgerlog.fd, ledgerlog.durable_off) < 0)
+    return -1;
+  ledgerlog.torn = 0;
+  return 0;
+}
+
+static int sync_fd(int fd){
+#ifdef _WIN32
+  return _commit(fd);
+#else
+  return fsync(fd);
+#endif
+}
@@ -0,0 +1,81 @@
+/**
+ * \file mt_ledgerlog.h
+ * \brief Header file for mt_ledgerlog.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated.
+ **/
+
+#ifndef mt_ledgerlog_h
+#define mt_ledgerlog_h
+
+#include "or.h"
+#include "mt_acctable.h"
+
+/** Name of the append-only transaction log inside the ledger log directory */
+#define MT_LEDGERLOG_LOG_FNAME "ledger.log"
+
+/** Name of the account snapshot inside the ledger log directory */
+#define MT_LEDGERLOG_SNAPSHOT_FNAME "ledger.snapshot"
+
+/**
+ * Called once for every log record that is newer than the loaded snapshot.
+ * <b>msg</b> is the verified (signature stripped) transaction as it was
+ * originally applied by the sender with address <b>addr</b>.
+ */
+typedef void (*mt_ledgerlog_replay_fn)(mt_ntype_t type, byte (*addr)[MT_SZ_ADDR],
+				       byte* msg, int size);
+
+/**
+ * Open the log in <b>dir</b>, creating it if necessary. The latest snapshot is
+ * loaded into <b>mac_accounts</b> and <b>chn_accounts</b> and every log record
+ * after it is passed to <b>replay</b> in order. A torn record at the end of
+ * the log is discarded.
+ */
+int mt_ledgerlog_open(const char* dir, mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts,
+		      mt_ledgerlog_replay_fn replay);
+
+/**
+ * Return 1 if a log is currently open and 0 otherwise
+ */
+int mt_ledgerlog_is_open(void);
+
+/**
+ * Buffer a log record for an applied transaction. The record is not durable
+ * until the next mt_ledgerlog_commit(). Its sequence number is written to
+ * <b>seq_out</b>.
+ */
+MOCK_DECL(int, mt_ledgerlog_append, (mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg,
+				     int size, uint64_t* seq_out));
+
+/**
+ * Write all buffered records to disk with a single fsync
+ */
+int mt_ledgerlog_commit(void);
+
+/**
+ * Return the number of records buffered since the last commit
+ */
+int mt_ledgerlog_pending(void);
+
+/**
+ * Return the highest sequence number known to be on stable storage
+ */
+uint64_t mt_ledgerlog_durable_seq(void);
+
+/**
+ * Return the number of records written since the last snapshot
+ */
+uint64_t mt_ledgerlog_since_snapshot(void);
+
+/**
+ * Commit any buffered records, atomically replace the snapshot with the
+ * current account tables, and truncate the log
+ */
+int mt_ledgerlog_snapshot(mt_acctable_t* mac_accounts, mt_acctable_t* chn_accounts);
+
+/**
+ * Commit any buffered records and close the log
+ */
+void mt_ledgerlog_close(void);
+
+#endif
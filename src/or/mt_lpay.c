@@ -21,6 +21,20 @@
  *     post() - Accepts a message to update the ledger state
  *     query() - Accepts a message to retrieve information about the ledger
  *
+ * Incoming transactions run through a three stage pipeline. Signature
+ * verification and receipt signing are handed to the cpuworker threadpool
+ * while account mutations are applied on the main thread strictly in the order
+ * in which messages arrived. Confirmations are sent out in that same order.
+ *
+ * If MoneTorLedgerReceiptBatch is set then receipts that become ready while
+ * another batch is being signed are collected and signed together: the ledger
+ * signs the Merkle root of the batch once and every receipt carries the path
+ * from its own leaf to that root.
+ *
+ * If MoneTorLedgerLogDir is set then every applied transaction is also written
+ * to a durable log (see mt_ledgerlog.c) and its confirmation is held back until
+ * the log record has been committed to disk.
+ *
  * Unless otherwise noted, all functions return 0 for success or -1 for failure.
  */
 
@@ -33,22 +47,71 @@
 
 #include "or.h"
 #include "config.h"
+#include "workqueue.h"
+#include "cpuworker.h"
+#include "timers.h"
 #include "mt_crypto.h"
 #include "mt_tokens.h"
 #include "mt_common.h"
 #include "mt_messagebuffer.h"
+#include "mt_acctable.h"
+#include "mt_ledgerlog.h"
 #include "mt_lpay.h"
+#include "trace/events.h"
 
 //TODO move resolve to separate algs file
 //TODO enforce nonce
 
+/**
+ * Prototype for multi-thread function used to run the expensive crypto
+ */
+typedef void (*work_task)(void*);
+
+/**
+ * Hold a single ledger transaction as it moves through the pipeline
+ */
+typedef struct {
+  mt_desc_t desc;
+  mt_ntype_t type;
+  byte* msg;
+  int size;
+
+  // output of the verify stage
+  int verify_done;
+  int verified;
+  byte addr[MT_SZ_ADDR];
+  byte* raw_msg;   // points into msg
+  int raw_size;
+
+  // output of the apply and sign stages
+  byte pid[DIGEST_LEN];
+  int result;
+  any_led_receipt_t rec;
+  int sign_done;
+
+  // sequence number of the log record; 0 if the ledger is not logged
+  uint64_t log_seq;
+
+  // value of pipeline_generation when the job was received
+  uint64_t generation;
+} mt_lpay_job_t;
+
+/**
+ * Running counters for a single pipeline stage
+ */
+typedef struct {
+  uint64_t completed;
+  uint64_t completed_last;
+  double rate;
+} mt_lpay_stage_t;
+
 /**
  * Single instance of a ledger payment object.
  */
 typedef struct {
 
-  digestmap_t* mac_accounts;
-  digestmap_t* chn_accounts;
+  mt_acctable_t* mac_accounts;
+  mt_acctable_t* chn_accounts;
 
   byte pp[MT_SZ_PP];
   int fee;
@@ -63,6 +126,21 @@ typedef struct {
   byte sk[MT_SZ_SK];
   byte led_addr[MT_SZ_ADDR];
 
+  // transaction pipeline; both queues are kept in arrival order
+  smartlist_t* verify_queue;     // jobs awaiting verification or application
+  smartlist_t* sign_queue;       // applied jobs awaiting signing or sending
+  smartlist_t* verify_batch;     // received jobs not yet handed to a cpuworker
+  int verify_inflight;
+  int batches_inflight;
+  smartlist_t* sign_batch;       // applied jobs whose receipts await a batch
+  int sign_batches_inflight;
+  mt_lpay_stage_t stages[MT_LPAY_NUM_STAGES];
+  time_t stats_last;
+
+  // fires when buffered log records have waited long enough for a commit
+  tor_timer_t* commit_timer;
+  int commit_scheduled;
+
   // structure to run message buffering functionality
   mt_msgbuf_t* msgbuf;
 } mt_lpay_t;
@@ -70,6 +148,10 @@ typedef struct {
 static mt_lpay_t ledger;
 static mt_payment_public_t public;
 
+// bumped by mt_lpay_clear() so that replies for jobs handed to a cpuworker
+// before the clear are recognized and dropped
+static uint64_t pipeline_generation;
+
 // private token handlers
 int handle_mac_aut_mint(mac_aut_mint_t* token, byte(*addr)[MT_SZ_ADDR], any_led_receipt_t* rec);
 int handle_mac_any_trans(mac_any_trans_t* token, byte(*addr)[MT_SZ_ADDR], any_led_receipt_t* rec);
@@ -81,6 +163,28 @@ int handle_chn_int_close(chn_int_close_t* token, byte(*addr)[MT_SZ_ADDR], any_le
 int handle_chn_end_cashout(chn_end_cashout_t* token, byte(*addr)[MT_SZ_ADDR], any_led_receipt_t* rec);
 int handle_chn_int_cashout(chn_int_cashout_t* token, byte(*addr)[MT_SZ_ADDR], any_led_receipt_t* rec);
 
+// pipeline stages
+static int apply_job(mt_lpay_job_t* job, int write_log);
+static int send_job(mt_lpay_job_t* job);
+static int pump_pipeline(void);
+static int log_job(mt_lpay_job_t* job);
+static void commit_log(void);
+static void schedule_commit(void);
+static void commit_timer_cb(tor_timer_t* timer, void* arg, const struct monotime_t* now);
+static void replay_job(mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg, int size);
+static int dispatch_verify_batch(void);
+static void finish_verify_batch(smartlist_t* batch);
+static int help_verify(void* args);
+static int help_sign(void* args);
+static int dispatch_sign_batch(void);
+static int help_sign_batch(void* args);
+static int batch_is_stale(smartlist_t* batch);
+static void free_job(mt_lpay_job_t* job);
+static workqueue_reply_t cpu_task_verify(void* thread, void* args);
+static workqueue_reply_t cpu_task_verify_batch(void* thread, void* args);
+static workqueue_reply_t cpu_task_sign(void* thread, void* args);
+static workqueue_reply_t cpu_task_sign_batch(void* thread, void* args);
+
 // helper functions
 int transfer(int* bal_from, int* bal_to, int val_from, int val_to, int val_auth);
 int close_channel(chn_led_data_t* data);
@@ -96,9 +200,20 @@ int mt_lpay_init(void){
 
   ledger.msgbuf = mt_messagebuffer_init();
 
+  // initialize transaction pipeline
+  ledger.verify_queue = smartlist_new();
+  ledger.sign_queue = smartlist_new();
+  ledger.verify_batch = smartlist_new();
+  ledger.verify_inflight = 0;
+  ledger.batches_inflight = 0;
+  ledger.sign_batch = smartlist_new();
+  ledger.sign_batches_inflight = 0;
+  memset(ledger.stages, 0, sizeof(ledger.stages));
+  ledger.stats_last = time(NULL);
+
   // initialize state
-  ledger.mac_accounts = digestmap_new();
-  ledger.chn_accounts = digestmap_new();
+  ledger.mac_accounts = mt_acctable_new(sizeof(mac_led_data_t));
+  ledger.chn_accounts = mt_acctable_new(sizeof(chn_led_data_t));
 
   // set ledger attributes
   byte* pp_temp;
@@ -137,7 +252,16 @@ int mt_lpay_init(void){
   memcpy(public.aut_pk, ledger.aut_pk, MT_SZ_PK);
 
   // add authority as first node on the tree
-  digestmap_set(ledger.mac_accounts, (char*)ledger.aut_addr, calloc(1, sizeof(mac_led_data_t)));
+  mt_acctable_add(ledger.mac_accounts, ledger.aut_addr);
+
+  // restore the ledger state from disk
+  const char* log_dir = get_options()->MoneTorLedgerLogDir;
+  if(log_dir){
+    if(mt_ledgerlog_open(log_dir, ledger.mac_accounts, ledger.chn_accounts, replay_job)
+       != MT_SUCCESS)
+      return MT_ERROR;
+    ledger.commit_timer = timer_new(commit_timer_cb, NULL);
+  }
 
   return MT_SUCCESS;
 }
@@ -149,118 +273,618 @@ int mt_lpay_init(void){
  */
 int mt_lpay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
 
-  log_info(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
+  log_debug(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
 	   mt_party_describe(desc->party), desc->id[0], desc->id[1], mt_token_describe(type));
+  tor_trace(mt, recv_begin, MT_PARTY_LED, desc->id[0], desc->id[1], (int)desc->party,
+	    (int)type, size);
+
+  mt_lpay_job_t* job = tor_calloc(1, sizeof(mt_lpay_job_t));
+  job->desc = *desc;
+  job->type = type;
+  job->size = size;
+  job->msg = mt_msgpool_get(size);
+  job->generation = pipeline_generation;
+  memcpy(job->msg, msg, size);
+
+  // if single threaded then just call procedures in series
+  if(get_options()->MoneTorSingleThread){
+    cpu_task_verify(NULL, job);
+    ledger.stages[MT_LPAY_STAGE_VERIFY].completed++;
+    if(!job->verified || apply_job(job, 1) != MT_SUCCESS){
+      free_job(job);
+      return MT_ERROR;
+    }
+    ledger.stages[MT_LPAY_STAGE_APPLY].completed++;
+    if(job->log_seq && mt_ledgerlog_commit() != MT_SUCCESS){
+      free_job(job);
+      return MT_ERROR;
+    }
+    cpu_task_sign(NULL, job);
+    ledger.stages[MT_LPAY_STAGE_SIGN].completed++;
+    int result = send_job(job);
+    free_job(job);
+    return result;
+  }
 
-  // verify signed message, produce addr to pass into handlers
-  byte pk[MT_SZ_PK];
-  byte addr[MT_SZ_ADDR];
+  // if not single threaded then offload the signature check to a cpuworker;
+  // jobs that arrive while a batch is being checked wait to form the next one
+  // unless the batch size is 0 or 1, in which case each job goes on its own
+  smartlist_add(ledger.verify_queue, job);
+  smartlist_add(ledger.verify_batch, job);
+  ledger.verify_inflight++;
+  if(ledger.batches_inflight == 0 ||
+     smartlist_len(ledger.verify_batch) >= get_options()->MoneTorLedgerVerifyBatch)
+    return dispatch_verify_batch();
+  return MT_SUCCESS;
+}
 
-  byte* raw_msg;
-  int raw_size = mt_verify_signed_msg(msg, size, &pk, &raw_msg);
-  if(raw_size == MT_ERROR)
-    return MT_ERROR;
+/**
+ * Hand all jobs waiting for verification to a cpuworker as a single batch
+ */
+static int dispatch_verify_batch(void){
 
-  mt_pk2addr(&pk, &addr);
+  if(smartlist_len(ledger.verify_batch) == 0)
+    return MT_SUCCESS;
 
-  byte pid[DIGEST_LEN];
-  any_led_receipt_t rec;
+  smartlist_t* batch = ledger.verify_batch;
+  ledger.verify_batch = smartlist_new();
+  ledger.batches_inflight++;
+
+  // the senders wait for a confirmation so check the batch here instead
+  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_verify_batch, (work_task)help_verify, batch)){
+    log_warn(LD_MT, "MoneTor: cpu task returned error; verifying inline");
+    cpu_task_verify_batch(NULL, batch);
+    finish_verify_batch(batch);
+    return pump_pipeline();
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Mark every job of a checked <b>batch</b> as ready to apply and free the
+ * batch
+ */
+static void finish_verify_batch(smartlist_t* batch){
+  SMARTLIST_FOREACH_BEGIN(batch, mt_lpay_job_t*, job){
+    job->verify_done = 1;
+    ledger.verify_inflight--;
+    ledger.stages[MT_LPAY_STAGE_VERIFY].completed++;
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(batch);
+  ledger.batches_inflight--;
+}
+
+/**
+ * Report the current depth and throughput of each stage of the transaction
+ * pipeline. Throughput is measured over the last mt_lpay_pipeline_tick()
+ * interval.
+ */
+void mt_lpay_pipeline_stats(mt_lpay_pipeline_stats_t* stats_out){
+
+  int queued = ledger.verify_queue ? smartlist_len(ledger.verify_queue) : 0;
+
+  stats_out->depth[MT_LPAY_STAGE_VERIFY] = ledger.verify_inflight;
+  stats_out->depth[MT_LPAY_STAGE_APPLY] = queued - ledger.verify_inflight;
+  stats_out->depth[MT_LPAY_STAGE_SIGN] = ledger.sign_queue ? smartlist_len(ledger.sign_queue) : 0;
+
+  for(int i = 0; i < MT_LPAY_NUM_STAGES; i++){
+    stats_out->completed[i] = ledger.stages[i].completed;
+    stats_out->rate[i] = ledger.stages[i].rate;
+  }
+}
+
+/**
+ * Recompute the per-stage throughput and drop confirmations that have
+ * outlived MoneTorMsgBufTTL; called once a second by the ledger controller
+ */
+void mt_lpay_pipeline_tick(time_t now){
+
+  if(now <= ledger.stats_last)
+    return;
+
+  double elapsed = (double)(now - ledger.stats_last);
+  for(int i = 0; i < MT_LPAY_NUM_STAGES; i++){
+    mt_lpay_stage_t* stage = &ledger.stages[i];
+    stage->rate = (double)(stage->completed - stage->completed_last) / elapsed;
+    stage->completed_last = stage->completed;
+  }
+  ledger.stats_last = now;
+
+  if(ledger.msgbuf)
+    mt_messagebuffer_expire(ledger.msgbuf, now);
+}
+
+/******************************* Pipeline *******************************/
+
+/**
+ * Unpack a verified message and apply it to the ledger state. Returns MT_ERROR
+ * if the message could not be parsed, in which case no confirmation is sent.
+ * Otherwise the handler result is saved in the job. If <b>write_log</b> is
+ * set the transaction is written to the ledger log before any balance is
+ * touched, and it is rejected without being applied if the log cannot take it.
+ */
+static int apply_job(mt_lpay_job_t* job, int write_log){
+
+  byte* raw_msg = job->raw_msg;
+  int raw_size = job->raw_size;
+  byte (*addr)[MT_SZ_ADDR] = &job->addr;
+  byte (*pid)[DIGEST_LEN] = &job->pid;
+  any_led_receipt_t* rec = &job->rec;
   int result;
 
-  switch(type){
-    case MT_NTYPE_MAC_AUT_MINT:;
-      mac_aut_mint_t mac_aut_mint_tkn;
-      if(unpack_mac_aut_mint(raw_msg, raw_size, &mac_aut_mint_tkn, &pid) != MT_SUCCESS)
+  union {
+    mac_aut_mint_t mac_aut_mint;
+    mac_any_trans_t mac_any_trans;
+    chn_end_setup_t chn_end_setup;
+    chn_int_setup_t chn_int_setup;
+    chn_int_reqclose_t chn_int_reqclose;
+    chn_end_close_t chn_end_close;
+    chn_int_close_t chn_int_close;
+    chn_end_cashout_t chn_end_cashout;
+    chn_int_cashout_t chn_int_cashout;
+  } tkn;
+
+  switch(job->type){
+    case MT_NTYPE_MAC_AUT_MINT:
+      if(unpack_mac_aut_mint(raw_msg, raw_size, &tkn.mac_aut_mint, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_mac_aut_mint(&mac_aut_mint_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_MAC_ANY_TRANS:;
-      mac_any_trans_t mac_any_trans_tkn;
-      if(unpack_mac_any_trans(raw_msg, raw_size, &mac_any_trans_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_MAC_ANY_TRANS:
+      if(unpack_mac_any_trans(raw_msg, raw_size, &tkn.mac_any_trans, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_mac_any_trans(&mac_any_trans_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_END_SETUP:;
-      chn_end_setup_t chn_end_setup_tkn;
-      if(unpack_chn_end_setup(raw_msg, raw_size, &chn_end_setup_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_END_SETUP:
+      if(unpack_chn_end_setup(raw_msg, raw_size, &tkn.chn_end_setup, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_end_setup(&chn_end_setup_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_INT_SETUP:;
-      chn_int_setup_t chn_int_setup_tkn;
-      if(unpack_chn_int_setup(raw_msg, raw_size, &chn_int_setup_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_INT_SETUP:
+      if(unpack_chn_int_setup(raw_msg, raw_size, &tkn.chn_int_setup, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_int_setup(&chn_int_setup_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_INT_REQCLOSE:;
-      chn_int_reqclose_t chn_int_reqclose_tkn;
-      if(unpack_chn_int_reqclose(raw_msg, raw_size, &chn_int_reqclose_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_INT_REQCLOSE:
+      if(unpack_chn_int_reqclose(raw_msg, raw_size, &tkn.chn_int_reqclose, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_int_reqclose(&chn_int_reqclose_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_END_CLOSE:;
-      chn_end_close_t chn_end_close_tkn;
-      if(unpack_chn_end_close(raw_msg, raw_size, &chn_end_close_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_END_CLOSE:
+      if(unpack_chn_end_close(raw_msg, raw_size, &tkn.chn_end_close, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_end_close(&chn_end_close_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_INT_CLOSE:;
-      chn_int_close_t chn_int_close_tkn;
-      if(unpack_chn_int_close(raw_msg, raw_size, &chn_int_close_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_INT_CLOSE:
+      if(unpack_chn_int_close(raw_msg, raw_size, &tkn.chn_int_close, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_int_close(&chn_int_close_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_END_CASHOUT:;
-      chn_end_cashout_t chn_end_cashout_tkn;
-      if(unpack_chn_end_cashout(raw_msg, raw_size, &chn_end_cashout_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_END_CASHOUT:
+      if(unpack_chn_end_cashout(raw_msg, raw_size, &tkn.chn_end_cashout, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_end_cashout(&chn_end_cashout_tkn, &addr, &rec);
       break;
-
-    case MT_NTYPE_CHN_INT_CASHOUT:;
-      chn_int_cashout_t chn_int_cashout_tkn;
-      if(unpack_chn_int_cashout(raw_msg, raw_size, &chn_int_cashout_tkn, &pid) != MT_SUCCESS)
+    case MT_NTYPE_CHN_INT_CASHOUT:
+      if(unpack_chn_int_cashout(raw_msg, raw_size, &tkn.chn_int_cashout, pid) != MT_SUCCESS)
 	return MT_ERROR;
-      result = handle_chn_int_cashout(&chn_int_cashout_tkn, &addr, &rec);
       break;
 
     default:
-      result = MT_ERROR;
+      return MT_ERROR;
+  }
+
+  if(write_log && log_job(job) != MT_SUCCESS){
+    job->result = MT_ERROR;
+    return MT_SUCCESS;
+  }
+
+  switch(job->type){
+    case MT_NTYPE_MAC_AUT_MINT:
+      result = handle_mac_aut_mint(&tkn.mac_aut_mint, addr, rec);
+      break;
+    case MT_NTYPE_MAC_ANY_TRANS:
+      result = handle_mac_any_trans(&tkn.mac_any_trans, addr, rec);
+      break;
+    case MT_NTYPE_CHN_END_SETUP:
+      result = handle_chn_end_setup(&tkn.chn_end_setup, addr, rec);
       break;
+    case MT_NTYPE_CHN_INT_SETUP:
+      result = handle_chn_int_setup(&tkn.chn_int_setup, addr, rec);
+      break;
+    case MT_NTYPE_CHN_INT_REQCLOSE:
+      result = handle_chn_int_reqclose(&tkn.chn_int_reqclose, addr, rec);
+      break;
+    case MT_NTYPE_CHN_END_CLOSE:
+      result = handle_chn_end_close(&tkn.chn_end_close, addr, rec);
+      break;
+    case MT_NTYPE_CHN_INT_CLOSE:
+      result = handle_chn_int_close(&tkn.chn_int_close, addr, rec);
+      break;
+    case MT_NTYPE_CHN_END_CASHOUT:
+      result = handle_chn_end_cashout(&tkn.chn_end_cashout, addr, rec);
+      break;
+    case MT_NTYPE_CHN_INT_CASHOUT:
+      result = handle_chn_int_cashout(&tkn.chn_int_cashout, addr, rec);
+      break;
+
+    default:
+      return MT_ERROR;
   }
 
+  job->result = result;
+  return MT_SUCCESS;
+}
+
+/**
+ * Send the confirmation for a job that has been applied and signed
+ */
+static int send_job(mt_lpay_job_t* job){
+
   // create confirmation message
   any_led_confirm_t response;
-  response.success = (result == MT_SUCCESS) ? MT_CODE_SUCCESS : MT_CODE_FAILURE;
-  memcpy(&response.receipt, &rec, sizeof(any_led_receipt_t));
+  response.success = (job->result == MT_SUCCESS) ? MT_CODE_SUCCESS : MT_CODE_FAILURE;
+  memcpy(&response.receipt, &job->rec, sizeof(any_led_receipt_t));
 
   // send confirmation message
   byte* response_msg;
-  int response_size = pack_any_led_confirm(&response, &pid, &response_msg);
+  int response_size = pack_any_led_confirm(&response, &job->pid, &response_msg);
 
-  if(mt_buffer_message(ledger.msgbuf, desc, MT_NTYPE_ANY_LED_CONFIRM, response_msg, response_size)
-     != MT_SUCCESS){
-    tor_free(raw_msg);
+  if(mt_buffer_message(ledger.msgbuf, &job->desc, MT_NTYPE_ANY_LED_CONFIRM, response_msg,
+		       response_size) != MT_SUCCESS){
     tor_free(response_msg);
     return MT_ERROR;
   }
-
-  tor_free(raw_msg);
   tor_free(response_msg);
 
-  if(result == MT_ERROR){
+  if(job->result == MT_ERROR){
     log_warn(LD_MT, "MoneTor: protocoal error processing message");
   }
+  return job->result;
+}
+
+/**
+ * Advance every job that can make progress. Verified jobs are applied in
+ * arrival order and handed to the sign stage; signed jobs are confirmed in
+ * that same order. Returns MT_ERROR if any job finished with an error.
+ */
+static int pump_pipeline(void){
+
+  int result = MT_SUCCESS;
+
+  while(smartlist_len(ledger.verify_queue) > 0){
+    mt_lpay_job_t* job = smartlist_get(ledger.verify_queue, 0);
+    if(!job->verify_done)
+      break;
+    smartlist_del_keeporder(ledger.verify_queue, 0);
+
+    if(!job->verified || apply_job(job, 1) != MT_SUCCESS){
+      free_job(job);
+      result = MT_ERROR;
+      continue;
+    }
+    ledger.stages[MT_LPAY_STAGE_APPLY].completed++;
+
+    smartlist_add(ledger.sign_queue, job);
+
+    // failed transactions carry no receipt so there is nothing to sign
+    if(job->result != MT_SUCCESS){
+      job->sign_done = 1;
+      continue;
+    }
+
+    if(get_options()->MoneTorLedgerReceiptBatch){
+      smartlist_add(ledger.sign_batch, job);
+      if(smartlist_len(ledger.sign_batch) >=
+	 MIN(get_options()->MoneTorLedgerReceiptBatch, MT_RECEIPT_MAX_BATCH))
+	dispatch_sign_batch();
+      continue;
+    }
+
+    // the transaction is already applied so the receipt must be signed
+    // here if the cpuworker cannot take it
+    if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_sign, (work_task)help_sign, job)){
+      log_warn(LD_MT, "MoneTor: cpu task returned error; signing inline");
+      cpu_task_sign(NULL, job);
+      job->sign_done = 1;
+      ledger.stages[MT_LPAY_STAGE_SIGN].completed++;
+    }
+  }
+
+  if(ledger.sign_batches_inflight == 0)
+    dispatch_sign_batch();
+
+  commit_log();
+
+  // confirmations are only released once the transaction is durable
+  while(smartlist_len(ledger.sign_queue) > 0){
+    mt_lpay_job_t* job = smartlist_get(ledger.sign_queue, 0);
+    if(!job->sign_done || job->log_seq > mt_ledgerlog_durable_seq())
+      break;
+    smartlist_del_keeporder(ledger.sign_queue, 0);
+
+    if(send_job(job) != MT_SUCCESS)
+      result = MT_ERROR;
+    free_job(job);
+  }
+
   return result;
 }
 
+/**
+ * Append a job to the ledger log if one is open. Every parsed transaction is
+ * logged, including ones the handler goes on to reject, since handlers may
+ * mutate state before rejecting a message. Returns MT_ERROR if the record
+ * could not be appended, in which case the transaction must not be applied.
+ */
+static int log_job(mt_lpay_job_t* job){
+  if(!mt_ledgerlog_is_open())
+    return MT_SUCCESS;
+  if(mt_ledgerlog_append(job->type, &job->addr, job->raw_msg, job->raw_size,
+			 &job->log_seq) != MT_SUCCESS){
+    log_warn(LD_MT, "MoneTor: could not append %s to ledger log; rejecting it",
+	     mt_token_describe(job->type));
+    job->log_seq = 0;
+    return MT_ERROR;
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Commit buffered log records once enough have accumulated; otherwise make
+ * sure the commit timer will pick them up after MoneTorLedgerCommitDelay
+ */
+static void commit_log(void){
+
+  int pending = mt_ledgerlog_pending();
+  if(pending == 0)
+    return;
+
+  if(pending >= get_options()->MoneTorLedgerCommitBatch){
+    if(ledger.commit_scheduled){
+      timer_disable(ledger.commit_timer);
+      ledger.commit_scheduled = 0;
+    }
+    if(mt_ledgerlog_commit() == MT_SUCCESS)
+      return;
+    // nothing else may arrive to trigger another attempt, so retry once the
+    // commit delay has passed
+    log_warn(LD_MT, "MoneTor: ledger log commit failed; retrying");
+  }
+
+  schedule_commit();
+}
+
+/**
+ * Arm the commit timer to fire after MoneTorLedgerCommitDelay unless it is
+ * already pending
+ */
+static void schedule_commit(void){
+  if(ledger.commit_scheduled)
+    return;
+  int delay = get_options()->MoneTorLedgerCommitDelay;
+  struct timeval tv = {.tv_sec = delay / 1000, .tv_usec = (delay % 1000) * 1000};
+  timer_schedule(ledger.commit_timer, &tv);
+  ledger.commit_scheduled = 1;
+}
+
+static void commit_timer_cb(tor_timer_t* timer, void* arg, const struct monotime_t* now){
+  (void)timer;
+  (void)arg;
+  (void)now;
+
+  ledger.commit_scheduled = 0;
+  if(mt_ledgerlog_commit() != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: ledger log commit failed");
+  pump_pipeline();
+}
+
+/**
+ * Reapply a logged transaction while restoring the ledger at startup
+ */
+static void replay_job(mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg, int size){
+
+  mt_lpay_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.type = type;
+  job.raw_msg = msg;
+  job.raw_size = size;
+  memcpy(job.addr, *addr, MT_SZ_ADDR);
+
+  if(apply_job(&job, 0) != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: could not replay logged %s", mt_token_describe(type));
+}
+
+/**
+ * Called on the main thread once a batch of signature checks has completed
+ */
+static int help_verify(void* args){
+  smartlist_t* batch = (smartlist_t*)args;
+
+  // the ledger was cleared while this batch was on the cpuworker
+  if(!ledger.verify_queue || batch_is_stale(batch)){
+    SMARTLIST_FOREACH(batch, mt_lpay_job_t*, job, free_job(job));
+    smartlist_free(batch);
+    return MT_ERROR;
+  }
+
+  finish_verify_batch(batch);
+
+  int result = dispatch_verify_batch();
+  if(pump_pipeline() != MT_SUCCESS)
+    result = MT_ERROR;
+  return result;
+}
+
+/**
+ * Called on the main thread once a receipt has been signed
+ */
+static int help_sign(void* args){
+  mt_lpay_job_t* job = (mt_lpay_job_t*)args;
+
+  // the ledger was cleared while this job was on the cpuworker
+  if(!ledger.sign_queue || job->generation != pipeline_generation){
+    free_job(job);
+    return MT_ERROR;
+  }
+
+  job->sign_done = 1;
+  ledger.stages[MT_LPAY_STAGE_SIGN].completed++;
+  return pump_pipeline();
+}
+
+/**
+ * Hand all receipts waiting for a signature to a cpuworker as a single batch
+ */
+static int dispatch_sign_batch(void){
+
+  if(smartlist_len(ledger.sign_batch) == 0)
+    return MT_SUCCESS;
+
+  smartlist_t* batch = ledger.sign_batch;
+  ledger.sign_batch = smartlist_new();
+  ledger.sign_batches_inflight++;
+
+  // these transactions are already applied so sign them here instead
+  if(!cpuworker_queue_work(WQ_PRI_HIGH, cpu_task_sign_batch, (work_task)help_sign_batch, batch)){
+    log_warn(LD_MT, "MoneTor: cpu task returned error; signing inline");
+    cpu_task_sign_batch(NULL, batch);
+    SMARTLIST_FOREACH_BEGIN(batch, mt_lpay_job_t*, job){
+      job->sign_done = 1;
+      ledger.stages[MT_LPAY_STAGE_SIGN].completed++;
+    } SMARTLIST_FOREACH_END(job);
+    smartlist_free(batch);
+    ledger.sign_batches_inflight--;
+  }
+  return MT_SUCCESS;
+}
+
+/**
+ * Called on the main thread once a batch of receipts has been signed
+ */
+static int help_sign_batch(void* args){
+  smartlist_t* batch = (smartlist_t*)args;
+
+  // the ledger was cleared while this batch was on the cpuworker
+  if(!ledger.sign_queue || batch_is_stale(batch)){
+    SMARTLIST_FOREACH(batch, mt_lpay_job_t*, job, free_job(job));
+    smartlist_free(batch);
+    return MT_ERROR;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(batch, mt_lpay_job_t*, job){
+    job->sign_done = 1;
+    ledger.stages[MT_LPAY_STAGE_SIGN].completed++;
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(batch);
+  ledger.sign_batches_inflight--;
+
+  dispatch_sign_batch();
+  return pump_pipeline();
+}
+
+/**
+ * Return true if the jobs in <b>batch</b> were received before the last
+ * mt_lpay_clear(); a batch never spans a clear
+ */
+static int batch_is_stale(smartlist_t* batch){
+  if(smartlist_len(batch) == 0)
+    return 0;
+  mt_lpay_job_t* job = smartlist_get(batch, 0);
+  return job->generation != pipeline_generation;
+}
+
+static void free_job(mt_lpay_job_t* job){
+  // every job ends here, whether it was confirmed or dropped along the way
+  tor_trace(mt, recv_end, MT_PARTY_LED, job->desc.id[0], job->desc.id[1], (int)job->type,
+	    job->verified ? job->result : MT_ERROR);
+  // raw_msg points into msg
+  mt_msgpool_put(job->msg, job->size);
+  tor_free(job);
+}
+
+static workqueue_reply_t cpu_task_verify(void* thread, void* args){
+  (void)thread;
+
+  mt_lpay_job_t* job = (mt_lpay_job_t*)args;
+  byte pk[MT_SZ_PK];
+
+  // verify signed message, produce addr to pass into handlers
+  job->raw_size = mt_verify_signed_msg(job->msg, job->size, &pk, &job->raw_msg);
+  job->verified = job->raw_size != MT_ERROR;
+  if(job->verified)
+    mt_pk2addr(&pk, &job->addr);
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t cpu_task_verify_batch(void* thread, void* args){
+  (void)thread;
+
+  smartlist_t* batch = (smartlist_t*)args;
+  int n = smartlist_len(batch);
+  byte** signed_msgs = tor_calloc(n, sizeof(byte*));
+  int* sizes = tor_calloc(n, sizeof(int));
+  byte (*pks)[MT_SZ_PK] = tor_calloc(n, MT_SZ_PK);
+  byte** raw_msgs = tor_calloc(n, sizeof(byte*));
+  int* raw_sizes = tor_calloc(n, sizeof(int));
+
+  SMARTLIST_FOREACH_BEGIN(batch, mt_lpay_job_t*, job){
+    signed_msgs[job_sl_idx] = job->msg;
+    sizes[job_sl_idx] = job->size;
+  } SMARTLIST_FOREACH_END(job);
+
+  // a failure only affects the messages that did not verify
+  mt_verify_signed_msgs(n, signed_msgs, sizes, pks, raw_msgs, raw_sizes);
+
+  SMARTLIST_FOREACH_BEGIN(batch, mt_lpay_job_t*, job){
+    job->raw_msg = raw_msgs[job_sl_idx];
+    job->raw_size = raw_sizes[job_sl_idx];
+    job->verified = job->raw_size != MT_ERROR;
+    if(job->verified)
+      mt_pk2addr(&pks[job_sl_idx], &job->addr);
+  } SMARTLIST_FOREACH_END(job);
+
+  tor_free(signed_msgs);
+  tor_free(sizes);
+  tor_free(pks);
+  tor_free(raw_msgs);
+  tor_free(raw_sizes);
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t cpu_task_sign(void* thread, void* args){
+  (void)thread;
+
+  // the ledger secret key is never modified after initialization
+  mt_lpay_job_t* job = (mt_lpay_job_t*)args;
+  if(job->result != MT_SUCCESS)
+    return WQ_RPL_REPLY;
+
+  // a receipt signed on its own leaves batch_size at 0 and needs no path
+  tor_assert(mt_receipt_sign(&job->rec, &ledger.sk) == MT_SUCCESS);
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t cpu_task_sign_batch(void* thread, void* args){
+  (void)thread;
+
+  smartlist_t* batch = (smartlist_t*)args;
+  int n = smartlist_len(batch);
+  any_led_receipt_t** recs = tor_calloc(n, sizeof(any_led_receipt_t*));
+  SMARTLIST_FOREACH(batch, mt_lpay_job_t*, job, recs[job_sl_idx] = &job->rec);
+  tor_assert(mt_receipt_sign_batch(n, recs, &ledger.sk) == MT_SUCCESS);
+  tor_free(recs);
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Write a new ledger snapshot if enough transactions have been logged since the
+ * last one, or unconditionally if <b>force</b> is set
+ */
+int mt_lpay_checkpoint(int force){
+
+  if(!mt_ledgerlog_is_open())
+    return MT_SUCCESS;
+
+  if(!force && mt_ledgerlog_since_snapshot() <
+     (uint64_t)get_options()->MoneTorLedgerSnapshotInterval)
+    return MT_SUCCESS;
+
+  return mt_ledgerlog_snapshot(ledger.mac_accounts, ledger.chn_accounts);
+}
+
 /**
  * Update the status of a descriptor (available/unavailable)
  */
@@ -284,7 +908,7 @@ int handle_mac_aut_mint(mac_aut_mint_t* token, byte (*addr)[MT_SZ_ADDR], any_led
     return MT_ERROR;
 
   // address is guaranteed to exist if module was setup with init()
-  mac_led_data_t* data = digestmap_get(ledger.mac_accounts, (char*)ledger.aut_addr);
+  mac_led_data_t* data = mt_acctable_get(ledger.mac_accounts, ledger.aut_addr);
   data->bal += token->value;
 
   // write the transaction receipt
@@ -292,7 +916,6 @@ int handle_mac_aut_mint(mac_aut_mint_t* token, byte (*addr)[MT_SZ_ADDR], any_led
   rec->val = token->value;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, *addr, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -306,19 +929,17 @@ int handle_mac_any_trans(mac_any_trans_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   if(memcmp(addr, token->from, MT_SZ_ADDR) != 0)
     return MT_ERROR;
 
-  mac_led_data_t* data_from = digestmap_get(ledger.mac_accounts, (char*)token->from);
+  mac_led_data_t* data_from = mt_acctable_get(ledger.mac_accounts, token->from);
 
   // check that the "from" address exists
   if(data_from == NULL)
     return MT_ERROR;
 
-  mac_led_data_t* data_to = digestmap_get(ledger.mac_accounts, (char*)token->to);
+  mac_led_data_t* data_to = mt_acctable_get(ledger.mac_accounts, token->to);
   // if the address doesn't exist then create it
 
-  if(data_to == NULL){
-    data_to = calloc(1, sizeof(mac_led_data_t));
-    digestmap_set(ledger.mac_accounts, (char*)token->to, data_to);
-  }
+  if(data_to == NULL)
+    data_to = mt_acctable_add(ledger.mac_accounts, token->to);
 
   int* bal_from = &(data_from->bal);
   int* bal_to = &(data_to->bal);
@@ -330,7 +951,6 @@ int handle_mac_any_trans(mac_any_trans_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   rec->val = token->val_to;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->to, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -359,8 +979,8 @@ int handle_chn_end_setup(chn_end_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
     return MT_ERROR;
   }
 
-  mac_led_data_t* data_from = digestmap_get(ledger.mac_accounts, (char*)token->from);
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  mac_led_data_t* data_from = mt_acctable_get(ledger.mac_accounts, token->from);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // if MoneTorPublicMint is on then user can set up channels for free
   if(!get_options()->MoneTorPublicMint){
@@ -370,18 +990,15 @@ int handle_chn_end_setup(chn_end_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
     }
   }
   else {
-    if(data_from == NULL){
-      data_from = calloc(1, sizeof(mac_led_data_t));
-      digestmap_set(ledger.mac_accounts, (char*)token->from, data_from);
-    }
+    if(data_from == NULL)
+      data_from = mt_acctable_add(ledger.mac_accounts, token->from);
     data_from->bal += token->val_from;
   }
 
   // if the channel doesn't exist then create one
   if(data_chn == NULL){
-    data_chn = calloc(1, sizeof(chn_led_data_t));
+    data_chn = mt_acctable_add(ledger.chn_accounts, token->chn);
     data_chn->state = MT_LSTATE_EMPTY;
-    digestmap_set(ledger.chn_accounts, (char*)token->chn, data_chn);
   }
 
   // check that we have a new and unused channel address
@@ -411,7 +1028,6 @@ int handle_chn_end_setup(chn_end_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   rec->val = token->val_to;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -430,8 +1046,8 @@ int handle_chn_int_setup(chn_int_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
     return MT_ERROR;
   }
 
-  mac_led_data_t* data_from = digestmap_get(ledger.mac_accounts, (char*)token->from);
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  mac_led_data_t* data_from = mt_acctable_get(ledger.mac_accounts, token->from);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the token public data is internally consistent
   byte token_addr[MT_SZ_ADDR];
@@ -451,10 +1067,8 @@ int handle_chn_int_setup(chn_int_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
     }
   }
   else {
-    if(data_from == NULL){
-      data_from = calloc(1, sizeof(mac_led_data_t));
-      digestmap_set(ledger.mac_accounts, (char*)token->from, data_from);
-    }
+    if(data_from == NULL)
+      data_from = mt_acctable_add(ledger.mac_accounts, token->from);
     data_from->bal += token->val_from;
   }
 
@@ -497,7 +1111,6 @@ int handle_chn_int_setup(chn_int_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   rec->val = token->val_to;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -510,7 +1123,7 @@ int handle_chn_int_setup(chn_int_setup_t* token, byte (*addr)[MT_SZ_ADDR], any_l
  */
 int handle_chn_int_reqclose(chn_int_reqclose_t* token, byte (*addr)[MT_SZ_ADDR], any_led_receipt_t* rec){
 
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the channel address exists
   if(data_chn == NULL)
@@ -532,7 +1145,6 @@ int handle_chn_int_reqclose(chn_int_reqclose_t* token, byte (*addr)[MT_SZ_ADDR],
   rec->val = 0;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -544,7 +1156,7 @@ int handle_chn_int_reqclose(chn_int_reqclose_t* token, byte (*addr)[MT_SZ_ADDR],
  */
 int handle_chn_end_close(chn_end_close_t* token, byte (*addr)[MT_SZ_ADDR], any_led_receipt_t* rec){
 
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the channel address exists
   if(data_chn == NULL)
@@ -567,7 +1179,6 @@ int handle_chn_end_close(chn_end_close_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   rec->val = 0;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -579,7 +1190,7 @@ int handle_chn_end_close(chn_end_close_t* token, byte (*addr)[MT_SZ_ADDR], any_l
  */
 int handle_chn_int_close(chn_int_close_t* token, byte (*addr)[MT_SZ_ADDR], any_led_receipt_t* rec){
 
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the channel address exists and is a channel address
   if(data_chn == NULL)
@@ -601,7 +1212,6 @@ int handle_chn_int_close(chn_int_close_t* token, byte (*addr)[MT_SZ_ADDR], any_l
   rec->val = 0;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return MT_SUCCESS;
 }
@@ -613,7 +1223,7 @@ int handle_chn_int_close(chn_int_close_t* token, byte (*addr)[MT_SZ_ADDR], any_l
  */
 int handle_chn_end_cashout(chn_end_cashout_t* token, byte (*addr)[MT_SZ_ADDR], any_led_receipt_t* rec){
 
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the channel address exists
   if(data_chn == NULL)
@@ -623,7 +1233,7 @@ int handle_chn_end_cashout(chn_end_cashout_t* token, byte (*addr)[MT_SZ_ADDR], a
   if(memcmp(addr, data_chn->end_addr, MT_SZ_ADDR))
     return MT_ERROR;
 
-  mac_led_data_t* data_to = digestmap_get(ledger.mac_accounts, (char*)addr);
+  mac_led_data_t* data_to = mt_acctable_get(ledger.mac_accounts, *addr);
 
   // attempt to close the channel if it isn't already
   if(close_channel(data_chn) == MT_ERROR)
@@ -640,7 +1250,6 @@ int handle_chn_end_cashout(chn_end_cashout_t* token, byte (*addr)[MT_SZ_ADDR], a
   rec->val = 0;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return result;
 }
@@ -651,7 +1260,7 @@ int handle_chn_end_cashout(chn_end_cashout_t* token, byte (*addr)[MT_SZ_ADDR], a
  */
 int handle_chn_int_cashout(chn_int_cashout_t* token, byte (*addr)[MT_SZ_ADDR], any_led_receipt_t* rec){
 
-  chn_led_data_t* data_chn = digestmap_get(ledger.chn_accounts, (char*)token->chn);
+  chn_led_data_t* data_chn = mt_acctable_get(ledger.chn_accounts, token->chn);
 
   // check that the channel address exists
   if(data_chn == NULL)
@@ -661,7 +1270,7 @@ int handle_chn_int_cashout(chn_int_cashout_t* token, byte (*addr)[MT_SZ_ADDR], a
   if(memcmp(addr, data_chn->int_addr, MT_SZ_ADDR))
     return MT_ERROR;
 
-  mac_led_data_t* data_to = digestmap_get(ledger.mac_accounts, (char*)addr);
+  mac_led_data_t* data_to = mt_acctable_get(ledger.mac_accounts, *addr);
 
   // attempt to close the channel if it isn't already
   if(close_channel(data_chn) == MT_ERROR)
@@ -679,7 +1288,6 @@ int handle_chn_int_cashout(chn_int_cashout_t* token, byte (*addr)[MT_SZ_ADDR], a
   rec->val = 0;
   memcpy(rec->from, *addr, MT_SZ_ADDR);
   memcpy(rec->to, token->chn, MT_SZ_ADDR);
-  tor_assert(mt_receipt_sign(rec, &ledger.sk) == MT_SUCCESS);
 
   return result;
 }
@@ -711,7 +1319,7 @@ int transfer(int* bal_from, int* bal_to, int val_from, int val_to, int val_auth)
   *bal_from -= val_from;
   *bal_to += val_to;
 
-  mac_led_data_t* aut_data = digestmap_get(ledger.mac_accounts, (char*)ledger.aut_addr);
+  mac_led_data_t* aut_data = mt_acctable_get(ledger.mac_accounts, ledger.aut_addr);
   aut_data->bal += (val_from - val_to);
   return MT_SUCCESS;
 }
@@ -773,26 +1381,36 @@ void resolve(byte (*pp)[MT_SZ_PP], chn_end_public_t T_E, chn_int_public_t T_I,
 
 int mt_lpay_clear(void){
 
-  const char* key;
-  void* val;
-  digestmap_iter_t* i;
+  mt_acctable_free(ledger.mac_accounts);
+  mt_acctable_free(ledger.chn_accounts);
 
-  // tor_free all mac accounts
-  for(i = digestmap_iter_init(ledger.mac_accounts); !(digestmap_iter_done(i)); ){
-    digestmap_iter_get(i, &key, &val);
-    i = digestmap_iter_next_rmv(ledger.mac_accounts, i);
-    tor_free(val);
+  // drop any transactions still in the pipeline
+  if(ledger.verify_queue){
+    SMARTLIST_FOREACH(ledger.verify_queue, mt_lpay_job_t*, job, if(job->verify_done) free_job(job));
+    smartlist_free(ledger.verify_queue);
   }
-
-  // tor_free all channel accounts
-  for(i = digestmap_iter_init(ledger.chn_accounts); !(digestmap_iter_done(i)); ){
-    digestmap_iter_get(i, &key, &val);
-    i = digestmap_iter_next_rmv(ledger.chn_accounts, i);
-    tor_free(val);
+  if(ledger.sign_queue){
+    SMARTLIST_FOREACH(ledger.sign_queue, mt_lpay_job_t*, job, if(job->sign_done) free_job(job));
+    smartlist_free(ledger.sign_queue);
   }
+  if(ledger.verify_batch){
+    SMARTLIST_FOREACH(ledger.verify_batch, mt_lpay_job_t*, job, free_job(job));
+    smartlist_free(ledger.verify_batch);
+  }
+  if(ledger.sign_batch){
+    SMARTLIST_FOREACH(ledger.sign_batch, mt_lpay_job_t*, job, free_job(job));
+    smartlist_free(ledger.sign_batch);
+  }
+
+  if(ledger.commit_timer)
+    timer_free(ledger.commit_timer);
+  mt_ledgerlog_close();
+  mt_messagebuffer_free(ledger.msgbuf);
 
-  // overwrite ledger state with zeros
+  // overwrite ledger state with zeros; jobs still on a cpuworker are freed
+  // by their reply handler once it sees the generation has moved on
   memset(&ledger, 0, sizeof(ledger));
+  pipeline_generation++;
   return MT_SUCCESS;
 }
 
@@ -809,29 +1427,28 @@ int mt_lpay_import(byte* import){
 //--------------------------------- Testing Functions -----------------------------------//
 
 int mt_lpay_query_mac_balance(byte (*addr)[MT_SZ_ADDR]){
-  mac_led_data_t* mac_ptr = digestmap_get(ledger.mac_accounts, (char*)addr);
+  mac_led_data_t* mac_ptr = mt_acctable_get(ledger.mac_accounts, *addr);
   if(mac_ptr == NULL)
     return MT_ERROR;
   return mac_ptr->bal;
 }
 
 int mt_lpay_query_end_balance(byte (*addr)[MT_SZ_ADDR]){
-  chn_led_data_t* chn_ptr = digestmap_get(ledger.chn_accounts, (char*)addr);
+  chn_led_data_t* chn_ptr = mt_acctable_get(ledger.chn_accounts, *addr);
   if(chn_ptr == NULL)
     return MT_ERROR;
   return chn_ptr->end_bal;
 }
 
 int mt_lpay_query_int_balance(byte (*addr)[MT_SZ_ADDR]){
-  chn_led_data_t* chn_ptr = digestmap_get(ledger.chn_accounts, (char*)addr);
+  chn_led_data_t* chn_ptr = mt_acctable_get(ledger.chn_accounts, *addr);
   if(chn_ptr == NULL)
     return MT_ERROR;
   return chn_ptr->int_bal;
 }
 
 int mt_lpay_set_balance(byte (*addr)[MT_SZ_ADDR], int balance){
-  mac_led_data_t* entry = calloc(1, sizeof(mac_led_data_t));
+  mac_led_data_t* entry = mt_acctable_add(ledger.mac_accounts, *addr);
   entry->bal = balance;
-  digestmap_set(ledger.mac_accounts, (char*)(*addr), entry);
   return MT_SUCCESS;
 }
@@ -22,6 +22,25 @@ typedef struct {
   byte led_pk[MT_SZ_PK];
 } mt_payment_public_t;
 
+/**
+ * Stages of the ledger transaction pipeline
+ */
+typedef enum {
+  MT_LPAY_STAGE_VERIFY,
+  MT_LPAY_STAGE_APPLY,
+  MT_LPAY_STAGE_SIGN,
+  MT_LPAY_NUM_STAGES,
+} mt_lpay_stage_type_t;
+
+/**
+ * Snapshot of the ledger transaction pipeline, indexed by mt_lpay_stage_type_t
+ */
+typedef struct {
+  int depth[MT_LPAY_NUM_STAGES];
+  uint64_t completed[MT_LPAY_NUM_STAGES];
+  double rate[MT_LPAY_NUM_STAGES];
+} mt_lpay_pipeline_stats_t;
+
 /**
  * Initialize a ledger instance given public input parameters
  * <b>pp<\b>, a per-ledger-post fee <b>fee<\b>, an intermediary tax
@@ -46,6 +65,25 @@ mt_payment_public_t mt_lpay_get_payment_public(void);
  */
 int mt_lpay_set_status(mt_desc_t* desc, int status);
 
+/**
+ * Report the current depth, total completed jobs, and jobs per second of each
+ * stage of the transaction pipeline
+ */
+void mt_lpay_pipeline_stats(mt_lpay_pipeline_stats_t* stats_out);
+
+/**
+ * Recompute per-stage throughput and expire held confirmations; should be
+ * called once a second
+ */
+void mt_lpay_pipeline_tick(time_t now);
+
+/**
+ * Write a new ledger snapshot if MoneTorLedgerSnapshotInterval transactions
+ * have been logged since the last one, or unconditionally if <b>force</b> is
+ * set. Does nothing if the ledger is not logged.
+ */
+int mt_lpay_checkpoint(int force);
+
 
 /********************** Instance Management ***********************/
 
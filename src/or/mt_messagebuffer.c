@@ -7,11 +7,20 @@
  * circuit is ready. The messages are sent immediately if possible. If
  * not, they are stored in a buffer until the circuit becomes
  * available.
+ *
+ * Held messages live in a fixed-size ring per descriptor and the buffer as a
+ * whole is capped in bytes, so a descriptor that keeps flapping cannot make
+ * it grow without bound. Messages also expire after MoneTorMsgBufTTL. When a
+ * descriptor comes back online its messages are resent a burst at a time,
+ * with the remainder spread over later event loop turns by a timer.
  */
 
+#include "or.h"
 #include "container.h"
+#include "config.h"
 #include "mt_common.h"
 #include "mt_messagebuffer.h"
+#include "trace/events.h"
 
 
 typedef struct {
@@ -21,9 +30,26 @@ typedef struct {
   mt_ntype_t type;
   byte* msg;
   int size;
+  time_t created;
 } message_t;
 
+/**
+ * Status and held messages of a single descriptor. The ring is only
+ * allocated while it holds messages.
+ */
+typedef struct {
+  mt_desc_t desc;
+  int status;
+  int replaying;
+  int pending;
+  message_t** ring;
+  int cap;
+  int head;
+  int len;
+} desc_entry_t;
+
 static int mt_add_to_buffer(mt_msgbuf_t* msgbuf, mt_desc_t* desc, message_t* message);
+static void replay_timer_cb(tor_timer_t* timer, void* arg, const struct monotime_t* now);
 
 /**
  * Initialize the module. This function can be safely called multiple
@@ -32,108 +58,281 @@ static int mt_add_to_buffer(mt_msgbuf_t* msgbuf, mt_desc_t* desc, message_t* mes
 mt_msgbuf_t* mt_messagebuffer_init(void){
 
   mt_msgbuf_t* msgbuf = tor_calloc(1, sizeof(mt_msgbuf_t));
+  msgbuf->descs = mt_descmap_new();
+  msgbuf->replay_pending = smartlist_new();
+  return msgbuf;
+}
 
-  if(!msgbuf->statuses)
-    msgbuf->statuses = digestmap_new();
-  if(!msgbuf->buffers)
-    msgbuf->buffers = digestmap_new();
+static void free_message(message_t* message){
+  tor_free(message->msg);
+  tor_free(message);
+}
 
-  return msgbuf;
+static desc_entry_t* get_entry(mt_msgbuf_t* msgbuf, mt_desc_t* desc, int create){
+
+  desc_entry_t* entry = mt_descmap_get(msgbuf->descs, desc);
+  if(!entry && create){
+    entry = tor_calloc(1, sizeof(desc_entry_t));
+    entry->desc = *desc;
+    mt_descmap_set(msgbuf->descs, desc, entry);
+  }
+  return entry;
 }
 
 /**
- * Set the status of the descriptor as either available (1) or
- * unavailable (0)
+ * Remove and return the oldest message held for <b>entry</b>
  */
-int mt_set_desc_status(mt_msgbuf_t* msgbuf, mt_desc_t* desc, int status_new){
+static message_t* ring_pop(mt_msgbuf_t* msgbuf, desc_entry_t* entry){
+
+  message_t* message = entry->ring[entry->head];
+  entry->ring[entry->head] = NULL;
+  entry->head = (entry->head + 1) % entry->cap;
+  entry->len--;
+
+  msgbuf->stats.depth--;
+  msgbuf->stats.bytes -= message->size;
+
+  if(entry->len == 0){
+    tor_free(entry->ring);
+    entry->head = 0;
+  }
+  return message;
+}
+
+static void ring_push(mt_msgbuf_t* msgbuf, desc_entry_t* entry, message_t* message){
+
+  if(!entry->ring){
+    entry->cap = MAX(get_options()->MoneTorMsgBufPerDesc, 1);
+    entry->ring = tor_calloc(entry->cap, sizeof(message_t*));
+    entry->head = 0;
+  }
+
+  entry->ring[(entry->head + entry->len) % entry->cap] = message;
+  entry->len++;
+
+  msgbuf->stats.depth++;
+  msgbuf->stats.bytes += message->size;
+}
+
+/**
+ * Discard the messages of <b>entry</b> that are older than MoneTorMsgBufTTL.
+ * Messages are held in order so only the front of the ring needs checking.
+ */
+static void drop_expired(mt_msgbuf_t* msgbuf, desc_entry_t* entry, time_t now){
+
+  int ttl = get_options()->MoneTorMsgBufTTL;
+  if(ttl <= 0)
+    return;
+
+  while(entry->len > 0 && entry->ring[entry->head]->created + ttl <= now){
+    message_t* message = ring_pop(msgbuf, entry);
+    log_info(LD_MT, "MoneTor: dropping expired %s for %s",
+	     mt_token_describe(message->type), mt_desc_describe(&entry->desc));
+    free_message(message);
+    msgbuf->stats.dropped_expired++;
+  }
+}
+
+/**
+ * Resend up to <b>budget</b> messages of <b>entry</b>. Returns the number of
+ * messages still held.
+ */
+static int replay_entry(mt_msgbuf_t* msgbuf, desc_entry_t* entry, int budget){
+
+  drop_expired(msgbuf, entry, approx_time());
+
+  // sending may call back into mt_set_desc_status() for this descriptor
+  entry->replaying = 1;
+  while(entry->status && entry->len > 0 && budget-- > 0){
+
+    message_t* elm = entry->ring[entry->head];
+    log_info(LD_MT, "MoneTor: descriptor %s is back online, resending %s",
+	     mt_desc_describe(&entry->desc), mt_token_describe(elm->type));
+
+    int result;
+
+    if(!elm->is_multidesc)
+      result = mt_send_message(&elm->desc1, elm->type, elm->msg, elm->size);
+    else
+      result = mt_send_message_multidesc(&elm->desc1, &elm->desc2, elm->type,
+					 elm->msg, elm->size);
+
+    if(result == 0){
+      free_message(ring_pop(msgbuf, entry));
+      msgbuf->stats.replayed++;
+    }
+    else{
+      log_info(LD_MT, "Descriptor disconnected while sending messages\n");
+      entry->status = 0;
+    }
+  }
+  entry->replaying = 0;
+  return entry->len;
+}
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
+/**
+ * Resend the rest of <b>entry</b>'s messages on later event loop turns
+ */
+static void schedule_replay(mt_msgbuf_t* msgbuf, desc_entry_t* entry){
 
-  int* status = digestmap_get(msgbuf->statuses, (char*)digest);
-  if(!status){
-    status = tor_calloc(1, sizeof(int));
-    digestmap_set(msgbuf->statuses, (char*)digest, status);
+  if(!entry->pending){
+    entry->pending = 1;
+    smartlist_add(msgbuf->replay_pending, entry);
   }
 
-  *status = status_new;
+  if(!msgbuf->replay_timer)
+    msgbuf->replay_timer = timer_new(replay_timer_cb, msgbuf);
+  struct timeval tv = {0, 0};
+  timer_schedule(msgbuf->replay_timer, &tv);
+}
 
-  smartlist_t* buffer;
-  if(*status && (buffer = digestmap_get(msgbuf->buffers, (char*)digest))){
+static void replay_timer_cb(tor_timer_t* timer, void* arg, const struct monotime_t* now){
+  (void)now;
 
-    SMARTLIST_FOREACH_BEGIN(buffer, message_t*, elm){
+  mt_msgbuf_t* msgbuf = (mt_msgbuf_t*)arg;
+  if(mt_messagebuffer_replay(msgbuf) > 0){
+    struct timeval tv = {0, 0};
+    timer_schedule(timer, &tv);
+  }
+}
 
-      log_info(LD_MT, "MoneTor: descriptor %s is back online, resending %s",
-	       mt_desc_describe(desc), mt_token_describe(elm->type));
+int mt_messagebuffer_replay(mt_msgbuf_t* msgbuf){
+
+  int burst = MAX(get_options()->MoneTorMsgBufReplayBurst, 1);
+
+  SMARTLIST_FOREACH_BEGIN(msgbuf->replay_pending, desc_entry_t*, entry){
+    if(!entry->status || entry->replaying || replay_entry(msgbuf, entry, burst) == 0 ||
+       !entry->status){
+      entry->pending = 0;
+      SMARTLIST_DEL_CURRENT_KEEPORDER(msgbuf->replay_pending, entry);
+    }
+  } SMARTLIST_FOREACH_END(entry);
+
+  return smartlist_len(msgbuf->replay_pending);
+}
 
-      int result;
+/**
+ * Set the status of the descriptor as either available (1) or
+ * unavailable (0)
+ */
+int mt_set_desc_status(mt_msgbuf_t* msgbuf, mt_desc_t* desc, int status_new){
 
-      if(!elm->is_multidesc)
-        result = mt_send_message(&elm->desc1, elm->type, elm->msg, elm->size);
-      else
-        result = mt_send_message_multidesc(&elm->desc1, &elm->desc2, elm->type,
-            elm->msg, elm->size);
+  desc_entry_t* entry = get_entry(msgbuf, desc, 1);
+  entry->status = status_new;
 
-      if(result == 0){
-        tor_free(elm);
-	SMARTLIST_DEL_CURRENT(buffer, elm);
-      }
-      else{
-        log_info(LD_MT, "Descriptor disconnected while sending messages\n");
-        *status = 0;
-        break;
-      }
-    } SMARTLIST_FOREACH_END(elm);
+  if(entry->status && entry->len > 0 && !entry->replaying){
+    if(replay_entry(msgbuf, entry, MAX(get_options()->MoneTorMsgBufReplayBurst, 1)) > 0 &&
+       entry->status)
+      schedule_replay(msgbuf, entry);
   }
 
   return 0;
 }
 
+void mt_messagebuffer_expire(mt_msgbuf_t* msgbuf, time_t now){
+  MT_DESCMAP_FOREACH(msgbuf->descs, desc, desc_entry_t*, entry){
+    drop_expired(msgbuf, entry, now);
+  } MT_DESCMAP_FOREACH_END;
+}
+
+void mt_messagebuffer_stats(mt_msgbuf_t* msgbuf, mt_msgbuf_stats_t* stats_out){
+  memcpy(stats_out, &msgbuf->stats, sizeof(mt_msgbuf_stats_t));
+}
+
+void mt_messagebuffer_free(mt_msgbuf_t* msgbuf){
+
+  if(!msgbuf)
+    return;
+
+  MT_DESCMAP_FOREACH_MODIFY(msgbuf->descs, desc, desc_entry_t*, entry){
+    while(entry->len > 0)
+      free_message(ring_pop(msgbuf, entry));
+    tor_free(entry);
+    MAP_DEL_CURRENT(desc);
+  } MT_DESCMAP_FOREACH_END;
+  mt_descmap_free(msgbuf->descs, NULL);
+  smartlist_free(msgbuf->replay_pending);
+  if(msgbuf->replay_timer)
+    timer_free(msgbuf->replay_timer);
+  tor_free(msgbuf);
+}
+
 /**
  * Helper function for <b>mt_send_message</b> and
  * <b>mt_send_message_multidesc</b>
  */
 static int mt_add_to_buffer(mt_msgbuf_t* msgbuf, mt_desc_t* desc, message_t* message){
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(desc, &digest);
-
   log_info(LD_MT, "MoneTor: buffering message to be sent when %s is back online",
 	   mt_desc_describe(desc));
 
-  // create new status element if necessary
-  int* status = digestmap_get(msgbuf->statuses, (char*)digest);
-  if(!status){
-    status = tor_calloc(1, sizeof(int));
-    digestmap_set(msgbuf->statuses, (char*)digest, status);
-  }
-  else{
-    // message should have gone through if status is available
-    //tor_assert(*status == 0);
-    log_warn(LD_MT, "MoneTor: Status should be zero but isn't");
-    *status = 0;
+  time_t now = approx_time();
+  message->created = now;
+
+  desc_entry_t* entry = get_entry(msgbuf, desc, 1);
+  drop_expired(msgbuf, entry, now);
+
+  // make room in this descriptor's ring by dropping its oldest message
+  if(entry->ring && entry->len == entry->cap){
+    message_t* oldest = ring_pop(msgbuf, entry);
+    log_info(LD_MT, "MoneTor: buffer for %s is full, dropping %s",
+	     mt_desc_describe(desc), mt_token_describe(oldest->type));
+    free_message(oldest);
+    msgbuf->stats.dropped_full++;
   }
-  // create new buffer element if necessary
-  smartlist_t* buffer = digestmap_get(msgbuf->buffers, (char*)digest);
-  if(!buffer){
-    buffer = smartlist_new();
-    digestmap_set(msgbuf->buffers, (char*)digest, buffer);
+
+  // past the memory cap push back on the payment module instead
+  uint64_t max_bytes = get_options()->MoneTorMsgBufMaxBytes;
+  if(msgbuf->stats.bytes + message->size > max_bytes){
+    mt_messagebuffer_expire(msgbuf, now);
+    if(msgbuf->stats.bytes + message->size > max_bytes){
+      log_warn(LD_MT, "MoneTor: message buffer is full, refusing %s for %s",
+	       mt_token_describe(message->type), mt_desc_describe(desc));
+      free_message(message);
+      msgbuf->stats.refused++;
+      return MT_ERROR;
+    }
   }
 
-  // add message to buffer
-  smartlist_add(buffer, message);
+  ring_push(msgbuf, entry, message);
+  tor_trace(mt, buffer_hold, desc->id[0], desc->id[1], (int)desc->party,
+	    (int)message->type, message->size, msgbuf->stats.depth);
   return MT_SUCCESS;
 }
 
+/**
+ * Return 1 if messages to <b>desc</b> must wait behind ones that are still
+ * being resent, so that they keep their order
+ */
+static int must_queue(mt_msgbuf_t* msgbuf, mt_desc_t* desc){
+  desc_entry_t* entry = get_entry(msgbuf, desc, 0);
+  return entry && entry->status && entry->len > 0;
+}
+
+/**
+ * Mark <b>desc</b> unavailable after a failed send
+ */
+static void mark_unavailable(mt_msgbuf_t* msgbuf, mt_desc_t* desc){
+  desc_entry_t* entry = get_entry(msgbuf, desc, 1);
+  entry->status = 0;
+}
+
 /**
  * Attempt to invoke an <b>mt_send_message</b> call. If the attempt
  * returns and ERROR, then queue the request and try again later.
  */
 int mt_buffer_message(mt_msgbuf_t* msgbuf, mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
 
+  // the message could not be packed
+  if(size < 0)
+    return MT_ERROR;
+
   // attempt to send message; if it goes through then we're done
-  if(mt_send_message(desc, type, msg, size) != MT_ERROR){
-    return MT_SUCCESS;
+  if(!must_queue(msgbuf, desc)){
+    if(mt_send_message(desc, type, msg, size) != MT_ERROR){
+      return MT_SUCCESS;
+    }
+    mark_unavailable(msgbuf, desc);
   }
 
   // create message to buffer
@@ -155,9 +354,16 @@ int mt_buffer_message(mt_msgbuf_t* msgbuf, mt_desc_t *desc, mt_ntype_t type, byt
 int mt_buffer_message_multidesc(mt_msgbuf_t* msgbuf, mt_desc_t* desc1, mt_desc_t* desc2,
 				mt_ntype_t type, byte* msg, int size){
 
+  // the message could not be packed
+  if(size < 0)
+    return MT_ERROR;
+
   // attempt to send message; if it goes through then we're done
-  if(mt_send_message_multidesc(desc1, desc2, type, msg, size) != MT_ERROR){
-    return MT_SUCCESS;
+  if(!must_queue(msgbuf, desc1)){
+    if(mt_send_message_multidesc(desc1, desc2, type, msg, size) != MT_ERROR){
+      return MT_SUCCESS;
+    }
+    mark_unavailable(msgbuf, desc1);
   }
 
   // create message to buffer
@@ -9,10 +9,34 @@
 #define mt_messagebuffer_h
 
 #include "or.h"
+#include "timers.h"
+#include "mt_descmap.h"
 
+/**
+ * Counters describing the state of a message buffer
+ */
 typedef struct {
-  digestmap_t* statuses;
-  digestmap_t* buffers;
+  /* messages currently held */
+  int depth;
+  /* bytes of message payload currently held */
+  size_t bytes;
+  /* held messages that were eventually sent */
+  uint64_t replayed;
+  /* oldest messages discarded to make room for a newer one */
+  uint64_t dropped_full;
+  /* messages discarded because they outlived MoneTorMsgBufTTL */
+  uint64_t dropped_expired;
+  /* messages refused because the memory cap was reached */
+  uint64_t refused;
+} mt_msgbuf_stats_t;
+
+typedef struct {
+  /* desc -> per-descriptor status and ring of held messages */
+  mt_descmap_t* descs;
+  /* descriptors that are back online but still have messages to resend */
+  smartlist_t* replay_pending;
+  tor_timer_t* replay_timer;
+  mt_msgbuf_stats_t stats;
 } mt_msgbuf_t;
 
 /**
@@ -20,15 +44,26 @@ typedef struct {
  */
 mt_msgbuf_t* mt_messagebuffer_init(void);
 
+/**
+ * Release the buffer along with every message it still holds
+ */
+void mt_messagebuffer_free(mt_msgbuf_t* msgbuf);
+
 /**
  * Set the status of the descriptor as either available (1) or
- * unavailable (0)
+ * unavailable (0). When a descriptor comes back online, at most
+ * MoneTorMsgBufReplayBurst of its held messages are resent right away and
+ * the rest on later event loop turns.
  */
 int mt_set_desc_status(mt_msgbuf_t* msgbuf, mt_desc_t* desc, int status);
 
 /**
  * Attempt to invoke an <b>mt_send_message</b> call. If the attempt
  * returns and ERROR, then queue the request and try again later.
+ *
+ * Each descriptor holds at most MoneTorMsgBufPerDesc messages, dropping its
+ * oldest one to make room. A message that would take the buffer past
+ * MoneTorMsgBufMaxBytes is refused with MT_ERROR.
  */
 int mt_buffer_message(mt_msgbuf_t* msgbuf, mt_desc_t *desc, mt_ntype_t type, byte* msg, int size);
 
@@ -40,4 +75,21 @@ int mt_buffer_message(mt_msgbuf_t* msgbuf, mt_desc_t *desc, mt_ntype_t type, byt
 int mt_buffer_message_multidesc(mt_msgbuf_t* msgbuf, mt_desc_t* desc1, mt_desc_t* desc2,
 				mt_ntype_t type, byte* msg, int size);
 
+/**
+ * Resend up to MoneTorMsgBufReplayBurst held messages for every descriptor
+ * that is back online. Called from the replay timer; returns the number of
+ * descriptors that still have messages waiting.
+ */
+int mt_messagebuffer_replay(mt_msgbuf_t* msgbuf);
+
+/**
+ * Discard every held message older than MoneTorMsgBufTTL
+ */
+void mt_messagebuffer_expire(mt_msgbuf_t* msgbuf, time_t now);
+
+/**
+ * Write the current depth and drop counters to <b>stats_out</b>
+ */
+void mt_messagebuffer_stats(mt_msgbuf_t* msgbuf, mt_msgbuf_stats_t* stats_out);
+
 #endif
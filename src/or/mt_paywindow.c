@@ -0,0 +1,103 @@
+/**
+ * \file mt_paywindow.c
+ *
+ * Size the payment window of a circuit hop from what the hop actually
+ * carries. The fixed scheme pays whenever the window falls one payment unit
+ * below MoneTorInitialWindow, which stalls fast circuits behind the payment
+ * round trip and makes slow ones pay far ahead of their use. Here the cell
+ * rate and the payment round trip are smoothed with an EWMA; a payment starts
+ * once the window could not outlast the next round trip and tops the window
+ * up to what the hop is expected to use over MoneTorPaymentLatencyBudget.
+ */
+
+#include "or.h"
+#include "config.h"
+#include "mt_common.h"
+#include "mt_paywindow.h"
+
+/** Weight of a new sample in the smoothed rate and round trip */
+#define MT_PAYWINDOW_ALPHA 0.25
+/** Headroom on the round trip when deciding to start a payment */
+#define MT_PAYWINDOW_RTT_MARGIN 1.5
+
+mt_paywindow_t* mt_paywindow_new(void){
+  return tor_calloc(1, sizeof(mt_paywindow_t));
+}
+
+void mt_paywindow_free(mt_paywindow_t* pw){
+  tor_free(pw);
+}
+
+static double
+ewma(double old, double sample){
+  return old + MT_PAYWINDOW_ALPHA * (sample - old);
+}
+
+void mt_paywindow_note_cell(mt_paywindow_t* pw, uint64_t now){
+
+  if(!pw)
+    return;
+
+  if(!pw->sample_start){
+    pw->sample_start = now;
+    pw->sample_cells = 0;
+  }
+  pw->sample_cells++;
+
+  uint64_t elapsed = now - pw->sample_start;
+  if(now < pw->sample_start || elapsed < MT_PAYWINDOW_SAMPLE_MSEC)
+    return;
+
+  double sample = pw->sample_cells * 1000.0 / elapsed;
+  pw->cell_rate = pw->cell_rate > 0 ? ewma(pw->cell_rate, sample) : sample;
+  pw->sample_start = now;
+  pw->sample_cells = 0;
+}
+
+void mt_paywindow_note_pay_start(mt_paywindow_t* pw, uint64_t now){
+  if(!pw)
+    return;
+  pw->pay_start = now;
+}
+
+void mt_paywindow_note_pay_done(mt_paywindow_t* pw, uint64_t now){
+
+  if(!pw || !pw->pay_start || now < pw->pay_start)
+    return;
+
+  double sample = (double)(now - pw->pay_start);
+  pw->rtt_msec = pw->rtt_measured ? ewma(pw->rtt_msec, sample) : sample;
+  pw->rtt_measured = 1;
+  pw->pay_start = 0;
+}
+
+/** Whether the adaptive thresholds apply to <b>pw</b> yet */
+static int
+is_adaptive(const mt_paywindow_t* pw){
+  return get_options()->MoneTorAdaptiveWindow && pw && pw->cell_rate > 0;
+}
+
+int mt_paywindow_low(const mt_paywindow_t* pw){
+
+  const or_options_t* options = get_options();
+  if(!is_adaptive(pw))
+    return options->MoneTorInitialWindow - options->MoneTorPaymentRate;
+
+  double rtt = pw->rtt_measured ? pw->rtt_msec : MT_PAYWINDOW_DEFAULT_RTT_MSEC;
+  double cells = pw->cell_rate * rtt * MT_PAYWINDOW_RTT_MARGIN / 1000.0;
+  if(cells >= INT32_MAX / 2)
+    return INT32_MAX / 2;
+  return MAX(1, (int)cells + 1);
+}
+
+int mt_paywindow_high(const mt_paywindow_t* pw){
+
+  const or_options_t* options = get_options();
+  int low = mt_paywindow_low(pw);
+  if(!is_adaptive(pw))
+    return low;
+
+  double cells = pw->cell_rate * options->MoneTorPaymentLatencyBudget / 1000.0;
+  int high = cells >= INT32_MAX / 2 ? INT32_MAX / 2 : (int)cells;
+  return MAX(high, low + MAX(options->MoneTorPaymentRate, 1));
+}
@@ -0,0 +1,72 @@
+/**
+ * \file mt_paywindow.h
+ * \brief Header file for mt_paywindow.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated
+ */
+
+#ifndef mt_paywindow_h
+#define mt_paywindow_h
+
+#include "or.h"
+
+/** Shortest span of cells (in msec) turned into one throughput sample */
+#define MT_PAYWINDOW_SAMPLE_MSEC 250
+/** Payment round trip assumed (in msec) until one has been measured */
+#define MT_PAYWINDOW_DEFAULT_RTT_MSEC 500
+
+/**
+ * Throughput and payment latency observed on one hop of a circuit, used to
+ * decide when to pay and how much. Times are monotonic milliseconds.
+ */
+typedef struct mt_paywindow_t {
+  /* smoothed cell rate in cells per second; 0 until the first sample */
+  double cell_rate;
+  /* smoothed time between asking for a payment and its success */
+  double rtt_msec;
+  /* cells seen since sample_start */
+  int sample_cells;
+  uint64_t sample_start;
+  /* when the outstanding payment was asked for; 0 if there is none */
+  uint64_t pay_start;
+  /* whether rtt_msec holds a measurement rather than the default */
+  unsigned int rtt_measured : 1;
+} mt_paywindow_t;
+
+mt_paywindow_t* mt_paywindow_new(void);
+
+void mt_paywindow_free(mt_paywindow_t* pw);
+
+/**
+ * Account for one cell sent or received on the hop at time <b>now</b>
+ */
+void mt_paywindow_note_cell(mt_paywindow_t* pw, uint64_t now);
+
+/**
+ * Record that a payment was asked for at time <b>now</b>
+ */
+void mt_paywindow_note_pay_start(mt_paywindow_t* pw, uint64_t now);
+
+/**
+ * Record that the outstanding payment succeeded at time <b>now</b>
+ */
+void mt_paywindow_note_pay_done(mt_paywindow_t* pw, uint64_t now);
+
+/**
+ * Return the window below which the hop should be paid for. In adaptive mode
+ * this is the number of cells expected to cross the hop during a payment
+ * round trip with some headroom, so that the window does not run dry before
+ * the payment lands. In fixed mode it is MoneTorInitialWindow minus
+ * MoneTorPaymentRate.
+ */
+int mt_paywindow_low(const mt_paywindow_t* pw);
+
+/**
+ * Return the window a payment should bring the hop back up to. In adaptive
+ * mode this is the number of cells expected over MoneTorPaymentLatencyBudget,
+ * and at least one payment unit above mt_paywindow_low(). In fixed mode it is
+ * the same as mt_paywindow_low().
+ */
+int mt_paywindow_high(const mt_paywindow_t* pw);
+
+#endif
@@ -0,0 +1,255 @@
+/**
+ * \file mt_reservoir.c
+ *
+ * Keep wallet keypairs and nanopayment hash chains ready ahead of the channels
+ * that need them. Generating a keypair for every new channel wallet and
+ * walking a MT_NAN_LEN hash chain for every nanopayment setup used to sit on
+ * the channel establishment path. Here the cpuworker produces them in the
+ * background: once the stock of either kind falls to half of
+ * MoneTorReservoirSize, one job per missing item is queued so the threads
+ * refill it in parallel. A take from an empty reservoir computes inline as
+ * before and is counted as starved.
+ *
+ * The reservoir is shared by every payment module in the process. Items are
+ * handed out once and wiped when dropped.
+ */
+
+#include "or.h"
+#include "config.h"
+#include "workqueue.h"
+#include "cpuworker.h"
+#include "mt_crypto.h"
+#include "mt_common.h"
+#include "mt_reservoir.h"
+
+/**
+ * Prototype for multi-thread function used to run the expensive crypto
+ */
+typedef void (*work_task)(void*);
+
+/**
+ * One precomputed item, also used as the cpuworker job that produces it
+ */
+typedef struct {
+  mt_reservoir_kind_t kind;
+  uint32_t generation;
+  int result;
+
+  // MT_RESERVOIR_KEY: the scheme chosen on the main thread when queued
+  mt_key_type_t key_type;
+  byte pk[MT_SZ_PK];
+  byte sk[MT_SZ_SK];
+
+  // MT_RESERVOIR_HC
+  mt_hc_t hc;
+  byte tail[MT_SZ_HASH];
+} mt_reservoir_item_t;
+
+/**
+ * Single instance of the reservoir
+ */
+static struct {
+  int initialized;
+  byte pp[MT_SZ_PP];
+  smartlist_t* ready[MT_RESERVOIR_NUM_KINDS];
+  mt_reservoir_stats_t stats[MT_RESERVOIR_NUM_KINDS];
+  // bumped by mt_reservoir_clear() so that jobs still out are dropped
+  uint32_t generation;
+} reservoir;
+
+static workqueue_reply_t cpu_task_produce(void* thread, void* args);
+static int help_produce(void* args);
+
+static void
+init_reservoir(void){
+
+  if(reservoir.initialized)
+    return;
+
+  byte* pp_temp;
+  tor_assert(mt_hex2bytes(MT_PP_HEX, &pp_temp) == MT_SZ_PP);
+  memcpy(reservoir.pp, pp_temp, MT_SZ_PP);
+  tor_free(pp_temp);
+
+  for(int i = 0; i < MT_RESERVOIR_NUM_KINDS; i++)
+    reservoir.ready[i] = smartlist_new();
+  reservoir.initialized = 1;
+}
+
+static void
+free_item(mt_reservoir_item_t* item){
+  memwipe(item, 0, sizeof(mt_reservoir_item_t));
+  tor_free(item);
+}
+
+/** Whether material should be produced in the background */
+static int
+is_enabled(void){
+  return get_options()->MoneTorReservoirSize > 0 && !get_options()->MoneTorSingleThread;
+}
+
+/** Queue enough jobs to bring <b>kind</b> up to MoneTorReservoirSize */
+static void
+refill(mt_reservoir_kind_t kind){
+
+  mt_reservoir_stats_t* stats = &reservoir.stats[kind];
+  int size = get_options()->MoneTorReservoirSize;
+  int have = stats->ready + stats->inflight;
+
+  // low watermark: only top up once half of the stock has been used
+  if(have > size / 2)
+    return;
+
+  for(; have < size; have++){
+    mt_reservoir_item_t* item = tor_malloc_zero(sizeof(mt_reservoir_item_t));
+    item->kind = kind;
+    item->generation = reservoir.generation;
+    item->key_type = mt_crypt_key_type();
+
+    if(!cpuworker_queue_work(WQ_PRI_LOW, cpu_task_produce, (work_task)help_produce, item)){
+      log_warn(LD_MT, "MoneTor: cpu task returned error");
+      free_item(item);
+      return;
+    }
+    stats->inflight++;
+  }
+}
+
+void mt_reservoir_fill(void){
+
+  if(!is_enabled())
+    return;
+
+  init_reservoir();
+  for(int i = 0; i < MT_RESERVOIR_NUM_KINDS; i++)
+    refill(i);
+}
+
+/** Take a ready item of <b>kind</b>, or return NULL if there is none */
+static mt_reservoir_item_t*
+take(mt_reservoir_kind_t kind){
+
+  init_reservoir();
+
+  mt_reservoir_item_t* item = NULL;
+  smartlist_t* ready = reservoir.ready[kind];
+  mt_reservoir_stats_t* stats = &reservoir.stats[kind];
+
+  while(!item && smartlist_len(ready) > 0){
+    item = smartlist_pop_last(ready);
+    stats->ready--;
+
+    // keys made before MoneTorEd25519 was changed are of the wrong type
+    if(kind == MT_RESERVOIR_KEY && item->key_type != mt_crypt_key_type()){
+      free_item(item);
+      item = NULL;
+    }
+  }
+
+  if(item)
+    stats->hits++;
+  else if(is_enabled())
+    stats->starved++;
+
+  if(is_enabled())
+    refill(kind);
+  return item;
+}
+
+int mt_reservoir_keygen(byte (*pp)[MT_SZ_PP], byte (*pk_out)[MT_SZ_PK],
+			byte (*sk_out)[MT_SZ_SK]){
+
+  mt_reservoir_item_t* item = take(MT_RESERVOIR_KEY);
+  if(!item)
+    return mt_crypt_keygen(pp, mt_crypt_key_type(), pk_out, sk_out);
+
+  memcpy(*pk_out, item->pk, MT_SZ_PK);
+  memcpy(*sk_out, item->sk, MT_SZ_SK);
+  free_item(item);
+  return MT_SUCCESS;
+}
+
+int mt_reservoir_hc(mt_hc_t* hc, int size, byte (*tail_out)[MT_SZ_HASH]){
+
+  mt_reservoir_item_t* item = size == MT_NAN_LEN ? take(MT_RESERVOIR_HC) : NULL;
+  if(!item){
+    byte head[MT_SZ_HASH];
+    mt_crypt_rand(MT_SZ_HASH, head);
+    int result = mt_hc_init(hc, size, &head, tail_out);
+    memwipe(head, 0, sizeof(head));
+    return result;
+  }
+
+  memcpy(hc, &item->hc, sizeof(mt_hc_t));
+  memcpy(*tail_out, item->tail, MT_SZ_HASH);
+  free_item(item);
+  return MT_SUCCESS;
+}
+
+void mt_reservoir_get_stats(mt_reservoir_kind_t kind, mt_reservoir_stats_t* stats_out){
+  tor_assert(kind >= 0 && kind < MT_RESERVOIR_NUM_KINDS);
+  memcpy(stats_out, &reservoir.stats[kind], sizeof(mt_reservoir_stats_t));
+}
+
+void mt_reservoir_clear(void){
+
+  if(!reservoir.initialized)
+    return;
+
+  for(int i = 0; i < MT_RESERVOIR_NUM_KINDS; i++){
+    SMARTLIST_FOREACH(reservoir.ready[i], mt_reservoir_item_t*, item, free_item(item));
+    smartlist_free(reservoir.ready[i]);
+    reservoir.ready[i] = NULL;
+  }
+  memset(reservoir.stats, 0, sizeof(reservoir.stats));
+  reservoir.initialized = 0;
+  reservoir.generation++;
+}
+
+/**
+ * Produce the item described by <b>args</b> on a cpuworker thread
+ */
+static workqueue_reply_t cpu_task_produce(void* thread, void* args){
+  (void)thread;
+
+  mt_reservoir_item_t* item = (mt_reservoir_item_t*)args;
+
+  if(item->kind == MT_RESERVOIR_KEY){
+    item->result = mt_crypt_keygen(&reservoir.pp, item->key_type, &item->pk, &item->sk);
+  }
+  else {
+    byte head[MT_SZ_HASH];
+    mt_crypt_rand(MT_SZ_HASH, head);
+    item->result = mt_hc_init(&item->hc, MT_NAN_LEN, &head, &item->tail);
+    memwipe(head, 0, sizeof(head));
+  }
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Called on the main thread once an item has been produced
+ */
+static int help_produce(void* args){
+
+  mt_reservoir_item_t* item = (mt_reservoir_item_t*)args;
+
+  // the reservoir was cleared while the item was on the cpuworker
+  if(item->generation != reservoir.generation || !reservoir.initialized){
+    free_item(item);
+    return MT_SUCCESS;
+  }
+
+  mt_reservoir_stats_t* stats = &reservoir.stats[item->kind];
+  stats->inflight--;
+
+  if(item->result != MT_SUCCESS){
+    log_warn(LD_MT, "MoneTor: could not precompute payment material");
+    free_item(item);
+    return MT_ERROR;
+  }
+
+  stats->produced++;
+  stats->ready++;
+  smartlist_add(reservoir.ready[item->kind], item);
+  return MT_SUCCESS;
+}
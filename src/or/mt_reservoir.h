@@ -0,0 +1,62 @@
+/**
+ * \file mt_reservoir.h
+ * \brief Header file for mt_reservoir.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated.
+ **/
+
+#ifndef mt_reservoir_h
+#define mt_reservoir_h
+
+#include "or.h"
+
+/** Kinds of precomputed material kept in the reservoir */
+typedef enum {
+  MT_RESERVOIR_KEY,
+  MT_RESERVOIR_HC,
+  MT_RESERVOIR_NUM_KINDS,
+} mt_reservoir_kind_t;
+
+/**
+ * Counters for one kind of material
+ */
+typedef struct {
+  /* items ready to be taken and items being produced on the cpuworker */
+  int ready;
+  int inflight;
+  /* takes served from the reservoir and takes that had to compute inline */
+  uint64_t hits;
+  uint64_t starved;
+  /* items produced in the background since start */
+  uint64_t produced;
+} mt_reservoir_stats_t;
+
+/**
+ * Start producing material on the cpuworker until each kind is stocked up to
+ * MoneTorReservoirSize. Does nothing in single-threaded mode.
+ */
+void mt_reservoir_fill(void);
+
+/**
+ * Write out a fresh wallet keypair, taken from the reservoir if one is ready
+ * and generated with mt_crypt_keygen() otherwise
+ */
+int mt_reservoir_keygen(byte (*pp)[MT_SZ_PP], byte (*pk_out)[MT_SZ_PK],
+			byte (*sk_out)[MT_SZ_SK]);
+
+/**
+ * Initialize <b>hc</b> as a hash chain of <b>size</b> from a fresh random
+ * head and write out its tail, as mt_hc_init() does. Chains of MT_NAN_LEN are
+ * taken from the reservoir if one is ready.
+ */
+int mt_reservoir_hc(mt_hc_t* hc, int size, byte (*tail_out)[MT_SZ_HASH]);
+
+void mt_reservoir_get_stats(mt_reservoir_kind_t kind, mt_reservoir_stats_t* stats_out);
+
+/**
+ * Drop all stocked material and reset the counters; anything still on the
+ * cpuworker is discarded when it comes back
+ */
+void mt_reservoir_clear(void);
+
+#endif
@@ -45,7 +45,20 @@
 #include "workqueue.h"
 #include "mt_common.h"
 #include "mt_messagebuffer.h"
+#include "mt_chntable.h"
+#include "mt_descmap.h"
+#include "mt_reservoir.h"
 #include "mt_rpay.h"
+#include "mt_stats.h"
+#include "trace/events.h"
+
+/**
+ * States of a channel held in the channel table; both are keyed by idesc
+ */
+typedef enum {
+  RPAY_CHN_SETUP,
+  RPAY_CHN_ESTAB,
+} rpay_chn_state_t;
 
 /**
  * Prototype for multi-thread function used to generate the expensive zkp proof
@@ -72,6 +85,9 @@ typedef struct {
   mt_desc_t idesc;
   chn_end_data_t data;
 
+  // when the establish or close under way started, for mt_stats
+  uint64_t stats_start;
+
   mt_callback_t callback;
 } mt_channel_t;
 
@@ -103,8 +119,7 @@ typedef struct {
   int fee;
 
   // channel states are encoded by which of these containers they are held
-  digestmap_t* chns_setup;       // digest(idesc) -> smartlist of channels
-  digestmap_t* chns_estab;       // digest(idesc) -> smartlist of channels
+  mt_chntable_t* chns;           // (rpay_chn_state_t, idesc) -> channels
   digestmap_t* nans_estab;       // digest(nan_pub) -> channel
   smartlist_t* chns_spent;
 
@@ -112,7 +127,7 @@ typedef struct {
   digestmap_t* chns_transition;  // pid -> channel
 
   // map
-  digestmap_t* clis_idesc; // digest(cdesc) -> int desc
+  mt_descmap_t* clis_idesc; // cdesc -> int desc
 
   // structure to run message buffering functionality
   mt_msgbuf_t* msgbuf;
@@ -149,8 +164,6 @@ static mt_channel_t* new_channel(void);
 static workqueue_reply_t cpu_task_estab(void* thread, void* arg);
 static workqueue_reply_t cpu_task_nanestab(void* thread, void* arg);
 static workqueue_reply_t cpu_task_nanclose(void* thread, void* arg);
-static void digestmap_smartlist_add(digestmap_t* map, char* key, void* val);
-static void* digestmap_smartlist_pop_last(digestmap_t* map, char* key);
 
 static mt_rpay_t relay;
 
@@ -176,7 +189,7 @@ int mt_rpay_init(void){
   tor_free(led_pk_temp);
 
   // setup crypto keys
-  mt_crypt_keygen(&relay.pp, &relay.pk, &relay.sk);
+  mt_crypt_keygen(&relay.pp, mt_crypt_key_type(), &relay.pk, &relay.sk);
   mt_pk2addr(&relay.pk, &relay.addr);
 
   // set ledger
@@ -191,12 +204,11 @@ int mt_rpay_init(void){
   relay.chn_number = 0;
 
   // initiate containers
-  relay.chns_setup = digestmap_new();
-  relay.chns_estab = digestmap_new();
+  relay.chns = mt_chntable_new();
   relay.nans_estab = digestmap_new();
   relay.chns_spent = smartlist_new();
   relay.chns_transition = digestmap_new();
-  relay.clis_idesc = digestmap_new();
+  relay.clis_idesc = mt_descmap_new();
   return MT_SUCCESS;
 }
 
@@ -207,12 +219,10 @@ int mt_rpay_init(void){
  */
 int mt_rpay_recv_multidesc(mt_desc_t* cdesc, mt_desc_t* idesc, mt_ntype_t type, byte* msg, int size){
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(cdesc, &digest);
   mt_desc_t* int_desc = tor_malloc(sizeof(mt_desc_t));
   memcpy(int_desc, idesc, sizeof(mt_desc_t));
 
-  digestmap_set(relay.clis_idesc, (char*)digest, int_desc);
+  tor_free_(mt_descmap_set(relay.clis_idesc, cdesc, int_desc));
   return mt_rpay_recv(cdesc, type, msg, size);
 }
 
@@ -220,10 +230,14 @@ int mt_rpay_recv_multidesc(mt_desc_t* cdesc, mt_desc_t* idesc, mt_ntype_t type,
  * Handle an incoming message from the given descriptor
  */
 int mt_rpay_recv(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
-  log_info(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
+  log_debug(LD_MT, "MoneTor: (msg) ------------ recv %s %" PRIu64 ".%" PRIu64 ", %s",
 	   mt_party_describe(desc->party), desc->id[0], desc->id[1], mt_token_describe(type));
+  tor_trace(mt, recv_begin, MT_PARTY_REL, desc->id[0], desc->id[1], (int)desc->party,
+	    (int)type, size);
 
-  return mt_rpay_recv_helper(desc, type, msg, size);
+  int result = mt_rpay_recv_helper(desc, type, msg, size);
+  tor_trace(mt, recv_end, MT_PARTY_REL, desc->id[0], desc->id[1], (int)type, result);
+  return result;
 }
 
 static int mt_rpay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int size){
@@ -323,6 +337,12 @@ static int mt_rpay_recv_helper(mt_desc_t* desc, mt_ntype_t type, byte* msg, int
 
   if(result == MT_ERROR){
     log_warn(LD_MT, "MoneTor: protocoal error processing message");
+    mt_channel_t* chn = digestmap_get(relay.chns_transition, (char*)pid);
+    if(chn){
+      mt_stats_note_failed(MT_STATS_RELAY, mt_stats_phase_of(type), &chn->cdesc,
+			   &chn->idesc);
+      chn->stats_start = 0;
+    }
   }
   return result;
 }
@@ -355,10 +375,20 @@ int mt_rpay_set_status(mt_desc_t* desc, int status){
   return mt_set_desc_status(relay.msgbuf, desc, status);
 }
 
+/**
+ * Drop held messages that have outlived MoneTorMsgBufTTL
+ */
+void mt_rpay_housekeeping(time_t now){
+  if(relay.msgbuf)
+    mt_messagebuffer_expire(relay.msgbuf, now);
+}
+
 /**
  * Delete the state of the payment module
  */
 int mt_rpay_clear(void){
+  mt_messagebuffer_free(relay.msgbuf);
+  relay.msgbuf = NULL;
   // Need to implement
   return MT_ERROR;
 }
@@ -437,10 +467,8 @@ static int handle_any_led_confirm(mt_desc_t* desc, any_led_confirm_t* token, byt
     return MT_ERROR;
   }
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(&chn->idesc, &digest);
   digestmap_remove(relay.chns_transition, (char*)*pid);
-  digestmap_smartlist_add(relay.chns_setup, (char*)digest, chn);
+  mt_chntable_add(relay.chns, RPAY_CHN_SETUP, &chn->idesc, chn);
 
   if(chn->callback.fn){
     mt_callback_t cb = chn->callback;
@@ -587,10 +615,8 @@ static int help_chn_int_estab4(void* args){
   memcpy(pid, ((mt_zkp_args_t*)args)->pid, DIGEST_LEN);
   tor_free(args);
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(&chn->idesc, &digest);
   digestmap_remove(relay.chns_transition, (char*)pid);
-  digestmap_smartlist_add(relay.chns_estab, (char*)digest, chn);
+  mt_chntable_add(relay.chns, RPAY_CHN_ESTAB, &chn->idesc, chn);
 
   if(chn->callback.fn){
     mt_callback_t cb = chn->callback;
@@ -606,17 +632,12 @@ static int help_chn_int_estab4(void* args){
 
 static int handle_nan_cli_estab1(mt_desc_t* desc, nan_cli_estab1_t* token, byte (*pid)[DIGEST_LEN]){
   mt_channel_t* chn;
-  byte cdigest[DIGEST_LEN];
-  mt_desc2digest(desc, &cdigest);
-
-  mt_desc_t* intermediary = digestmap_get(relay.clis_idesc, (char*)cdigest);
-  byte idigest[DIGEST_LEN];
-  mt_desc2digest(intermediary, &idigest);
+  mt_desc_t* intermediary = mt_descmap_get(relay.clis_idesc, desc);
 
   mt_paymod_signal(MT_SIGNAL_PAYMENT_INITIALIZED, desc);
 
   // we have a tor_free channel with this intermediary
-  if((chn = digestmap_smartlist_pop_last(relay.chns_estab, (char*)idigest))){
+  if((chn = mt_chntable_take(relay.chns, RPAY_CHN_ESTAB, intermediary))){
 
     // if the channel doesn't have enough money then move it to spent and retry
     if(chn->data.wallet.int_bal < token->nan_public.val_to * token->nan_public.num_payments){
@@ -627,6 +648,8 @@ static int handle_nan_cli_estab1(mt_desc_t* desc, nan_cli_estab1_t* token, byte
     digestmap_set(relay.chns_transition, (char*)*pid, chn);
     chn->cdesc = *desc;
     chn->callback.fn = NULL;
+    if(!chn->stats_start)
+      chn->stats_start = monotime_absolute_usec();
 
     // save the nanopayment channel token
     memcpy(&chn->data.nan_public, &token->nan_public, sizeof(nan_any_public_t));
@@ -650,11 +673,19 @@ static int handle_nan_cli_estab1(mt_desc_t* desc, nan_cli_estab1_t* token, byte
   byte rpid[DIGEST_LEN];
   mt_crypt_rand(DIGEST_LEN, rpid);
 
+  // repack the request so it can be replayed once a channel is established
+  byte* estab1_msg;
+  int estab1_size = pack_nan_cli_estab1(token, pid, &estab1_msg);
+  if(estab1_size < 0)
+    return MT_ERROR;
+
   // if we have a channel set up then establish it
-  if((chn = digestmap_smartlist_pop_last(relay.chns_setup, (char*)idigest))){
+  if((chn = mt_chntable_take(relay.chns, RPAY_CHN_SETUP, intermediary))){
     digestmap_set(relay.chns_transition, (char*)rpid, chn);
-    chn->callback = (mt_callback_t){.fn = mt_rpay_recv_helper, .dref1 = *desc, .arg2 = MT_NTYPE_NAN_CLI_ESTAB1};
-    chn->callback.arg4 = pack_nan_cli_estab1(token, pid, &chn->callback.arg3);
+    chn->cdesc = *desc;
+    chn->stats_start = monotime_absolute_usec();
+    chn->callback = (mt_callback_t){.fn = mt_rpay_recv_helper, .dref1 = *desc, .arg2 = MT_NTYPE_NAN_CLI_ESTAB1,
+				    .arg3 = estab1_msg, .arg4 = estab1_size};
     return init_chn_end_estab1(chn, &rpid);
   }
 
@@ -662,13 +693,16 @@ static int handle_nan_cli_estab1(mt_desc_t* desc, nan_cli_estab1_t* token, byte
   if((relay.mac_bal >= relay.fee) || get_options()->MoneTorPublicMint){
     chn = new_channel();
     digestmap_set(relay.chns_transition, (char*)rpid, chn);
+    chn->cdesc = *desc;
     chn->idesc = *intermediary;
+    chn->stats_start = monotime_absolute_usec();
     chn->callback = (mt_callback_t){.fn = mt_rpay_recv_helper, .dref1 = *desc,
-				    .arg2 = MT_NTYPE_NAN_CLI_ESTAB1};
-    chn->callback.arg4 = pack_nan_cli_estab1(token, pid, &chn->callback.arg3);
+				    .arg2 = MT_NTYPE_NAN_CLI_ESTAB1, .arg3 = estab1_msg,
+				    .arg4 = estab1_size};
     return init_chn_end_setup(chn, &rpid);
   }
 
+  tor_free(estab1_msg);
   log_warn(LD_MT, "insufficient funds to start channel\n");
   return MT_ERROR;
 }
@@ -742,6 +776,10 @@ static int handle_nan_int_estab5(mt_desc_t* desc, nan_int_estab5_t* token, byte
   digestmap_remove(relay.chns_transition, (char*)*pid);
   digestmap_set(relay.nans_estab, (char*)digest, chn);
 
+  mt_stats_note_done(MT_STATS_RELAY, MT_STATS_ESTAB, &chn->cdesc, &chn->idesc,
+		     monotime_absolute_usec() - chn->stats_start);
+  chn->stats_start = 0;
+
   // create and send reply token to client
   nan_rel_estab6_t reply;
   reply.success = MT_CODE_SUCCESS;
@@ -758,6 +796,7 @@ static int handle_nan_int_estab5(mt_desc_t* desc, nan_int_estab5_t* token, byte
 static int handle_nan_cli_pay1(mt_desc_t* desc, nan_cli_pay1_t* token, byte (*pid)[DIGEST_LEN]){
   (void)desc;
 
+  uint64_t start = monotime_absolute_usec();
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
   mt_channel_t* chn = digestmap_get(relay.nans_estab, (char*)digest);
@@ -766,14 +805,21 @@ static int handle_nan_cli_pay1(mt_desc_t* desc, nan_cli_pay1_t* token, byte (*pi
     return MT_ERROR;
   }
 
-  // if the payment number > 0 then need to check hashes
+  // a payment may cover several units as long as the channel has room for them
+  int units = token->num_units;
+  if(units < 1 || units > chn->data.nan_public.num_payments - chn->data.nan_state.num_payments){
+    log_warn(LD_MT, "MoneTor: bad number of payment units %d", units);
+    return MT_ERROR;
+  }
+
+  // the preimage sits units steps behind the last one (units - 1 behind the tail)
   if(chn->data.nan_state.num_payments &&
-     mt_hc_verify(&chn->data.nan_state.last_hash, &token->preimage, 1)){
+     mt_hc_verify(&chn->data.nan_state.last_hash, &token->preimage, units)){
     log_warn(LD_MT, "MoneTor: hash preimage did not verify (not first payment)");
     return MT_ERROR;
   }
   else if(!chn->data.nan_state.num_payments &&
-	  memcmp(token->preimage, token->nan_public.hash_tail, MT_SZ_HASH) != 0){
+	  mt_hc_verify(&token->nan_public.hash_tail, &token->preimage, units - 1)){
     log_warn(LD_MT, "MoneTor: hash preimage did not verify (first payment)");
     return MT_ERROR;
   }
@@ -782,12 +828,16 @@ static int handle_nan_cli_pay1(mt_desc_t* desc, nan_cli_pay1_t* token, byte (*pi
   reply.success = MT_CODE_SUCCESS;
 
   // update channel data
-  relay.chn_bal += chn->data.nan_public.val_to;
-  chn->data.wallet.end_bal += chn->data.nan_public.val_to;
-  chn->data.nan_state.num_payments ++;
+  relay.chn_bal += units * chn->data.nan_public.val_to;
+  chn->data.wallet.end_bal += units * chn->data.nan_public.val_to;
+  chn->data.nan_state.num_payments += units;
   memcpy(chn->data.nan_state.last_hash, token->preimage, MT_SZ_HASH);
+  mt_stats_note_done(MT_STATS_RELAY, MT_STATS_PAY, desc, &chn->idesc,
+		     monotime_absolute_usec() - start);
 
-  mt_paymod_signal(MT_SIGNAL_PAYMENT_RECEIVED, desc);
+  // the controller credits one payment rate per signal
+  for(int i = 0; i < units; i++)
+    mt_paymod_signal(MT_SIGNAL_PAYMENT_RECEIVED, desc);
   if(get_options()->MoneTorAcknowledge){
 
     byte* msg;
@@ -814,11 +864,19 @@ static int handle_nan_cli_reqclose1(mt_desc_t* desc, nan_cli_reqclose1_t* token,
   byte digest[DIGEST_LEN];
   mt_nanpub2digest(&token->nan_public, &digest);
 
-  if((chn = digestmap_remove(relay.nans_estab, (char*)digest))){
+  if(digestmap_get(relay.nans_estab, (char*)digest)){
+    // repack the request so it can be replayed once the channel is closed
+    byte* reqclose1_msg;
+    int reqclose1_size = pack_nan_cli_reqclose1(token, pid, &reqclose1_msg);
+    if(reqclose1_size < 0)
+      return MT_ERROR;
+
+    chn = digestmap_remove(relay.nans_estab, (char*)digest);
     digestmap_set(relay.chns_transition, (char*)pid, chn);
-    chn->callback = (mt_callback_t){.fn = mt_rpay_recv_helper, .dref1 = *desc};
-    chn->callback.arg2 = MT_NTYPE_NAN_CLI_REQCLOSE1;
-    chn->callback.arg4 = pack_nan_cli_reqclose1(token, pid, &chn->callback.arg3);
+    chn->stats_start = monotime_absolute_usec();
+    chn->callback = (mt_callback_t){.fn = mt_rpay_recv_helper, .dref1 = *desc,
+				    .arg2 = MT_NTYPE_NAN_CLI_REQCLOSE1, .arg3 = reqclose1_msg,
+				    .arg4 = reqclose1_size};
     return init_nan_end_close1(chn, pid);
   }
 
@@ -1023,13 +1081,15 @@ static int help_nan_int_close8(void *args){
   memcpy(pid, ((mt_zkp_args_t*)args)->pid, DIGEST_LEN);
   tor_free(args);
 
-  byte digest[DIGEST_LEN];
-  mt_desc2digest(&chn->idesc, &digest);
   digestmap_remove(relay.chns_transition, (char*)pid);
 
+  mt_stats_note_done(MT_STATS_RELAY, MT_STATS_CLOSE, &chn->cdesc, &chn->idesc,
+		     monotime_absolute_usec() - chn->stats_start);
+  chn->stats_start = 0;
+
   // if sufficient funds left then move channel to establish state, otherwise move to spent
   if(chn->data.wallet.int_bal >= MT_NAN_LEN * MT_NAN_VAL){
-    digestmap_smartlist_add(relay.chns_estab, (char*)digest, chn);
+    mt_chntable_add(relay.chns, RPAY_CHN_ESTAB, &chn->idesc, chn);
   }
   else{
     smartlist_add(relay.chns_spent, chn);
@@ -1054,7 +1114,7 @@ static mt_channel_t* new_channel(void){
   chn->data.wallet.end_bal = MT_CHN_VAL_REL;
   chn->data.wallet.int_bal = MT_CHN_VAL_INT;
   memcpy(chn->data.wallet.csk, relay.sk, MT_SZ_SK);
-  mt_crypt_keygen(&relay.pp, &chn->data.wallet.wpk, &chn->data.wallet.wsk);
+  mt_reservoir_keygen(&relay.pp, &chn->data.wallet.wpk, &chn->data.wallet.wsk);
   mt_crypt_rand(MT_SZ_HASH, chn->data.wallet.rand);
 
   // initialize channel public info
@@ -1081,33 +1141,12 @@ static mt_channel_t* new_channel(void){
 
   return chn;
 }
-/**
- * Append a value to the appropriate list in a digestmap of smartlists
- */
-static void digestmap_smartlist_add(digestmap_t* map, char* key, void* val){
-  smartlist_t* list = digestmap_get(map, (char*)key);
-  if(list == NULL){
-    digestmap_set(map, (char*)key, smartlist_new());
-    list = digestmap_get(map, (char*)key);
-  }
-  smartlist_add(list, val);
-}
-
-/**
- * Pop the last item from the appropriate list in a digestmap of smartlists
- */
-static void* digestmap_smartlist_pop_last(digestmap_t* map, char* key){
-  smartlist_t* list = digestmap_get(map, (char*)key);
-  if(!list)
-    return NULL;
-  return smartlist_pop_last(list);
-}
-
 static workqueue_reply_t cpu_task_estab(void* thread, void* args){
   (void)thread;
 
   mt_zkp_args_t* zkp_args = (mt_zkp_args_t*)args;
   mt_channel_t* chn = zkp_args->chn;
+  tor_trace(mt, zkp_begin, MT_PARTY_REL, "estab", chn->idesc.id[0], chn->idesc.id[1]);
 
   // public zkp parameters
   int public_size = sizeof(int) + MT_SZ_COM;
@@ -1123,8 +1162,11 @@ static workqueue_reply_t cpu_task_estab(void* thread, void* args){
   memcpy(hidden + MT_SZ_PK + MT_SZ_SK, chn->data.wallet.rand, MT_SZ_HASH);
 
   // record zkp
-  mt_zkp_prove(MT_ZKP_TYPE_1, &relay.pp, public, public_size,
-	       hidden, hidden_size, &chn->data.wallet.zkp);
+  int result = mt_zkp_prove(MT_ZKP_TYPE_1, &relay.pp, public, public_size,
+			    hidden, hidden_size, &chn->data.wallet.zkp);
+  tor_trace(mt, zkp_end, MT_PARTY_REL, "estab", chn->idesc.id[0], chn->idesc.id[1], result);
+  if(result != MT_SUCCESS)
+    log_warn(LD_MT, "MoneTor: could not prove knowledge of the channel wallet");
 
   return WQ_RPL_REPLY;
 }
@@ -1133,11 +1175,13 @@ static workqueue_reply_t cpu_task_nanestab(void* thread, void* args){
   (void)thread;
 
   mt_channel_t* chn = ((mt_zkp_args_t*)args)->chn;
+  tor_trace(mt, zkp_begin, MT_PARTY_REL, "nanestab", chn->idesc.id[0], chn->idesc.id[1]);
 
-  if(mt_wallet_create(&relay.pp, MT_NAN_VAL, &chn->data.wallet, &chn->data.wallet_nan)
-     != MT_SUCCESS)
-    return WQ_RPL_ERROR;
-  return WQ_RPL_REPLY;
+  int result = mt_wallet_create(&relay.pp, MT_NAN_VAL, &chn->data.wallet,
+				&chn->data.wallet_nan);
+  tor_trace(mt, zkp_end, MT_PARTY_REL, "nanestab", chn->idesc.id[0], chn->idesc.id[1], result);
+
+  return result == MT_SUCCESS ? WQ_RPL_REPLY : WQ_RPL_ERROR;
 }
 
 static workqueue_reply_t cpu_task_nanclose(void* thread, void* args){
@@ -1145,8 +1189,11 @@ static workqueue_reply_t cpu_task_nanclose(void* thread, void* args){
 
   // extract parameters
   mt_channel_t* chn = ((mt_zkp_args_t*)args)->chn;
-  if(mt_wallet_create(&relay.pp, MT_NAN_VAL, &chn->data.wallet, &chn->data.wallet_new)
-     != MT_SUCCESS)
-    return WQ_RPL_ERROR;
-  return WQ_RPL_REPLY;
+  tor_trace(mt, zkp_begin, MT_PARTY_REL, "nanclose", chn->idesc.id[0], chn->idesc.id[1]);
+
+  int result = mt_wallet_create(&relay.pp, MT_NAN_VAL, &chn->data.wallet,
+				&chn->data.wallet_new);
+  tor_trace(mt, zkp_end, MT_PARTY_REL, "nanclose", chn->idesc.id[0], chn->idesc.id[1], result);
+
+  return result == MT_SUCCESS ? WQ_RPL_REPLY : WQ_RPL_ERROR;
 }
@@ -48,6 +48,12 @@ int mt_rpay_chn_number(void);
  */
 int mt_rpay_set_status(mt_desc_t* desc, int status);
 
+/**
+ * Periodic upkeep; called once a second by the controller. Drops held
+ * messages that have been waiting longer than MoneTorMsgBufTTL.
+ */
+void mt_rpay_housekeeping(time_t now);
+
 /********************** Instance Management ***********************/
 
 /**
@@ -0,0 +1,360 @@
+/**
+ * \file mt_stats.c
+ *
+ * Aggregate payment channel telemetry for the control port. The client,
+ * relay and intermediary payment modules each time establish, pay and close
+ * into fixed log2 histograms of their own, and clients and relays count
+ * protocol outcomes per intermediary, so recording is a few increments and at
+ * most one map lookup. Relays and intermediaries time a protocol from the first
+ * message they receive for it to their answer to the last one. Gauges such as
+ * channel counts and queue depths are read from the client payment module only
+ * when a controller asks for them.
+ *
+ * The following GETINFO keys are answered:
+ *   <ul>
+ *     <li>mt/latency/establish, mt/latency/pay, mt/latency/close
+ *     <li>mt/channels
+ *     <li>mt/msgbuf
+ *     <li>mt/cpuworker
+ *     <li>mt/pool
+ *     <li>mt/reservoir
+ *     <li>mt/intermediaries
+ *   <\ul>
+ *
+ * Interested controllers also get a MT_CHANNEL event for every completed or
+ * failed phase and a MT_STATS event once a second.
+ */
+
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+
+#include "or.h"
+#include "control.h"
+#include "mt_common.h"
+#include "mt_descmap.h"
+#include "mt_messagebuffer.h"
+#include "mt_cpay.h"
+#include "mt_reservoir.h"
+#include "mt_stats.h"
+
+/** Control port names of the phases */
+static const char* phase_names[MT_STATS_NUM_PHASES] = {
+  "ESTABLISH", "PAY", "CLOSE",
+};
+
+/** Control port names of the roles */
+static const char* role_names[MT_STATS_NUM_ROLES] = {
+  "CLIENT", "RELAY", "INTERMEDIARY",
+};
+
+/**
+ * Single instance of the statistics
+ */
+static struct {
+  mt_stats_hist_t hists[MT_STATS_NUM_ROLES][MT_STATS_NUM_PHASES];
+  // idesc -> mt_stats_result_t
+  mt_descmap_t* results;
+  // idescs in the order they were first seen
+  smartlist_t* idescs;
+} stats;
+
+static void
+init_stats(void){
+  if(stats.results)
+    return;
+  stats.results = mt_descmap_new();
+  stats.idescs = smartlist_new();
+}
+
+static mt_stats_result_t*
+result_for(mt_desc_t* idesc){
+
+  init_stats();
+
+  mt_stats_result_t* result = mt_descmap_get(stats.results, idesc);
+  if(!result){
+    result = tor_malloc_zero(sizeof(mt_stats_result_t));
+    mt_descmap_set(stats.results, idesc, result);
+    smartlist_add(stats.idescs, tor_memdup(idesc, sizeof(mt_desc_t)));
+  }
+  return result;
+}
+
+/** Return the histogram bucket of a latency of <b>usec</b> microseconds */
+static int
+bucket_of(uint64_t usec){
+  uint64_t msec = usec / 1000;
+  int bucket = 0;
+  while(msec && bucket < MT_STATS_HIST_BUCKETS - 1){
+    msec >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+/** Write a descriptor the way controllers see it */
+static void
+format_desc(mt_desc_t* desc, char* buf, size_t len){
+  tor_snprintf(buf, len, "%" PRIu64 ".%" PRIu64, desc->id[0], desc->id[1]);
+}
+
+static void
+send_channel_event(mt_stats_role_t role, mt_stats_phase_t phase, mt_desc_t* peer,
+		   mt_desc_t* idesc, const char* status, const char* latency){
+  if(!control_event_is_interesting(EVENT_MT_CHANNEL))
+    return;
+
+  char pbuf[48], ibuf[48];
+  format_desc(peer, pbuf, sizeof(pbuf));
+  if(idesc)
+    format_desc(idesc, ibuf, sizeof(ibuf));
+  control_event_mt_channel(role_names[role], pbuf, idesc ? ibuf : NULL,
+			   phase_names[phase], status, latency);
+}
+
+void mt_stats_note_done(mt_stats_role_t role, mt_stats_phase_t phase, mt_desc_t* peer,
+			mt_desc_t* idesc, uint64_t usec){
+
+  tor_assert(role >= 0 && role < MT_STATS_NUM_ROLES);
+  tor_assert(phase >= 0 && phase < MT_STATS_NUM_PHASES);
+
+  mt_stats_hist_t* hist = &stats.hists[role][phase];
+  hist->buckets[bucket_of(usec)]++;
+  hist->count++;
+  hist->total_usec += usec;
+  if(idesc)
+    result_for(idesc)->done[phase]++;
+
+  char latency[32];
+  tor_snprintf(latency, sizeof(latency), "%.3f", usec / 1000.0);
+  send_channel_event(role, phase, peer, idesc, "DONE", latency);
+}
+
+void mt_stats_note_failed(mt_stats_role_t role, mt_stats_phase_t phase, mt_desc_t* peer,
+			  mt_desc_t* idesc){
+
+  tor_assert(role >= 0 && role < MT_STATS_NUM_ROLES);
+  tor_assert(phase >= 0 && phase < MT_STATS_NUM_PHASES);
+
+  if(idesc)
+    result_for(idesc)->failed[phase]++;
+  send_channel_event(role, phase, peer, idesc, "FAILED", NULL);
+}
+
+mt_stats_phase_t mt_stats_phase_of(mt_ntype_t type){
+  switch(type){
+    case MT_NTYPE_NAN_CLI_PAY1:
+    case MT_NTYPE_NAN_REL_PAY2:
+    case MT_NTYPE_NAN_CLI_DPAY1:
+    case MT_NTYPE_NAN_INT_DPAY2:
+      return MT_STATS_PAY;
+    case MT_NTYPE_NAN_CLI_REQCLOSE1:
+    case MT_NTYPE_NAN_REL_REQCLOSE2:
+    case MT_NTYPE_NAN_END_CLOSE1:
+    case MT_NTYPE_NAN_INT_CLOSE2:
+    case MT_NTYPE_NAN_END_CLOSE3:
+    case MT_NTYPE_NAN_INT_CLOSE4:
+    case MT_NTYPE_NAN_END_CLOSE5:
+    case MT_NTYPE_NAN_INT_CLOSE6:
+    case MT_NTYPE_NAN_END_CLOSE7:
+    case MT_NTYPE_NAN_INT_CLOSE8:
+      return MT_STATS_CLOSE;
+    default:
+      return MT_STATS_ESTAB;
+  }
+}
+
+void mt_stats_get_hist(mt_stats_role_t role, mt_stats_phase_t phase,
+		       mt_stats_hist_t* hist_out){
+  tor_assert(role >= 0 && role < MT_STATS_NUM_ROLES);
+  tor_assert(phase >= 0 && phase < MT_STATS_NUM_PHASES);
+  memcpy(hist_out, &stats.hists[role][phase], sizeof(mt_stats_hist_t));
+}
+
+void mt_stats_get_result(mt_desc_t* idesc, mt_stats_result_t* result_out){
+  mt_stats_result_t* result = stats.results ? mt_descmap_get(stats.results, idesc) : NULL;
+  if(result)
+    memcpy(result_out, result, sizeof(mt_stats_result_t));
+  else
+    memset(result_out, 0, sizeof(mt_stats_result_t));
+}
+
+void mt_stats_clear(void){
+
+  memset(stats.hists, 0, sizeof(stats.hists));
+  if(!stats.results)
+    return;
+
+  SMARTLIST_FOREACH(stats.idescs, mt_desc_t*, idesc, tor_free(idesc));
+  smartlist_free(stats.idescs);
+  mt_descmap_free(stats.results, tor_free_);
+  stats.idescs = NULL;
+  stats.results = NULL;
+}
+
+/************************** Formatting *****************************/
+
+/** Write the histograms of <b>phase</b>, one line per role */
+static char*
+format_hist(mt_stats_phase_t phase){
+
+  smartlist_t* lines = smartlist_new();
+  smartlist_t* parts = smartlist_new();
+
+  for(int role = 0; role < MT_STATS_NUM_ROLES; role++){
+    mt_stats_hist_t* hist = &stats.hists[role][phase];
+
+    for(int i = 0; i < MT_STATS_HIST_BUCKETS - 1; i++)
+      smartlist_add_asprintf(parts, "%d:%" PRIu64, 1 << i, hist->buckets[i]);
+    smartlist_add_asprintf(parts, "inf:%" PRIu64, hist->buckets[MT_STATS_HIST_BUCKETS - 1]);
+
+    char* buckets = smartlist_join_strings(parts, ",", 0, NULL);
+    smartlist_add_asprintf(lines, "%s COUNT=%" PRIu64 " TOTAL-MS=%" PRIu64 " HIST=%s",
+			   role_names[role], hist->count, hist->total_usec / 1000, buckets);
+
+    SMARTLIST_FOREACH(parts, char*, cp, tor_free(cp));
+    smartlist_clear(parts);
+    tor_free(buckets);
+  }
+
+  char* out = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char*, cp, tor_free(cp));
+  smartlist_free(lines);
+  smartlist_free(parts);
+  return out;
+}
+
+static char*
+format_channels(mt_cpay_chn_stats_t* cstats){
+
+  smartlist_t* parts = smartlist_new();
+  for(int i = 0; i < MT_CPAY_NUM_STATES; i++)
+    smartlist_add_asprintf(parts, "%s=%d", mt_cpay_state_name(i), cstats->states[i]);
+  smartlist_add_asprintf(parts, "TRANSITION=%d", cstats->transition);
+
+  char* out = smartlist_join_strings(parts, " ", 0, NULL);
+  SMARTLIST_FOREACH(parts, char*, cp, tor_free(cp));
+  smartlist_free(parts);
+  return out;
+}
+
+/** Write message buffer counters with every key starting with <b>prefix</b> */
+static char*
+format_msgbuf(mt_msgbuf_stats_t* mstats, const char* prefix){
+  char* out;
+  tor_asprintf(&out, "%sDEPTH=%d %sBYTES=%lu %sREPLAYED=%" PRIu64 " %sDROPPED-FULL=%" PRIu64
+	       " %sDROPPED-EXPIRED=%" PRIu64 " %sREFUSED=%" PRIu64,
+	       prefix, mstats->depth, prefix, (unsigned long)mstats->bytes,
+	       prefix, mstats->replayed, prefix, mstats->dropped_full,
+	       prefix, mstats->dropped_expired, prefix, mstats->refused);
+  return out;
+}
+
+/** Control port names of the reservoir kinds */
+static const char* reservoir_names[MT_RESERVOIR_NUM_KINDS] = {
+  "KEY", "HC",
+};
+
+static char*
+format_reservoir(void){
+
+  smartlist_t* lines = smartlist_new();
+
+  for(int i = 0; i < MT_RESERVOIR_NUM_KINDS; i++){
+    mt_reservoir_stats_t rstats;
+    mt_reservoir_get_stats(i, &rstats);
+    smartlist_add_asprintf(lines, "%s READY=%d INFLIGHT=%d HITS=%" PRIu64 " STARVED=%" PRIu64
+			   " PRODUCED=%" PRIu64, reservoir_names[i], rstats.ready,
+			   rstats.inflight, rstats.hits, rstats.starved, rstats.produced);
+  }
+
+  char* out = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char*, cp, tor_free(cp));
+  smartlist_free(lines);
+  return out;
+}
+
+static char*
+format_intermediaries(void){
+
+  smartlist_t* lines = smartlist_new();
+  char ibuf[48];
+
+  if(stats.idescs){
+    SMARTLIST_FOREACH_BEGIN(stats.idescs, mt_desc_t*, idesc){
+      mt_stats_result_t* result = mt_descmap_get(stats.results, idesc);
+      format_desc(idesc, ibuf, sizeof(ibuf));
+      smartlist_add_asprintf(lines, "%s ESTABLISH=%" PRIu64 ",%" PRIu64
+			     " PAY=%" PRIu64 ",%" PRIu64 " CLOSE=%" PRIu64 ",%" PRIu64, ibuf,
+			     result->done[MT_STATS_ESTAB], result->failed[MT_STATS_ESTAB],
+			     result->done[MT_STATS_PAY], result->failed[MT_STATS_PAY],
+			     result->done[MT_STATS_CLOSE], result->failed[MT_STATS_CLOSE]);
+    } SMARTLIST_FOREACH_END(idesc);
+  }
+
+  char* out = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char*, cp, tor_free(cp));
+  smartlist_free(lines);
+  return out;
+}
+
+void mt_stats_send_event(void){
+
+  if(!control_event_is_interesting(EVENT_MT_STATS))
+    return;
+
+  mt_cpay_chn_stats_t cstats;
+  mt_cpay_chn_stats(&cstats);
+
+  char* channels = format_channels(&cstats);
+  char* msgbuf = format_msgbuf(&cstats.msgbuf, "MSGBUF-");
+  control_event_mt_stats(channels, msgbuf, cstats.cpuworker_queued);
+  tor_free(channels);
+  tor_free(msgbuf);
+}
+
+/** Implementation helper for GETINFO: answers queries about payment channel
+ * telemetry. */
+int
+getinfo_helper_mt(control_connection_t *conn, const char *question,
+		  char **answer, const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+
+  mt_cpay_chn_stats_t cstats;
+
+  if(!strcmp(question, "mt/latency/establish")){
+    *answer = format_hist(MT_STATS_ESTAB);
+  }
+  else if(!strcmp(question, "mt/latency/pay")){
+    *answer = format_hist(MT_STATS_PAY);
+  }
+  else if(!strcmp(question, "mt/latency/close")){
+    *answer = format_hist(MT_STATS_CLOSE);
+  }
+  else if(!strcmp(question, "mt/channels")){
+    mt_cpay_chn_stats(&cstats);
+    *answer = format_channels(&cstats);
+  }
+  else if(!strcmp(question, "mt/msgbuf")){
+    mt_cpay_chn_stats(&cstats);
+    *answer = format_msgbuf(&cstats.msgbuf, "");
+  }
+  else if(!strcmp(question, "mt/cpuworker")){
+    mt_cpay_chn_stats(&cstats);
+    tor_asprintf(answer, "QUEUED=%d", cstats.cpuworker_queued);
+  }
+  else if(!strcmp(question, "mt/pool")){
+    mt_cpay_pool_stats_t pstats;
+    mt_cpay_pool_stats(&pstats);
+    tor_asprintf(answer, "HITS=%" PRIu64 " MISSES=%" PRIu64 " READY=%d PENDING=%d",
+		 pstats.hits, pstats.misses, pstats.ready, pstats.pending);
+  }
+  else if(!strcmp(question, "mt/reservoir")){
+    *answer = format_reservoir();
+  }
+  else if(!strcmp(question, "mt/intermediaries")){
+    *answer = format_intermediaries();
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * \file mt_stats.h
+ * \brief Header file for mt_stats.c
+ *
+ * All functions return MT_SUCCESS/MT_ERROR unless void or otherwise stated.
+ **/
+
+#ifndef mt_stats_h
+#define mt_stats_h
+
+#include "or.h"
+
+/** Number of latency buckets: below 1ms, below 2ms, ... below 2^14ms, rest */
+#define MT_STATS_HIST_BUCKETS 16
+
+/** Steps of a nanopayment channel's life that are timed */
+typedef enum {
+  MT_STATS_ESTAB,
+  MT_STATS_PAY,
+  MT_STATS_CLOSE,
+  MT_STATS_NUM_PHASES,
+} mt_stats_phase_t;
+
+/** Payment roles that time their channels separately */
+typedef enum {
+  MT_STATS_CLIENT,
+  MT_STATS_RELAY,
+  MT_STATS_INTERMEDIARY,
+  MT_STATS_NUM_ROLES,
+} mt_stats_role_t;
+
+/**
+ * Latency histogram of one phase since start
+ */
+typedef struct {
+  /* bucket i counts latencies below 2^i ms; the last bucket counts the rest */
+  uint64_t buckets[MT_STATS_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t total_usec;
+} mt_stats_hist_t;
+
+/**
+ * Outcomes of the protocols run through one intermediary since start
+ */
+typedef struct {
+  uint64_t done[MT_STATS_NUM_PHASES];
+  uint64_t failed[MT_STATS_NUM_PHASES];
+} mt_stats_result_t;
+
+/**
+ * Record that <b>phase</b> of a channel we hold as <b>role</b> with
+ * <b>peer</b> through intermediary <b>idesc</b> completed after <b>usec</b>
+ * microseconds and tell interested controllers. <b>idesc</b> is NULL when we
+ * are the intermediary.
+ */
+void mt_stats_note_done(mt_stats_role_t role, mt_stats_phase_t phase, mt_desc_t* peer,
+			mt_desc_t* idesc, uint64_t usec);
+
+/**
+ * Record that <b>phase</b> of a channel we hold as <b>role</b> with
+ * <b>peer</b> through intermediary <b>idesc</b> failed and tell interested
+ * controllers. <b>idesc</b> is NULL when we are the intermediary.
+ */
+void mt_stats_note_failed(mt_stats_role_t role, mt_stats_phase_t phase, mt_desc_t* peer,
+			  mt_desc_t* idesc);
+
+/**
+ * Return the phase of a channel's life that a message of <b>type</b> is part
+ * of
+ */
+mt_stats_phase_t mt_stats_phase_of(mt_ntype_t type);
+
+void mt_stats_get_hist(mt_stats_role_t role, mt_stats_phase_t phase,
+		       mt_stats_hist_t* hist_out);
+
+/**
+ * Write the outcomes recorded for intermediary <b>idesc</b> to
+ * <b>result_out</b>; all zero if there are none
+ */
+void mt_stats_get_result(mt_desc_t* idesc, mt_stats_result_t* result_out);
+
+/**
+ * Send the current channel, message buffer and cpuworker gauges to interested
+ * controllers. Called once a second.
+ */
+void mt_stats_send_event(void);
+
+/**
+ * Drop everything recorded so far
+ */
+void mt_stats_clear(void);
+
+int getinfo_helper_mt(control_connection_t *conn, const char *question,
+		      char **answer, const char **errmsg);
+
+#endif
@@ -5,10 +5,26 @@
  * that enable conversion between semantically meaningful c structs and network
  * sendable byte strings.
  *
- * The current definitions do straightforward casting between structs and byte
- * strings. It may be necessary in more mature versions to explictly define byte
- * allocation in the messages for portability and to add additional meta
- * information.
+ * Tokens are described field by field in the tables below and encoded in a
+ * versioned wire format that does not depend on the host. A packed token is
+ *
+ *   version (1) | type (1) | pid (DIGEST_LEN) | fields...
+ *
+ * where every int or enum field is 4 bytes in network order, byte arrays are
+ * copied as they are and struct padding is never sent. Public keys are sent
+ * as their 1024-bit RSA modulus or tagged Ed25519 key (see encode_pk()) rather
+ * than as PEM blobs. Batch fields (see W_BATCH) follow a marker byte and are
+ * only sent when it is set, so a token with them ranges from the size without
+ * them up to mt_token_get_size_of(); every other token of a given type has the
+ * same compact size.
+ *
+ * A signed message is
+ *
+ *   scheme (1) | token | public key | signature
+ *
+ * where the scheme byte gives the size of the key and signature: RSA keys and
+ * signatures fill MT_SZ_WIRE_PK and MT_SZ_SIG bytes, while Ed25519 ones are
+ * sent at their natural size.
  */
 
 #pragma GCC diagnostic ignored "-Wswitch-enum"
@@ -17,735 +33,1619 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
+#include "crypto_ed25519.h"
 #include "mt_crypto.h"
 #include "mt_tokens.h"
 
-int pack_token(mt_ntype_t type, void* ptr, int tkn_size, byte(*pid)[DIGEST_LEN], byte** str_out);
-int unpack_token(mt_ntype_t type, byte* str, int tkn_size, void* tkn_out, byte(*pid_out)[DIGEST_LEN]);
+int pack_token(mt_ntype_t type, void* ptr, byte(*pid)[DIGEST_LEN], byte** str_out);
+int unpack_token(mt_ntype_t type, byte* str, int size, void* tkn_out, int tkn_size,
+		 byte(*pid_out)[DIGEST_LEN]);
+
+/******************************** Public Keys ********************************/
+
+#define PK_PEM_HEAD "-----BEGIN PUBLIC KEY-----\n"
+#define PK_PEM_TAIL "-----END PUBLIC KEY-----\n"
+
+/** DER SubjectPublicKeyInfo of a 1024-bit RSA key with exponent 65537, as
+ * written by mt_crypt_keygen(), surrounding the modulus */
+static const byte pk_der_prefix[] = {
+  0x30, 0x81, 0x9f, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7,
+  0x0d, 0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x81, 0x8d, 0x00, 0x30, 0x81,
+  0x89, 0x02, 0x81, 0x81, 0x00
+};
+static const byte pk_der_suffix[] = { 0x02, 0x03, 0x01, 0x00, 0x01 };
+
+#define PK_SZ_DER (sizeof(pk_der_prefix) + MT_SZ_WIRE_PK + sizeof(pk_der_suffix))
+
+/** First byte of the compact form of an Ed25519 key. A 1024-bit RSA modulus
+ * always has its top bit set, so the two forms cannot be confused. */
+#define PK_WIRE_ED25519 0x01
+
+/**
+ * Rebuild the public key for a compact form written by encode_pk(). An all
+ * zero form stands for a blank key.
+ */
+static void decode_pk(const byte* in, byte (*pk_out)[MT_SZ_PK]){
+
+  memset(*pk_out, 0, MT_SZ_PK);
+  if(tor_mem_is_zero((const char*)in, MT_SZ_WIRE_PK))
+    return;
+
+  if(in[0] == PK_WIRE_ED25519){
+    memcpy(*pk_out, MT_ED25519_TAG, MT_SZ_ED25519_TAG);
+    memcpy(*pk_out + MT_SZ_ED25519_TAG, in + 1, ED25519_PUBKEY_LEN);
+    return;
+  }
+
+  byte der[PK_SZ_DER];
+  memcpy(der, pk_der_prefix, sizeof(pk_der_prefix));
+  memcpy(der + sizeof(pk_der_prefix), in, MT_SZ_WIRE_PK);
+  memcpy(der + sizeof(pk_der_prefix) + MT_SZ_WIRE_PK, pk_der_suffix, sizeof(pk_der_suffix));
+
+  char* pem = (char*)*pk_out;
+  size_t head = strlen(PK_PEM_HEAD);
+  memcpy(pem, PK_PEM_HEAD, head);
+  int body = base64_encode(pem + head, MT_SZ_PK - head, (const char*)der, sizeof(der),
+			   BASE64_ENCODE_MULTILINE);
+  tor_assert(body > 0 && head + body + strlen(PK_PEM_TAIL) < MT_SZ_PK);
+  memcpy(pem + head + body, PK_PEM_TAIL, strlen(PK_PEM_TAIL));
+}
+
+/**
+ * Write the compact form of <b>pk</b>: the 128-byte modulus of an RSA key as
+ * produced by mt_crypt_keygen(), PK_WIRE_ED25519 followed by an Ed25519 key,
+ * or zeros for a blank key. Any other key cannot be sent and MT_ERROR is
+ * returned with <b>out</b> set to zeros.
+ */
+static int encode_pk(const byte (*pk)[MT_SZ_PK], byte* out){
+
+  memset(out, 0, MT_SZ_WIRE_PK);
+  if(tor_mem_is_zero((const char*)*pk, MT_SZ_PK))
+    return MT_SUCCESS;
+
+  if(mt_crypt_is_ed25519(*pk)){
+    size_t used = MT_SZ_ED25519_TAG + ED25519_PUBKEY_LEN;
+    if(!tor_mem_is_zero((const char*)*pk + used, MT_SZ_PK - used))
+      return MT_ERROR;
+    out[0] = PK_WIRE_ED25519;
+    memcpy(out + 1, *pk + MT_SZ_ED25519_TAG, ED25519_PUBKEY_LEN);
+    return MT_SUCCESS;
+  }
+
+  const char* pem = (const char*)*pk;
+  size_t head = strlen(PK_PEM_HEAD);
+  if(strncmp(pem, PK_PEM_HEAD, head) != 0)
+    return MT_ERROR;
+
+  const char* tail = tor_memstr(pem + head, MT_SZ_PK - head, PK_PEM_TAIL);
+  if(!tail)
+    return MT_ERROR;
+
+  byte der[MT_SZ_PK];
+  int der_size = base64_decode((char*)der, sizeof(der), pem + head, tail - (pem + head));
+  if(der_size != (int)PK_SZ_DER ||
+     memcmp(der, pk_der_prefix, sizeof(pk_der_prefix)) != 0 ||
+     memcmp(der + sizeof(pk_der_prefix) + MT_SZ_WIRE_PK, pk_der_suffix,
+	    sizeof(pk_der_suffix)) != 0)
+    return MT_ERROR;
+
+  // only accept keys that decode_pk() reproduces byte for byte
+  byte check[MT_SZ_PK];
+  decode_pk(der + sizeof(pk_der_prefix), &check);
+  if(tor_memneq(check, *pk, MT_SZ_PK))
+    return MT_ERROR;
+
+  memcpy(out, der + sizeof(pk_der_prefix), MT_SZ_WIRE_PK);
+  return MT_SUCCESS;
+}
 
 /*************************** Sign/Verify Messages ****************************/
 
+/** Scheme bytes at the start of a signed message */
+#define SIGNED_RSA 0x01
+#define SIGNED_ED25519 0x02
+
+/** Bytes a signed message adds around the message for each scheme */
+#define SIGNED_SZ_RSA (1 + MT_SZ_WIRE_PK + MT_SZ_SIG)
+#define SIGNED_SZ_ED25519 (1 + ED25519_PUBKEY_LEN + ED25519_SIG_LEN)
+
+/**
+ * Return the bytes a signed message of the given scheme adds to the message,
+ * or 0 for an unknown scheme
+ */
+static int signed_overhead(byte scheme){
+  switch(scheme){
+    case SIGNED_RSA:
+      return SIGNED_SZ_RSA;
+    case SIGNED_ED25519:
+      return SIGNED_SZ_ED25519;
+    default:
+      return 0;
+  }
+}
+
 int mt_create_signed_msg(byte* msg, int size, byte (*pk)[MT_SZ_PK], byte (*sk)[MT_SZ_SK],
 			 byte** signed_out){
 
-  *signed_out = tor_malloc(size + MT_SZ_PK + MT_SZ_SIG);
-  memcpy(*signed_out, msg, size);
-  memcpy(*signed_out + size, *pk, MT_SZ_PK);
+  if(size < 0)
+    return MT_ERROR;
+
+  byte wire_pk[MT_SZ_WIRE_PK];
+  if(encode_pk((const byte (*)[MT_SZ_PK])pk, wire_pk) != MT_SUCCESS){
+    log_warn(LD_MT, "MoneTor: cannot sign with a key that has no compact form");
+    return MT_ERROR;
+  }
 
   byte sig[MT_SZ_SIG];
   if(mt_sig_sign(msg, size, sk, &sig) != MT_SUCCESS)
     return MT_ERROR;
 
-  memcpy(*signed_out + size + MT_SZ_PK, sig, MT_SZ_SIG);
-  return size + MT_SZ_PK + MT_SZ_SIG;
+  byte scheme = wire_pk[0] == PK_WIRE_ED25519 ? SIGNED_ED25519 : SIGNED_RSA;
+  int signed_size = size + signed_overhead(scheme);
+  byte* out = *signed_out = tor_malloc(signed_size);
+
+  *out++ = scheme;
+  memcpy(out, msg, size);
+  out += size;
+  if(scheme == SIGNED_ED25519){
+    memcpy(out, wire_pk + 1, ED25519_PUBKEY_LEN);
+    memcpy(out + ED25519_PUBKEY_LEN, sig, ED25519_SIG_LEN);
+  }
+  else {
+    memcpy(out, wire_pk, MT_SZ_WIRE_PK);
+    memcpy(out + MT_SZ_WIRE_PK, sig, MT_SZ_SIG);
+  }
+  return signed_size;
+}
+
+/**
+ * Split a signed message into the message, the signer's key and signature
+ * and return the size of the message itself
+ */
+static int parse_signed_msg(byte* signed_msg, int size, byte** msg_out, byte (*pk_out)[MT_SZ_PK],
+			    byte (*sig_out)[MT_SZ_SIG]){
+  if(size < 1)
+    return MT_ERROR;
+
+  int overhead = signed_overhead(signed_msg[0]);
+  int msg_size = size - overhead;
+  if(overhead == 0 || msg_size < 0)
+    return MT_ERROR;
+
+  const byte* trailer = signed_msg + 1 + msg_size;
+  memset(*sig_out, 0, MT_SZ_SIG);
+  if(signed_msg[0] == SIGNED_ED25519){
+    memset(*pk_out, 0, MT_SZ_PK);
+    memcpy(*pk_out, MT_ED25519_TAG, MT_SZ_ED25519_TAG);
+    memcpy(*pk_out + MT_SZ_ED25519_TAG, trailer, ED25519_PUBKEY_LEN);
+    memcpy(*sig_out, trailer + ED25519_PUBKEY_LEN, ED25519_SIG_LEN);
+  }
+  else {
+    decode_pk(trailer, pk_out);
+    memcpy(*sig_out, trailer + MT_SZ_WIRE_PK, MT_SZ_SIG);
+  }
+
+  *msg_out = signed_msg + 1;
+  return msg_size;
 }
 
 int mt_verify_signed_msg(byte* signed_msg, int size, byte(*pk_out)[MT_SZ_PK], byte** msg_out){
-  int msg_size = size - MT_SZ_PK - MT_SZ_SIG;
 
+  byte* msg;
   byte sig[MT_SZ_SIG];
-  memcpy(*pk_out, signed_msg + msg_size, MT_SZ_PK);
-  memcpy(sig, signed_msg + msg_size + MT_SZ_PK, MT_SZ_SIG);
+  int msg_size = parse_signed_msg(signed_msg, size, &msg, pk_out, &sig);
+  if(msg_size == MT_ERROR)
+    return MT_ERROR;
 
-  if(mt_sig_verify(signed_msg, msg_size, pk_out, &sig) != MT_SUCCESS)
+  if(mt_sig_verify(msg, msg_size, pk_out, &sig) != MT_SUCCESS)
     return MT_ERROR;
 
-  *msg_out = tor_malloc(msg_size);
-  memcpy(*msg_out, signed_msg, msg_size);
+  *msg_out = msg;
   return msg_size;
 }
 
+int mt_verify_signed_msgs(int n, byte** signed_msgs, int* sizes, byte (*pks_out)[MT_SZ_PK],
+			  byte** msgs_out, int* sizes_out){
+
+  int result = MT_SUCCESS;
+  mt_sig_checkable_t* checks = tor_calloc(n, sizeof(mt_sig_checkable_t));
+  byte (*sigs)[MT_SZ_SIG] = tor_calloc(n, MT_SZ_SIG);
+  int* index = tor_calloc(n, sizeof(int));
+  int* ok = tor_calloc(n, sizeof(int));
+  int num_checks = 0;
+
+  for(int i = 0; i < n; i++){
+    msgs_out[i] = NULL;
+    sizes_out[i] = MT_ERROR;
+
+    byte* msg;
+    int msg_size = parse_signed_msg(signed_msgs[i], sizes[i], &msg, &pks_out[i], &sigs[i]);
+    if(msg_size == MT_ERROR){
+      result = MT_ERROR;
+      continue;
+    }
+    checks[num_checks].msg = msg;
+    checks[num_checks].msg_size = msg_size;
+    checks[num_checks].pk = &pks_out[i];
+    checks[num_checks].sig = &sigs[i];
+    index[num_checks++] = i;
+  }
+
+  if(mt_sig_verify_batch(checks, num_checks, ok) != MT_SUCCESS)
+    result = MT_ERROR;
+
+  for(int j = 0; j < num_checks; j++){
+    if(!ok[j])
+      continue;
+    int i = index[j];
+    sizes_out[i] = checks[j].msg_size;
+    msgs_out[i] = checks[j].msg;
+  }
+
+  tor_free(checks);
+  tor_free(sigs);
+  tor_free(index);
+  tor_free(ok);
+  return result;
+}
+
 /**************************** Pack/Unpack Tokens *****************************/
 
 int pack_mac_aut_mint(mac_aut_mint_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MAC_AUT_MINT, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MAC_AUT_MINT, token, pid, str_out);
 }
 
 int pack_mac_any_trans(mac_any_trans_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MAC_ANY_TRANS, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MAC_ANY_TRANS, token, pid, str_out);
 }
 
 int pack_chn_end_setup(chn_end_setup_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_END_SETUP, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_END_SETUP, token, pid, str_out);
 }
 
 int pack_chn_int_setup(chn_int_setup_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_SETUP, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_SETUP, token, pid, str_out);
 }
 
 int pack_any_led_confirm(any_led_confirm_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_ANY_LED_CONFIRM, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_ANY_LED_CONFIRM, token, pid, str_out);
 }
 
 int pack_chn_int_reqclose(chn_int_reqclose_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_REQCLOSE, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_REQCLOSE, token, pid, str_out);
 }
 
 int pack_chn_end_close(chn_end_close_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_END_CLOSE, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_END_CLOSE, token, pid, str_out);
 }
 
 int pack_chn_int_close(chn_int_close_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_CLOSE, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_CLOSE, token, pid, str_out);
 }
 
 int pack_chn_end_cashout(chn_end_cashout_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_END_CASHOUT, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_END_CASHOUT, token, pid, str_out);
 }
 
 int pack_chn_int_cashout(chn_int_cashout_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_CASHOUT, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_CASHOUT, token, pid, str_out);
 }
 
 int pack_mac_led_data(mac_led_data_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MAC_LED_DATA, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MAC_LED_DATA, token, pid, str_out);
 }
 
 int pack_chn_led_data(chn_led_data_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_LED_DATA, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_LED_DATA, token, pid, str_out);
 }
 
 int pack_mac_led_query(mac_led_query_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MAC_LED_QUERY, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MAC_LED_QUERY, token, pid, str_out);
 }
 
 int pack_chn_led_query(chn_led_query_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_LED_QUERY, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_LED_QUERY, token, pid, str_out);
 }
 
 int pack_chn_end_estab1(chn_end_estab1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_END_ESTAB1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_END_ESTAB1, token, pid, str_out);
 }
 
 int pack_chn_int_estab2(chn_int_estab2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_ESTAB2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_ESTAB2, token, pid, str_out);
 }
 
 int pack_chn_end_estab3(chn_end_estab3_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_END_ESTAB3, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_END_ESTAB3, token, pid, str_out);
 }
 
 int pack_chn_int_estab4(chn_int_estab4_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_CHN_INT_ESTAB4, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_CHN_INT_ESTAB4, token, pid, str_out);
 }
 
 int pack_mic_cli_pay1(mic_cli_pay1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_CLI_PAY1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_CLI_PAY1, token, pid, str_out);
 }
 
 int pack_mic_rel_pay2(mic_rel_pay2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_REL_PAY2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_REL_PAY2, token, pid, str_out);
 }
 
 int pack_mic_cli_pay3(mic_cli_pay3_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_CLI_PAY3, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_CLI_PAY3, token, pid, str_out);
 }
 
 int pack_mic_int_pay4(mic_int_pay4_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_INT_PAY4, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_INT_PAY4, token, pid, str_out);
 }
 
 int pack_mic_cli_pay5(mic_cli_pay5_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_CLI_PAY5, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_CLI_PAY5, token, pid, str_out);
 }
 
 int pack_mic_rel_pay6(mic_rel_pay6_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_REL_PAY6, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_REL_PAY6, token, pid, str_out);
 }
 
 int pack_mic_int_pay7(mic_int_pay7_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_INT_PAY7, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_INT_PAY7, token, pid, str_out);
 }
 
 int pack_mic_int_pay8(mic_int_pay8_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_MIC_INT_PAY8, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_MIC_INT_PAY8, token, pid, str_out);
 }
 
 int pack_nan_cli_setup1(nan_cli_setup1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_SETUP1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_SETUP1, token, pid, str_out);
 }
 
 int pack_nan_int_setup2(nan_int_setup2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_SETUP2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_SETUP2, token, pid, str_out);
 }
 
 int pack_nan_cli_setup3(nan_cli_setup3_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_SETUP3, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_SETUP3, token, pid, str_out);
 }
 
 int pack_nan_int_setup4(nan_int_setup4_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_SETUP4, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_SETUP4, token, pid, str_out);
 }
 
 int pack_nan_cli_setup5(nan_cli_setup5_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_SETUP5, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_SETUP5, token, pid, str_out);
 }
 
 int pack_nan_int_setup6(nan_int_setup6_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_SETUP6, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_SETUP6, token, pid, str_out);
 }
 
 int pack_nan_cli_estab1(nan_cli_estab1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_ESTAB1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_ESTAB1, token, pid, str_out);
 }
 
 int pack_nan_rel_estab2(nan_rel_estab2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_REL_ESTAB2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_REL_ESTAB2, token, pid, str_out);
 }
 
 int pack_nan_int_estab3(nan_int_estab3_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_ESTAB3, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_ESTAB3, token, pid, str_out);
 }
 
 int pack_nan_rel_estab4(nan_rel_estab4_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_REL_ESTAB4, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_REL_ESTAB4, token, pid, str_out);
 }
 
 int pack_nan_int_estab5(nan_int_estab5_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_ESTAB5, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_ESTAB5, token, pid, str_out);
 }
 
 int pack_nan_rel_estab6(nan_rel_estab6_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_REL_ESTAB6, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_REL_ESTAB6, token, pid, str_out);
 }
 
 int pack_nan_cli_pay1(nan_cli_pay1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_PAY1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_PAY1, token, pid, str_out);
 }
 
 int pack_nan_rel_pay2(nan_rel_pay2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_REL_PAY2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_REL_PAY2, token, pid, str_out);
 }
 
 int pack_nan_cli_reqclose1(nan_cli_reqclose1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_REQCLOSE1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_REQCLOSE1, token, pid, str_out);
 }
 
 int pack_nan_rel_reqclose2(nan_rel_reqclose2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_REL_REQCLOSE2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_REL_REQCLOSE2, token, pid, str_out);
 }
 
 int pack_nan_cli_destab1(nan_cli_destab1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_DESTAB1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_DESTAB1, token, pid, str_out);
 }
 
 int pack_nan_int_destab2(nan_int_destab2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_DESTAB2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_DESTAB2, token, pid, str_out);
 }
 
 int pack_nan_cli_dpay1(nan_cli_dpay1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_CLI_DPAY1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_CLI_DPAY1, token, pid, str_out);
 }
 
 int pack_nan_int_dpay2(nan_int_dpay2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_DPAY2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_DPAY2, token, pid, str_out);
 }
 
 int pack_nan_end_close1(nan_end_close1_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_END_CLOSE1, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_END_CLOSE1, token, pid, str_out);
 }
 
 int pack_nan_int_close2(nan_int_close2_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_CLOSE2, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_CLOSE2, token, pid, str_out);
 }
 
 int pack_nan_end_close3(nan_end_close3_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_END_CLOSE3, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_END_CLOSE3, token, pid, str_out);
 }
 
 int pack_nan_int_close4(nan_int_close4_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_CLOSE4, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_CLOSE4, token, pid, str_out);
 }
 
 int pack_nan_end_close5(nan_end_close5_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_END_CLOSE5, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_END_CLOSE5, token, pid, str_out);
 }
 
 int pack_nan_int_close6(nan_int_close6_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_CLOSE6, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_CLOSE6, token, pid, str_out);
 }
 
 int pack_nan_end_close7(nan_end_close7_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_END_CLOSE7, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_END_CLOSE7, token, pid, str_out);
 }
 
 int pack_nan_int_close8(nan_int_close8_t* token, byte(*pid)[DIGEST_LEN], byte** str_out){
-    return pack_token(MT_NTYPE_NAN_INT_CLOSE8, token, sizeof(*token), pid, str_out);
+    return pack_token(MT_NTYPE_NAN_INT_CLOSE8, token, pid, str_out);
 }
 
 
 //--------------------------------- Unpack --------------------------------//
 
 int unpack_mac_aut_mint(byte* str, int size, mac_aut_mint_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MAC_AUT_MINT, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MAC_AUT_MINT, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mac_any_trans(byte* str, int size, mac_any_trans_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MAC_ANY_TRANS, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MAC_ANY_TRANS, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_end_setup(byte* str, int size, chn_end_setup_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_END_SETUP, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_END_SETUP, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_int_setup(byte* str, int size, chn_int_setup_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_SETUP, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_SETUP, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_any_led_confirm(byte* str, int size, any_led_confirm_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_ANY_LED_CONFIRM, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_ANY_LED_CONFIRM, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_int_reqclose(byte* str, int size, chn_int_reqclose_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_REQCLOSE, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_REQCLOSE, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_end_close(byte* str, int size, chn_end_close_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_END_CLOSE, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_END_CLOSE, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_int_close(byte* str, int size, chn_int_close_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_CLOSE, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_CLOSE, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_end_cashout(byte* str, int size, chn_end_cashout_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_END_CASHOUT, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_END_CASHOUT, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_int_cashout(byte* str, int size, chn_int_cashout_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_CASHOUT, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_CASHOUT, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mac_led_data(byte* str, int size, mac_led_data_t* tkn_out,  byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MAC_LED_DATA, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MAC_LED_DATA, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 int unpack_chn_led_data(byte* str, int size, chn_led_data_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_LED_DATA, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_LED_DATA, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mac_led_query(byte* str, int size, mac_led_query_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MAC_LED_QUERY, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MAC_LED_QUERY, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 int unpack_chn_led_query(byte* str, int size, chn_led_query_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_LED_QUERY, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_LED_QUERY, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_end_estab1(byte* str, int size, chn_end_estab1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_END_ESTAB1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_END_ESTAB1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 int unpack_chn_int_estab2(byte* str, int size, chn_int_estab2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_ESTAB2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_ESTAB2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_end_estab3(byte* str, int size, chn_end_estab3_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_END_ESTAB3, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_END_ESTAB3, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_chn_int_estab4(byte* str, int size, chn_int_estab4_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_CHN_INT_ESTAB4, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_CHN_INT_ESTAB4, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_cli_pay1(byte* str, int size, mic_cli_pay1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_CLI_PAY1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_CLI_PAY1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_rel_pay2(byte* str, int size, mic_rel_pay2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_REL_PAY2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_REL_PAY2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_cli_pay3(byte* str, int size, mic_cli_pay3_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_CLI_PAY3, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_CLI_PAY3, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_int_pay4(byte* str, int size, mic_int_pay4_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_INT_PAY4, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_INT_PAY4, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_cli_pay5(byte* str, int size, mic_cli_pay5_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_CLI_PAY5, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_CLI_PAY5, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_rel_pay6(byte* str, int size, mic_rel_pay6_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_REL_PAY6, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_REL_PAY6, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_int_pay7(byte* str, int size, mic_int_pay7_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_INT_PAY7, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_INT_PAY7, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_mic_int_pay8(byte* str, int size, mic_int_pay8_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_MIC_INT_PAY8, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_MIC_INT_PAY8, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_setup1(byte* str, int size, nan_cli_setup1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_SETUP1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_SETUP1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_setup2(byte* str, int size, nan_int_setup2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_SETUP2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_SETUP2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_setup3(byte* str, int size, nan_cli_setup3_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_SETUP3, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_SETUP3, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_setup4(byte* str, int size, nan_int_setup4_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_SETUP4, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_SETUP4, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_setup5(byte* str, int size, nan_cli_setup5_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_SETUP5, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_SETUP5, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_setup6(byte* str, int size, nan_int_setup6_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_SETUP6, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_SETUP6, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_estab1(byte* str, int size, nan_cli_estab1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_ESTAB1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_ESTAB1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_rel_estab2(byte* str, int size, nan_rel_estab2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_REL_ESTAB2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_REL_ESTAB2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_estab3(byte* str, int size, nan_int_estab3_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_ESTAB3, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_ESTAB3, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_rel_estab4(byte* str, int size, nan_rel_estab4_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_REL_ESTAB4, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_REL_ESTAB4, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_estab5(byte* str, int size, nan_int_estab5_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_ESTAB5, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_ESTAB5, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_rel_estab6(byte* str, int size, nan_rel_estab6_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_REL_ESTAB6, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_REL_ESTAB6, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_pay1(byte* str, int size, nan_cli_pay1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_PAY1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_PAY1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_rel_pay2(byte* str, int size, nan_rel_pay2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_REL_PAY2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_REL_PAY2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_reqclose1(byte* str, int size, nan_cli_reqclose1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_REQCLOSE1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_REQCLOSE1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_rel_reqclose2(byte* str, int size, nan_rel_reqclose2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_REL_REQCLOSE2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_REL_REQCLOSE2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_destab1(byte* str, int size, nan_cli_destab1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_DESTAB1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_DESTAB1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_destab2(byte* str, int size, nan_int_destab2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_DESTAB2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_DESTAB2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_cli_dpay1(byte* str, int size, nan_cli_dpay1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_CLI_DPAY1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_CLI_DPAY1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_dpay2(byte* str, int size, nan_int_dpay2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_DPAY2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_DPAY2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_end_close1(byte* str, int size, nan_end_close1_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_END_CLOSE1, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_END_CLOSE1, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_close2(byte* str, int size, nan_int_close2_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_CLOSE2, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_CLOSE2, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_end_close3(byte* str, int size, nan_end_close3_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_END_CLOSE3, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_END_CLOSE3, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_close4(byte* str, int size, nan_int_close4_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_CLOSE4, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_CLOSE4, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_end_close5(byte* str, int size, nan_end_close5_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_END_CLOSE5, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_END_CLOSE5, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_close6(byte* str, int size, nan_int_close6_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_CLOSE6, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_CLOSE6, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_end_close7(byte* str, int size, nan_end_close7_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_END_CLOSE7, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_END_CLOSE7, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 int unpack_nan_int_close8(byte* str, int size, nan_int_close8_t* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  if(size != sizeof(mt_ntype_t) + sizeof(*tkn_out) + DIGEST_LEN)
-    return MT_ERROR;
-  return unpack_token(MT_NTYPE_NAN_INT_CLOSE8, str, sizeof(*tkn_out), tkn_out, pid_out);
+  return unpack_token(MT_NTYPE_NAN_INT_CLOSE8, str, size, tkn_out, sizeof(*tkn_out), pid_out);
 }
 
 //------------------------------ Helper Functions ---------------------------//
 
-int pack_token(mt_ntype_t type, void *ptr, int tkn_size, byte(*pid)[DIGEST_LEN], byte** str_out){
-    int str_size = sizeof(mt_ntype_t) + tkn_size + DIGEST_LEN;
-    byte* str = tor_malloc(str_size);
-    memcpy(str, &type, sizeof(type));
-    memcpy(str + sizeof(mt_ntype_t), ptr, tkn_size);
-    memcpy(str + sizeof(mt_ntype_t) + tkn_size, *pid, DIGEST_LEN);
+/******************************** Wire Format ********************************/
+
+/** Kinds of fields that make up a token on the wire */
+typedef enum {
+  WIRE_END,        // terminates a field list
+  WIRE_U32,        // int or enum, 4 bytes in network order
+  WIRE_BYTES,      // byte array copied as is
+  WIRE_PK,         // public key in compact form
+  WIRE_STRUCT,     // nested struct with its own field list
+  WIRE_BATCH,      // marker byte, then fields of the same struct if it is set
+} wire_kind_t;
+
+typedef struct wire_field_t {
+  wire_kind_t kind;
+  size_t offset;
+  size_t size;
+  const struct wire_field_t* sub;
+} wire_field_t;
+
+#define W_U32(t, f) { WIRE_U32, offsetof(t, f), sizeof(((t*)0)->f), NULL }
+#define W_BYTES(t, f) { WIRE_BYTES, offsetof(t, f), sizeof(((t*)0)->f), NULL }
+#define W_PK(t, f) { WIRE_PK, offsetof(t, f), MT_SZ_PK, NULL }
+#define W_STRUCT(t, f, s) { WIRE_STRUCT, offsetof(t, f), sizeof(((t*)0)->f), s }
+/** Fields sent only when the first of them, a U32, is not zero */
+#define W_BATCH(t, s) { WIRE_BATCH, 0, sizeof(t), s }
+#define W_END { WIRE_END, 0, 0, NULL }
+
+/** Values of the marker byte in front of batch fields */
+#define WIRE_BATCH_ABSENT 0x00
+#define WIRE_BATCH_PRESENT 0x01
+
+static const wire_field_t nan_any_public_fields[] = {
+  W_U32(nan_any_public_t, val_from),
+  W_U32(nan_any_public_t, val_to),
+  W_U32(nan_any_public_t, num_payments),
+  W_BYTES(nan_any_public_t, hash_tail),
+  W_END
+};
+
+/** The revocation message is a code byte followed by the wallet key */
+static const wire_field_t chn_end_revocation_fields[] = {
+  { WIRE_BYTES, offsetof(chn_end_revocation_t, msg), sizeof(byte), NULL },
+  { WIRE_PK, offsetof(chn_end_revocation_t, msg) + sizeof(byte), MT_SZ_PK, NULL },
+  W_BYTES(chn_end_revocation_t, sig),
+  W_END
+};
+
+static const wire_field_t any_led_receipt_batch_fields[] = {
+  W_U32(any_led_receipt_t, batch_size),
+  W_U32(any_led_receipt_t, index),
+  W_BYTES(any_led_receipt_t, path),
+  W_END
+};
+
+static const wire_field_t any_led_receipt_fields[] = {
+  W_U32(any_led_receipt_t, type),
+  W_U32(any_led_receipt_t, val),
+  W_BYTES(any_led_receipt_t, from),
+  W_BYTES(any_led_receipt_t, to),
+  W_BYTES(any_led_receipt_t, sig),
+  W_BATCH(any_led_receipt_t, any_led_receipt_batch_fields),
+  W_END
+};
+
+static const wire_field_t chn_end_public_fields[] = {
+  W_U32(chn_end_public_t, end_bal),
+  W_U32(chn_end_public_t, int_bal),
+  W_PK(chn_end_public_t, cpk),
+  W_BYTES(chn_end_public_t, addr),
+  W_BYTES(chn_end_public_t, wcom),
+  W_END
+};
+
+/** Only the first MT_SZ_ADDR bytes of the (oversized) address are used */
+static const wire_field_t chn_int_public_fields[] = {
+  W_U32(chn_int_public_t, end_bal),
+  W_U32(chn_int_public_t, int_bal),
+  W_PK(chn_int_public_t, cpk),
+  { WIRE_BYTES, offsetof(chn_int_public_t, addr), MT_SZ_ADDR, NULL },
+  W_END
+};
+
+static const wire_field_t chn_end_refund_fields[] = {
+  W_U32(chn_end_refund_t, code),
+  W_PK(chn_end_refund_t, wpk),
+  W_U32(chn_end_refund_t, end_bal),
+  W_PK(chn_end_refund_t, conditional),
+  W_BYTES(chn_end_refund_t, msg),
+  W_BYTES(chn_end_refund_t, sig),
+  W_END
+};
+
+static const wire_field_t mac_aut_mint_fields[] = {
+  W_BYTES(mac_aut_mint_t, nonce),
+  W_U32(mac_aut_mint_t, value),
+  W_PK(mac_aut_mint_t, pk),
+  W_BYTES(mac_aut_mint_t, sig),
+  W_END
+};
+
+static const wire_field_t mac_any_trans_fields[] = {
+  W_BYTES(mac_any_trans_t, nonce),
+  W_U32(mac_any_trans_t, val_from),
+  W_U32(mac_any_trans_t, val_to),
+  W_BYTES(mac_any_trans_t, from),
+  W_BYTES(mac_any_trans_t, to),
+  W_END
+};
+
+static const wire_field_t chn_end_setup_fields[] = {
+  W_U32(chn_end_setup_t, val_from),
+  W_U32(chn_end_setup_t, val_to),
+  W_BYTES(chn_end_setup_t, from),
+  W_BYTES(chn_end_setup_t, chn),
+  W_STRUCT(chn_end_setup_t, chn_public, chn_end_public_fields),
+  W_END
+};
+
+static const wire_field_t chn_int_setup_fields[] = {
+  W_U32(chn_int_setup_t, val_from),
+  W_U32(chn_int_setup_t, val_to),
+  W_BYTES(chn_int_setup_t, from),
+  W_BYTES(chn_int_setup_t, chn),
+  W_STRUCT(chn_int_setup_t, chn_public, chn_int_public_fields),
+  W_END
+};
+
+static const wire_field_t any_led_confirm_fields[] = {
+  W_U32(any_led_confirm_t, success),
+  W_STRUCT(any_led_confirm_t, receipt, any_led_receipt_fields),
+  W_END
+};
+
+static const wire_field_t chn_int_reqclose_fields[] = {
+  W_BYTES(chn_int_reqclose_t, chn),
+  W_PK(chn_int_reqclose_t, pk),
+  W_BYTES(chn_int_reqclose_t, sig),
+  W_END
+};
+
+static const wire_field_t chn_end_close_fields[] = {
+  W_BYTES(chn_end_close_t, chn),
+  W_STRUCT(chn_end_close_t, refund_token, chn_end_refund_fields),
+  W_U32(chn_end_close_t, last_pay_num),
+  W_BYTES(chn_end_close_t, last_hash),
+  W_PK(chn_end_close_t, pk),
+  W_BYTES(chn_end_close_t, sig),
+  W_END
+};
+
+static const wire_field_t chn_int_close_fields[] = {
+  W_U32(chn_int_close_t, close_code),
+  W_BYTES(chn_int_close_t, chn),
+  W_STRUCT(chn_int_close_t, revocation, chn_end_revocation_fields),
+  W_U32(chn_int_close_t, last_pay_num),
+  W_BYTES(chn_int_close_t, last_hash),
+  W_PK(chn_int_close_t, pk),
+  W_BYTES(chn_int_close_t, sig),
+  W_END
+};
+
+static const wire_field_t chn_end_cashout_fields[] = {
+  W_U32(chn_end_cashout_t, val_from),
+  W_U32(chn_end_cashout_t, val_to),
+  W_BYTES(chn_end_cashout_t, chn),
+  W_PK(chn_end_cashout_t, pk),
+  W_BYTES(chn_end_cashout_t, sig),
+  W_END
+};
+
+static const wire_field_t chn_int_cashout_fields[] = {
+  W_U32(chn_int_cashout_t, val_from),
+  W_U32(chn_int_cashout_t, val_to),
+  W_BYTES(chn_int_cashout_t, chn),
+  W_PK(chn_int_cashout_t, pk),
+  W_BYTES(chn_int_cashout_t, sig),
+  W_END
+};
+
+static const wire_field_t mac_led_data_fields[] = {
+  W_U32(mac_led_data_t, bal),
+  W_END
+};
+
+static const wire_field_t chn_led_data_fields[] = {
+  W_U32(chn_led_data_t, state),
+  W_BYTES(chn_led_data_t, end_addr),
+  W_BYTES(chn_led_data_t, int_addr),
+  W_U32(chn_led_data_t, end_bal),
+  W_U32(chn_led_data_t, int_bal),
+  W_STRUCT(chn_led_data_t, end_public, chn_end_public_fields),
+  W_STRUCT(chn_led_data_t, int_public, chn_int_public_fields),
+  W_STRUCT(chn_led_data_t, end_close_token, chn_end_close_fields),
+  W_STRUCT(chn_led_data_t, int_close_token, chn_int_close_fields),
+  W_U32(chn_led_data_t, close_epoch),
+  W_END
+};
+
+static const wire_field_t mac_led_query_fields[] = {
+  W_BYTES(mac_led_query_t, addr),
+  W_END
+};
+
+static const wire_field_t chn_led_query_fields[] = {
+  W_BYTES(chn_led_query_t, addr),
+  W_END
+};
+
+static const wire_field_t chn_end_estab1_fields[] = {
+  W_U32(chn_end_estab1_t, end_bal),
+  W_U32(chn_end_estab1_t, int_bal),
+  W_BYTES(chn_end_estab1_t, addr),
+  W_BYTES(chn_end_estab1_t, wcom),
+  W_BYTES(chn_end_estab1_t, zkp),
+  W_END
+};
+
+static const wire_field_t chn_int_estab2_fields[] = {
+  W_U32(chn_int_estab2_t, verified),
+  W_PK(chn_int_estab2_t, int_pk),
+  W_STRUCT(chn_int_estab2_t, receipt, any_led_receipt_fields),
+  W_END
+};
+
+static const wire_field_t chn_end_estab3_fields[] = {
+  W_BYTES(chn_end_estab3_t, wcom),
+  W_END
+};
+
+static const wire_field_t chn_int_estab4_fields[] = {
+  W_U32(chn_int_estab4_t, success),
+  W_BYTES(chn_int_estab4_t, sig),
+  W_END
+};
+
+static const wire_field_t mic_cli_pay1_fields[] = {
+  W_U32(mic_cli_pay1_t, value),
+  W_END
+};
+
+static const wire_field_t mic_rel_pay2_fields[] = {
+  W_BYTES(mic_rel_pay2_t, wcom),
+  W_BYTES(mic_rel_pay2_t, zkp),
+  W_END
+};
+
+static const wire_field_t mic_cli_pay3_fields[] = {
+  W_BYTES(mic_cli_pay3_t, cli_valcom),
+  W_BYTES(mic_cli_pay3_t, rel_valcom),
+  W_BYTES(mic_cli_pay3_t, cli_wcom),
+  W_BYTES(mic_cli_pay3_t, rel_wcom),
+  W_BYTES(mic_cli_pay3_t, cli_zkp),
+  W_BYTES(mic_cli_pay3_t, rel_zkp),
+  W_END
+};
+
+static const wire_field_t mic_int_pay4_fields[] = {
+  W_STRUCT(mic_int_pay4_t, cli_refund, chn_end_refund_fields),
+  W_STRUCT(mic_int_pay4_t, rel_refund, chn_end_refund_fields),
+  W_END
+};
+
+static const wire_field_t mic_cli_pay5_fields[] = {
+  W_STRUCT(mic_cli_pay5_t, cli_revocation, chn_end_revocation_fields),
+  W_STRUCT(mic_cli_pay5_t, rel_refund, chn_end_refund_fields),
+  W_END
+};
+
+static const wire_field_t mic_rel_pay6_fields[] = {
+  W_STRUCT(mic_rel_pay6_t, cli_revocation, chn_end_revocation_fields),
+  W_STRUCT(mic_rel_pay6_t, rel_revocation, chn_end_revocation_fields),
+  W_END
+};
+
+static const wire_field_t mic_int_pay7_fields[] = {
+  W_U32(mic_int_pay7_t, success),
+  W_BYTES(mic_int_pay7_t, wsig),
+  W_END
+};
+
+static const wire_field_t mic_int_pay8_fields[] = {
+  W_U32(mic_int_pay8_t, success),
+  W_BYTES(mic_int_pay8_t, wsig),
+  W_END
+};
+
+static const wire_field_t nan_cli_setup1_fields[] = {
+  W_PK(nan_cli_setup1_t, wpk),
+  W_PK(nan_cli_setup1_t, wpk_nan),
+  W_BYTES(nan_cli_setup1_t, wcom),
+  W_BYTES(nan_cli_setup1_t, zkp),
+  W_STRUCT(nan_cli_setup1_t, nan_public, nan_any_public_fields),
+  W_END
+};
+
+static const wire_field_t nan_int_setup2_fields[] = {
+  W_U32(nan_int_setup2_t, verified),
+  W_END
+};
+
+static const wire_field_t nan_cli_setup3_fields[] = {
+  W_BYTES(nan_cli_setup3_t, refund_msg),
+  W_END
+};
+
+static const wire_field_t nan_int_setup4_fields[] = {
+  W_BYTES(nan_int_setup4_t, sig),
+  W_END
+};
+
+static const wire_field_t nan_cli_setup5_fields[] = {
+  W_STRUCT(nan_cli_setup5_t, revocation, chn_end_revocation_fields),
+  W_END
+};
+
+static const wire_field_t nan_int_setup6_fields[] = {
+  W_U32(nan_int_setup6_t, success),
+  W_END
+};
+
+static const wire_field_t nan_cli_estab1_fields[] = {
+  W_STRUCT(nan_cli_estab1_t, nan_public, nan_any_public_fields),
+  W_END
+};
+
+static const wire_field_t nan_rel_estab2_fields[] = {
+  W_PK(nan_rel_estab2_t, wpk),
+  W_PK(nan_rel_estab2_t, wpk_nan),
+  W_BYTES(nan_rel_estab2_t, wcom),
+  W_BYTES(nan_rel_estab2_t, zkp),
+  W_STRUCT(nan_rel_estab2_t, nan_public, nan_any_public_fields),
+  W_END
+};
+
+static const wire_field_t nan_int_estab3_fields[] = {
+  W_U32(nan_int_estab3_t, verified),
+  W_END
+};
+
+static const wire_field_t nan_rel_estab4_fields[] = {
+  W_BYTES(nan_rel_estab4_t, refund_msg),
+  W_END
+};
+
+static const wire_field_t nan_int_estab5_fields[] = {
+  W_U32(nan_int_estab5_t, success),
+  W_BYTES(nan_int_estab5_t, sig),
+  W_END
+};
+
+static const wire_field_t nan_rel_estab6_fields[] = {
+  W_U32(nan_rel_estab6_t, success),
+  W_END
+};
+
+static const wire_field_t nan_cli_pay1_fields[] = {
+  W_STRUCT(nan_cli_pay1_t, nan_public, nan_any_public_fields),
+  W_BYTES(nan_cli_pay1_t, preimage),
+  W_U32(nan_cli_pay1_t, num_units),
+  W_END
+};
+
+static const wire_field_t nan_rel_pay2_fields[] = {
+  W_U32(nan_rel_pay2_t, success),
+  W_END
+};
+
+static const wire_field_t nan_cli_reqclose1_fields[] = {
+  W_STRUCT(nan_cli_reqclose1_t, nan_public, nan_any_public_fields),
+  W_U32(nan_cli_reqclose1_t, reqclose),
+  W_END
+};
+
+static const wire_field_t nan_rel_reqclose2_fields[] = {
+  W_U32(nan_rel_reqclose2_t, success),
+  W_END
+};
+
+static const wire_field_t nan_cli_destab1_fields[] = {
+  W_STRUCT(nan_cli_destab1_t, nan_public, nan_any_public_fields),
+  W_END
+};
+
+static const wire_field_t nan_int_destab2_fields[] = {
+  W_U32(nan_int_destab2_t, success),
+  W_END
+};
+
+static const wire_field_t nan_cli_dpay1_fields[] = {
+  W_STRUCT(nan_cli_dpay1_t, nan_public, nan_any_public_fields),
+  W_BYTES(nan_cli_dpay1_t, preimage),
+  W_U32(nan_cli_dpay1_t, num_units),
+  W_END
+};
+
+static const wire_field_t nan_int_dpay2_fields[] = {
+  W_U32(nan_int_dpay2_t, success),
+  W_END
+};
+
+static const wire_field_t nan_end_close1_fields[] = {
+  W_PK(nan_end_close1_t, wpk),
+  W_BYTES(nan_end_close1_t, wcom_new),
+  W_BYTES(nan_end_close1_t, zkp_new),
+  W_STRUCT(nan_end_close1_t, nan_public, nan_any_public_fields),
+  W_U32(nan_end_close1_t, total_val),
+  W_U32(nan_end_close1_t, num_payments),
+  W_BYTES(nan_end_close1_t, preimage),
+  W_END
+};
+
+static const wire_field_t nan_int_close2_fields[] = {
+  W_U32(nan_int_close2_t, verified),
+  W_END
+};
+
+static const wire_field_t nan_end_close3_fields[] = {
+  W_STRUCT(nan_end_close3_t, nan_public, nan_any_public_fields),
+  W_BYTES(nan_end_close3_t, refund_msg),
+  W_END
+};
+
+static const wire_field_t nan_int_close4_fields[] = {
+  W_BYTES(nan_int_close4_t, sig),
+  W_END
+};
+
+static const wire_field_t nan_end_close5_fields[] = {
+  W_PK(nan_end_close5_t, wpk_nan),
+  W_STRUCT(nan_end_close5_t, revocation, chn_end_revocation_fields),
+  W_END
+};
+
+static const wire_field_t nan_int_close6_fields[] = {
+  W_U32(nan_int_close6_t, verified),
+  W_END
+};
+
+static const wire_field_t nan_end_close7_fields[] = {
+  W_STRUCT(nan_end_close7_t, nan_public, nan_any_public_fields),
+  W_BYTES(nan_end_close7_t, wcom_new),
+  W_END
+};
+
+static const wire_field_t nan_int_close8_fields[] = {
+  W_U32(nan_int_close8_t, success),
+  W_BYTES(nan_int_close8_t, sig),
+  W_END
+};
+
+/** Field list of every token type, indexed by mt_ntype_t */
+static const wire_field_t* const token_fields[] = {
+  [MT_NTYPE_CHN_END_ESTAB1] = chn_end_estab1_fields,
+  [MT_NTYPE_CHN_INT_ESTAB2] = chn_int_estab2_fields,
+  [MT_NTYPE_CHN_END_ESTAB3] = chn_end_estab3_fields,
+  [MT_NTYPE_CHN_INT_ESTAB4] = chn_int_estab4_fields,
+  [MT_NTYPE_MIC_CLI_PAY1] = mic_cli_pay1_fields,
+  [MT_NTYPE_MIC_REL_PAY2] = mic_rel_pay2_fields,
+  [MT_NTYPE_MIC_CLI_PAY3] = mic_cli_pay3_fields,
+  [MT_NTYPE_MIC_INT_PAY4] = mic_int_pay4_fields,
+  [MT_NTYPE_MIC_CLI_PAY5] = mic_cli_pay5_fields,
+  [MT_NTYPE_MIC_REL_PAY6] = mic_rel_pay6_fields,
+  [MT_NTYPE_MIC_INT_PAY7] = mic_int_pay7_fields,
+  [MT_NTYPE_MIC_INT_PAY8] = mic_int_pay8_fields,
+  [MT_NTYPE_NAN_CLI_SETUP1] = nan_cli_setup1_fields,
+  [MT_NTYPE_NAN_INT_SETUP2] = nan_int_setup2_fields,
+  [MT_NTYPE_NAN_CLI_SETUP3] = nan_cli_setup3_fields,
+  [MT_NTYPE_NAN_INT_SETUP4] = nan_int_setup4_fields,
+  [MT_NTYPE_NAN_CLI_SETUP5] = nan_cli_setup5_fields,
+  [MT_NTYPE_NAN_INT_SETUP6] = nan_int_setup6_fields,
+  [MT_NTYPE_NAN_CLI_DESTAB1] = nan_cli_destab1_fields,
+  [MT_NTYPE_NAN_INT_DESTAB2] = nan_int_destab2_fields,
+  [MT_NTYPE_NAN_CLI_DPAY1] = nan_cli_dpay1_fields,
+  [MT_NTYPE_NAN_INT_DPAY2] = nan_int_dpay2_fields,
+  [MT_NTYPE_NAN_CLI_ESTAB1] = nan_cli_estab1_fields,
+  [MT_NTYPE_NAN_REL_ESTAB2] = nan_rel_estab2_fields,
+  [MT_NTYPE_NAN_INT_ESTAB3] = nan_int_estab3_fields,
+  [MT_NTYPE_NAN_REL_ESTAB4] = nan_rel_estab4_fields,
+  [MT_NTYPE_NAN_INT_ESTAB5] = nan_int_estab5_fields,
+  [MT_NTYPE_NAN_REL_ESTAB6] = nan_rel_estab6_fields,
+  [MT_NTYPE_NAN_CLI_PAY1] = nan_cli_pay1_fields,
+  [MT_NTYPE_NAN_REL_PAY2] = nan_rel_pay2_fields,
+  [MT_NTYPE_NAN_CLI_REQCLOSE1] = nan_cli_reqclose1_fields,
+  [MT_NTYPE_NAN_REL_REQCLOSE2] = nan_rel_reqclose2_fields,
+  [MT_NTYPE_NAN_END_CLOSE1] = nan_end_close1_fields,
+  [MT_NTYPE_NAN_INT_CLOSE2] = nan_int_close2_fields,
+  [MT_NTYPE_NAN_END_CLOSE3] = nan_end_close3_fields,
+  [MT_NTYPE_NAN_INT_CLOSE4] = nan_int_close4_fields,
+  [MT_NTYPE_NAN_END_CLOSE5] = nan_end_close5_fields,
+  [MT_NTYPE_NAN_INT_CLOSE6] = nan_int_close6_fields,
+  [MT_NTYPE_NAN_END_CLOSE7] = nan_end_close7_fields,
+  [MT_NTYPE_NAN_INT_CLOSE8] = nan_int_close8_fields,
+  [MT_NTYPE_MAC_AUT_MINT] = mac_aut_mint_fields,
+  [MT_NTYPE_MAC_ANY_TRANS] = mac_any_trans_fields,
+  [MT_NTYPE_CHN_END_SETUP] = chn_end_setup_fields,
+  [MT_NTYPE_CHN_INT_SETUP] = chn_int_setup_fields,
+  [MT_NTYPE_CHN_INT_REQCLOSE] = chn_int_reqclose_fields,
+  [MT_NTYPE_CHN_END_CLOSE] = chn_end_close_fields,
+  [MT_NTYPE_CHN_INT_CLOSE] = chn_int_close_fields,
+  [MT_NTYPE_CHN_END_CASHOUT] = chn_end_cashout_fields,
+  [MT_NTYPE_CHN_INT_CASHOUT] = chn_int_cashout_fields,
+  [MT_NTYPE_ANY_LED_CONFIRM] = any_led_confirm_fields,
+  [MT_NTYPE_MAC_LED_DATA] = mac_led_data_fields,
+  [MT_NTYPE_CHN_LED_DATA] = chn_led_data_fields,
+  [MT_NTYPE_MAC_LED_QUERY] = mac_led_query_fields,
+  [MT_NTYPE_CHN_LED_QUERY] = chn_led_query_fields,
+};
+
+static const wire_field_t* fields_of(mt_ntype_t type){
+  if((unsigned)type >= ARRAY_LENGTH(token_fields))
+    return NULL;
+  return token_fields[type];
+}
 
-    *str_out = str;
-    return str_size;
+/**
+ * Return the largest number of bytes taken on the wire by a field list, which
+ * counts every batch field as present
+ */
+static size_t wire_size(const wire_field_t* fields){
+  size_t size = 0;
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    switch(f->kind){
+      case WIRE_U32:
+	size += sizeof(uint32_t);
+	break;
+      case WIRE_BYTES:
+	size += f->size;
+	break;
+      case WIRE_PK:
+	size += MT_SZ_WIRE_PK;
+	break;
+      case WIRE_STRUCT:
+	size += wire_size(f->sub);
+	break;
+      case WIRE_BATCH:
+	size += 1 + wire_size(f->sub);
+	break;
+      default:
+	tor_assert_nonfatal_unreached();
+    }
+  }
+  return size;
 }
 
-int unpack_token(mt_ntype_t type, byte* str, int tkn_size, void* tkn_out, byte(*pid_out)[DIGEST_LEN]){
-  // message is not the type it clai)
-  if(type != *((mt_ntype_t*)str)){
+/**
+ * Return 1 if every packed token with these fields has the same size
+ */
+static int wire_is_fixed(const wire_field_t* fields){
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    if(f->kind == WIRE_BATCH)
+      return 0;
+    if(f->kind == WIRE_STRUCT && !wire_is_fixed(f->sub))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Write to <b>size_out</b> the number of bytes taken by the fields packed at
+ * <b>in</b>, reading the marker bytes among the first <b>avail</b> bytes.
+ * Return MT_ERROR if a marker is invalid or lies beyond <b>avail</b>.
+ */
+static int wire_read_size(const wire_field_t* fields, const byte* in, size_t avail,
+			  size_t* size_out){
+  size_t size = 0;
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    switch(f->kind){
+      case WIRE_U32:
+	size += sizeof(uint32_t);
+	break;
+      case WIRE_BYTES:
+	size += f->size;
+	break;
+      case WIRE_PK:
+	size += MT_SZ_WIRE_PK;
+	break;
+      case WIRE_STRUCT: {
+	size_t sub_size;
+	if(wire_read_size(f->sub, in + MIN(size, avail), avail - MIN(size, avail),
+			  &sub_size) != MT_SUCCESS)
+	  return MT_ERROR;
+	size += sub_size;
+	break;
+      }
+      case WIRE_BATCH:
+	if(size >= avail)
+	  return MT_ERROR;
+	if(in[size] == WIRE_BATCH_PRESENT)
+	  size += 1 + wire_size(f->sub);
+	else if(in[size] == WIRE_BATCH_ABSENT)
+	  size += 1;
+	else
+	  return MT_ERROR;
+	break;
+      default:
+	tor_assert_nonfatal_unreached();
+    }
+  }
+  *size_out = size;
+  return MT_SUCCESS;
+}
+
+/**
+ * Write the fields of the struct at <b>src</b> to <b>out</b> and return the
+ * position just past them, or NULL if a public key has no compact form
+ */
+static byte* wire_encode(const wire_field_t* fields, const byte* src, byte* out){
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    switch(f->kind){
+      case WIRE_U32: {
+	int32_t val;
+	tor_assert(f->size == sizeof(val));
+	memcpy(&val, src + f->offset, sizeof(val));
+	set_uint32(out, htonl((uint32_t)val));
+	out += sizeof(uint32_t);
+	break;
+      }
+      case WIRE_BYTES:
+	memcpy(out, src + f->offset, f->size);
+	out += f->size;
+	break;
+      case WIRE_PK:
+	if(encode_pk((const byte (*)[MT_SZ_PK])(src + f->offset), out) != MT_SUCCESS)
+	  return NULL;
+	out += MT_SZ_WIRE_PK;
+	break;
+      case WIRE_STRUCT:
+	out = wire_encode(f->sub, src + f->offset, out);
+	if(!out)
+	  return NULL;
+	break;
+      case WIRE_BATCH: {
+	int32_t first;
+	tor_assert(f->sub[0].kind == WIRE_U32);
+	memcpy(&first, src + f->sub[0].offset, sizeof(first));
+	*out++ = first ? WIRE_BATCH_PRESENT : WIRE_BATCH_ABSENT;
+	if(first)
+	  out = wire_encode(f->sub, src, out);
+	break;
+      }
+      default:
+	tor_assert_nonfatal_unreached();
+    }
+  }
+  return out;
+}
+
+/**
+ * Read the fields written by wire_encode() from <b>in</b> into the struct at
+ * <b>dst</b> and return the position just past them
+ */
+static const byte* wire_decode(const wire_field_t* fields, const byte* in, byte* dst){
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    switch(f->kind){
+      case WIRE_U32: {
+	int32_t val = (int32_t)ntohl(get_uint32(in));
+	memcpy(dst + f->offset, &val, sizeof(val));
+	in += sizeof(uint32_t);
+	break;
+      }
+      case WIRE_BYTES:
+	memcpy(dst + f->offset, in, f->size);
+	in += f->size;
+	break;
+      case WIRE_PK:
+	decode_pk(in, (byte (*)[MT_SZ_PK])(dst + f->offset));
+	in += MT_SZ_WIRE_PK;
+	break;
+      case WIRE_STRUCT:
+	in = wire_decode(f->sub, in, dst + f->offset);
+	break;
+      case WIRE_BATCH:
+	if(*in++ == WIRE_BATCH_PRESENT)
+	  in = wire_decode(f->sub, in, dst);
+	break;
+      default:
+	tor_assert_nonfatal_unreached();
+    }
+  }
+  return in;
+}
+
+int pack_token(mt_ntype_t type, void* ptr, byte(*pid)[DIGEST_LEN], byte** str_out){
+  const wire_field_t* fields = fields_of(type);
+  tor_assert(fields);
+
+  int str_size = MT_SZ_WIRE_HEADER + wire_size(fields);
+  byte* str = tor_malloc(str_size);
+  str[0] = MT_WIRE_VERSION;
+  str[1] = (byte)type;
+  memcpy(str + 2, *pid, DIGEST_LEN);
+  byte* end = wire_encode(fields, ptr, str + 2 + DIGEST_LEN);
+  if(!end){
+    log_warn(LD_MT, "MoneTor: cannot pack %s with a malformed public key",
+	     mt_token_describe(type));
+    tor_free(str);
+    *str_out = NULL;
+    return MT_ERROR;
+  }
+  tor_assert(end <= str + str_size);
+
+  *str_out = str;
+  return end - str;
+}
+
+/**
+ * Decode the part of the struct at <b>offset</b> of length <b>len</b> from
+ * the fields at <b>in</b>, which describe a struct placed at <b>base</b>, into
+ * <b>out</b>. Keys, ints and nested structs must be decoded whole, while a
+ * slice of a byte array is enough. Returns MT_ERROR if no field covers it.
+ */
+static int wire_peek(const wire_field_t* fields, const byte* in, size_t base, size_t offset,
+		     size_t len, byte* out){
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    size_t start = base + f->offset;
+    int covers = offset >= start && offset + len <= start + f->size;
+    int whole = offset == start && len == f->size;
+    switch(f->kind){
+      case WIRE_U32:
+	if(whole){
+	  int32_t val = (int32_t)ntohl(get_uint32(in));
+	  memcpy(out, &val, sizeof(val));
+	  return MT_SUCCESS;
+	}
+	in += sizeof(uint32_t);
+	break;
+      case WIRE_BYTES:
+	if(covers){
+	  memcpy(out, in + (offset - start), len);
+	  return MT_SUCCESS;
+	}
+	in += f->size;
+	break;
+      case WIRE_PK:
+	if(whole){
+	  decode_pk(in, (byte (*)[MT_SZ_PK])out);
+	  return MT_SUCCESS;
+	}
+	in += MT_SZ_WIRE_PK;
+	break;
+      case WIRE_STRUCT:
+	if(whole){
+	  memset(out, 0, len);
+	  wire_decode(f->sub, in, out);
+	  return MT_SUCCESS;
+	}
+	if(covers)
+	  return wire_peek(f->sub, in, start, offset, len, out);
+	{
+	  // the token was checked by check_header() so its markers are valid
+	  size_t sub_size = 0;
+	  wire_read_size(f->sub, in, SIZE_MAX, &sub_size);
+	  in += sub_size;
+	}
+	break;
+      case WIRE_BATCH:
+	if(*in++ != WIRE_BATCH_PRESENT)
+	  break;
+	if(wire_peek(f->sub, in, base, offset, len, out) == MT_SUCCESS)
+	  return MT_SUCCESS;
+	in += wire_size(f->sub);
+	break;
+      default:
+	tor_assert_nonfatal_unreached();
+    }
+  }
+  return MT_ERROR;
+}
+
+/**
+ * Return MT_SUCCESS if <b>str</b> has the header and size of a packed token of
+ * <b>type</b>
+ */
+static int check_header(mt_ntype_t type, const wire_field_t* fields, const byte* str, int size){
+
+  size_t fields_size;
+  if(size < MT_SZ_WIRE_HEADER ||
+     wire_read_size(fields, str + MT_SZ_WIRE_HEADER, size - MT_SZ_WIRE_HEADER,
+		    &fields_size) != MT_SUCCESS ||
+     size != (int)(MT_SZ_WIRE_HEADER + fields_size)){
+    log_warn(LD_MT, "MoneTor: cannot unpack token of incorrect size");
+    return MT_ERROR;
+  }
+  if(str[0] != MT_WIRE_VERSION){
+    log_warn(LD_MT, "MoneTor: cannot unpack token of unknown version %d", str[0]);
+    return MT_ERROR;
+  }
+  // message is not the type it claims to be
+  if(str[1] != (byte)type){
     log_warn(LD_MT, "MoneTor: cannot unpack token of incorrect type");
     return MT_ERROR;
   }
+  return MT_SUCCESS;
+}
+
+int unpack_token(mt_ntype_t type, byte* str, int size, void* tkn_out, int tkn_size,
+		 byte(*pid_out)[DIGEST_LEN]){
+  const wire_field_t* fields = fields_of(type);
+  tor_assert(fields);
 
-  memcpy(tkn_out, str + sizeof(mt_ntype_t), tkn_size);
-  memcpy(*pid_out, str + sizeof(mt_ntype_t) + tkn_size, DIGEST_LEN);
+  if(check_header(type, fields, str, size) != MT_SUCCESS)
+    return MT_ERROR;
+
+  // padding and unused bytes are not sent
+  memset(tkn_out, 0, tkn_size);
+  memcpy(*pid_out, str + 2, DIGEST_LEN);
+  wire_decode(fields, str + 2 + DIGEST_LEN, tkn_out);
   return MT_SUCCESS;
 }
 
+/**
+ * Read the protocol id of a packed token of <b>type</b> without unpacking it
+ */
+int mt_token_peek_pid(mt_ntype_t type, byte* str, int size, byte (*pid_out)[DIGEST_LEN]){
+  const wire_field_t* fields = fields_of(type);
+  tor_assert(fields);
+
+  if(check_header(type, fields, str, size) != MT_SUCCESS)
+    return MT_ERROR;
+  memcpy(*pid_out, str + 2, DIGEST_LEN);
+  return MT_SUCCESS;
+}
+
+/**
+ * Read <b>len</b> bytes of the token struct starting at <b>offset</b> from a
+ * packed token of <b>type</b> without unpacking the rest of it, e.g. to route
+ * a message by a single field. Returns MT_ERROR if the token is malformed or
+ * the range is not a whole field or a slice of a byte array.
+ */
+int mt_token_peek(mt_ntype_t type, byte* str, int size, size_t offset, size_t len,
+		  void* field_out){
+  const wire_field_t* fields = fields_of(type);
+  tor_assert(fields);
+
+  if(check_header(type, fields, str, size) != MT_SUCCESS)
+    return MT_ERROR;
+  return wire_peek(fields, str + 2 + DIGEST_LEN, 0, offset, len, field_out);
+}
+
+/**
+ * Write <b>pk</b> into every public key field of the struct at <b>dst</b>
+ */
+static void wire_set_keys(const wire_field_t* fields, byte* dst, const byte (*pk)[MT_SZ_PK]){
+  for(const wire_field_t* f = fields; f->kind != WIRE_END; f++){
+    if(f->kind == WIRE_PK)
+      memcpy(dst + f->offset, *pk, MT_SZ_PK);
+    else if(f->kind == WIRE_STRUCT)
+      wire_set_keys(f->sub, dst + f->offset, pk);
+  }
+}
+
+/**
+ * Overwrite every public key in the token of <b>type</b> at <b>tkn</b> with
+ * <b>pk</b>, e.g. to make a token of arbitrary fields packable
+ */
+void mt_token_set_keys(mt_ntype_t type, void* tkn, byte (*pk)[MT_SZ_PK]){
+  const wire_field_t* fields = fields_of(type);
+  tor_assert(fields);
+  wire_set_keys(fields, tkn, (const byte (*)[MT_SZ_PK])pk);
+}
+
+/**
+ * Return 1 if messages of <b>type</b> are sent signed and 0 otherwise
+ */
+static int token_is_signed(mt_ntype_t type){
+  switch(type){
+    case MT_NTYPE_MAC_ANY_TRANS:
+    case MT_NTYPE_CHN_END_SETUP:
+    case MT_NTYPE_CHN_INT_SETUP:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
 /*
  * This function shoud return the payload size of a given mt_ntype_t.
  * This should match the size of data sent through the network minus
  * the size of the header.
  */
-
 size_t mt_token_get_size_of(mt_ntype_t type) {
-  //Used of test unit - To change later
-  size_t strlen = sizeof(mt_ntype_t)+DIGEST_LEN;
+  const wire_field_t* fields = fields_of(type);
+  if(!fields){
+    log_warn(LD_MT, "BUG - unknown type %hhx", type);
+    return 0;
+  }
+
+  size_t size = MT_SZ_WIRE_HEADER + wire_size(fields);
+  /** Any signed message also carries the signer's key and signature */
+  if(token_is_signed(type))
+    return size+SIGNED_SZ_RSA;
   switch(type) {
-    case MT_NTYPE_CHN_END_ESTAB1:
-      return sizeof(chn_end_estab1_t)+strlen;
-    case MT_NTYPE_CHN_END_ESTAB3:
-      return sizeof(chn_end_estab3_t)+strlen;
-    case MT_NTYPE_CHN_INT_ESTAB2:
-      return sizeof(chn_int_estab2_t)+strlen;
-    case MT_NTYPE_CHN_INT_ESTAB4:
-      return sizeof(chn_int_estab4_t)+strlen;
-    case MT_NTYPE_MIC_CLI_PAY1:
-      return sizeof(mic_cli_pay1_t)+strlen;
-    case MT_NTYPE_MIC_REL_PAY2:
-      return sizeof(mic_rel_pay2_t)+strlen;
-    case MT_NTYPE_MIC_CLI_PAY3:
-      return sizeof(mic_cli_pay3_t)+strlen;
-    case MT_NTYPE_MIC_INT_PAY4:
-      return sizeof(mic_int_pay4_t)+strlen;
-    case MT_NTYPE_MIC_CLI_PAY5:
-      return sizeof(mic_cli_pay5_t)+strlen;
-    case MT_NTYPE_MIC_REL_PAY6:
-      return sizeof(mic_rel_pay6_t)+strlen;
-    case MT_NTYPE_MIC_INT_PAY7:
-      return sizeof(mic_int_pay7_t)+strlen;
-    case MT_NTYPE_MIC_INT_PAY8:
-      return sizeof(mic_int_pay8_t)+strlen;
-    case MT_NTYPE_NAN_CLI_SETUP1:
-      return sizeof(nan_cli_setup1_t)+strlen;
-    case MT_NTYPE_NAN_INT_SETUP2:
-      return sizeof(nan_int_setup2_t)+strlen;
-    case MT_NTYPE_NAN_CLI_SETUP3:
-      return sizeof(nan_cli_setup3_t)+strlen;
-    case MT_NTYPE_NAN_INT_SETUP4:
-      return sizeof(nan_int_setup4_t)+strlen;
-    case MT_NTYPE_NAN_CLI_SETUP5:
-      return sizeof(nan_cli_setup5_t)+strlen;
-    case MT_NTYPE_NAN_INT_SETUP6:
-      return sizeof(nan_int_setup6_t)+strlen;
-    case MT_NTYPE_NAN_CLI_DESTAB1:
-      return sizeof(nan_cli_destab1_t)+strlen;
-    case MT_NTYPE_NAN_INT_DESTAB2:
-      return sizeof(nan_int_destab2_t)+strlen;
-    case MT_NTYPE_NAN_CLI_DPAY1:
-      return sizeof(nan_cli_dpay1_t)+strlen;
-    case MT_NTYPE_NAN_INT_DPAY2:
-      return sizeof(nan_int_dpay2_t)+strlen;
+    /** The controller prefixes the intermediary identity and descriptor */
     case MT_NTYPE_NAN_CLI_ESTAB1:
-      return sizeof(nan_cli_estab1_t)+strlen+sizeof(int_id_t)+sizeof(mt_desc_t);
-    case MT_NTYPE_NAN_REL_ESTAB2:
-      return sizeof(nan_rel_estab2_t)+strlen;
-    case MT_NTYPE_NAN_INT_ESTAB3:
-      return sizeof(nan_int_estab3_t)+strlen;
-    case MT_NTYPE_NAN_REL_ESTAB4:
-      return sizeof(nan_rel_estab4_t)+strlen;
-    case MT_NTYPE_NAN_INT_ESTAB5:
-      return sizeof(nan_int_estab5_t)+strlen;
-    case MT_NTYPE_NAN_REL_ESTAB6:
-      return sizeof(nan_rel_estab6_t)+strlen;
-    case MT_NTYPE_NAN_CLI_PAY1:
-      return sizeof(nan_cli_pay1_t)+strlen;
-    case MT_NTYPE_NAN_REL_PAY2:
-      return sizeof(nan_rel_pay2_t)+strlen;
-    case MT_NTYPE_NAN_CLI_REQCLOSE1:
-      return sizeof(nan_cli_reqclose1_t)+strlen;
-    case MT_NTYPE_NAN_REL_REQCLOSE2:
-      return sizeof(nan_rel_reqclose2_t)+strlen;
-    case MT_NTYPE_NAN_END_CLOSE1:
-      return sizeof(nan_end_close1_t)+strlen;
-    case MT_NTYPE_NAN_INT_CLOSE2:
-      return sizeof(nan_int_close2_t)+strlen;
-    case MT_NTYPE_NAN_END_CLOSE3:
-      return sizeof(nan_end_close3_t)+strlen;
-    case MT_NTYPE_NAN_INT_CLOSE4:
-      return sizeof(nan_int_close4_t)+strlen;
-    case MT_NTYPE_NAN_END_CLOSE5:
-      return sizeof(nan_end_close5_t)+strlen;
-    case MT_NTYPE_NAN_INT_CLOSE6:
-      return sizeof(nan_int_close6_t)+strlen;
-    case MT_NTYPE_NAN_END_CLOSE7:
-      return sizeof(nan_end_close7_t)+strlen;
-    case MT_NTYPE_NAN_INT_CLOSE8:
-      return sizeof(nan_int_close8_t)+strlen;
-    case MT_NTYPE_MAC_AUT_MINT:
-      return sizeof(mac_aut_mint_t)+strlen;
-    /** Any signed message have also MT_SZ_PK+MT_SZ_SIG */
-    case MT_NTYPE_MAC_ANY_TRANS:
-      return sizeof(mac_any_trans_t)+MT_SZ_PK+MT_SZ_SIG+strlen;
-    case MT_NTYPE_CHN_END_SETUP:
-      return sizeof(chn_end_setup_t)+MT_SZ_PK+MT_SZ_SIG+strlen;
-    case MT_NTYPE_CHN_INT_SETUP:
-      return sizeof(chn_int_setup_t)+MT_SZ_PK+MT_SZ_SIG+strlen;
-    case MT_NTYPE_CHN_INT_REQCLOSE:
-      return sizeof(chn_int_reqclose_t)+strlen;
-    case MT_NTYPE_CHN_END_CLOSE:
-      return sizeof(chn_end_close_t)+strlen;
-    case MT_NTYPE_CHN_INT_CLOSE:
-      return sizeof(chn_int_close_t)+strlen;
-    case MT_NTYPE_CHN_END_CASHOUT:
-      return sizeof(chn_end_cashout_t)+strlen;
-    case MT_NTYPE_CHN_INT_CASHOUT:
-      return sizeof(chn_int_cashout_t)+strlen;
-    case MT_NTYPE_ANY_LED_CONFIRM:
-      return sizeof(any_led_confirm_t)+strlen;
-    case MT_NTYPE_MAC_LED_DATA:
-      return sizeof(mac_led_data_t)+strlen;
-    case MT_NTYPE_CHN_LED_DATA:
-      return sizeof(chn_led_data_t)+strlen;
-    case MT_NTYPE_MAC_LED_QUERY:
-      return sizeof(mac_led_query_t)+strlen;
-    case MT_NTYPE_CHN_LED_QUERY:
-      return sizeof(chn_led_query_t)+strlen;
+      return size+sizeof(int_id_t)+sizeof(mt_desc_t);
     default:
-      log_warn(LD_MT, "BUG - unknown type %hhx", type);
+      return size;
+  }
+}
+
+size_t mt_token_get_size_of_msg(mt_ntype_t type, const byte* data, size_t len) {
+  size_t size = mt_token_get_size_of(type);
+  if(size == 0 || (!token_is_signed(type) && wire_is_fixed(fields_of(type))))
+    return size;
+
+  // the scheme byte decides how large the key and signature are
+  if(token_is_signed(type)){
+    if(len < 1 || signed_overhead(data[0]) == 0)
       return 0;
+    return size - SIGNED_SZ_RSA + signed_overhead(data[0]);
   }
+
+  // marker bytes decide whether batch fields are present
+  size_t fields_size;
+  if(len < MT_SZ_WIRE_HEADER ||
+     wire_read_size(fields_of(type), data + MT_SZ_WIRE_HEADER, len - MT_SZ_WIRE_HEADER,
+		    &fields_size) != MT_SUCCESS)
+    return 0;
+  return MT_SZ_WIRE_HEADER + fields_size;
 }
 
 const char * mt_token_describe(mt_ntype_t token) {
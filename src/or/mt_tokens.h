@@ -8,6 +8,16 @@
 
 #include "or.h"
 
+/** Version byte at the start of every packed token */
+#define MT_WIRE_VERSION 1
+
+/** Size of the version, type and protocol id that precede the token fields */
+#define MT_SZ_WIRE_HEADER (2 + DIGEST_LEN)
+
+/** Size of a public key on the wire (the modulus of a 1024-bit RSA key, which
+ * also holds a tagged Ed25519 key) */
+#define MT_SZ_WIRE_PK 128
+
 typedef struct {
   byte* msg;
   byte pk[MT_SZ_PK];
@@ -16,8 +26,26 @@ typedef struct {
 
 int mt_create_signed_msg(byte* msg, int size, byte (*pk)[MT_SZ_PK], byte (*sk)[MT_SZ_SK],
 			 byte** signed_out);
+
+/**
+ * Verify a message created by mt_create_signed_msg() and write the signer's key
+ * to <b>pk_out</b>. The message is stored inside <b>signed_msg</b>, so
+ * <b>msg_out</b> points into <b>signed_msg</b> rather than to a copy. Returns
+ * the size of the message.
+ */
 int mt_verify_signed_msg(byte* signed_msg, int size, byte(*pk_out)[MT_SZ_PK],  byte** msg_out);
 
+/**
+ * Verify <b>n</b> signed messages at once, batching the signature checks where
+ * the keys allow it. For each message the signer's key is written to
+ * <b>pks_out</b>[i] and either a pointer to the message inside
+ * <b>signed_msgs</b>[i] and its size or NULL and MT_ERROR to
+ * <b>msgs_out</b>[i] and <b>sizes_out</b>[i].
+ * Returns MT_SUCCESS only if every message verified.
+ */
+int mt_verify_signed_msgs(int n, byte** signed_msgs, int* sizes, byte (*pks_out)[MT_SZ_PK],
+			  byte** msgs_out, int* sizes_out);
+
 //-------------------------- Pack/Unpack Functions --------------------------//
 
 /**
@@ -147,7 +175,22 @@ int unpack_nan_int_close6(byte* str, int size, nan_int_close6_t* tkn_out, byte(*
 int unpack_nan_end_close7(byte* str, int size, nan_end_close7_t* tkn_out, byte(*pid_out)[DIGEST_LEN]);
 int unpack_nan_int_close8(byte* str, int size, nan_int_close8_t* tkn_out, byte(*pid_out)[DIGEST_LEN]);
 
+/**
+ * Return the size of a message of <b>type</b> on the wire. For signed messages
+ * this is the size with an RSA signer and for receipts the size with their
+ * batch fields, which are the largest.
+ */
 size_t mt_token_get_size_of(mt_ntype_t type);
+
+/**
+ * Return the size of the message of <b>type</b> whose first <b>len</b> bytes
+ * are <b>data</b>, or 0 if those bytes do not start a valid message
+ */
+size_t mt_token_get_size_of_msg(mt_ntype_t type, const byte* data, size_t len);
+int mt_token_peek_pid(mt_ntype_t type, byte* str, int size, byte (*pid_out)[DIGEST_LEN]);
+int mt_token_peek(mt_ntype_t type, byte* str, int size, size_t offset, size_t len,
+		  void* field_out);
+void mt_token_set_keys(mt_ntype_t type, void* tkn, byte (*pk)[MT_SZ_PK]);
 const char* mt_token_describe(mt_ntype_t type);
 int mt_token_is_for_intermediary(mt_ntype_t token);
 #endif
@@ -1974,7 +1974,9 @@ networkstatus_set_current_consensus(const char *consensus,
     /* Change the cell EWMA settings */
     cell_ewma_set_scale_factor(options, c);
     /* If we just enabled ewma, set the cmux policy on all active channels */
-    if (cell_ewma_enabled() && !old_ewma_enabled) {
+    if (options->MoneTorWFQ) {
+      /* WFQ stays on every channel and only takes the scale factor */
+    } else if (cell_ewma_enabled() && !old_ewma_enabled) {
       channel_set_cmux_policy_everywhere(&ewma_policy);
     } else if (!cell_ewma_enabled() && old_ewma_enabled) {
       /* Turn it off everywhere */
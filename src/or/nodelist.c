@@ -1128,6 +1128,27 @@ node_supports_v3_rendezvous_point(const node_t *node)
   return 0;
 }
 
+/** Return true iff <b>node</b> takes nanopayments from the spare room of
+ * data cells (Pay=1). */
+int
+node_supports_pay_piggyback(const node_t *node)
+{
+  tor_assert(node);
+
+  if (node->rs) {
+    return node->rs->supports_pay_piggyback;
+  }
+  if (node->ri) {
+    if (node->ri->protocol_list == NULL) {
+      return 0;
+    }
+    return protocol_list_supports_protocol(node->ri->protocol_list,
+                                           PRT_PAY, PROTOVER_PAY_PIGGYBACK);
+  }
+  tor_assert_nonfatal_unreached_once();
+  return 0;
+}
+
 /** Return the RSA ID key's SHA1 digest for the provided node. */
 const uint8_t *
 node_get_rsa_id_digest(const node_t *node)
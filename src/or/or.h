@@ -2420,6 +2420,10 @@ typedef struct routerstatus_t {
    * This requires HSRend=2. */
   unsigned int supports_v3_rendezvous_point: 1;
 
+  /** True iff this router has a protocol list that allows it to take
+   * nanopayments from the spare room of data cells. This requires Pay=1. */
+  unsigned int supports_pay_piggyback : 1;
+
   unsigned int has_bandwidth:1; /**< The vote/consensus had bw info */
   unsigned int has_exitsummary:1; /**< The vote/consensus had exit summaries */
   unsigned int bw_is_unmeasured:1; /**< This is a consensus entry, with
@@ -2987,6 +2991,8 @@ typedef struct pay_path_t {
   unsigned int establish_succeeded : 1;
   /** Tell whether we already called a mt_cpay_pay */
   unsigned int payment_is_processing : 1;
+  /* Number of payment units requested by the outstanding mt_cpay_pay_units */
+  int payment_units;
   /* Position type of the current hop */
   position_t position;
   /* Used to keep track of number of cells we can send/receive
@@ -3001,9 +3007,16 @@ typedef struct pay_path_t {
   /* Payment descriptor for the relay at that hop*/
   mt_desc_t desc;
 
-  /*buf containing cell payloads if we need multiple
+  /*reassembles cell payloads if we need multiple
    * cells for a mt_type_t */
-  struct buf_t *buf;
+  struct mt_msgreasm_t *buf;
+
+  /* observed throughput and payment latency that size the window */
+  struct mt_paywindow_t *pw;
+
+  /* Payment message waiting for the next data cell to this hop */
+  uint8_t *piggyback;
+  int piggyback_size;
 
   struct pay_path_t *next;
   struct pay_path_t *prev;
@@ -3176,6 +3189,9 @@ typedef struct circuit_t {
 
   /** Queue of cells waiting to be transmitted on n_chan */
   cell_queue_t n_chan_cells;
+  /** Queue of payment cells waiting to be transmitted on n_chan; these are
+   * sent before anything in n_chan_cells. */
+  cell_queue_t n_chan_pcells;
 
   /**
    * The hop to which we want to extend this circuit.  Should be NULL if
@@ -3419,9 +3435,9 @@ typedef struct origin_circuit_t {
 
   mt_desc_t *desci;
 
-  /** buffer used for intermediary circuits and ledger circuits
+  /** reassembly buffer used for intermediary circuits and ledger circuits
    * on client, intermediary and relay */
-  struct buf_t *buf;
+  struct mt_msgreasm_t *buf;
 
   /** Holds the data that the entry guard system uses to track the
    * status of the guard this circuit is using, and thereby to determine
@@ -3611,6 +3627,9 @@ typedef struct or_circuit_t {
   circid_t p_circ_id;
   /** Queue of cells waiting to be transmitted on p_conn. */
   cell_queue_t p_chan_cells;
+  /** Queue of payment cells waiting to be transmitted on p_conn; these are
+   * sent before anything in p_chan_cells. */
+  cell_queue_t p_chan_pcells;
   /** The channel that is previous in this circuit. */
   channel_t *p_chan;
   /**
@@ -3691,7 +3710,7 @@ typedef struct or_circuit_t {
   /*
    * Contains buffering that received on that circuit
    * if this is a CIRCUIT_PURPOSE_INTERMEDIARY */
-  struct buf_t *buf;
+  struct mt_msgreasm_t *buf;
 } or_circuit_t;
 
 #if REND_COOKIE_LEN != DIGEST_LEN
@@ -4893,6 +4912,95 @@ typedef struct {
 
   int MoneTorInitialWindow;
 
+  /* Maximum number of zkp verifications an intermediary hands to the
+   * cpuworker at once; 0 means no limit */
+  int MoneTorMaxVerifyInFlight;
+
+  /* Directory holding the ledger transaction log and snapshot; the ledger is
+   * kept in memory only if unset */
+  char *MoneTorLedgerLogDir;
+
+  /* Number of buffered ledger log records that forces an immediate commit */
+  int MoneTorLedgerCommitBatch;
+
+  /* Longest time (in msec) a ledger log record waits for a group commit */
+  int MoneTorLedgerCommitDelay;
+
+  /* Number of ledger log records after which a new snapshot is written */
+  int MoneTorLedgerSnapshotInterval;
+
+  /* Most nanopayment units a client reveals in a single payment message */
+  int MoneTorMaxPaymentUnits;
+
+  /* Generate Ed25519 instead of RSA keys for new payment keypairs */
+  int MoneTorEd25519;
+
+  /* Number of waiting ledger transactions that start a new signature batch
+   * even while another batch is being checked; 0 or 1 hands every
+   * transaction to a cpuworker on its own as soon as it arrives */
+  int MoneTorLedgerVerifyBatch;
+
+  /* Most bytes of payment messages held for unavailable descriptors, summed
+   * over every descriptor of a payment module */
+  uint64_t MoneTorMsgBufMaxBytes;
+
+  /* Most payment messages held for a single unavailable descriptor */
+  int MoneTorMsgBufPerDesc;
+
+  /* Longest time (in seconds) a held payment message is kept for resending;
+   * 0 keeps messages until they are sent */
+  int MoneTorMsgBufTTL;
+
+  /* Most held payment messages resent per descriptor in one event loop turn */
+  int MoneTorMsgBufReplayBurst;
+
+  /* Most payment cells a circuit may have queued and still be sent ahead of
+   * the other circuits on its channel */
+  int MoneTorPaymentLaneMaxCells;
+
+  /* Nanopayment channels a client keeps set up with each intermediary ahead
+   * of the circuits that will use them; 0 disables the pool */
+  int MoneTorChannelPool;
+
+  /* Size the payment window of each hop from its measured throughput and
+   * payment round trip instead of paying a fixed amount ahead */
+  int MoneTorAdaptiveWindow;
+
+  /* Time (in msec) of traffic an adaptive payment window pays ahead for */
+  int MoneTorPaymentLatencyBudget;
+
+  /* Number of shards an intermediary splits its channels over, each handling
+   * its messages on its own; 0 means one per CPU */
+  int MoneTorIntermediaryShards;
+
+  /* Maximum number of intermediary shards with a job on the cpuworker at
+   * once; 0 means no limit */
+  int MoneTorIntermediaryShardsInFlight;
+
+  /* Most ledger receipts covered by a single signature over their Merkle
+   * root; 0 signs every receipt on its own. Batched receipts mark their
+   * Merkle path on the wire, so only the ledger reads this. */
+  int MoneTorLedgerReceiptBatch;
+
+  /* Wallet keypairs and hash chains kept precomputed for new channels; 0
+   * computes them when a channel is set up */
+  int MoneTorReservoirSize;
+
+  /* Schedule the circuits of each channel with circuitmux_wfq instead of
+   * EWMA, giving paid circuits a set share of the channel */
+  int MoneTorWFQ;
+
+  /* Weight of each WFQ tier, tier i holding circuits with mt_priority i and
+   * the last tier every circuit above it */
+  smartlist_t *MoneTorWFQWeights;
+
+  /* Fraction of the relayed bandwidth reserved for connections carrying paid
+   * circuits; each class may borrow what the other leaves unused */
+  double MoneTorPremiumReserve;
+
+  /* Carry nanopayments to the exit in the spare room of data cells that are
+   * being packaged anyway instead of in cells of their own */
+  int MoneTorPiggyback;
 
 } or_options_t;
 
@@ -5860,6 +5968,10 @@ typedef enum {
 
 #define MT_SZ_ADDR DIGEST_LEN
 
+// deepest Merkle tree over a batch of ledger receipts
+#define MT_RECEIPT_MAX_DEPTH 8
+#define MT_RECEIPT_MAX_BATCH (1 << MT_RECEIPT_MAX_DEPTH)
+
 //---------------------------- Controller States ----------------------------//
 
 // possible states for micropayment channels on the ledger
@@ -6026,6 +6138,11 @@ typedef struct {
   byte from[MT_SZ_ADDR];
   byte to[MT_SZ_ADDR];
   byte sig[MT_SZ_SIG];
+  // if batch_size is not 0 then sig signs the Merkle root of a batch of
+  // receipts and path leads from this receipt (leaf index) up to that root
+  int batch_size;
+  int index;
+  byte path[MT_RECEIPT_MAX_DEPTH][MT_SZ_HASH];
 } any_led_receipt_t;
 
 typedef struct {
@@ -6057,8 +6174,23 @@ typedef struct {
   nan_end_state_t end_state;
 } nan_int_state_t;
 
+/** Checkpoints kept by mt_hc_t; enough for any chain length that fits in an int */
+#define MT_HC_PEBBLES 33
+
+/**
+ * Hash chain that stores O(log n) checkpoints ("pebbles") instead of every
+ * element. Pebbles are kept in increasing order of their distance from the
+ * head; the first pebble is always the head itself.
+ */
+typedef struct {
+  int size;
+  int num_pebbles;
+  int pos[MT_HC_PEBBLES];
+  byte val[MT_HC_PEBBLES][MT_SZ_HASH];
+} mt_hc_t;
+
 typedef struct {
-  byte hc[MT_NAN_LEN][MT_SZ_HASH];
+  mt_hc_t hc;
 } nan_end_wallet_t;
 
 typedef struct {
@@ -6373,6 +6505,7 @@ typedef struct {
 typedef struct {
   nan_any_public_t nan_public;
   byte preimage[MT_SZ_HASH];
+  int num_units;
 } nan_cli_pay1_t;
 
 typedef struct {
@@ -6399,6 +6532,7 @@ typedef struct {
 typedef struct {
   nan_any_public_t nan_public;
   byte preimage[MT_SZ_HASH];
+  int num_units;
 } nan_cli_dpay1_t;
 
 typedef struct {
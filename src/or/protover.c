@@ -45,7 +45,8 @@ static const struct {
   { PRT_HSREND, "HSRend" },
   { PRT_DESC, "Desc" },
   { PRT_MICRODESC, "Microdesc"},
-  { PRT_CONS, "Cons" }
+  { PRT_CONS, "Cons" },
+  { PRT_PAY, "Pay" }
 };
 
 #define N_PROTOCOL_NAMES ARRAY_LENGTH(PROTOCOL_NAMES)
@@ -307,6 +308,7 @@ protover_get_supported_protocols(void)
     "Link=1-5 "
     "LinkAuth=1,3 "
     "Microdesc=1-2 "
+    "Pay=1 "
     "Relay=1-2";
 }
 
@@ -23,6 +23,9 @@
 #define PROTOVER_HS_INTRO_V3 4
 /** The protover version number that signifies HSv3 rendezvous point support */
 #define PROTOVER_HS_RENDEZVOUS_POINT_V3 2
+/** The protover version number that signifies support for nanopayments
+ * carried in the spare room of data cells */
+#define PROTOVER_PAY_PIGGYBACK 1
 
 /** List of recognized subprotocols. */
 typedef enum protocol_type_t {
@@ -36,6 +39,7 @@ typedef enum protocol_type_t {
   PRT_DESC,
   PRT_MICRODESC,
   PRT_CONS,
+  PRT_PAY,
 } protocol_type_t;
 
 int protover_all_supported(const char *s, char **missing);
@@ -124,6 +124,13 @@ uint64_t stats_n_relay_cells_relayed = 0;
  * hop?
  */
 uint64_t stats_n_relay_cells_delivered = 0;
+/** Stats: how many payment cells have been flushed from the payment queues
+ * of circuits, how many milliseconds they waited there in total, and the
+ * longest any of them waited?
+ */
+uint64_t stats_n_pcells_flushed = 0;
+uint64_t stats_pcell_wait_msec = 0;
+uint32_t stats_pcell_max_wait_msec = 0;
 
 /** Used to tell which stream to read from first on a circuit. */
 static tor_weak_rng_t stream_choice_rng = TOR_WEAK_RNG_INIT;
@@ -500,13 +507,14 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
 
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
- *  - Append it to the appropriate cell_queue on <b>circ</b>.
+ *  - Append it to the appropriate cell_queue on <b>circ</b>, or to its
+ *    payment queue if <b>is_payment</b> is set.
  */
 static int
 circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction,
                            crypt_path_t *layer_hint, crypt_path_t *layer_stop,
-                           streamid_t on_stream,
+                           streamid_t on_stream, int is_payment,
                            const char *filename, int lineno)
 {
   channel_t *chan; /* where to send the cell */
@@ -572,7 +580,10 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
   }
   ++stats_n_relay_cells_relayed;
 
-  append_cell_to_circuit_queue(circ, chan, cell, cell_direction, on_stream);
+  if (is_payment)
+    append_pcell_to_circuit_queue(circ, chan, cell, cell_direction);
+  else
+    append_cell_to_circuit_queue(circ, chan, cell, cell_direction, on_stream);
   return 0;
 }
 
@@ -751,7 +762,7 @@ relay_send_pcommand_from_edge_,(circuit_t* circ, uint8_t relay_command,
             cell_direction == CELL_DIRECTION_OUT ? "forward" : "backward",  mt_token_describe(relay_pcommand));
 
     return circuit_package_relay_cell(&cell, circ, cell_direction,
-        layer_start, cpath_layer, 0, filename, lineno);
+        layer_start, cpath_layer, 0, 1, filename, lineno);
   }
   else {
     int nbr_cells;
@@ -775,7 +786,7 @@ relay_send_pcommand_from_edge_,(circuit_t* circ, uint8_t relay_command,
       memcpy(cell.payload+RELAY_HEADER_SIZE+RELAY_PHEADER_SIZE,
           payload+i*RELAY_PPAYLOAD_SIZE, rph.length);
       if (circuit_package_relay_cell(&cell, circ, cell_direction,
-            layer_start, cpath_layer, 0, filename, lineno) < 0) {
+            layer_start, cpath_layer, 0, 1, filename, lineno) < 0) {
         log_info(LD_MT, "We are packaging several cells at once"
             " and one packaging failed ...");
         return -2;
@@ -808,12 +819,16 @@ relay_send_pcommand_from_edge_,(circuit_t* circ, uint8_t relay_command,
    *
    * If you can't send the cell, mark the circuit for close and return -1. Else
    * return 0.
+   *
+   * The last <b>pext_len</b> bytes of <b>payload</b> are a payment header
+   * extension: they go into the cell but not into its relay header length.
    */
-MOCK_IMPL(int,
-relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
-                               uint8_t relay_command, const char *payload,
-                               size_t payload_len, crypt_path_t *cpath_layer,
-                               const char *filename, int lineno))
+MOCK_IMPL(STATIC int,
+relay_send_command_from_edge_ext,(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len, size_t pext_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno))
 {
   cell_t cell;
   relay_header_t rh;
@@ -823,6 +838,7 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
 
   tor_assert(circ);
   tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
+  tor_assert(pext_len <= payload_len);
 
   memset(&cell, 0, sizeof(cell_t));
   cell.command = CELL_RELAY;
@@ -840,7 +856,7 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
   memset(&rh, 0, sizeof(rh));
   rh.command = relay_command;
   rh.stream_id = stream_id;
-  rh.length = payload_len;
+  rh.length = payload_len - pext_len;
   relay_header_pack(cell.payload, &rh);
   if (payload_len)
     memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
@@ -901,7 +917,8 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
   }
 
   if (circuit_package_relay_cell(&cell, circ, cell_direction, cpath_layer,
-                                 layer_stop, stream_id, filename, lineno) < 0) {
+                                 layer_stop, stream_id, 0,
+                                 filename, lineno) < 0) {
     log_warn(LD_BUG,"circuit_package_relay_cell failed. Closing.");
     if (get_options()->EnablePayment) {
       circuit_mark_payment_channel_for_close(circ, 0, END_CIRC_REASON_INTERNAL);
@@ -914,19 +931,24 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
   return 0;
 }
 
-/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and
- * send it onto the open circuit <b>circ</b>. <b>fromconn</b> is the stream
- * that's sending the relay cell, or NULL if it's a control cell.
- * <b>cpath_layer</b> is NULL for OR->OP cells, or the destination hop
- * for OP->OR cells.
- *
- * If you can't send the cell, mark the circuit for close and
- * return -1. Else return 0.
- */
-int
-connection_edge_send_command(edge_connection_t *fromconn,
-                             uint8_t relay_command, const char *payload,
-                             size_t payload_len)
+MOCK_IMPL(int,
+relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
+                               uint8_t relay_command, const char *payload,
+                               size_t payload_len, crypt_path_t *cpath_layer,
+                               const char *filename, int lineno))
+{
+  return relay_send_command_from_edge_ext(stream_id, circ, relay_command,
+                                          payload, payload_len, 0,
+                                          cpath_layer, filename, lineno);
+}
+
+/** As connection_edge_send_command(), but the last <b>pext_len</b> bytes of
+ * <b>payload</b> are a payment header extension that follows the relay
+ * payload in the cell. */
+static int
+connection_edge_send_command_ext(edge_connection_t *fromconn,
+                                 uint8_t relay_command, const char *payload,
+                                 size_t payload_len, size_t pext_len)
 {
   /* XXXX NM Split this function into a separate versions per circuit type? */
   circuit_t *circ;
@@ -972,11 +994,34 @@ connection_edge_send_command(edge_connection_t *fromconn,
   }
 #endif /* defined(MEASUREMENTS_21206) */
 
+  if (pext_len)
+    return relay_send_command_from_edge_ext(fromconn->stream_id, circ,
+                                            relay_command, payload,
+                                            payload_len, pext_len,
+                                            cpath_layer, __FILE__, __LINE__);
   return relay_send_command_from_edge(fromconn->stream_id, circ,
                                       relay_command, payload,
                                       payload_len, cpath_layer);
 }
 
+/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and
+ * send it onto the open circuit <b>circ</b>. <b>fromconn</b> is the stream
+ * that's sending the relay cell, or NULL if it's a control cell.
+ * <b>cpath_layer</b> is NULL for OR->OP cells, or the destination hop
+ * for OP->OR cells.
+ *
+ * If you can't send the cell, mark the circuit for close and
+ * return -1. Else return 0.
+ */
+int
+connection_edge_send_command(edge_connection_t *fromconn,
+                             uint8_t relay_command, const char *payload,
+                             size_t payload_len)
+{
+  return connection_edge_send_command_ext(fromconn, relay_command, payload,
+                                          payload_len, 0);
+}
+
 /** How many times will I retry a stream that fails due to DNS
  * resolve failure or misc error?
  */
@@ -1792,6 +1837,9 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
 
       return connection_exit_begin_conn(cell, circ);
     case RELAY_COMMAND_DATA:
+      /* a nanopayment to us may follow the data */
+      if (!layer_hint)
+        mt_process_piggyback(circ, &rh, cell->payload+RELAY_HEADER_SIZE);
       /** update moneTor */
       mt_update_payment_window(circ);
       ++stats_n_data_cells_received;
@@ -2123,21 +2171,12 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
-/** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
- * <b>package_partial</b> is true), and the appropriate package windows aren't
- * empty, grab a cell and send it down the circuit.
- *
- * If *<b>max_cells</b> is given, package no more than max_cells.  Decrement
- * *<b>max_cells</b> by the number of cells packaged.
- *
- * Return -1 (and send a RELAY_COMMAND_END cell if necessary) if conn should
- * be marked for close, else return 0.
- */
-int
-connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
-                                  int *max_cells)
+/** Helper for connection_edge_package_raw_inbuf(): package the cells. */
+static int
+connection_edge_package_raw_inbuf_impl(edge_connection_t *conn,
+                                       int package_partial, int *max_cells)
 {
-  size_t bytes_to_process, length;
+  size_t bytes_to_process, length, pext_len, room;
   char payload[CELL_PAYLOAD_SIZE];
   circuit_t *circ;
   const unsigned domain = conn->base_.type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
@@ -2198,11 +2237,17 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!bytes_to_process)
     return 0;
 
-  if (!package_partial && bytes_to_process < RELAY_PAYLOAD_SIZE)
+  /* leave room for a nanopayment waiting to ride along, unless the data may
+   * have to be resent on another circuit */
+  pext_len = sending_optimistically ? 0 :
+    mt_cclient_piggyback_size(circ, cpath_layer);
+  room = RELAY_PAYLOAD_SIZE - pext_len;
+
+  if (!package_partial && bytes_to_process < room)
     return 0;
 
-  if (bytes_to_process > RELAY_PAYLOAD_SIZE) {
-    length = RELAY_PAYLOAD_SIZE;
+  if (bytes_to_process > room) {
+    length = room;
   } else {
     length = bytes_to_process;
   }
@@ -2234,8 +2279,12 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     buf_add(entry_conn->pending_optimistic_data, payload, length);
   }
 
-  if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
-                                   payload, length) < 0 )
+  if (pext_len)
+    mt_cclient_piggyback_take(circ, (uint8_t*)payload+length);
+
+  if (connection_edge_send_command_ext(conn, RELAY_COMMAND_DATA,
+                                       payload, length+pext_len,
+                                       pext_len) < 0 )
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
 
@@ -2267,6 +2316,35 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   goto repeat_connection_edge_package_raw_inbuf;
 }
 
+/** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
+ * <b>package_partial</b> is true), and the appropriate package windows aren't
+ * empty, grab a cell and send it down the circuit.
+ *
+ * If *<b>max_cells</b> is given, package no more than max_cells.  Decrement
+ * *<b>max_cells</b> by the number of cells packaged.
+ *
+ * Nanopayments to the exit that packaging triggers ride the next data cell
+ * when MoneTorPiggyback is set.
+ *
+ * Return -1 (and send a RELAY_COMMAND_END cell if necessary) if conn should
+ * be marked for close, else return 0.
+ */
+int
+connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
+                                  int *max_cells)
+{
+  circuit_t *circ = circuit_get_by_edge_conn(conn);
+  int r;
+
+  if (circ)
+    mt_cclient_piggyback_begin(circ);
+  r = connection_edge_package_raw_inbuf_impl(conn, package_partial,
+                                             max_cells);
+  if (circ)
+    mt_cclient_piggyback_end(circ);
+  return r;
+}
+
 /** Called when we've just received a relay data cell, when
  * we've just finished flushing all bytes to stream <b>conn</b>,
  * or when we've flushed *some* bytes to the stream <b>conn</b>.
@@ -2605,9 +2683,10 @@ dump_cell_pool_usage(int severity)
   int n_circs = 0;
   int n_cells = 0;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
-    n_cells += c->n_chan_cells.n;
+    n_cells += c->n_chan_cells.n + c->n_chan_pcells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
-      n_cells += TO_OR_CIRCUIT(c)->p_chan_cells.n;
+      n_cells += TO_OR_CIRCUIT(c)->p_chan_cells.n +
+        TO_OR_CIRCUIT(c)->p_chan_pcells.n;
     ++n_circs;
   }
   SMARTLIST_FOREACH_END(c);
@@ -2860,9 +2939,14 @@ update_circuit_on_cmux_(circuit_t *circ, cell_direction_t direction,
 
   /* Update the number of cells we have for the circuit mux */
   if (direction == CELL_DIRECTION_OUT) {
-    circuitmux_set_num_cells(cmux, circ, circ->n_chan_cells.n);
+    circuitmux_set_num_cells(cmux, circ,
+                             circ->n_chan_cells.n + circ->n_chan_pcells.n);
+    circuitmux_set_num_pcells(cmux, circ, circ->n_chan_pcells.n);
   } else {
-    circuitmux_set_num_cells(cmux, circ, or_circ->p_chan_cells.n);
+    circuitmux_set_num_cells(cmux, circ,
+                             or_circ->p_chan_cells.n +
+                             or_circ->p_chan_pcells.n);
+    circuitmux_set_num_pcells(cmux, circ, or_circ->p_chan_pcells.n);
   }
 
   assert_cmux_ok_paranoid(chan);
@@ -2985,7 +3069,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 {
   circuitmux_t *cmux = NULL;
   int n_flushed = 0;
-  cell_queue_t *queue;
+  cell_queue_t *queue, *pqueue;
   destroy_cell_queue_t *destroy_queue=NULL;
   circuit_t *circ;
   or_circuit_t *or_circ;
@@ -3025,32 +3109,45 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 
     if (circ->n_chan == chan) {
       queue = &circ->n_chan_cells;
+      pqueue = &circ->n_chan_pcells;
       streams_blocked = circ->streams_blocked_on_n_chan;
     } else {
       or_circ = TO_OR_CIRCUIT(circ);
       tor_assert(or_circ->p_chan == chan);
       queue = &TO_OR_CIRCUIT(circ)->p_chan_cells;
+      pqueue = &TO_OR_CIRCUIT(circ)->p_chan_pcells;
       streams_blocked = circ->streams_blocked_on_p_chan;
     }
 
     /* Circuitmux told us this was active, so it should have cells */
-    if (/*BUG(*/ queue->n == 0 /*)*/) {
+    if (/*BUG(*/ queue->n == 0 && pqueue->n == 0 /*)*/) {
       log_warn(LD_BUG, "Found a supposedly active circuit with no cells "
                "to send. Trying to recover.");
-      circuitmux_set_num_cells(cmux, circ, 0);
+      circuitmux_clear_num_cells(cmux, circ);
       if (! circ->marked_for_close)
         circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
       continue;
     }
 
-    tor_assert(queue->n > 0);
-
     /*
      * Get just one cell here; once we've sent it, that can change the circuit
      * selection, so we have to loop around for another even if this circuit
-     * has more than one.
+     * has more than one.  Payment cells go before the rest of the circuit.
      */
-    cell = cell_queue_pop(queue);
+    if (pqueue->n > 0) {
+      uint32_t msec_waiting;
+      cell = cell_queue_pop(pqueue);
+      tor_assert(cell);
+
+      msec_waiting = (uint32_t)monotime_coarse_absolute_msec() -
+        cell->inserted_time;
+      ++stats_n_pcells_flushed;
+      stats_pcell_wait_msec += msec_waiting;
+      if (msec_waiting > stats_pcell_max_wait_msec)
+        stats_pcell_max_wait_msec = msec_waiting;
+    } else {
+      cell = cell_queue_pop(queue);
+    }
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
@@ -3083,7 +3180,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 
     /* If we just flushed our queue and this circuit is used for a
      * tunneled directory request, possibly advance its state. */
-    if (queue->n == 0 && chan->dirreq_id)
+    if (queue->n == 0 && pqueue->n == 0 && chan->dirreq_id)
       geoip_change_dirreq_state(chan->dirreq_id,
                                 DIRREQ_TUNNELED,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
@@ -3106,8 +3203,9 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * we have left.
      */
     circuitmux_notify_xmit_cells(cmux, circ, 1);
-    circuitmux_set_num_cells(cmux, circ, queue->n);
-    if (queue->n == 0)
+    circuitmux_set_num_cells(cmux, circ, queue->n + pqueue->n);
+    circuitmux_set_num_pcells(cmux, circ, pqueue->n);
+    if (queue->n == 0 && pqueue->n == 0)
       log_debug(LD_GENERAL, "Made a circuit inactive.");
 
     /* Is the cell queue low enough to unblock all the streams that are waiting
@@ -3252,6 +3350,15 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   cell_queue_append_packed_copy(circ, queue, exitward, cell,
                                 chan->wide_circ_ids, 1);
 
+  /* Paid cells put both channels of the circuit in the premium class */
+  if (circ->mt_priority) {
+    time_t now = approx_time();
+    if (circ->n_chan)
+      circ->n_chan->timestamp_mt_priority = now;
+    if (! CIRCUIT_IS_ORIGIN(circ) && TO_OR_CIRCUIT(circ)->p_chan)
+      TO_OR_CIRCUIT(circ)->p_chan->timestamp_mt_priority = now;
+  }
+
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
     /* We ran the OOM handler */
     if (circ->marked_for_close)
@@ -3280,6 +3387,48 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
 
 }
 
+/** Add the payment cell <b>cell</b> to the payment queue of <b>circ</b>
+ * writing to <b>chan</b> transmitting in <b>direction</b>; the payment queue
+ * is flushed before the circuit's other cells. */
+void
+append_pcell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                              cell_t *cell, cell_direction_t direction)
+{
+  cell_queue_t *queue, *pqueue;
+  int exitward;
+
+  if (circ->marked_for_close)
+    return;
+
+  exitward = (direction == CELL_DIRECTION_OUT);
+  if (exitward) {
+    queue = &circ->n_chan_cells;
+    pqueue = &circ->n_chan_pcells;
+  } else {
+    queue = &TO_OR_CIRCUIT(circ)->p_chan_cells;
+    pqueue = &TO_OR_CIRCUIT(circ)->p_chan_pcells;
+  }
+
+  /* Relay cells are decrypted in the order they were encrypted, so one can
+   * only skip ahead when no older relay cell is still waiting. */
+  if (cell->command == CELL_RELAY && queue->n > 0) {
+    append_cell_to_circuit_queue(circ, chan, cell, direction, 0);
+    return;
+  }
+
+  cell_queue_append_packed_copy(circ, pqueue, exitward, cell,
+                                chan->wide_circ_ids, 1);
+
+  if (PREDICT_UNLIKELY(cell_queues_check_size())) {
+    /* We ran the OOM handler */
+    if (circ->marked_for_close)
+      return;
+  }
+
+  update_circuit_on_cmux(circ, direction);
+  scheduler_channel_has_waiting_cells(chan);
+}
+
 /** Append an encoded value of <b>addr</b> to <b>payload_out</b>, which must
  * have at least 18 bytes of free space.  The encoding is, as specified in
  * tor-spec.txt:
@@ -3344,21 +3493,24 @@ decode_address_from_payload(tor_addr_t *addr_out, const uint8_t *payload,
 void
 circuit_clear_cell_queue(circuit_t *circ, channel_t *chan)
 {
-  cell_queue_t *queue;
+  cell_queue_t *queue, *pqueue;
   cell_direction_t direction;
 
   if (circ->n_chan == chan) {
     queue = &circ->n_chan_cells;
+    pqueue = &circ->n_chan_pcells;
     direction = CELL_DIRECTION_OUT;
   } else {
     or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
     tor_assert(orcirc->p_chan == chan);
     queue = &orcirc->p_chan_cells;
+    pqueue = &orcirc->p_chan_pcells;
     direction = CELL_DIRECTION_IN;
   }
 
-  /* Clear the queue */
+  /* Clear the queues */
   cell_queue_clear(queue);
+  cell_queue_clear(pqueue);
 
   /* Update the cell counter in the cmux */
   if (chan->cmux && circuitmux_is_circuit_attached(chan->cmux, circ))
@@ -14,6 +14,9 @@
 
 extern uint64_t stats_n_relay_cells_relayed;
 extern uint64_t stats_n_relay_cells_delivered;
+extern uint64_t stats_n_pcells_flushed;
+extern uint64_t stats_pcell_wait_msec;
+extern uint32_t stats_pcell_max_wait_msec;
 
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
@@ -74,6 +77,8 @@ void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
 void append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_pcell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                   cell_t *cell, cell_direction_t direction);
 
 void destroy_cell_queue_init(destroy_cell_queue_t *queue);
 void destroy_cell_queue_clear(destroy_cell_queue_t *queue);
@@ -125,6 +130,12 @@ STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC size_t cell_queues_get_total_allocation(void);
 STATIC int cell_queues_check_size(void);
+MOCK_DECL(STATIC int,
+relay_send_command_from_edge_ext,(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len, size_t pext_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno));
 #endif /* defined(RELAY_PRIVATE) */
 
 #endif /* !defined(TOR_RELAY_H) */
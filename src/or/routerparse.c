@@ -2724,6 +2724,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     rs->supports_v3_rendezvous_point =
       protocol_list_supports_protocol(tok->args[0], PRT_HSREND,
                                       PROTOVER_HS_RENDEZVOUS_POINT_V3);
+    rs->supports_pay_piggyback =
+      protocol_list_supports_protocol(tok->args[0], PRT_PAY,
+                                      PROTOVER_PAY_PIGGYBACK);
   }
   if ((tok = find_opt_by_keyword(tokens, K_V))) {
     tor_assert(tok->n_args == 1);
@@ -143,6 +143,15 @@ log_heartbeat(time_t now)
          "Average packaged cell fullness: %2.3f%%. "
          "TLS write overhead: %.f%%", fullness_pct, overhead_pct);
 
+  if (stats_n_pcells_flushed) {
+    log_notice(LD_HEARTBEAT, "Payment cell lane: flushed "U64_FORMAT" cells "
+               "with an average wait of %.1f ms and a longest wait of %u ms.",
+               U64_PRINTF_ARG(stats_n_pcells_flushed),
+               U64_TO_DBL(stats_pcell_wait_msec) /
+               U64_TO_DBL(stats_n_pcells_flushed),
+               stats_pcell_max_wait_msec);
+  }
+
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
@@ -29,6 +29,11 @@ const char tor_git_revision[] = "";
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
 #include "consdiff.h"
+#include "mt_crypto.h"
+#include "mt_common.h"
+#include "mt_tokens.h"
+#include "mt_chntable.h"
+#include "mt_descmap.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -625,6 +630,454 @@ bench_ecdh_p224(void)
   bench_ecdh_impl(NID_secp224r1, "P-224");
 }
 
+/** Time finding and moving a payment channel by descriptor, comparing a
+ * scan over one list of channels with the per-state channel table. */
+static void
+bench_mt_chntable(void)
+{
+  const int sizes[] = { 16, 256, 4096, 65536 };
+  const int iters = 100000;
+  uint64_t start, end;
+  int i, j, n = 0;
+
+  for (j = 0; j < (int)ARRAY_LENGTH(sizes); ++j) {
+    const int nchns = sizes[j];
+    mt_desc_t *descs = tor_calloc(nchns, sizeof(mt_desc_t));
+    smartlist_t *sl = smartlist_new();
+    mt_chntable_t *table = mt_chntable_new();
+
+    for (i = 0; i < nchns; ++i) {
+      descs[i].id[0] = i;
+      descs[i].party = MT_PARTY_INT;
+      smartlist_add(sl, &descs[i]);
+      mt_chntable_add(table, 0, &descs[i], &descs[i]);
+    }
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      mt_desc_t *want = &descs[(i * 7919) % nchns];
+      SMARTLIST_FOREACH_BEGIN(sl, mt_desc_t *, d) {
+        if (d->id[0] == want->id[0] && d->party == want->party) {
+          SMARTLIST_DEL_CURRENT_KEEPORDER(sl, d);
+          smartlist_add(sl, d);
+          ++n;
+          break;
+        }
+      } SMARTLIST_FOREACH_END(d);
+    }
+    end = perftime();
+    printf("%6d channels: list scan   %9.2f ns per transition\n",
+           nchns, NANOCOUNT(start, end, iters));
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      mt_desc_t *want = &descs[(i * 7919) % nchns];
+      mt_desc_t *d = mt_chntable_take(table, 0, want);
+      mt_chntable_add(table, 1, d, d);
+      d = mt_chntable_take(table, 1, want);
+      mt_chntable_add(table, 0, d, d);
+      ++n;
+    }
+    end = perftime();
+    printf("%6d channels: state table %9.2f ns per transition\n",
+           nchns, NANOCOUNT(start, end, iters));
+
+    mt_chntable_free(table, NULL);
+    smartlist_free(sl);
+    tor_free(descs);
+  }
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Hits == %d\n", n);
+}
+
+/** Time a lookup by payment descriptor in a digestmap keyed by
+ * mt_desc2digest() and in an mt_descmap_t. */
+static void
+bench_mt_descmap(void)
+{
+  const int elts = 4096;
+  const int iters = 256;
+  uint64_t start, end;
+  int i, j, n = 0;
+  byte digest[DIGEST_LEN];
+  mt_desc_t *descs = tor_calloc(elts, sizeof(mt_desc_t));
+  digestmap_t *dm = digestmap_new();
+  mt_descmap_t *map = mt_descmap_new();
+
+  for (i = 0; i < elts; ++i) {
+    descs[i].id[0] = i;
+    descs[i].party = MT_PARTY_REL;
+    mt_desc2digest(&descs[i], &digest);
+    digestmap_set(dm, (char*)digest, &descs[i]);
+    mt_descmap_set(map, &descs[i], &descs[i]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < elts; ++i) {
+      mt_desc2digest(&descs[i], &digest);
+      n += digestmap_get(dm, (char*)digest) != NULL;
+    }
+  }
+  end = perftime();
+  printf("digestmap_get(mt_desc2digest()): %.2f ns per lookup\n",
+         NANOCOUNT(start, end, iters*elts));
+
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < elts; ++i)
+      n += mt_descmap_get(map, &descs[i]) != NULL;
+  }
+  end = perftime();
+  printf("mt_descmap_get: %.2f ns per lookup\n",
+         NANOCOUNT(start, end, iters*elts));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Hits == %d\n", n);
+
+  digestmap_free(dm, NULL);
+  mt_descmap_free(map, NULL);
+  tor_free(descs);
+}
+
+/** Compare two uint64_t for qsort(). */
+static int
+compare_uint64_(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Call <b>fn</b>(<b>arg</b>) in <b>samples</b> rounds of <b>batch</b>
+ * calls, timing each round. Print the rate and the median, 90th and 99th
+ * percentile time of a single call; rounds of more than one call keep the
+ * clock from dominating fast operations. */
+static void
+bench_mt_run(const char *name, void (*fn)(void *), void *arg,
+             int samples, int batch)
+{
+  uint64_t *lat = tor_calloc(samples, sizeof(uint64_t));
+  uint64_t total = 0, start;
+  int i, j;
+
+  reset_perftime();
+  for (i = 0; i < samples; ++i) {
+    start = perftime();
+    for (j = 0; j < batch; ++j)
+      fn(arg);
+    lat[i] = perftime() - start;
+    total += lat[i];
+  }
+  qsort(lat, samples, sizeof(uint64_t), compare_uint64_);
+
+#define MT_PCT(p) (lat[(samples - 1) * (p) / 100] / (double)batch / 1000.0)
+  printf("%-32s %11.0f ops/sec  p50 %9.2f us  p90 %9.2f us  p99 %9.2f us\n",
+         name, (double)samples * batch * 1e9 / total,
+         MT_PCT(50), MT_PCT(90), MT_PCT(99));
+#undef MT_PCT
+  tor_free(lat);
+}
+
+/** State shared by the payment benchmarks */
+typedef struct {
+  byte pp[MT_SZ_PP];
+  byte pk[MT_SZ_PK];
+  byte sk[MT_SZ_SK];
+  byte sig[MT_SZ_SIG];
+  byte msg[256];
+  byte *signed_msg;
+  int signed_size;
+  byte hc[MT_NAN_LEN][MT_SZ_HASH];
+  int k;
+  mt_desc_t *descs;
+  digestmap_t *dm;
+  int n_descs;
+  int i;
+  int hits;
+} bench_mt_state_t;
+
+static void
+bench_mt_sig_sign_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  tor_assert(mt_sig_sign(s->msg, sizeof(s->msg), &s->sk, &s->sig) ==
+             MT_SUCCESS);
+}
+
+static void
+bench_mt_sig_verify_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  tor_assert(mt_sig_verify(s->msg, sizeof(s->msg), &s->pk, &s->sig) ==
+             MT_SUCCESS);
+}
+
+static void
+bench_mt_signed_create_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  byte *out;
+  tor_assert(mt_create_signed_msg(s->msg, sizeof(s->msg), &s->pk, &s->sk,
+                                  &out) > 0);
+  tor_free(out);
+}
+
+static void
+bench_mt_signed_verify_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  byte pk[MT_SZ_PK];
+  byte *msg;
+  tor_assert(mt_verify_signed_msg(s->signed_msg, s->signed_size, &pk,
+                                  &msg) == (int)sizeof(s->msg));
+}
+
+/** Time signing and verification with both kinds of payment key, both raw
+ * and wrapped as a signed protocol message. */
+static void
+bench_mt_sig(void)
+{
+  bench_mt_state_t *s = tor_malloc_zero(sizeof(bench_mt_state_t));
+  const char *schemes[] = { "rsa", "ed25519" };
+  char name[64];
+  int i;
+
+  mt_crypt_setup(&s->pp);
+  crypto_rand((char *)s->msg, sizeof(s->msg));
+
+  for (i = 0; i < 2; ++i) {
+    tor_assert(mt_crypt_keygen(&s->pp, i ? MT_KEY_ED25519 : MT_KEY_RSA, &s->pk, &s->sk) ==
+               MT_SUCCESS);
+    tor_assert(mt_sig_sign(s->msg, sizeof(s->msg), &s->sk, &s->sig) ==
+               MT_SUCCESS);
+    s->signed_size = mt_create_signed_msg(s->msg, sizeof(s->msg), &s->pk,
+                                          &s->sk, &s->signed_msg);
+
+    tor_snprintf(name, sizeof(name), "mt_sig_sign (%s)", schemes[i]);
+    bench_mt_run(name, bench_mt_sig_sign_, s, 1000, 1);
+    tor_snprintf(name, sizeof(name), "mt_sig_verify (%s)", schemes[i]);
+    bench_mt_run(name, bench_mt_sig_verify_, s, 1000, 1);
+    tor_snprintf(name, sizeof(name), "mt_create_signed_msg (%s)", schemes[i]);
+    bench_mt_run(name, bench_mt_signed_create_, s, 1000, 1);
+    tor_snprintf(name, sizeof(name), "mt_verify_signed_msg (%s)", schemes[i]);
+    bench_mt_run(name, bench_mt_signed_verify_, s, 1000, 1);
+
+    tor_free(s->signed_msg);
+  }
+  tor_free(s);
+}
+
+/** Every token type, as (type name, token type) */
+#define BENCH_MT_TOKENS(X)                                              \
+  X(mac_aut_mint, MT_NTYPE_MAC_AUT_MINT)                                \
+  X(mac_any_trans, MT_NTYPE_MAC_ANY_TRANS)                              \
+  X(chn_end_setup, MT_NTYPE_CHN_END_SETUP)                              \
+  X(chn_int_setup, MT_NTYPE_CHN_INT_SETUP)                              \
+  X(any_led_confirm, MT_NTYPE_ANY_LED_CONFIRM)                          \
+  X(chn_int_reqclose, MT_NTYPE_CHN_INT_REQCLOSE)                        \
+  X(chn_end_close, MT_NTYPE_CHN_END_CLOSE)                              \
+  X(chn_int_close, MT_NTYPE_CHN_INT_CLOSE)                              \
+  X(chn_end_cashout, MT_NTYPE_CHN_END_CASHOUT)                          \
+  X(chn_int_cashout, MT_NTYPE_CHN_INT_CASHOUT)                          \
+  X(mac_led_data, MT_NTYPE_MAC_LED_DATA)                                \
+  X(chn_led_data, MT_NTYPE_CHN_LED_DATA)                                \
+  X(mac_led_query, MT_NTYPE_MAC_LED_QUERY)                              \
+  X(chn_led_query, MT_NTYPE_CHN_LED_QUERY)                              \
+  X(chn_end_estab1, MT_NTYPE_CHN_END_ESTAB1)                            \
+  X(chn_int_estab2, MT_NTYPE_CHN_INT_ESTAB2)                            \
+  X(chn_end_estab3, MT_NTYPE_CHN_END_ESTAB3)                            \
+  X(chn_int_estab4, MT_NTYPE_CHN_INT_ESTAB4)                            \
+  X(mic_cli_pay1, MT_NTYPE_MIC_CLI_PAY1)                                \
+  X(mic_rel_pay2, MT_NTYPE_MIC_REL_PAY2)                                \
+  X(mic_cli_pay3, MT_NTYPE_MIC_CLI_PAY3)                                \
+  X(mic_int_pay4, MT_NTYPE_MIC_INT_PAY4)                                \
+  X(mic_cli_pay5, MT_NTYPE_MIC_CLI_PAY5)                                \
+  X(mic_rel_pay6, MT_NTYPE_MIC_REL_PAY6)                                \
+  X(mic_int_pay7, MT_NTYPE_MIC_INT_PAY7)                                \
+  X(mic_int_pay8, MT_NTYPE_MIC_INT_PAY8)                                \
+  X(nan_cli_setup1, MT_NTYPE_NAN_CLI_SETUP1)                            \
+  X(nan_int_setup2, MT_NTYPE_NAN_INT_SETUP2)                            \
+  X(nan_cli_setup3, MT_NTYPE_NAN_CLI_SETUP3)                            \
+  X(nan_int_setup4, MT_NTYPE_NAN_INT_SETUP4)                            \
+  X(nan_cli_setup5, MT_NTYPE_NAN_CLI_SETUP5)                            \
+  X(nan_int_setup6, MT_NTYPE_NAN_INT_SETUP6)                            \
+  X(nan_cli_estab1, MT_NTYPE_NAN_CLI_ESTAB1)                            \
+  X(nan_rel_estab2, MT_NTYPE_NAN_REL_ESTAB2)                            \
+  X(nan_int_estab3, MT_NTYPE_NAN_INT_ESTAB3)                            \
+  X(nan_rel_estab4, MT_NTYPE_NAN_REL_ESTAB4)                            \
+  X(nan_int_estab5, MT_NTYPE_NAN_INT_ESTAB5)                            \
+  X(nan_rel_estab6, MT_NTYPE_NAN_REL_ESTAB6)                            \
+  X(nan_cli_pay1, MT_NTYPE_NAN_CLI_PAY1)                                \
+  X(nan_rel_pay2, MT_NTYPE_NAN_REL_PAY2)                                \
+  X(nan_cli_reqclose1, MT_NTYPE_NAN_CLI_REQCLOSE1)                      \
+  X(nan_rel_reqclose2, MT_NTYPE_NAN_REL_REQCLOSE2)                      \
+  X(nan_cli_destab1, MT_NTYPE_NAN_CLI_DESTAB1)                          \
+  X(nan_int_destab2, MT_NTYPE_NAN_INT_DESTAB2)                          \
+  X(nan_cli_dpay1, MT_NTYPE_NAN_CLI_DPAY1)                              \
+  X(nan_int_dpay2, MT_NTYPE_NAN_INT_DPAY2)                              \
+  X(nan_end_close1, MT_NTYPE_NAN_END_CLOSE1)                            \
+  X(nan_int_close2, MT_NTYPE_NAN_INT_CLOSE2)                            \
+  X(nan_end_close3, MT_NTYPE_NAN_END_CLOSE3)                            \
+  X(nan_int_close4, MT_NTYPE_NAN_INT_CLOSE4)                            \
+  X(nan_end_close5, MT_NTYPE_NAN_END_CLOSE5)                            \
+  X(nan_int_close6, MT_NTYPE_NAN_INT_CLOSE6)                            \
+  X(nan_end_close7, MT_NTYPE_NAN_END_CLOSE7)                            \
+  X(nan_int_close8, MT_NTYPE_NAN_INT_CLOSE8)
+
+/* For each token type, a pack and an unpack step over a token of random
+ * fields. Random bytes are not valid keys, so every key field holds a real
+ * key instead. */
+#define BENCH_MT_TOKEN_FNS(t, type)                                     \
+  typedef struct {                                                      \
+    t##_t tkn;                                                          \
+    byte pid[DIGEST_LEN];                                               \
+    byte *str;                                                          \
+    int size;                                                           \
+  } bench_mt_##t##_t;                                                   \
+  static void                                                           \
+  bench_mt_pack_##t(void *arg)                                          \
+  {                                                                     \
+    bench_mt_##t##_t *s = arg;                                          \
+    byte *str;                                                          \
+    tor_assert(pack_##t(&s->tkn, &s->pid, &str) == s->size);            \
+    tor_free(str);                                                      \
+  }                                                                     \
+  static void                                                           \
+  bench_mt_unpack_##t(void *arg)                                        \
+  {                                                                     \
+    bench_mt_##t##_t *s = arg;                                          \
+    tor_assert(unpack_##t(s->str, s->size, &s->tkn, &s->pid) ==         \
+               MT_SUCCESS);                                             \
+  }                                                                     \
+  static void                                                           \
+  bench_mt_token_##t(byte (*pk)[MT_SZ_PK])                              \
+  {                                                                     \
+    bench_mt_##t##_t *s = tor_malloc_zero(sizeof(*s));                  \
+    crypto_rand((char *)&s->tkn, sizeof(s->tkn));                       \
+    mt_token_set_keys(type, &s->tkn, pk);                               \
+    s->size = pack_##t(&s->tkn, &s->pid, &s->str);                      \
+    tor_assert(s->size > 0);                                            \
+    tor_assert(unpack_##t(s->str, s->size, &s->tkn, &s->pid) ==         \
+               MT_SUCCESS);                                             \
+    bench_mt_run("pack_" #t, bench_mt_pack_##t, s, 1000, 16);           \
+    bench_mt_run("unpack_" #t, bench_mt_unpack_##t, s, 1000, 16);       \
+    tor_free(s->str);                                                   \
+    tor_free(s);                                                        \
+  }
+BENCH_MT_TOKENS(BENCH_MT_TOKEN_FNS)
+#undef BENCH_MT_TOKEN_FNS
+
+/** Time packing and unpacking every payment token type. */
+static void
+bench_mt_tokens(void)
+{
+  byte pp[MT_SZ_PP];
+  byte pk[MT_SZ_PK];
+  byte sk[MT_SZ_SK];
+
+  mt_crypt_setup(&pp);
+  tor_assert(mt_crypt_keygen(&pp, MT_KEY_RSA, &pk, &sk) == MT_SUCCESS);
+
+#define BENCH_MT_TOKEN_CALL(t, type) bench_mt_token_##t(&pk);
+  BENCH_MT_TOKENS(BENCH_MT_TOKEN_CALL)
+#undef BENCH_MT_TOKEN_CALL
+}
+
+static void
+bench_mt_hc_create_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  tor_assert(mt_hc_create(MT_NAN_LEN, &s->hc[MT_NAN_LEN - 1],
+                          &s->hc) == MT_SUCCESS);
+}
+
+static void
+bench_mt_hc_verify_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  tor_assert(mt_hc_verify(&s->hc[0], &s->hc[s->k], s->k) == MT_SUCCESS);
+}
+
+/** Time building a nanopayment hash chain and checking preimages at a few
+ * distances from its tail. */
+static void
+bench_mt_hc(void)
+{
+  bench_mt_state_t *s = tor_malloc_zero(sizeof(bench_mt_state_t));
+  const int ks[] = { 1, 10, 100, MT_NAN_LEN - 1 };
+  char name[64];
+  int i;
+
+  crypto_rand((char *)s->hc[MT_NAN_LEN - 1], MT_SZ_HASH);
+  bench_mt_run("mt_hc_create", bench_mt_hc_create_, s, 200, 1);
+
+  for (i = 0; i < (int)ARRAY_LENGTH(ks); ++i) {
+    s->k = ks[i];
+    tor_snprintf(name, sizeof(name), "mt_hc_verify (k=%d)", s->k);
+    bench_mt_run(name, bench_mt_hc_verify_, s, 1000, s->k < 100 ? 16 : 1);
+  }
+  tor_free(s);
+}
+
+static void
+bench_mt_desc2digest_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  byte digest[DIGEST_LEN];
+  mt_desc2digest(&s->descs[s->i++ % s->n_descs], &digest);
+  s->hits += digest[0] & 1;
+}
+
+static void
+bench_mt_desc2digest_get_(void *arg)
+{
+  bench_mt_state_t *s = arg;
+  byte digest[DIGEST_LEN];
+  mt_desc2digest(&s->descs[s->i++ % s->n_descs], &digest);
+  s->hits += digestmap_get(s->dm, (char *)digest) != NULL;
+}
+
+/** Time turning a payment descriptor into a digest, alone and followed by
+ * the digestmap lookup the payment modules use it for. */
+static void
+bench_mt_desc2digest(void)
+{
+  bench_mt_state_t *s = tor_malloc_zero(sizeof(bench_mt_state_t));
+  byte digest[DIGEST_LEN];
+  int i;
+
+  s->n_descs = 4096;
+  s->descs = tor_calloc(s->n_descs, sizeof(mt_desc_t));
+  s->dm = digestmap_new();
+  for (i = 0; i < s->n_descs; ++i) {
+    crypto_rand((char *)s->descs[i].id, sizeof(s->descs[i].id));
+    s->descs[i].party = MT_PARTY_REL;
+    mt_desc2digest(&s->descs[i], &digest);
+    digestmap_set(s->dm, (char *)digest, &s->descs[i]);
+  }
+
+  bench_mt_run("mt_desc2digest", bench_mt_desc2digest_, s, 4096, 64);
+  bench_mt_run("mt_desc2digest + lookup", bench_mt_desc2digest_get_, s,
+               4096, 64);
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Hits == %d\n", s->hits);
+
+  digestmap_free(s->dm, NULL);
+  tor_free(s->descs);
+  tor_free(s);
+}
+
+/** Run every payment-layer benchmark. */
+static void
+bench_mt(void)
+{
+  bench_mt_sig();
+  bench_mt_tokens();
+  bench_mt_hc();
+  bench_mt_desc2digest();
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -649,6 +1102,9 @@ static struct benchmark_t benchmarks[] = {
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(mt_chntable),
+  ENT(mt_descmap),
+  ENT(mt),
   {NULL,NULL,0}
 };
 
@@ -1230,10 +1230,19 @@ struct testgroup_t testgroups[] = {
   { "introduce/", introduce_tests },
   { "keypin/", keypin_tests },
   { "link-handshake/", link_handshake_tests },
+  { "mt_acctable/", mt_acctable_tests },
+  { "mt_chntable/", mt_chntable_tests },
   { "mt_common/", mt_common_tests },
   { "mt_crypto/", mt_crypto_tests },
+  { "mt_descmap/", mt_descmap_tests },
+  { "mt_ipay/", mt_ipay_tests },
+  { "mt_ledgerlog/", mt_ledgerlog_tests },
   { "mt_lpay/", mt_lpay_tests },
+  { "mt_messagebuffer/", mt_messagebuffer_tests },
   { "mt_paymulti/", mt_paymulti_tests },
+  { "mt_paywindow/", mt_paywindow_tests },
+  { "mt_reservoir/", mt_reservoir_tests },
+  { "mt_stats/", mt_stats_tests },
   { "mt_tokens/", mt_tokens_tests },
   { "nodelist/", nodelist_tests },
   { "oom/", oom_tests },
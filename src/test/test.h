@@ -222,10 +222,19 @@ extern struct testcase_t keypin_tests[];
 extern struct testcase_t link_handshake_tests[];
 extern struct testcase_t logging_tests[];
 extern struct testcase_t microdesc_tests[];
+extern struct testcase_t mt_acctable_tests[];
+extern struct testcase_t mt_chntable_tests[];
 extern struct testcase_t mt_common_tests[];
 extern struct testcase_t mt_crypto_tests[];
+extern struct testcase_t mt_descmap_tests[];
+extern struct testcase_t mt_ipay_tests[];
+extern struct testcase_t mt_ledgerlog_tests[];
 extern struct testcase_t mt_lpay_tests[];
+extern struct testcase_t mt_messagebuffer_tests[];
 extern struct testcase_t mt_paymulti_tests[];
+extern struct testcase_t mt_paywindow_tests[];
+extern struct testcase_t mt_reservoir_tests[];
+extern struct testcase_t mt_stats_tests[];
 extern struct testcase_t mt_tokens_tests[];
 extern struct testcase_t nodelist_tests[];
 extern struct testcase_t oom_tests[];
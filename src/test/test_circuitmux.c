@@ -7,6 +7,9 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
+#include "config.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -77,8 +80,267 @@ test_cmux_destroy_cell_queue(void *arg)
   tor_free(dc);
 }
 
+/** Test that circuits with a few payment cells are picked first. */
+static void
+test_cmux_payment_lane(void *arg)
+{
+  circuitmux_t *cmux = NULL, *cmux2 = NULL;
+  channel_t *ch = NULL;
+  circuit_t *circ1 = NULL, *circ2 = NULL;
+  destroy_cell_queue_t *cq = NULL;
+
+  scheduler_init();
+
+  (void) arg;
+
+  cmux = circuitmux_alloc();
+  cmux2 = circuitmux_alloc();
+  ch = new_fake_channel();
+  ch->has_queued_writes = has_queued_writes;
+  ch->wide_circ_ids = 1;
+
+  circ1 = tor_malloc_zero(sizeof(circuit_t));
+  circ1->magic = ORIGIN_CIRCUIT_MAGIC;
+  circ1->n_chan = ch;
+  circ1->n_circ_id = 1;
+  circ2 = tor_malloc_zero(sizeof(circuit_t));
+  circ2->magic = ORIGIN_CIRCUIT_MAGIC;
+  circ2->n_chan = ch;
+  circ2->n_circ_id = 2;
+  circuitmux_attach_circuit(cmux, circ1, CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(cmux, circ2, CELL_DIRECTION_OUT);
+
+  circuitmux_set_num_cells(cmux, circ1, 10);
+  circuitmux_set_num_cells(cmux, circ2, 3);
+
+  /* Payment cells move a circuit ahead of the others and of destroys */
+  circuitmux_append_destroy_cell(ch, cmux, 100, 10);
+  circuitmux_set_num_pcells(cmux, circ2, 2);
+  tt_int_op(circuitmux_num_pcells(cmux), OP_EQ, 2);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, circ2);
+  tt_ptr_op(cq, OP_EQ, NULL);
+  tt_int_op(circuitmux_compare_muxes(cmux, cmux2), OP_LT, 0);
+  tt_int_op(circuitmux_compare_muxes(cmux2, cmux), OP_GT, 0);
+
+  /* ...but not once it queues more of them than the lane allows */
+  get_options_mutable()->MoneTorPaymentLaneMaxCells = 1;
+  circuitmux_set_num_pcells(cmux, circ2, 2);
+  tt_int_op(circuitmux_num_pcells(cmux), OP_EQ, 2);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, NULL);
+  tt_ptr_op(cq, OP_NE, NULL);
+  tt_int_op(circuitmux_compare_muxes(cmux, cmux2), OP_EQ, 0);
+  circuitmux_set_num_pcells(cmux, circ2, 1);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, circ2);
+
+  /* Detaching takes the circuit off the lane */
+  circuitmux_detach_circuit(cmux, circ2);
+  tt_int_op(circuitmux_num_pcells(cmux), OP_EQ, 0);
+  tt_int_op(circuitmux_compare_muxes(cmux, cmux2), OP_EQ, 0);
+
+ done:
+  circuitmux_detach_all_circuits(cmux, NULL);
+  circuitmux_free(cmux);
+  circuitmux_free(cmux2);
+  channel_free(ch);
+  tor_free(circ1);
+  tor_free(circ2);
+}
+
+/** Test that EWMA copes with the payment lane serving a circuit that is
+ * not at the head of its queue. */
+static void
+test_cmux_payment_lane_ewma(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  channel_t *ch = NULL;
+  circuit_t *circs[3], *head = NULL, *other = NULL;
+  destroy_cell_queue_t *cq = NULL;
+  int i;
+
+  scheduler_init();
+
+  (void) arg;
+
+  memset(circs, 0, sizeof(circs));
+  cmux = circuitmux_alloc();
+  circuitmux_set_policy(cmux, &ewma_policy);
+  ch = new_fake_channel();
+  ch->has_queued_writes = has_queued_writes;
+  ch->wide_circ_ids = 1;
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    circs[i]->magic = ORIGIN_CIRCUIT_MAGIC;
+    circs[i]->n_chan = ch;
+    circs[i]->n_circ_id = i + 1;
+    circuitmux_attach_circuit(cmux, circs[i], CELL_DIRECTION_OUT);
+    circuitmux_set_num_cells(cmux, circs[i], 100);
+  }
+
+  /* Give the circuits different EWMA values */
+  for (i = 0; i < 6; ++i) {
+    circuit_t *circ = circuitmux_get_first_active_circuit(cmux, &cq);
+    tt_assert(circ);
+    circuitmux_notify_xmit_cells(cmux, circ, i + 1);
+  }
+  head = circuitmux_get_first_active_circuit(cmux, &cq);
+  other = (head == circs[0]) ? circs[1] : circs[0];
+
+  /* Sending on a lane circuit behind the head leaves the queue intact */
+  circuitmux_set_num_pcells(cmux, other, 1);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, other);
+  circuitmux_notify_xmit_cells(cmux, other, 1);
+  circuitmux_set_num_pcells(cmux, other, 0);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, head);
+
+  for (i = 0; i < 30; ++i) {
+    circuit_t *circ = circuitmux_get_first_active_circuit(cmux, &cq);
+    tt_assert(circ);
+    circuitmux_notify_xmit_cells(cmux, circ, 1);
+  }
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (circs[i] && circuitmux_is_circuit_attached(cmux, circs[i]))
+      circuitmux_detach_circuit(cmux, circs[i]);
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux);
+  channel_free(ch);
+}
+
+/** Send <b>n</b> cells one at a time and count them per tier. */
+static void
+wfq_send_cells(circuitmux_t *cmux, int n, int *sent)
+{
+  destroy_cell_queue_t *cq = NULL;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    circuit_t *circ = circuitmux_get_first_active_circuit(cmux, &cq);
+    tor_assert(circ);
+    sent[circuitmux_wfq_get_tier(circ)]++;
+    circuitmux_notify_xmit_cells(cmux, circ, 1);
+  }
+}
+
+/** Test that WFQ tiers get bandwidth in proportion to their weights. */
+static void
+test_cmux_wfq_shares(void *arg)
+{
+  circuitmux_t *cmux = NULL, *cmux2 = NULL;
+  channel_t *ch = NULL;
+  circuit_t *circs[5];
+  uint32_t priorities[5] = { 0, 0, 1, 2, 5 };
+  smartlist_t *weights = smartlist_new();
+  int sent[WFQ_MAX_TIERS];
+  int i;
+
+  scheduler_init();
+
+  (void) arg;
+
+  memset(circs, 0, sizeof(circs));
+  smartlist_split_string(weights, "1,2,4", ",", 0, 0);
+  tt_int_op(circuitmux_wfq_set_weights(weights, 0), OP_EQ, 0);
+
+  cmux = circuitmux_alloc();
+  cmux2 = circuitmux_alloc();
+  circuitmux_set_policy(cmux, &wfq_policy);
+  circuitmux_set_policy(cmux2, &wfq_policy);
+  ch = new_fake_channel();
+  ch->has_queued_writes = has_queued_writes;
+  ch->wide_circ_ids = 1;
+
+  /* Two unpaid circuits, one in the middle tier and two in the top one */
+  for (i = 0; i < 5; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    circs[i]->magic = ORIGIN_CIRCUIT_MAGIC;
+    circs[i]->n_chan = ch;
+    circs[i]->n_circ_id = i + 1;
+    circs[i]->mt_priority = priorities[i];
+    circuitmux_attach_circuit(cmux, circs[i], CELL_DIRECTION_OUT);
+    circuitmux_set_num_cells(cmux, circs[i], 100000);
+  }
+  tt_int_op(circuitmux_wfq_get_tier(circs[4]), OP_EQ, 2);
+
+  /* Backlogged tiers share 1:2:4 whatever their number of circuits */
+  memset(sent, 0, sizeof(sent));
+  wfq_send_cells(cmux, 7000, sent);
+  tt_int_op(sent[0], OP_GE, 999);
+  tt_int_op(sent[0], OP_LE, 1001);
+  tt_int_op(sent[1], OP_GE, 1999);
+  tt_int_op(sent[1], OP_LE, 2001);
+  tt_int_op(sent[2], OP_GE, 3999);
+  tt_int_op(sent[2], OP_LE, 4001);
+
+  /* Circuits of one tier share it evenly */
+  tt_int_op(circuitmux_num_cells_for_circuit(cmux, circs[0]), OP_GE,
+            circuitmux_num_cells_for_circuit(cmux, circs[1]) - 1);
+  tt_int_op(circuitmux_num_cells_for_circuit(cmux, circs[0]), OP_LE,
+            circuitmux_num_cells_for_circuit(cmux, circs[1]) + 1);
+
+  /* An idle tier's share goes to the others */
+  circuitmux_set_num_cells(cmux, circs[3], 0);
+  circuitmux_set_num_cells(cmux, circs[4], 0);
+  memset(sent, 0, sizeof(sent));
+  wfq_send_cells(cmux, 3000, sent);
+  tt_int_op(sent[0], OP_GE, 999);
+  tt_int_op(sent[0], OP_LE, 1001);
+  tt_int_op(sent[2], OP_EQ, 0);
+
+  /* ...and it gets no burst for the time it was idle */
+  circuitmux_set_num_cells(cmux, circs[3], 100000);
+  circuitmux_set_num_cells(cmux, circs[4], 100000);
+  memset(sent, 0, sizeof(sent));
+  wfq_send_cells(cmux, 700, sent);
+  tt_int_op(sent[0], OP_GE, 99);
+  tt_int_op(sent[0], OP_LE, 101);
+  tt_int_op(sent[2], OP_GE, 399);
+  tt_int_op(sent[2], OP_LE, 401);
+
+  /* A circuit moves up a tier once its payment comes in */
+  circs[2]->mt_priority = 2;
+  circuitmux_set_num_cells(cmux, circs[0], 0);
+  circuitmux_set_num_cells(cmux, circs[1], 0);
+  memset(sent, 0, sizeof(sent));
+  wfq_send_cells(cmux, 100, sent);
+  tt_int_op(sent[1], OP_LE, 1);
+  tt_int_op(sent[2], OP_GE, 99);
+
+  /* Channels about to serve a heavier tier go first */
+  circuitmux_detach_circuit(cmux, circs[0]);
+  circuitmux_attach_circuit(cmux2, circs[0], CELL_DIRECTION_OUT);
+  circuitmux_set_num_cells(cmux2, circs[0], 10);
+  tt_int_op(circuitmux_compare_muxes(cmux, cmux2), OP_LT, 0);
+  tt_int_op(circuitmux_compare_muxes(cmux2, cmux), OP_GT, 0);
+
+ done:
+  /* The fake channel cannot be looked up, so detach one by one */
+  for (i = 0; i < 5; ++i) {
+    if (circs[i] && circuitmux_is_circuit_attached(cmux, circs[i]))
+      circuitmux_detach_circuit(cmux, circs[i]);
+    if (circs[i] && circuitmux_is_circuit_attached(cmux2, circs[i]))
+      circuitmux_detach_circuit(cmux2, circs[i]);
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux);
+  circuitmux_free(cmux2);
+  channel_free(ch);
+  /* Put back the default weights for whoever runs next */
+  SMARTLIST_FOREACH(weights, char *, cp, tor_free(cp));
+  smartlist_clear(weights);
+  smartlist_split_string(weights, "1,4", ",", 0, 0);
+  circuitmux_wfq_set_weights(weights, 0);
+  SMARTLIST_FOREACH(weights, char *, cp, tor_free(cp));
+  smartlist_free(weights);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "payment_lane", test_cmux_payment_lane, TT_FORK, NULL, NULL },
+  { "payment_lane_ewma", test_cmux_payment_lane_ewma, TT_FORK, NULL, NULL },
+  { "wfq_shares", test_cmux_wfq_shares, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
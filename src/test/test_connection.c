@@ -5,10 +5,13 @@
 
 #define CONNECTION_PRIVATE
 #define MAIN_PRIVATE
+#define TOR_CHANNEL_INTERNAL_
 
 #include "or.h"
 #include "test.h"
 
+#include "channeltls.h"
+#include "config.h"
 #include "connection.h"
 #include "hs_common.h"
 #include "main.h"
@@ -776,6 +779,117 @@ test_conn_download_status(void *arg)
   /* the teardown function removes all the connections in the global list*/;
 }
 
+/** Return a rate-limited open OR connection that only the global buckets
+ * hold back, with a channel of its own. */
+static connection_t *
+test_conn_premium_new_or_conn(void)
+{
+  or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  tor_addr_parse(&or_conn->base_.addr, "18.0.0.1");
+  or_conn->base_.state = OR_CONN_STATE_OPEN;
+  or_conn->bandwidthrate = or_conn->bandwidthburst = INT32_MAX;
+  or_conn->read_bucket = or_conn->write_bucket = INT32_MAX;
+  or_conn->chan = tor_malloc_zero(sizeof(channel_tls_t));
+  return TO_CONN(or_conn);
+}
+
+static void
+test_conn_premium_free_or_conn(connection_t *conn)
+{
+  if (!conn)
+    return;
+  tor_free(TO_OR_CONN(conn)->chan);
+  connection_free_(conn);
+}
+
+/** Read as much as the buckets allow on <b>conns</b> in turn during
+ * <b>ticks</b> refills of 100 msec, adding the bytes read to <b>nread</b>. */
+static void
+test_conn_premium_run(connection_t **conns, int n_conns, uint64_t *nread,
+                      int ticks, time_t now)
+{
+  for (int t = 0; t < ticks; t++) {
+    connection_bucket_refill(100, now);
+    int progress = 1;
+    while (progress) {
+      progress = 0;
+      /* alternate who goes first so neither class profits from the order */
+      for (int i = 0; i < n_conns; i++) {
+        int idx = (t % 2) ? n_conns - 1 - i : i;
+        if (!conns[idx])
+          continue;
+        ssize_t n = connection_bucket_read_limit(conns[idx], now);
+        if (n > 0) {
+          connection_buckets_decrement(conns[idx], now, n, 0);
+          nread[idx] += n;
+          progress = 1;
+        }
+      }
+    }
+  }
+}
+
+static void
+test_conn_premium_reserve(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  time_t now = approx_time();
+  connection_t *conns[4] = { NULL, NULL, NULL, NULL };
+  uint64_t nread[4];
+  int i;
+  (void)arg;
+
+  options->BandwidthRate = options->BandwidthBurst = 100000;
+  options->RelayBandwidthRate = options->RelayBandwidthBurst = 0;
+  options->MoneTorPremiumReserve = 0.5;
+
+  for (i = 0; i < 4; i++)
+    conns[i] = test_conn_premium_new_or_conn();
+
+  /* only channels with a recent paid cell are premium */
+  tt_int_op(connection_is_premium(conns[3], now), OP_EQ, 0);
+  TLS_CHAN_TO_BASE(TO_OR_CONN(conns[3])->chan)->timestamp_mt_priority = now;
+  tt_int_op(connection_is_premium(conns[3], now), OP_EQ, 1);
+  tt_int_op(connection_is_premium(conns[3], now + 60), OP_EQ, 0);
+
+  /* all saturated: the paid one gets its reserved half rather than a
+   * quarter, and the total stays at the configured rate */
+  connection_bucket_init();
+  memset(nread, 0, sizeof(nread));
+  test_conn_premium_run(conns, 4, nread, 10, now);
+  memset(nread, 0, sizeof(nread));
+  test_conn_premium_run(conns, 4, nread, 100, now);
+  tt_u64_op(nread[0] + nread[1] + nread[2] + nread[3], OP_GE, 990000);
+  tt_u64_op(nread[0] + nread[1] + nread[2] + nread[3], OP_LE, 1010000);
+  tt_u64_op(nread[3], OP_GE, 490000);
+  tt_u64_op(nread[3], OP_LE, 510000);
+
+  /* with nothing else to carry, paid traffic borrows the whole rate */
+  memset(nread, 0, sizeof(nread));
+  test_conn_premium_run(conns + 3, 1, nread + 3, 100, now);
+  tt_u64_op(nread[3], OP_GE, 990000);
+  tt_u64_op(nread[3], OP_LE, 1010000);
+
+  /* borrowing left no debt: saturated again, paid gets its half at once */
+  memset(nread, 0, sizeof(nread));
+  test_conn_premium_run(conns, 4, nread, 100, now);
+  tt_u64_op(nread[0] + nread[1] + nread[2] + nread[3], OP_GE, 990000);
+  tt_u64_op(nread[0] + nread[1] + nread[2] + nread[3], OP_LE, 1010000);
+  tt_u64_op(nread[3], OP_GE, 490000);
+  tt_u64_op(nread[3], OP_LE, 510000);
+
+  /* and so does unpaid traffic when no paid circuit is active */
+  memset(nread, 0, sizeof(nread));
+  test_conn_premium_run(conns, 3, nread, 100, now);
+  tt_u64_op(nread[0] + nread[1] + nread[2], OP_GE, 990000);
+  tt_u64_op(nread[0] + nread[1] + nread[2], OP_LE, 1010000);
+
+ done:
+  for (i = 0; i < 4; i++)
+    test_conn_premium_free_or_conn(conns[i]);
+  options->MoneTorPremiumReserve = 0.0;
+}
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -791,6 +905,7 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_MICRODESC),
   CONNECTION_TESTCASE_ARG(download_status,  TT_FORK,
                           test_conn_download_status_st, FLAV_NS),
+  { "premium_reserve", test_conn_premium_reserve, TT_FORK, NULL, NULL },
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   END_OF_TESTCASES
 };
@@ -0,0 +1,113 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "mt_common.h"
+#include "mt_acctable.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static void make_addr(int i, byte (*addr)[MT_SZ_ADDR]){
+  memset(*addr, 0xAA, MT_SZ_ADDR);
+  set_uint32(*addr, (uint32_t)i);
+}
+
+static void test_mt_acctable(void *arg)
+{
+  (void) arg;
+
+  mt_acctable_t* table = mt_acctable_new(sizeof(mac_led_data_t));
+  mt_acctable_t* copy = NULL;
+  int n = 3 * MT_ACCTABLE_CHUNK + 17;
+  byte addr[MT_SZ_ADDR];
+
+  make_addr(0, &addr);
+  tt_ptr_op(mt_acctable_get(table, addr), OP_EQ, NULL);
+  tt_int_op(mt_acctable_lookup(table, addr), OP_EQ, MT_ACCTABLE_NONE);
+
+  // new accounts start zeroed and adding twice returns the same account
+  mac_led_data_t* first = mt_acctable_add(table, addr);
+  tt_int_op(first->bal, OP_EQ, 0);
+  first->bal = 5;
+  tt_ptr_op(mt_acctable_add(table, addr), OP_EQ, first);
+  tt_int_op(mt_acctable_size(table), OP_EQ, 1);
+
+  // accounts keep their address while the arena and the index grow
+  for(int i = 1; i < n; i++){
+    make_addr(i, &addr);
+    mac_led_data_t* data = mt_acctable_add(table, addr);
+    data->bal = i * 10;
+  }
+  tt_int_op(mt_acctable_size(table), OP_EQ, n);
+  make_addr(0, &addr);
+  tt_ptr_op(mt_acctable_get(table, addr), OP_EQ, first);
+  tt_int_op(first->bal, OP_EQ, 5);
+
+  for(int i = 1; i < n; i++){
+    make_addr(i, &addr);
+    mt_acctable_handle_t h = mt_acctable_lookup(table, addr);
+    tt_int_op(h, OP_EQ, i);
+    tt_mem_op(mt_acctable_addr_at(table, h), OP_EQ, addr, MT_SZ_ADDR);
+    tt_int_op(((mac_led_data_t*)mt_acctable_at(table, h))->bal, OP_EQ, i * 10);
+  }
+  make_addr(n, &addr);
+  tt_ptr_op(mt_acctable_get(table, addr), OP_EQ, NULL);
+
+  // iteration visits every account in the order it was added
+  int count = 0;
+  MT_ACCTABLE_FOREACH(table, a, mac_led_data_t*, data){
+    tt_int_op(get_uint32(a), OP_EQ, count);
+    tt_int_op(data->bal, OP_EQ, count ? count * 10 : 5);
+    count++;
+  } MT_ACCTABLE_FOREACH_END;
+  tt_int_op(count, OP_EQ, n);
+
+  // sorted iteration visits every account once in increasing address order
+  const byte* prev = NULL;
+  count = 0;
+  MT_ACCTABLE_FOREACH_SORTED(table, a, mac_led_data_t*, data){
+    if(prev)
+      tt_int_op(memcmp(prev, a, MT_SZ_ADDR), OP_LT, 0);
+    int i = (int)get_uint32(a);
+    tt_int_op(data->bal, OP_EQ, i ? i * 10 : 5);
+    prev = a;
+    count++;
+  } MT_ACCTABLE_FOREACH_SORTED_END;
+  tt_int_op(count, OP_EQ, n);
+
+  // a copy is independent of the original
+  copy = mt_acctable_copy(table);
+  tt_int_op(mt_acctable_size(copy), OP_EQ, n);
+  make_addr(7, &addr);
+  ((mac_led_data_t*)mt_acctable_get(copy, addr))->bal = -1;
+  tt_int_op(((mac_led_data_t*)mt_acctable_get(table, addr))->bal, OP_EQ, 70);
+  make_addr(n, &addr);
+  mt_acctable_add(copy, addr);
+  tt_ptr_op(mt_acctable_get(table, addr), OP_EQ, NULL);
+  tt_int_op(mt_acctable_size(table), OP_EQ, n);
+
+  // the used part of the arena chunks holds exactly the accounts
+  size_t arena_len = 0;
+  for(int i = 0; i < table->n_chunks; i++){
+    size_t len;
+    const byte* chunk = mt_acctable_chunk(table, i, &len);
+    tt_ptr_op(chunk, OP_EQ, mt_acctable_at(table, i * MT_ACCTABLE_CHUNK));
+    arena_len += len;
+  }
+  tt_int_op(arena_len, OP_EQ, (size_t)n * table->ent_size);
+
+  // the arena holds little beyond the accounts themselves
+  tt_int_op(mt_acctable_memory(table), OP_LT,
+	    (size_t)n * (sizeof(mac_led_data_t) + MT_SZ_ADDR + 8) * 2);
+
+ done:;
+  mt_acctable_free(table);
+  mt_acctable_free(copy);
+}
+
+struct testcase_t mt_acctable_tests[] = {
+  { "mt_acctable", test_mt_acctable, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -0,0 +1,76 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "mt_common.h"
+#include "mt_chntable.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+/** Order values from largest to smallest, as the client orders channels */
+static int compare_ints_desc(const void** a, const void** b){
+  return *(const int*)*b - *(const int*)*a;
+}
+
+static void test_mt_chntable(void *arg)
+{
+  (void) arg;
+
+  mt_chntable_t* table = mt_chntable_new();
+  mt_desc_t desc1 = {.id = {1, 1}, .party = MT_PARTY_INT};
+  mt_desc_t desc2 = {.id = {2, 2}, .party = MT_PARTY_INT};
+  int vals[] = {5, 9, 2, 7};
+
+  // an empty state has nothing to take
+  tt_ptr_op(mt_chntable_get(table, 0, &desc1), OP_EQ, NULL);
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, NULL);
+  tt_int_op(mt_chntable_count(table, 0), OP_EQ, 0);
+
+  for(int i = 0; i < 3; i++)
+    mt_chntable_add(table, 0, &desc1, &vals[i]);
+  mt_chntable_add(table, 0, &desc2, &vals[3]);
+  tt_int_op(mt_chntable_count(table, 0), OP_EQ, 4);
+  tt_int_op(mt_chntable_count(table, 1), OP_EQ, 0);
+  tt_int_op(mt_chntable_count_desc(table, 0, &desc1), OP_EQ, 3);
+  tt_int_op(mt_chntable_count_desc(table, 0, &desc2), OP_EQ, 1);
+  tt_int_op(mt_chntable_count_desc(table, 1, &desc1), OP_EQ, 0);
+
+  // the same descriptor in another state is a separate entry
+  tt_ptr_op(mt_chntable_get(table, 1, &desc1), OP_EQ, NULL);
+
+  // get peeks at the channel that take returns next
+  tt_ptr_op(mt_chntable_get(table, 0, &desc1), OP_EQ, &vals[0]);
+  tt_int_op(mt_chntable_count(table, 0), OP_EQ, 4);
+
+  // channels come out in the order they were added
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, &vals[0]);
+  mt_chntable_add(table, 0, &desc1, &vals[0]);
+
+  // after sorting the greatest channel is taken first
+  mt_chntable_sort(table, 0, compare_ints_desc);
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, &vals[1]);
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, &vals[0]);
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, &vals[2]);
+  tt_int_op(mt_chntable_count(table, 0), OP_EQ, 1);
+
+  // the emptied descriptor is gone while the other one is untouched
+  tt_int_op(mt_descmap_size(table->buckets[0]), OP_EQ, 1);
+  tt_ptr_op(mt_chntable_take(table, 0, &desc1), OP_EQ, NULL);
+  tt_ptr_op(mt_chntable_get(table, 0, &desc2), OP_EQ, &vals[3]);
+
+  // moving a channel between states
+  mt_chntable_add(table, 1, &desc1, mt_chntable_take(table, 0, &desc2));
+  tt_int_op(mt_chntable_count(table, 0), OP_EQ, 0);
+  tt_int_op(mt_chntable_count(table, 1), OP_EQ, 1);
+  tt_ptr_op(mt_chntable_get(table, 1, &desc1), OP_EQ, &vals[3]);
+
+ done:;
+  mt_chntable_free(table, NULL);
+}
+
+struct testcase_t mt_chntable_tests[] = {
+  { "mt_chntable", test_mt_chntable, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -1,4 +1,7 @@
 #define MT_CCLIENT_PRIVATE
+#define CIRCUITLIST_PRIVATE
+#define CONNECTION_PRIVATE
+#define RELAY_PRIVATE
 
 #include <string.h>
 #include <stdio.h>
@@ -13,6 +16,10 @@
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "buffers.h"
+#include "config.h"
+#include "connection.h"
+#include "nodelist.h"
+#include "relay.h"
 
 static void test_mt_common(void *arg)
 {
@@ -26,7 +33,7 @@ static void test_mt_common(void *arg)
     byte sk[MT_SZ_SK];
 
     mt_crypt_setup(&pp);
-    mt_crypt_keygen(&pp, &pk, &sk);
+    mt_crypt_keygen(&pp, MT_KEY_RSA, &pk, &sk);
 
     //----------------------------- Test PK to Address ---------------------------//
 
@@ -35,7 +42,7 @@ static void test_mt_common(void *arg)
     byte sk_diff[MT_SZ_SK];
 
     memcpy(pk_copy, pk, MT_SZ_PK);
-    mt_crypt_keygen(&pp, &pk_diff, &sk_diff);
+    mt_crypt_keygen(&pp, MT_KEY_RSA, &pk_diff, &sk_diff);
 
     byte addr[MT_SZ_ADDR];
     byte addr_copy[MT_SZ_ADDR];
@@ -142,10 +149,10 @@ static void test_mt_process_msg(void *args) {
  /*      rph->length = bytes_remains; */
  /*    } */
  /*    i++; */
- /*  } while (buf_datalen(circ->ppath->next->buf) != 0 && i < 10); */
+ /*  } while (mt_msgreasm_datalen(circ->ppath->next->buf) != 0 && i < 10); */
 
  /*  tt_int_op(i, OP_EQ, msg_len1/RELAY_PPAYLOAD_SIZE + 1); */
- /*  tt_int_op(buf_datalen(circ->ppath->next->buf), OP_EQ, 0); */
+ /*  tt_int_op(mt_msgreasm_datalen(circ->ppath->next->buf), OP_EQ, 0); */
 
  /*  mt_cclient_init(); */
  /*  node_t node; */
@@ -158,7 +165,7 @@ static void test_mt_process_msg(void *args) {
  /*  circ->inter_ident = tor_malloc_zero(sizeof(intermediary_identity_t)); */
  /*  memcpy(circ->inter_ident->identity, inter->identity->identity, DIGEST_LEN); */
  /*  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_C_INTERMEDIARY; */
- /*  circ->buf = buf_new_with_capacity(RELAY_PPAYLOAD_SIZE); */
+ /*  circ->buf = mt_msgreasm_new(); */
  /*  rph->length = RELAY_PPAYLOAD_SIZE; */
  /*  bytes_remains = msg_len1; */
  /*  i = 0; */
@@ -170,9 +177,9 @@ static void test_mt_process_msg(void *args) {
  /*      rph->length = bytes_remains; */
  /*    } */
  /*    i++; */
- /*  } while (buf_datalen(circ->buf) != 0 && i < 10); */
+ /*  } while (mt_msgreasm_datalen(circ->buf) != 0 && i < 10); */
  /*  tt_int_op(i, OP_EQ, msg_len1/RELAY_PPAYLOAD_SIZE+1); */
- /*  tt_int_op(buf_datalen(circ->buf), OP_EQ, 0); */
+ /*  tt_int_op(mt_msgreasm_datalen(circ->buf), OP_EQ, 0); */
 
  /* done: */
  /*  UNMOCK(mt_cclient_process_received_msg); */
@@ -184,10 +191,479 @@ static void test_mt_process_msg(void *args) {
  /*  tor_free(msg3); */
 }
 
+static void test_mt_hc_pebble(void *arg)
+{
+  (void) arg;
+
+  int hc_size = 1000;
+  byte head[MT_SZ_HASH];
+  byte (*hc)[MT_SZ_HASH] = tor_malloc(hc_size * MT_SZ_HASH);
+  byte tail[MT_SZ_HASH];
+  byte preimage[MT_SZ_HASH];
+  mt_hc_t pebbled;
+
+  mt_crypt_rand(MT_SZ_HASH, head);
+  mt_hc_create(hc_size, &head, (byte (*)[][MT_SZ_HASH])hc);
+
+  tt_int_op(mt_hc_init(&pebbled, hc_size, &head, &tail), OP_EQ, MT_SUCCESS);
+  tt_mem_op(tail, OP_EQ, hc[0], MT_SZ_HASH);
+
+  // walking the chain in order reproduces the full chain with log storage
+  for(int k = 0; k < hc_size; k++){
+    tt_int_op(mt_hc_get(&pebbled, k, &preimage), OP_EQ, MT_SUCCESS);
+    tt_mem_op(preimage, OP_EQ, hc[k], MT_SZ_HASH);
+    tt_int_op(pebbled.num_pebbles, OP_LE, 11);
+  }
+
+  // out of order requests are still answered correctly
+  tt_int_op(mt_hc_get(&pebbled, 0, &preimage), OP_EQ, MT_SUCCESS);
+  tt_mem_op(preimage, OP_EQ, hc[0], MT_SZ_HASH);
+  tt_int_op(mt_hc_get(&pebbled, 500, &preimage), OP_EQ, MT_SUCCESS);
+  tt_mem_op(preimage, OP_EQ, hc[500], MT_SZ_HASH);
+  tt_int_op(mt_hc_get(&pebbled, 10, &preimage), OP_EQ, MT_SUCCESS);
+  tt_mem_op(preimage, OP_EQ, hc[10], MT_SZ_HASH);
+
+  // bounds
+  tt_int_op(mt_hc_get(&pebbled, -1, &preimage), OP_EQ, MT_ERROR);
+  tt_int_op(mt_hc_get(&pebbled, hc_size, &preimage), OP_EQ, MT_ERROR);
+  tt_int_op(mt_hc_init(&pebbled, 0, &head, &tail), OP_EQ, MT_ERROR);
+
+  // single element chain is just the head
+  tt_int_op(mt_hc_init(&pebbled, 1, &head, &tail), OP_EQ, MT_SUCCESS);
+  tt_mem_op(tail, OP_EQ, head, MT_SZ_HASH);
+
+ done:;
+  tor_free(hc);
+}
+
+static void test_mt_receipt_batch(void *arg)
+{
+  (void) arg;
+
+  byte pp[MT_SZ_PP];
+  byte pk[MT_SZ_PK];
+  byte sk[MT_SZ_SK];
+  mt_crypt_setup(&pp);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk, &sk);
+
+  // an uneven batch so that some nodes have no sibling
+  int n = 7;
+  any_led_receipt_t recs[7];
+  any_led_receipt_t* ptrs[7];
+  memset(recs, 0, sizeof(recs));
+  for(int i = 0; i < n; i++){
+    recs[i].type = MT_NTYPE_CHN_END_SETUP;
+    recs[i].val = 100 + i;
+    mt_crypt_rand(MT_SZ_ADDR, recs[i].from);
+    mt_crypt_rand(MT_SZ_ADDR, recs[i].to);
+    ptrs[i] = &recs[i];
+  }
+
+  tt_int_op(mt_receipt_sign_batch(0, ptrs, &sk), OP_EQ, MT_ERROR);
+  tt_int_op(mt_receipt_sign_batch(n, ptrs, &sk), OP_EQ, MT_SUCCESS);
+
+  // every receipt verifies but the root signature is only checked once
+  uint64_t checks = mt_receipt_root_checks();
+  for(int i = 0; i < n; i++){
+    tt_int_op(recs[i].batch_size, OP_EQ, n);
+    tt_int_op(mt_receipt_verify(&recs[i], &pk), OP_EQ, MT_SUCCESS);
+  }
+  tt_u64_op(mt_receipt_root_checks(), OP_EQ, checks + 1);
+
+  // tampering with a leaf, its path or its position breaks the receipt
+  any_led_receipt_t bad = recs[2];
+  bad.val++;
+  tt_int_op(mt_receipt_verify(&bad, &pk), OP_EQ, MT_ERROR);
+  bad = recs[2];
+  bad.path[1][0] ^= 1;
+  tt_int_op(mt_receipt_verify(&bad, &pk), OP_EQ, MT_ERROR);
+  bad = recs[2];
+  bad.index = 3;
+  tt_int_op(mt_receipt_verify(&bad, &pk), OP_EQ, MT_ERROR);
+  bad = recs[2];
+  bad.index = n;
+  tt_int_op(mt_receipt_verify(&bad, &pk), OP_EQ, MT_ERROR);
+
+  // a batch of one and individually signed receipts still work
+  tt_int_op(mt_receipt_sign_batch(1, ptrs, &sk), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_receipt_verify(&recs[0], &pk), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_receipt_sign(&recs[1], &sk), OP_EQ, MT_SUCCESS);
+  tt_int_op(recs[1].batch_size, OP_EQ, 0);
+  tt_int_op(mt_receipt_verify(&recs[1], &pk), OP_EQ, MT_SUCCESS);
+
+ done:;
+}
+
+static void test_mt_msgreasm(void *arg)
+{
+  (void) arg;
+
+  mt_ntype_t type = MT_NTYPE_CHN_END_SETUP;
+  size_t size = mt_token_get_size_of(type);
+  byte* expected = tor_malloc(size);
+  mt_crypt_rand(size, expected);
+  // an RSA signed message, which is the largest
+  expected[0] = 0x01;
+  size_t msg_size = 0;
+  mt_msgreasm_t* mb = mt_msgreasm_new();
+  byte* msg = NULL;
+  byte* first = NULL;
+
+  tt_int_op(size, OP_GT, RELAY_PPAYLOAD_SIZE);
+
+  // fragments are written in place and the last one completes the message
+  for(int round = 0; round < 2; round++){
+    size_t off = 0;
+    while(off < size){
+      size_t len = MIN(size - off, (size_t)RELAY_PPAYLOAD_SIZE);
+      msg = mt_msgreasm_add(mb, type, expected + off, len, &msg_size);
+      off += len;
+      if(off < size){
+        tt_ptr_op(msg, OP_EQ, NULL);
+        tt_int_op(mt_msgreasm_datalen(mb), OP_EQ, off);
+      }
+    }
+    tt_ptr_op(msg, OP_NE, NULL);
+    tt_int_op(msg_size, OP_EQ, size);
+    tt_mem_op(msg, OP_EQ, expected, size);
+    tt_int_op(mt_msgreasm_datalen(mb), OP_EQ, 0);
+
+    // the second message reuses the recycled buffer
+    if(round == 0)
+      first = msg;
+    else
+      tt_ptr_op(msg, OP_EQ, first);
+    mt_msgpool_put(msg, size);
+    msg = NULL;
+    tt_int_op(mt_msgpool_idle(size), OP_EQ, 1);
+  }
+
+  // a fragment of another type drops the partial message
+  tt_ptr_op(mt_msgreasm_add(mb, type, expected, RELAY_PPAYLOAD_SIZE, &msg_size), OP_EQ, NULL);
+  tt_int_op(mt_msgpool_idle(size), OP_EQ, 0);
+  tt_ptr_op(mt_msgreasm_add(mb, MT_NTYPE_CHN_INT_SETUP, expected, 10, &msg_size), OP_EQ, NULL);
+  tt_int_op(mt_msgreasm_datalen(mb), OP_EQ, 10);
+  tt_int_op(mt_msgpool_idle(size), OP_EQ, 1);
+
+  // an oversized fragment is rejected
+  mt_msgreasm_free(mb);
+  mb = mt_msgreasm_new();
+  tt_ptr_op(mt_msgreasm_add(mb, type, expected, size - 1, &msg_size), OP_EQ, NULL);
+  tt_ptr_op(mt_msgreasm_add(mb, type, expected, 2, &msg_size), OP_EQ, NULL);
+  tt_int_op(mt_msgreasm_datalen(mb), OP_EQ, 0);
+
+  // a message signed with Ed25519 is smaller and fits in a single cell
+  expected[0] = 0x02;
+  size_t ed_size = mt_token_get_size_of_msg(type, expected, 1);
+  tt_int_op(ed_size, OP_LE, RELAY_PPAYLOAD_SIZE);
+  msg = mt_msgreasm_add(mb, type, expected, ed_size, &msg_size);
+  tt_ptr_op(msg, OP_NE, NULL);
+  tt_int_op(msg_size, OP_EQ, ed_size);
+  mt_msgpool_put(msg, msg_size);
+  msg = NULL;
+
+  // an unknown scheme is dropped with the first fragment
+  expected[0] = 0x7f;
+  tt_ptr_op(mt_msgreasm_add(mb, type, expected, RELAY_PPAYLOAD_SIZE, &msg_size), OP_EQ, NULL);
+  tt_int_op(mt_msgreasm_datalen(mb), OP_EQ, 0);
+
+ done:;
+  mt_msgpool_put(msg, size);
+  mt_msgreasm_free(mb);
+  mt_msgpool_free_all();
+  tor_free(expected);
+}
+
+static int piggyback_received;
+static relay_pheader_t piggyback_rph;
+static byte piggyback_msg[RELAY_PAYLOAD_SIZE];
+
+static void
+mt_process_received_relaycell_mock(circuit_t *circ, relay_header_t *rh,
+    relay_pheader_t *rph, crypt_path_t *layer_hint, uint8_t *payload) {
+  (void) circ;
+  (void) rh;
+  (void) layer_hint;
+  piggyback_received++;
+  piggyback_rph = *rph;
+  memcpy(piggyback_msg, payload, rph->length);
+}
+
+static routerstatus_t piggyback_exit_rs;
+static node_t piggyback_exit_node;
+
+static const node_t *
+node_get_by_id_mock(const char *identity_digest)
+{
+  (void) identity_digest;
+  return &piggyback_exit_node;
+}
+
+/** Return a one-hop payment circuit to an exit that advertises Pay=1 */
+static origin_circuit_t *
+piggyback_circ_new(void)
+{
+  memset(&piggyback_exit_rs, 0, sizeof(piggyback_exit_rs));
+  memset(&piggyback_exit_node, 0, sizeof(piggyback_exit_node));
+  piggyback_exit_rs.supports_pay_piggyback = 1;
+  piggyback_exit_node.rs = &piggyback_exit_rs;
+
+  origin_circuit_t* ocirc = origin_circuit_new();
+  TO_CIRCUIT(ocirc)->purpose = CIRCUIT_PURPOSE_C_GENERAL_PAYMENT;
+  ocirc->cpath = tor_malloc_zero(sizeof(crypt_path_t));
+  ocirc->cpath->next = ocirc->cpath->prev = ocirc->cpath;
+  ocirc->cpath->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+  return ocirc;
+}
+
+static void test_mt_piggyback(void *arg)
+{
+  (void) arg;
+
+  or_options_t* options = get_options_mutable();
+  options->EnablePayment = 1;
+  options->MoneTorPiggyback = 1;
+  MOCK(mt_process_received_relaycell, mt_process_received_relaycell_mock);
+  MOCK(node_get_by_id, node_get_by_id_mock);
+
+  // a client circuit with a payment held for its exit
+  origin_circuit_t* ocirc = piggyback_circ_new();
+  pay_path_t* ppath = tor_malloc_zero(sizeof(pay_path_t));
+  ocirc->ppath = ppath;
+  or_circuit_t* orcirc = or_circuit_new(0, NULL);
+
+  int size = mt_token_get_size_of(MT_NTYPE_NAN_CLI_PAY1);
+  byte* expected = tor_malloc(size);
+  mt_crypt_rand(size, expected);
+  ppath->piggyback = tor_memdup(expected, size);
+  ppath->piggyback_size = size;
+
+  // the payment only rides data cells packaged to the exit
+  tt_int_op(mt_cclient_piggyback_size(TO_CIRCUIT(ocirc), ocirc->cpath), OP_EQ, 0);
+  mt_cclient_piggyback_begin(TO_CIRCUIT(ocirc));
+  tt_int_op(mt_cclient_piggyback_size(TO_CIRCUIT(ocirc), NULL), OP_EQ, 0);
+  size_t pext_len = mt_cclient_piggyback_size(TO_CIRCUIT(ocirc), ocirc->cpath);
+  tt_int_op(pext_len, OP_EQ, RELAY_PHEADER_SIZE + size);
+
+  // it follows the data and is handed over as a RELAY_COMMAND_MT payload
+  uint8_t body[RELAY_PAYLOAD_SIZE];
+  relay_header_t rh;
+  memset(body, 0, sizeof(body));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.length = RELAY_PAYLOAD_SIZE - pext_len;
+  memset(body, 'x', rh.length);
+  mt_cclient_piggyback_take(TO_CIRCUIT(ocirc), body+rh.length);
+  tt_ptr_op(ppath->piggyback, OP_EQ, NULL);
+  tt_int_op(mt_cclient_piggyback_size(TO_CIRCUIT(ocirc), ocirc->cpath), OP_EQ, 0);
+  mt_cclient_piggyback_end(TO_CIRCUIT(ocirc));
+
+  mt_process_piggyback(TO_CIRCUIT(orcirc), &rh, body);
+  tt_int_op(piggyback_received, OP_EQ, 1);
+  tt_int_op(piggyback_rph.pcommand, OP_EQ, MT_NTYPE_NAN_CLI_PAY1);
+  tt_int_op(piggyback_rph.length, OP_EQ, size);
+  tt_mem_op(piggyback_msg, OP_EQ, expected, size);
+
+  // clients ignore them
+  mt_process_piggyback(TO_CIRCUIT(ocirc), &rh, body);
+  tt_int_op(piggyback_received, OP_EQ, 1);
+
+  // zeroed room or a full cell carries nothing
+  rh.length = 100;
+  memset(body, 0, sizeof(body));
+  mt_process_piggyback(TO_CIRCUIT(orcirc), &rh, body);
+  rh.length = RELAY_PAYLOAD_SIZE - 2;
+  mt_process_piggyback(TO_CIRCUIT(orcirc), &rh, body);
+  tt_int_op(piggyback_received, OP_EQ, 1);
+
+  // an extension that does not fit or has the wrong length is dropped
+  relay_pheader_t rph = {.pcommand = MT_NTYPE_NAN_CLI_PAY1, .length = size};
+  rh.length = RELAY_PAYLOAD_SIZE - size;
+  direct_pheader_pack(body+rh.length, &rph);
+  mt_process_piggyback(TO_CIRCUIT(orcirc), &rh, body);
+  rh.length = 100;
+  rph.length = size - 1;
+  direct_pheader_pack(body+rh.length, &rph);
+  mt_process_piggyback(TO_CIRCUIT(orcirc), &rh, body);
+  tt_int_op(piggyback_received, OP_EQ, 1);
+
+  // nothing is held unless the option is set
+  options->MoneTorPiggyback = 0;
+  ppath->piggyback = tor_memdup(expected, size);
+  mt_cclient_piggyback_begin(TO_CIRCUIT(ocirc));
+  tt_int_op(mt_cclient_piggyback_size(TO_CIRCUIT(ocirc), ocirc->cpath), OP_EQ, 0);
+
+ done:;
+  UNMOCK(mt_process_received_relaycell);
+  UNMOCK(node_get_by_id);
+  ocirc->ppath = NULL;
+  tor_free(ppath->piggyback);
+  tor_free(ppath);
+  circuit_free(TO_CIRCUIT(ocirc));
+  circuit_free(TO_CIRCUIT(orcirc));
+  tor_free(expected);
+  options->EnablePayment = 0;
+  options->MoneTorPiggyback = 0;
+}
+
+static mt_desc_t piggyback_exit_desc;
+static byte* piggyback_pay;
+static int piggyback_pay_size;
+static int piggyback_pay_on_cell;
+static int piggyback_n_cells;
+static size_t piggyback_data_len[8];
+static size_t piggyback_pext_len[8];
+static uint8_t piggyback_ext[RELAY_PAYLOAD_SIZE];
+static int piggyback_n_pcells;
+static uint8_t piggyback_pcommand;
+static uint8_t piggyback_pcell[RELAY_PAYLOAD_SIZE];
+
+static int
+relay_send_command_from_edge_ext_mock(streamid_t stream_id, circuit_t *circ,
+    uint8_t relay_command, const char *payload, size_t payload_len,
+    size_t pext_len, crypt_path_t *cpath_layer, const char *filename,
+    int lineno)
+{
+  (void) stream_id;
+  (void) circ;
+  (void) relay_command;
+  (void) cpath_layer;
+  (void) filename;
+  (void) lineno;
+  int i = piggyback_n_cells++;
+  if (i < 8) {
+    piggyback_data_len[i] = payload_len - pext_len;
+    piggyback_pext_len[i] = pext_len;
+  }
+  if (pext_len)
+    memcpy(piggyback_ext, payload + payload_len - pext_len, pext_len);
+  // the payment window runs out right after this cell
+  if (i == piggyback_pay_on_cell)
+    mt_cclient_send_message(&piggyback_exit_desc, RELAY_COMMAND_MT,
+        MT_NTYPE_NAN_CLI_PAY1, piggyback_pay, piggyback_pay_size);
+  return 0;
+}
+
+static int
+relay_send_pcommand_from_edge_mock(circuit_t* circ, uint8_t relay_command,
+    uint8_t relay_pcommand, crypt_path_t *layer_start, const char *payload,
+    size_t payload_len, const char *filename, int lineno)
+{
+  (void) circ;
+  (void) relay_command;
+  (void) layer_start;
+  (void) filename;
+  (void) lineno;
+  piggyback_n_pcells++;
+  piggyback_pcommand = relay_pcommand;
+  memcpy(piggyback_pcell, payload, payload_len);
+  return 0;
+}
+
+static void test_mt_piggyback_package(void *arg)
+{
+  (void) arg;
+
+  or_options_t* options = get_options_mutable();
+  options->EnablePayment = 1;
+  options->MoneTorPiggyback = 1;
+  MOCK(node_get_by_id, node_get_by_id_mock);
+  MOCK(relay_send_command_from_edge_ext,
+      relay_send_command_from_edge_ext_mock);
+  MOCK(relay_send_pcommand_from_edge_, relay_send_pcommand_from_edge_mock);
+
+  // a stream on an open payment circuit whose exit we pay
+  origin_circuit_t* ocirc = piggyback_circ_new();
+  TO_CIRCUIT(ocirc)->state = CIRCUIT_STATE_OPEN;
+  ocirc->cpath->package_window = 1000;
+  pay_path_t* ppath = tor_malloc_zero(sizeof(pay_path_t));
+  ppath->desc.id[0] = 1;
+  ppath->desc.party = MT_PARTY_REL;
+  ocirc->ppath = ppath;
+  piggyback_exit_desc = ppath->desc;
+  desc2circ = mt_descmap_new();
+  mt_descmap_set(desc2circ, &ppath->desc, TO_CIRCUIT(ocirc));
+
+  entry_connection_t* entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  edge_connection_t* conn = ENTRY_TO_EDGE_CONN(entry_conn);
+  TO_CONN(conn)->state = AP_CONN_STATE_OPEN;
+  conn->on_circuit = TO_CIRCUIT(ocirc);
+  conn->cpath_layer = ocirc->cpath;
+  conn->package_window = 500;
+
+  piggyback_pay_size = mt_token_get_size_of(MT_NTYPE_NAN_CLI_PAY1);
+  piggyback_pay = tor_malloc(piggyback_pay_size);
+  mt_crypt_rand(piggyback_pay_size, piggyback_pay);
+  size_t pext_len = RELAY_PHEADER_SIZE + piggyback_pay_size;
+  char data[RELAY_PAYLOAD_SIZE*2];
+  memset(data, 'x', sizeof(data));
+
+  // a payment after the first cell is held and rides the second
+  buf_add(TO_CONN(conn)->inbuf, data, RELAY_PAYLOAD_SIZE*2);
+  piggyback_pay_on_cell = 0;
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(piggyback_n_cells, OP_EQ, 3);
+  tt_int_op(piggyback_n_pcells, OP_EQ, 0);
+  tt_int_op(piggyback_data_len[0], OP_EQ, RELAY_PAYLOAD_SIZE);
+  tt_int_op(piggyback_pext_len[0], OP_EQ, 0);
+  tt_int_op(piggyback_pext_len[1], OP_EQ, pext_len);
+  tt_int_op(piggyback_data_len[1], OP_EQ, RELAY_PAYLOAD_SIZE - pext_len);
+  tt_int_op(piggyback_pext_len[2], OP_EQ, 0);
+  tt_int_op(piggyback_data_len[2], OP_EQ, pext_len);
+  relay_pheader_t rph;
+  relay_pheader_unpack(&rph, piggyback_ext);
+  tt_int_op(rph.pcommand, OP_EQ, MT_NTYPE_NAN_CLI_PAY1);
+  tt_int_op(rph.length, OP_EQ, piggyback_pay_size);
+  tt_mem_op(piggyback_ext+RELAY_PHEADER_SIZE, OP_EQ, piggyback_pay,
+      piggyback_pay_size);
+  tt_ptr_op(ppath->piggyback, OP_EQ, NULL);
+
+  // a payment after the last cell goes out on its own when packaging ends
+  buf_add(TO_CONN(conn)->inbuf, data, RELAY_PAYLOAD_SIZE);
+  piggyback_pay_on_cell = 3;
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(piggyback_n_cells, OP_EQ, 4);
+  tt_int_op(piggyback_pext_len[3], OP_EQ, 0);
+  tt_int_op(piggyback_n_pcells, OP_EQ, 1);
+  tt_int_op(piggyback_pcommand, OP_EQ, MT_NTYPE_NAN_CLI_PAY1);
+  tt_mem_op(piggyback_pcell, OP_EQ, piggyback_pay, piggyback_pay_size);
+  tt_ptr_op(ppath->piggyback, OP_EQ, NULL);
+
+  // nothing is held for an exit that does not advertise Pay=1
+  piggyback_exit_rs.supports_pay_piggyback = 0;
+  buf_add(TO_CONN(conn)->inbuf, data, RELAY_PAYLOAD_SIZE*2);
+  piggyback_pay_on_cell = 4;
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(piggyback_n_cells, OP_EQ, 6);
+  tt_int_op(piggyback_n_pcells, OP_EQ, 2);
+  tt_int_op(piggyback_pext_len[5], OP_EQ, 0);
+  tt_int_op(piggyback_data_len[5], OP_EQ, RELAY_PAYLOAD_SIZE);
+
+ done:;
+  UNMOCK(node_get_by_id);
+  UNMOCK(relay_send_command_from_edge_ext);
+  UNMOCK(relay_send_pcommand_from_edge_);
+  connection_free_(TO_CONN(conn));
+  mt_descmap_free(desc2circ, NULL);
+  desc2circ = NULL;
+  ocirc->ppath = NULL;
+  tor_free(ppath->piggyback);
+  tor_free(ppath);
+  circuit_free(TO_CIRCUIT(ocirc));
+  tor_free(piggyback_pay);
+  options->EnablePayment = 0;
+  options->MoneTorPiggyback = 0;
+}
+
 struct testcase_t mt_common_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
 { "mt_common", test_mt_common, 0, NULL, NULL },
 { "process_msg", test_mt_process_msg, 0, NULL, NULL },
+{ "hc_pebble", test_mt_hc_pebble, 0, NULL, NULL },
+{ "receipt_batch", test_mt_receipt_batch, 0, NULL, NULL },
+{ "msgreasm", test_mt_msgreasm, TT_FORK, NULL, NULL },
+{ "piggyback", test_mt_piggyback, TT_FORK, NULL, NULL },
+{ "piggyback_package", test_mt_piggyback_package, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
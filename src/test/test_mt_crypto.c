@@ -1,9 +1,12 @@
+#define MT_CRYPTO_PRIVATE
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "test.h"
 #include "or.h"
+#include "config.h"
 #include "mt_crypto.h"
 
 #pragma GCC diagnostic ignored "-Wstack-protector"
@@ -35,8 +38,8 @@ static void test_mt_crypto(void *arg)
 
   // if these are buggy then it should be obvious later
   mt_crypt_setup(&pp);
-  mt_crypt_keygen(&pp, &pk1, &sk1);
-  mt_crypt_keygen(&pp, &pk2, &sk2);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk1, &sk1);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk2, &sk2);
 
   //----------------------------- test random ------------------------------//
 
@@ -181,9 +184,146 @@ static void test_mt_crypto(void *arg)
   UNMOCK(mt_micro_sleep);
 }
 
+static void test_mt_crypto_key_cache(void *arg)
+{
+  (void) arg;
+
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+
+  const char* str = "This is a test message for the parsed key cache";
+  int msg_size = strlen(str);
+  byte* msg = (byte*)str;
+
+  byte pp[MT_SZ_PP];
+  byte pk[3][MT_SZ_PK];
+  byte sk[3][MT_SZ_SK];
+  byte sig[3][MT_SZ_SIG];
+
+  int old_max = mt_key_cache_max;
+  mt_key_cache_max = 2;
+
+  mt_crypt_setup(&pp);
+  mt_crypt_free_all();
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 0);
+
+  for(int i = 0; i < 3; i++)
+    mt_crypt_keygen(&pp, MT_KEY_RSA, &pk[i], &sk[i]);
+
+  // signing populates the cache up to its bound
+  tt_int_op(mt_sig_sign(msg, msg_size, &sk[0], &sig[0]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 1);
+  tt_int_op(mt_sig_sign(msg, msg_size, &sk[0], &sig[0]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 1);
+  tt_int_op(mt_sig_sign(msg, msg_size, &sk[1], &sig[1]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_sig_sign(msg, msg_size, &sk[2], &sig[2]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 2);
+
+  // evicted and re-parsed keys still produce correct results
+  for(int i = 0; i < 3; i++){
+    tt_int_op(mt_sig_verify(msg, msg_size, &pk[i], &sig[i]), OP_EQ, MT_SUCCESS);
+    tt_int_op(mt_sig_verify(msg, msg_size, &pk[i], &sig[(i + 1) % 3]), OP_EQ, MT_ERROR);
+  }
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 2);
+
+  // malformed keys are rejected and never cached
+  byte bad_pk[MT_SZ_PK];
+  memset(bad_pk, 'a', MT_SZ_PK - 1);
+  bad_pk[MT_SZ_PK - 1] = '\0';
+  tt_int_op(mt_sig_verify(msg, msg_size, &bad_pk, &sig[0]), OP_EQ, MT_ERROR);
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 2);
+
+  mt_crypt_free_all();
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 0);
+
+  // the cache comes back after a shutdown
+  tt_int_op(mt_sig_sign(msg, msg_size, &sk[0], &sig[0]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_crypt_key_cache_size(), OP_EQ, 1);
+
+ done:;
+  mt_key_cache_max = old_max;
+  mt_crypt_free_all();
+  UNMOCK(mt_micro_sleep);
+}
+
+static void test_mt_crypto_ed25519(void *arg)
+{
+  (void) arg;
+
+  const char* str = "This is a message signed by both kinds of keys";
+  byte* msg = (byte*)str;
+  int msg_size = strlen(str);
+
+  byte pp[MT_SZ_PP];
+  byte pk[4][MT_SZ_PK];
+  byte sk[4][MT_SZ_SK];
+  byte sig[4][MT_SZ_SIG];
+
+  mt_crypt_setup(&pp);
+
+  // the first two keys are RSA and the others Ed25519
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk[0], &sk[0]);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk[1], &sk[1]);
+  tt_int_op(mt_crypt_keygen(&pp, MT_KEY_ED25519, &pk[2], &sk[2]), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_crypt_keygen(&pp, MT_KEY_ED25519, &pk[3], &sk[3]), OP_EQ, MT_SUCCESS);
+
+  tt_int_op(mt_crypt_is_ed25519(pk[1]), OP_EQ, 0);
+  tt_int_op(mt_crypt_is_ed25519(pk[2]), OP_EQ, 1);
+  tt_int_op(mt_crypt_is_ed25519(sk[3]), OP_EQ, 1);
+  tt_mem_op(pk[2], OP_NE, pk[3], MT_SZ_PK);
+
+  for(int i = 0; i < 4; i++)
+    tt_int_op(mt_sig_sign(msg, msg_size, &sk[i], &sig[i]), OP_EQ, MT_SUCCESS);
+
+  // signatures only verify under their own key
+  for(int i = 0; i < 4; i++){
+    for(int j = 0; j < 4; j++){
+      tt_int_op(mt_sig_verify(msg, msg_size, &pk[i], &sig[j]), OP_EQ,
+		i == j ? MT_SUCCESS : MT_ERROR);
+    }
+  }
+  tt_int_op(mt_sig_verify(msg, msg_size - 1, &pk[2], &sig[2]), OP_EQ, MT_ERROR);
+
+  // a mixed batch reports each bad signature on its own
+  mt_sig_checkable_t checks[4];
+  int ok[4];
+  for(int i = 0; i < 4; i++){
+    checks[i].msg = msg;
+    checks[i].msg_size = msg_size;
+    checks[i].pk = &pk[i];
+    checks[i].sig = &sig[i];
+  }
+  tt_int_op(mt_sig_verify_batch(checks, 4, ok), OP_EQ, MT_SUCCESS);
+  for(int i = 0; i < 4; i++)
+    tt_int_op(ok[i], OP_EQ, 1);
+
+  checks[1].sig = &sig[0];
+  checks[3].sig = &sig[2];
+  tt_int_op(mt_sig_verify_batch(checks, 4, ok), OP_EQ, MT_ERROR);
+  tt_int_op(ok[0], OP_EQ, 1);
+  tt_int_op(ok[1], OP_EQ, 0);
+  tt_int_op(ok[2], OP_EQ, 1);
+  tt_int_op(ok[3], OP_EQ, 0);
+
+  // bytes after the 64-byte Ed25519 signature must be zero
+  sig[2][MT_SZ_SIG - 1] = 1;
+  tt_int_op(mt_sig_verify(msg, msg_size, &pk[2], &sig[2]), OP_EQ, MT_ERROR);
+  checks[1].sig = &sig[1];
+  checks[3].sig = &sig[3];
+  tt_int_op(mt_sig_verify_batch(checks, 4, ok), OP_EQ, MT_ERROR);
+  tt_int_op(ok[0], OP_EQ, 1);
+  tt_int_op(ok[1], OP_EQ, 1);
+  tt_int_op(ok[2], OP_EQ, 0);
+  tt_int_op(ok[3], OP_EQ, 1);
+
+ done:;
+  mt_crypt_free_all();
+}
+
 struct testcase_t mt_crypto_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
   { "mt_crypto", test_mt_crypto, 0, NULL, NULL },
+  { "key_cache", test_mt_crypto_key_cache, 0, NULL, NULL },
+  { "ed25519", test_mt_crypto_ed25519, 0, NULL, NULL },
   END_OF_TESTCASES
 };
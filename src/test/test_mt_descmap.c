@@ -0,0 +1,71 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "mt_common.h"
+#include "mt_descmap.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static void test_mt_descmap(void *arg)
+{
+  (void) arg;
+
+  mt_descmap_t* map = mt_descmap_new();
+  int vals[64];
+
+  // descriptors that only differ in one field are different keys
+  mt_desc_t a = {.id = {1, 2}, .party = MT_PARTY_REL};
+  mt_desc_t b = {.id = {1, 2}, .party = MT_PARTY_INT};
+  mt_desc_t c = {.id = {2, 1}, .party = MT_PARTY_REL};
+
+  tt_ptr_op(mt_descmap_get(map, &a), OP_EQ, NULL);
+  tt_ptr_op(mt_descmap_set(map, &a, &vals[0]), OP_EQ, NULL);
+  tt_ptr_op(mt_descmap_set(map, &b, &vals[1]), OP_EQ, NULL);
+  tt_ptr_op(mt_descmap_set(map, &c, &vals[2]), OP_EQ, NULL);
+  tt_int_op(mt_descmap_size(map), OP_EQ, 3);
+  tt_ptr_op(mt_descmap_get(map, &a), OP_EQ, &vals[0]);
+  tt_ptr_op(mt_descmap_get(map, &b), OP_EQ, &vals[1]);
+  tt_ptr_op(mt_descmap_get(map, &c), OP_EQ, &vals[2]);
+
+  // the key is copied, so a lookup through another pointer matches
+  mt_desc_t a_copy = a;
+  tt_ptr_op(mt_descmap_set(map, &a_copy, &vals[3]), OP_EQ, &vals[0]);
+  tt_int_op(mt_descmap_size(map), OP_EQ, 3);
+
+  tt_ptr_op(mt_descmap_remove(map, &b), OP_EQ, &vals[1]);
+  tt_ptr_op(mt_descmap_remove(map, &b), OP_EQ, NULL);
+  tt_ptr_op(mt_descmap_get(map, &b), OP_EQ, NULL);
+
+  // grow past the initial table and drop every other entry while iterating
+  for(int i = 0; i < 64; i++){
+    mt_desc_t desc = {.id = {i, 0}, .party = MT_PARTY_CLI};
+    vals[i] = i;
+    mt_descmap_set(map, &desc, &vals[i]);
+  }
+  tt_int_op(mt_descmap_size(map), OP_EQ, 66);
+
+  MT_DESCMAP_FOREACH_MODIFY(map, desc, int*, val){
+    if(desc->party == MT_PARTY_CLI){
+      tt_int_op((int)desc->id[0], OP_EQ, *val);
+      if(*val % 2)
+	MAP_DEL_CURRENT(desc);
+    }
+  } MT_DESCMAP_FOREACH_END;
+  tt_int_op(mt_descmap_size(map), OP_EQ, 34);
+
+  for(int i = 0; i < 64; i++){
+    mt_desc_t desc = {.id = {i, 0}, .party = MT_PARTY_CLI};
+    tt_ptr_op(mt_descmap_get(map, &desc), OP_EQ, (i % 2) ? NULL : &vals[i]);
+  }
+
+ done:;
+  mt_descmap_free(map, NULL);
+}
+
+struct testcase_t mt_descmap_tests[] = {
+  { "mt_descmap", test_mt_descmap, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
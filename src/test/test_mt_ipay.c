@@ -0,0 +1,330 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "config.h"
+#include "compat_time.h"
+#include "workqueue.h"
+#include "cpuworker.h"
+#include "mt_crypto.h"
+#include "mt_tokens.h"
+#include "mt_common.h"
+#include "mt_ipay.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static int setups_sent;
+
+static int mock_send_message(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
+  (void)desc;
+  (void)msg;
+  (void)size;
+  if(type == MT_NTYPE_CHN_INT_SETUP)
+    setups_sent++;
+  return MT_SUCCESS;
+}
+
+static workqueue_entry_t* mock_cpuworker_queue_work_fail(workqueue_priority_t priority,
+							 workqueue_reply_t (*fn)(void*, void*),
+							 int (*reply_fn)(void*), void* arg){
+  (void)priority;
+  (void)fn;
+  (void)reply_fn;
+  (void)arg;
+  return NULL;
+}
+
+typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
+					   workqueue_reply_t (*)(void*, void*),
+					   void (*)(void*), void*);
+
+typedef struct {
+  mt_desc_t desc;
+  mt_ntype_t type;
+  byte* msg;
+  int size;
+} sent_msg_t;
+
+typedef struct {
+  workqueue_reply_t (*fn)(void*, void*);
+  int (*reply_fn)(void*);
+  void* arg;
+} queued_job_t;
+
+static smartlist_t* sent;
+static smartlist_t* jobs;
+
+/** Record every message the intermediary sends */
+static int mock_send_record(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
+  sent_msg_t* rec = tor_malloc(sizeof(sent_msg_t));
+  rec->desc = *desc;
+  rec->type = type;
+  rec->msg = tor_memdup(msg, size);
+  rec->size = size;
+  smartlist_add(sent, rec);
+  return MT_SUCCESS;
+}
+
+static void clear_sent(void){
+  SMARTLIST_FOREACH(sent, sent_msg_t*, rec, tor_free(rec->msg); tor_free(rec));
+  smartlist_clear(sent);
+}
+
+/** Hold jobs until run_job() */
+static workqueue_entry_t* mock_cpuworker_queue_work_hold(workqueue_priority_t priority,
+							 workqueue_reply_t (*fn)(void*, void*),
+							 int (*reply_fn)(void*), void* arg){
+  (void)priority;
+  queued_job_t* job = tor_malloc(sizeof(queued_job_t));
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(jobs, job);
+  return (workqueue_entry_t*)job;
+}
+
+/** Run the held job at <b>idx</b> as the cpuworker and the main thread would */
+static int run_job(int idx){
+  queued_job_t* job = smartlist_get(jobs, idx);
+  smartlist_del_keeporder(jobs, idx);
+  job->fn(NULL, job->arg);
+  int result = job->reply_fn(job->arg);
+  tor_free(job);
+  return result;
+}
+
+/**
+ * Pack a request from <b>desc</b> to open a new channel with the intermediary
+ */
+static int pack_estab1(mt_desc_t* desc, byte** msg_out){
+  chn_end_estab1_t token;
+  byte pid[DIGEST_LEN];
+  memset(&token, 0, sizeof(token));
+  memcpy(token.addr, desc->id, sizeof(desc->id));
+  mt_crypt_rand(DIGEST_LEN, pid);
+  return pack_chn_end_estab1(&token, &pid, msg_out);
+}
+
+/**
+ * Check that a message whose job cannot be queued on the cpuworker is handled
+ * inline instead of being dropped
+ */
+static void test_mt_ipay_queue_failure(void *arg){
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorPublicMint = 1;
+  options->MoneTorIntermediaryShards = 4;
+
+  MOCK(mt_send_message, mock_send_message);
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work_fail);
+
+  mt_desc_t edesc = {.id = {11, 12}, .party = MT_PARTY_REL};
+  byte* msg = NULL;
+
+  tt_int_op(mt_ipay_init(), OP_EQ, MT_SUCCESS);
+  setups_sent = 0;
+
+  int msg_size = pack_estab1(&edesc, &msg);
+  tt_int_op(mt_ipay_recv(&edesc, MT_NTYPE_CHN_END_ESTAB1, msg, msg_size), OP_EQ, MT_SUCCESS);
+  tt_int_op(setups_sent, OP_EQ, 1);
+
+ done:;
+  tor_free(msg);
+  UNMOCK(mt_send_message);
+  UNMOCK(mt_micro_sleep);
+  UNMOCK(cpuworker_queue_work);
+}
+
+/**
+ * Check that replies to messages from one descriptor leave in the order the
+ * messages arrived even when they are handled by different shards and the
+ * later one finishes first
+ */
+static void test_mt_ipay_shard_order(void *arg){
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorPublicMint = 1;
+  options->MoneTorIntermediaryShards = 4;
+  options->MoneTorIntermediaryShardsInFlight = 0;
+  options->MoneTorMaxVerifyInFlight = 0;
+
+  sent = smartlist_new();
+  jobs = smartlist_new();
+  MOCK(mt_send_message, mock_send_record);
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work_hold);
+
+  mt_desc_t led_desc = {.id = {0, 0}, .party = MT_PARTY_LED};
+  mt_desc_t rel_descs[2];
+  byte ipids[2][DIGEST_LEN];
+  chn_int_setup_t setups[2];
+  byte* msg = NULL;
+  byte* led_sk = NULL;
+  int found = 0;
+
+  tt_int_op(mt_hex2bytes(MT_LED_SK_HEX, &led_sk), OP_EQ, MT_SZ_SK);
+
+  tt_int_op(mt_ipay_init(), OP_EQ, MT_SUCCESS);
+
+  // open channels from relays until two of them land on different shards;
+  // the ledger confirmation of each is routed to the shard of its channel
+  for(uint64_t i = 1; i <= 64 && found < 2; i++){
+    mt_desc_t rel_desc = {.id = {i, 0}, .party = MT_PARTY_REL};
+    int msg_size = pack_estab1(&rel_desc, &msg);
+    tt_int_op(mt_ipay_recv(&rel_desc, MT_NTYPE_CHN_END_ESTAB1, msg, msg_size), OP_EQ, MT_SUCCESS);
+    tor_free(msg);
+    tt_int_op(run_job(0), OP_EQ, MT_SUCCESS);
+
+    tt_int_op(smartlist_len(sent), OP_EQ, 1);
+    sent_msg_t* setup = smartlist_get(sent, 0);
+    tt_int_op(setup->type, OP_EQ, MT_NTYPE_CHN_INT_SETUP);
+    byte pk[MT_SZ_PK];
+    byte* setup_msg;
+    int setup_size = mt_verify_signed_msg(setup->msg, setup->size, &pk, &setup_msg);
+    byte ipid[DIGEST_LEN];
+    chn_int_setup_t setup_tkn;
+    tt_int_op(unpack_chn_int_setup(setup_msg, setup_size, &setup_tkn, &ipid), OP_EQ, MT_SUCCESS);
+    if(found == 0 || get_uint32(ipid) % 4 != get_uint32(ipids[0]) % 4){
+      rel_descs[found] = rel_desc;
+      memcpy(ipids[found], ipid, DIGEST_LEN);
+      setups[found] = setup_tkn;
+      found++;
+    }
+    clear_sent();
+  }
+  tt_int_op(found, OP_EQ, 2);
+
+  // the ledger confirms both channels, one job per shard
+  for(int i = 0; i < 2; i++){
+    any_led_confirm_t confirm;
+    memset(&confirm, 0, sizeof(confirm));
+    confirm.success = MT_CODE_SUCCESS;
+    confirm.receipt.type = MT_NTYPE_CHN_INT_SETUP;
+    confirm.receipt.val = setups[i].val_to;
+    memcpy(confirm.receipt.from, setups[i].from, MT_SZ_ADDR);
+    memcpy(confirm.receipt.to, setups[i].chn, MT_SZ_ADDR);
+    tt_int_op(mt_receipt_sign(&confirm.receipt, (byte (*)[MT_SZ_SK])led_sk), OP_EQ, MT_SUCCESS);
+    int msg_size = pack_any_led_confirm(&confirm, &ipids[i], &msg);
+    tt_int_op(mt_ipay_recv(&led_desc, MT_NTYPE_ANY_LED_CONFIRM, msg, msg_size), OP_EQ, MT_SUCCESS);
+    tor_free(msg);
+  }
+  tt_int_op(smartlist_len(jobs), OP_EQ, 2);
+
+  // the second confirmation finishes first but its reply is held back
+  tt_int_op(run_job(1), OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(sent), OP_EQ, 0);
+
+  tt_int_op(run_job(0), OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(sent), OP_EQ, 2);
+  for(int i = 0; i < 2; i++){
+    sent_msg_t* reply = smartlist_get(sent, i);
+    tt_int_op(reply->type, OP_EQ, MT_NTYPE_CHN_INT_ESTAB2);
+    tt_int_op(mt_desc_comp(&reply->desc, &rel_descs[i]), OP_EQ, 0);
+  }
+
+ done:;
+  tor_free(msg);
+  tor_free(led_sk);
+  clear_sent();
+  smartlist_free(sent);
+  SMARTLIST_FOREACH(jobs, queued_job_t*, job, tor_free(job));
+  smartlist_free(jobs);
+  UNMOCK(mt_send_message);
+  UNMOCK(mt_micro_sleep);
+  UNMOCK(cpuworker_queue_work);
+}
+
+static threadpool_t* bench_pool;
+
+static workqueue_entry_t* mock_cpuworker_queue_work_pool(workqueue_priority_t priority,
+							 workqueue_reply_t (*fn)(void*, void*),
+							 void (*reply_fn)(void*), void* arg){
+  return threadpool_queue_work_priority(bench_pool, priority, fn, reply_fn, arg);
+}
+
+/** Spend the simulated time of a crypto operation on the cpu */
+static void mock_micro_spin(uint microsecs){
+  uint64_t end = monotime_absolute_usec() + microsecs;
+  while(monotime_absolute_usec() < end)
+    ;
+}
+
+static void* new_bench_state(void* arg){
+  (void)arg;
+  return NULL;
+}
+
+static void free_bench_state(void* arg){
+  (void)arg;
+}
+
+/**
+ * Report how many channel establishments per second the intermediary handles
+ * with one shard and worker thread per core, for one core up to all of them.
+ * Off by default; run with +mt_ipay/shard_scaling
+ */
+static void test_mt_ipay_shard_scaling(void *arg){
+  (void)arg;
+
+  const int num_msgs = 256;
+  int num_cpus = compute_num_cpus();
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorPublicMint = 1;
+  options->MoneTorIntermediaryShardsInFlight = 0;
+  options->MoneTorMaxVerifyInFlight = 0;
+
+  MOCK(mt_send_message, mock_send_message);
+  MOCK(mt_micro_sleep, mock_micro_spin);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_pool);
+
+  byte* msg = NULL;
+
+  for(int cores = 1; cores <= num_cpus; cores *= 2){
+
+    replyqueue_t* queue = replyqueue_new(0);
+    tt_assert(queue);
+    bench_pool = threadpool_new(cores, queue, new_bench_state, free_bench_state, NULL);
+    tt_assert(bench_pool);
+
+    options->MoneTorIntermediaryShards = cores;
+    tt_int_op(mt_ipay_init(), OP_EQ, MT_SUCCESS);
+    setups_sent = 0;
+
+    uint64_t start = monotime_absolute_usec();
+    for(int i = 0; i < num_msgs; i++){
+      mt_desc_t rel_desc = {.id = {(uint64_t)cores, (uint64_t)i}, .party = MT_PARTY_REL};
+      int msg_size = pack_estab1(&rel_desc, &msg);
+      tt_int_op(mt_ipay_recv(&rel_desc, MT_NTYPE_CHN_END_ESTAB1, msg, msg_size), OP_EQ, MT_SUCCESS);
+      tor_free(msg);
+    }
+    while(setups_sent < num_msgs)
+      replyqueue_process(queue);
+    uint64_t usec = monotime_absolute_usec() - start;
+
+    printf("\n%d core(s): %d estab1 in %.3f s (%.0f/s)", cores, num_msgs, usec / 1e6,
+	   num_msgs * 1e6 / usec);
+  }
+  printf("\n");
+
+ done:;
+  tor_free(msg);
+  UNMOCK(mt_send_message);
+  UNMOCK(mt_micro_sleep);
+  UNMOCK(cpuworker_queue_work);
+}
+
+struct testcase_t mt_ipay_tests[] = {
+  { "queue_failure", test_mt_ipay_queue_failure, TT_FORK, NULL, NULL },
+  { "shard_order", test_mt_ipay_shard_order, TT_FORK, NULL, NULL },
+  { "shard_scaling", test_mt_ipay_shard_scaling, TT_FORK|TT_OFF_BY_DEFAULT, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -0,0 +1,272 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#include <signal.h>
+
+#include "test.h"
+#include "or.h"
+#include "mt_common.h"
+#include "mt_ledgerlog.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static int replay_count;
+static mt_ntype_t replay_types[8];
+static int replay_sizes[8];
+
+static void test_replay(mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg, int size){
+  if(replay_count < 8){
+    replay_types[replay_count] = type;
+    replay_sizes[replay_count] = size;
+  }
+  // every test message is filled with its address byte
+  for(int i = 0; i < size; i++)
+    tor_assert(msg[i] == (*addr)[0]);
+  replay_count++;
+}
+
+static void append_msg(mt_ntype_t type, byte fill, int size, uint64_t* seq_out){
+  byte addr[MT_SZ_ADDR];
+  byte* msg = tor_malloc(size);
+  memset(addr, fill, MT_SZ_ADDR);
+  memset(msg, fill, size);
+  tor_assert(mt_ledgerlog_append(type, &addr, msg, size, seq_out) == MT_SUCCESS);
+  tor_free(msg);
+}
+
+static void test_mt_ledgerlog(void *arg)
+{
+  (void) arg;
+
+  char* dir = tor_strdup(get_fname("mt_ledgerlog"));
+  char* log_fname = NULL;
+  tor_asprintf(&log_fname, "%s"PATH_SEPARATOR"%s", dir, MT_LEDGERLOG_LOG_FNAME);
+
+  mt_acctable_t* mac_accounts = mt_acctable_new(sizeof(mac_led_data_t));
+  mt_acctable_t* chn_accounts = mt_acctable_new(sizeof(chn_led_data_t));
+  uint64_t seq;
+  struct stat st;
+
+  // fresh log
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 0);
+  tt_int_op(mt_ledgerlog_is_open(), OP_EQ, 1);
+
+  append_msg(MT_NTYPE_MAC_AUT_MINT, 1, 10, &seq);
+  tt_u64_op(seq, OP_EQ, 1);
+  append_msg(MT_NTYPE_MAC_ANY_TRANS, 2, 20, &seq);
+  append_msg(MT_NTYPE_CHN_END_SETUP, 3, 30, &seq);
+  tt_u64_op(seq, OP_EQ, 3);
+
+  // nothing is durable until the group commit
+  tt_int_op(mt_ledgerlog_pending(), OP_EQ, 3);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 0);
+  tt_int_op(mt_ledgerlog_commit(), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_ledgerlog_pending(), OP_EQ, 0);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 3);
+  mt_ledgerlog_close();
+  tt_int_op(mt_ledgerlog_is_open(), OP_EQ, 0);
+
+  // reopen and replay the whole log
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 3);
+  tt_int_op(replay_types[0], OP_EQ, MT_NTYPE_MAC_AUT_MINT);
+  tt_int_op(replay_types[2], OP_EQ, MT_NTYPE_CHN_END_SETUP);
+  tt_int_op(replay_sizes[1], OP_EQ, 20);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 3);
+  tt_u64_op(mt_ledgerlog_since_snapshot(), OP_EQ, 3);
+
+  // snapshot the accounts and then log a short tail
+  byte mac_addr[MT_SZ_ADDR];
+  byte chn_addr[MT_SZ_ADDR];
+  memset(mac_addr, 7, MT_SZ_ADDR);
+  memset(chn_addr, 8, MT_SZ_ADDR);
+
+  mac_led_data_t* mac_data = mt_acctable_add(mac_accounts, mac_addr);
+  mac_data->bal = 1234;
+  chn_led_data_t* chn_data = mt_acctable_add(chn_accounts, chn_addr);
+  chn_data->end_bal = 55;
+  chn_data->int_bal = 66;
+
+  tt_int_op(mt_ledgerlog_snapshot(mac_accounts, chn_accounts), OP_EQ, MT_SUCCESS);
+  tt_u64_op(mt_ledgerlog_since_snapshot(), OP_EQ, 0);
+  tt_int_op(stat(log_fname, &st), OP_EQ, 0);
+  tt_int_op(st.st_size, OP_EQ, 0);
+
+  append_msg(MT_NTYPE_CHN_INT_SETUP, 4, 40, &seq);
+  append_msg(MT_NTYPE_CHN_END_CLOSE, 5, 50, &seq);
+  tt_u64_op(seq, OP_EQ, 5);
+  mt_ledgerlog_close();
+
+  // restart from an empty ledger: snapshot plus tail replay
+  mt_acctable_free(mac_accounts);
+  mt_acctable_free(chn_accounts);
+  mac_accounts = mt_acctable_new(sizeof(mac_led_data_t));
+  chn_accounts = mt_acctable_new(sizeof(chn_led_data_t));
+
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 2);
+  tt_int_op(replay_types[0], OP_EQ, MT_NTYPE_CHN_INT_SETUP);
+  tt_int_op(replay_types[1], OP_EQ, MT_NTYPE_CHN_END_CLOSE);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 5);
+
+  tt_int_op(mt_acctable_size(mac_accounts), OP_EQ, 1);
+  tt_int_op(mt_acctable_size(chn_accounts), OP_EQ, 1);
+  mac_data = mt_acctable_get(mac_accounts, mac_addr);
+  tt_assert(mac_data);
+  tt_int_op(mac_data->bal, OP_EQ, 1234);
+  chn_data = mt_acctable_get(chn_accounts, chn_addr);
+  tt_assert(chn_data);
+  tt_int_op(chn_data->end_bal, OP_EQ, 55);
+  tt_int_op(chn_data->int_bal, OP_EQ, 66);
+  mt_ledgerlog_close();
+
+  // simulate a crash in the middle of writing a record
+  tt_int_op(stat(log_fname, &st), OP_EQ, 0);
+  off_t good_size = st.st_size;
+  byte torn[37];
+  memset(torn, 0x52, sizeof(torn));
+  tt_int_op(append_bytes_to_file(log_fname, (char*)torn, sizeof(torn), 1), OP_EQ, 0);
+
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 2);
+  tt_int_op(stat(log_fname, &st), OP_EQ, 0);
+  tt_int_op(st.st_size, OP_EQ, good_size);
+
+  // the log continues cleanly after the torn record
+  append_msg(MT_NTYPE_CHN_INT_CLOSE, 6, 60, &seq);
+  tt_u64_op(seq, OP_EQ, 6);
+  mt_ledgerlog_close();
+
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 3);
+  tt_int_op(replay_types[2], OP_EQ, MT_NTYPE_CHN_INT_CLOSE);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 6);
+
+#ifdef HAVE_SYS_RESOURCE_H
+  // a commit that dies partway through a record is cut back before the retry
+  tt_int_op(stat(log_fname, &st), OP_EQ, 0);
+  good_size = st.st_size;
+  struct rlimit old_limit, limit;
+  tt_int_op(getrlimit(RLIMIT_FSIZE, &old_limit), OP_EQ, 0);
+  limit = old_limit;
+  limit.rlim_cur = good_size + 100;
+  signal(SIGXFSZ, SIG_IGN);
+  tt_int_op(setrlimit(RLIMIT_FSIZE, &limit), OP_EQ, 0);
+
+  append_msg(MT_NTYPE_MAC_ANY_TRANS, 7, 300, &seq);
+  tt_int_op(mt_ledgerlog_commit(), OP_EQ, MT_ERROR);
+  tt_int_op(mt_ledgerlog_pending(), OP_EQ, 1);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 6);
+
+  tt_int_op(setrlimit(RLIMIT_FSIZE, &old_limit), OP_EQ, 0);
+  tt_int_op(mt_ledgerlog_commit(), OP_EQ, MT_SUCCESS);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 7);
+  mt_ledgerlog_close();
+
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 4);
+  tt_int_op(replay_sizes[3], OP_EQ, 300);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 7);
+#endif
+
+ done:;
+  mt_ledgerlog_close();
+  mt_acctable_free(mac_accounts);
+  mt_acctable_free(chn_accounts);
+  tor_free(log_fname);
+  tor_free(dir);
+}
+
+/**
+ * Check that a snapshot in the unpadded version 1 layout still loads
+ */
+static void test_mt_ledgerlog_snapshot_v1(void *arg)
+{
+  (void) arg;
+
+  char* dir = tor_strdup(get_fname("mt_ledgerlog_v1"));
+  char* snap_fname = NULL;
+  tor_asprintf(&snap_fname, "%s"PATH_SEPARATOR"%s", dir, MT_LEDGERLOG_SNAPSHOT_FNAME);
+  tt_int_op(check_private_dir(dir, CPD_CREATE, NULL), OP_EQ, 0);
+
+  mt_acctable_t* mac_accounts = mt_acctable_new(sizeof(mac_led_data_t));
+  mt_acctable_t* chn_accounts = mt_acctable_new(sizeof(chn_led_data_t));
+
+  // magic, version, seq, mac_size, chn_size, n_mac, n_chn, then addr | data
+  byte snap[40 + MT_SZ_ADDR + sizeof(mac_led_data_t) + DIGEST_LEN];
+  memset(snap, 0, sizeof(snap));
+  uint32_t u32;
+  uint64_t u64;
+  u32 = 0x4d544c53;
+  memcpy(snap, &u32, 4);
+  u32 = 1;
+  memcpy(snap + 4, &u32, 4);
+  u64 = 9;
+  memcpy(snap + 8, &u64, 8);
+  u32 = sizeof(mac_led_data_t);
+  memcpy(snap + 16, &u32, 4);
+  u32 = sizeof(chn_led_data_t);
+  memcpy(snap + 20, &u32, 4);
+  u64 = 1;
+  memcpy(snap + 24, &u64, 8);
+
+  byte mac_addr[MT_SZ_ADDR];
+  memset(mac_addr, 7, MT_SZ_ADDR);
+  mac_led_data_t mac_data;
+  memset(&mac_data, 0, sizeof(mac_data));
+  mac_data.bal = 4321;
+  memcpy(snap + 40, mac_addr, MT_SZ_ADDR);
+  memcpy(snap + 40 + MT_SZ_ADDR, &mac_data, sizeof(mac_data));
+  crypto_digest((char*)snap + sizeof(snap) - DIGEST_LEN, (const char*)snap,
+		sizeof(snap) - DIGEST_LEN);
+  tt_int_op(write_bytes_to_file(snap_fname, (char*)snap, sizeof(snap), 1), OP_EQ, 0);
+
+  replay_count = 0;
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  tt_int_op(replay_count, OP_EQ, 0);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 9);
+  tt_int_op(mt_acctable_size(mac_accounts), OP_EQ, 1);
+  tt_int_op(mt_acctable_size(chn_accounts), OP_EQ, 0);
+  mac_led_data_t* got = mt_acctable_get(mac_accounts, mac_addr);
+  tt_assert(got);
+  tt_int_op(got->bal, OP_EQ, 4321);
+
+  // the next snapshot is written in the current layout and loads back
+  tt_int_op(mt_ledgerlog_snapshot(mac_accounts, chn_accounts), OP_EQ, MT_SUCCESS);
+  mt_ledgerlog_close();
+  mt_acctable_free(mac_accounts);
+  mac_accounts = mt_acctable_new(sizeof(mac_led_data_t));
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_SUCCESS);
+  got = mt_acctable_get(mac_accounts, mac_addr);
+  tt_assert(got);
+  tt_int_op(got->bal, OP_EQ, 4321);
+
+  // a corrupt snapshot is refused
+  mt_ledgerlog_close();
+  snap[45] ^= 1;
+  tt_int_op(write_bytes_to_file(snap_fname, (char*)snap, sizeof(snap), 1), OP_EQ, 0);
+  tt_int_op(mt_ledgerlog_open(dir, mac_accounts, chn_accounts, test_replay), OP_EQ, MT_ERROR);
+
+ done:;
+  mt_ledgerlog_close();
+  mt_acctable_free(mac_accounts);
+  mt_acctable_free(chn_accounts);
+  tor_free(snap_fname);
+  tor_free(dir);
+}
+
+struct testcase_t mt_ledgerlog_tests[] = {
+  { "mt_ledgerlog", test_mt_ledgerlog, TT_FORK, NULL, NULL },
+  { "snapshot_v1", test_mt_ledgerlog_snapshot_v1, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -11,6 +11,9 @@
 #include "mt_tokens.h"
 #include "mt_common.h"
 #include "mt_lpay.h"
+#include "mt_ledgerlog.h"
+#include "workqueue.h"
+#include "cpuworker.h"
 #include "test.h"
 
 int send_intercept_1;
@@ -125,7 +128,7 @@ static void test_mt_lpay(void *arg)
   byte end_1_sk[MT_SZ_SK];
   byte end_1_addr[MT_SZ_ADDR];
   mt_desc_t end_1_desc = {.party = MT_PARTY_CLI};
-  mt_crypt_keygen(&pp, &end_1_pk, &end_1_sk);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &end_1_pk, &end_1_sk);
   mt_pk2addr(&end_1_pk, &end_1_addr);
   mt_crypt_rand(sizeof(end_1_desc), (byte*)&end_1_desc);
 
@@ -134,7 +137,7 @@ static void test_mt_lpay(void *arg)
   byte int_1_sk[MT_SZ_SK];
   byte int_1_addr[MT_SZ_ADDR];
   mt_desc_t int_1_desc = {.party = MT_PARTY_INT};
-  mt_crypt_keygen(&pp, &int_1_pk, &int_1_sk);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &int_1_pk, &int_1_sk);
   mt_pk2addr(&int_1_pk, &int_1_addr);
   mt_crypt_rand(sizeof(int_1_desc), (byte*)&int_1_desc);
 
@@ -280,9 +283,307 @@ static void test_mt_lpay(void *arg)
   UNMOCK(mt_micro_sleep);
 }
 
+static int confirm_count;
+static any_led_confirm_t last_confirm;
+
+static int mock_send_confirm(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
+  (void)desc;
+  byte pid[DIGEST_LEN];
+  if(type == MT_NTYPE_ANY_LED_CONFIRM &&
+     unpack_any_led_confirm(msg, size, &last_confirm, &pid) == MT_SUCCESS)
+    confirm_count++;
+  return MT_SUCCESS;
+}
+
+static int mock_ledgerlog_append_fail(mt_ntype_t type, byte (*addr)[MT_SZ_ADDR], byte* msg,
+				      int size, uint64_t* seq_out){
+  (void)type;
+  (void)addr;
+  (void)msg;
+  (void)size;
+  (void)seq_out;
+  return MT_ERROR;
+}
+
+static void test_mt_lpay_log_failure(void *arg)
+{
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 1;
+  options->MoneTorLedgerLogDir = tor_strdup(get_fname("mt_lpay_log"));
+
+  MOCK(mt_send_message, mock_send_confirm);
+
+  byte* aut_pk_temp;
+  byte* aut_sk_temp;
+  byte aut_pk[MT_SZ_PK];
+  byte aut_sk[MT_SZ_SK];
+  byte aut_addr[MT_SZ_ADDR];
+  tor_assert(mt_hex2bytes(MT_AUT_PK_HEX, &aut_pk_temp) == MT_SZ_PK);
+  tor_assert(mt_hex2bytes(MT_AUT_SK_HEX, &aut_sk_temp) == MT_SZ_SK);
+  memcpy(aut_pk, aut_pk_temp, MT_SZ_PK);
+  memcpy(aut_sk, aut_sk_temp, MT_SZ_SK);
+  free(aut_pk_temp);
+  free(aut_sk_temp);
+  mt_pk2addr(&aut_pk, &aut_addr);
+
+  mt_desc_t aut_desc = {.party = MT_PARTY_AUT};
+  aut_desc.id[0] = 1;
+
+  tt_int_op(mt_lpay_init(), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_ledgerlog_is_open(), OP_EQ, 1);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 0);
+
+  // a mint that cannot be logged is rejected and never reaches the balances
+  MOCK(mt_ledgerlog_append, mock_ledgerlog_append_fail);
+  mac_aut_mint_t mint = {.value = 1000};
+  confirm_count = 0;
+  tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	    OP_EQ, MT_ERROR);
+  tt_int_op(confirm_count, OP_EQ, 1);
+  tt_int_op(last_confirm.success, OP_EQ, MT_CODE_FAILURE);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 0);
+  tt_int_op(mt_ledgerlog_pending(), OP_EQ, 0);
+  UNMOCK(mt_ledgerlog_append);
+
+  // the same mint goes through once the log accepts it
+  confirm_count = 0;
+  tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	    OP_EQ, MT_SUCCESS);
+  tt_int_op(confirm_count, OP_EQ, 1);
+  tt_int_op(last_confirm.success, OP_EQ, MT_CODE_SUCCESS);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 1000);
+  tt_u64_op(mt_ledgerlog_durable_seq(), OP_EQ, 1);
+
+ done:;
+  UNMOCK(mt_ledgerlog_append);
+  UNMOCK(mt_send_message);
+  mt_lpay_clear();
+}
+
+typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
+					   workqueue_reply_t (*)(void*, void*),
+					   void (*)(void*), void*);
+
+typedef struct {
+  workqueue_reply_t (*fn)(void*, void*);
+  int (*reply_fn)(void*);
+  void* arg;
+} queued_job_t;
+
+static smartlist_t* jobs;
+static int queue_allowed;
+
+/** Hold jobs until run_jobs(); refuse any after the first <b>queue_allowed</b> */
+static workqueue_entry_t* mock_cpuworker_queue_work(workqueue_priority_t priority,
+						    workqueue_reply_t (*fn)(void*, void*),
+						    int (*reply_fn)(void*), void* arg){
+  (void)priority;
+  if(queue_allowed-- <= 0)
+    return NULL;
+  queued_job_t* job = tor_malloc(sizeof(queued_job_t));
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(jobs, job);
+  return (workqueue_entry_t*)job;
+}
+
+/** Run every queued job as the cpuworker and the main thread would */
+static int run_jobs(void){
+  int result = MT_SUCCESS;
+  while(smartlist_len(jobs) > 0){
+    queued_job_t* job = smartlist_get(jobs, 0);
+    smartlist_del_keeporder(jobs, 0);
+    job->fn(NULL, job->arg);
+    if(job->reply_fn(job->arg) != MT_SUCCESS)
+      result = MT_ERROR;
+    tor_free(job);
+  }
+  return result;
+}
+
+static void setup_aut(byte (*pk)[MT_SZ_PK], byte (*sk)[MT_SZ_SK], byte (*addr)[MT_SZ_ADDR]){
+  byte* pk_temp;
+  byte* sk_temp;
+  tor_assert(mt_hex2bytes(MT_AUT_PK_HEX, &pk_temp) == MT_SZ_PK);
+  tor_assert(mt_hex2bytes(MT_AUT_SK_HEX, &sk_temp) == MT_SZ_SK);
+  memcpy(*pk, pk_temp, MT_SZ_PK);
+  memcpy(*sk, sk_temp, MT_SZ_SK);
+  tor_free(pk_temp);
+  tor_free(sk_temp);
+  mt_pk2addr(pk, addr);
+}
+
+/**
+ * Check that a transaction is still verified, signed and confirmed when the
+ * cpuworker refuses its jobs
+ */
+static void test_mt_lpay_sign_inline(void *arg)
+{
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorLedgerVerifyBatch = 1;
+  options->MoneTorLedgerReceiptBatch = 0;
+
+  jobs = smartlist_new();
+  MOCK(mt_send_message, mock_send_confirm);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+
+  byte aut_pk[MT_SZ_PK];
+  byte aut_sk[MT_SZ_SK];
+  byte aut_addr[MT_SZ_ADDR];
+  byte* led_pk = NULL;
+  setup_aut(&aut_pk, &aut_sk, &aut_addr);
+  mt_desc_t aut_desc = {.party = MT_PARTY_AUT};
+  aut_desc.id[0] = 1;
+
+  tt_int_op(mt_lpay_init(), OP_EQ, MT_SUCCESS);
+
+  // the verify job is accepted but the sign job that follows is not
+  mac_aut_mint_t mint = {.value = 1000};
+  confirm_count = 0;
+  queue_allowed = 1;
+  tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	    OP_EQ, MT_SUCCESS);
+  tt_int_op(run_jobs(), OP_EQ, MT_SUCCESS);
+  tt_int_op(confirm_count, OP_EQ, 1);
+  tt_int_op(last_confirm.success, OP_EQ, MT_CODE_SUCCESS);
+  tt_int_op(mt_hex2bytes(MT_LED_PK_HEX, &led_pk), OP_EQ, MT_SZ_PK);
+  tt_int_op(mt_receipt_verify(&last_confirm.receipt, (byte (*)[MT_SZ_PK])led_pk),
+	    OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 1000);
+
+  // neither stage is accepted: the transaction is verified and signed here
+  confirm_count = 0;
+  queue_allowed = 0;
+  tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	    OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 0);
+  tt_int_op(confirm_count, OP_EQ, 1);
+  tt_int_op(last_confirm.success, OP_EQ, MT_CODE_SUCCESS);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 2000);
+
+ done:;
+  tor_free(led_pk);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(mt_send_message);
+  mt_lpay_clear();
+}
+
+/**
+ * Check that a job still on a cpuworker when the ledger is cleared is dropped
+ * instead of being applied to the ledger that replaces it
+ */
+static void test_mt_lpay_stale_job(void *arg)
+{
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorLedgerVerifyBatch = 1;
+
+  jobs = smartlist_new();
+  MOCK(mt_send_message, mock_send_confirm);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+
+  byte aut_pk[MT_SZ_PK];
+  byte aut_sk[MT_SZ_SK];
+  byte aut_addr[MT_SZ_ADDR];
+  setup_aut(&aut_pk, &aut_sk, &aut_addr);
+  mt_desc_t aut_desc = {.party = MT_PARTY_AUT};
+  aut_desc.id[0] = 1;
+  mt_lpay_pipeline_stats_t stats;
+
+  tt_int_op(mt_lpay_init(), OP_EQ, MT_SUCCESS);
+
+  mac_aut_mint_t mint = {.value = 1000};
+  confirm_count = 0;
+  queue_allowed = 1;
+  tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	    OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 1);
+
+  mt_lpay_clear();
+  tt_int_op(mt_lpay_init(), OP_EQ, MT_SUCCESS);
+
+  // the reply arrives after the restart and must leave the new ledger alone
+  tt_int_op(run_jobs(), OP_EQ, MT_ERROR);
+  tt_int_op(confirm_count, OP_EQ, 0);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 0);
+  mt_lpay_pipeline_stats(&stats);
+  tt_int_op(stats.depth[MT_LPAY_STAGE_VERIFY], OP_EQ, 0);
+  tt_int_op(stats.depth[MT_LPAY_STAGE_APPLY], OP_EQ, 0);
+
+ done:;
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(mt_send_message);
+  mt_lpay_clear();
+}
+
+/**
+ * Check that transactions arriving while a batch is being checked wait for
+ * the next batch unless MoneTorLedgerVerifyBatch is 0
+ */
+static void test_mt_lpay_verify_batch(void *arg)
+{
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 0;
+  options->MoneTorLedgerReceiptBatch = 0;
+
+  jobs = smartlist_new();
+  MOCK(mt_send_message, mock_send_confirm);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+
+  byte aut_pk[MT_SZ_PK];
+  byte aut_sk[MT_SZ_SK];
+  byte aut_addr[MT_SZ_ADDR];
+  setup_aut(&aut_pk, &aut_sk, &aut_addr);
+  mt_desc_t aut_desc = {.party = MT_PARTY_AUT};
+  aut_desc.id[0] = 1;
+  mac_aut_mint_t mint = {.value = 1000};
+
+  tt_int_op(mt_lpay_init(), OP_EQ, MT_SUCCESS);
+  queue_allowed = INT_MAX;
+  confirm_count = 0;
+
+  // batched: the second transaction waits for the first batch to finish
+  options->MoneTorLedgerVerifyBatch = 32;
+  for(int i = 0; i < 2; i++)
+    tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	      OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 1);
+  tt_int_op(run_jobs(), OP_EQ, MT_SUCCESS);
+  tt_int_op(confirm_count, OP_EQ, 2);
+
+  // unbatched: every transaction is dispatched as soon as it arrives
+  options->MoneTorLedgerVerifyBatch = 0;
+  for(int i = 0; i < 2; i++)
+    tt_int_op(send_ledger(&aut_pk, &aut_sk, &aut_desc, MT_NTYPE_MAC_AUT_MINT, &mint),
+	      OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 2);
+  tt_int_op(run_jobs(), OP_EQ, MT_SUCCESS);
+  tt_int_op(confirm_count, OP_EQ, 4);
+  tt_int_op(mt_lpay_query_mac_balance(&aut_addr), OP_EQ, 4000);
+
+ done:;
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(mt_send_message);
+  mt_lpay_clear();
+}
+
 struct testcase_t mt_lpay_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
   { "mt_lpay", test_mt_lpay, 0, NULL, NULL },
+  { "log_failure", test_mt_lpay_log_failure, TT_FORK, NULL, NULL },
+  { "sign_inline", test_mt_lpay_sign_inline, TT_FORK, NULL, NULL },
+  { "stale_job", test_mt_lpay_stale_job, TT_FORK, NULL, NULL },
+  { "verify_batch", test_mt_lpay_verify_batch, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -0,0 +1,122 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "config.h"
+#include "compat_libevent.h"
+#include "timers.h"
+#include "mt_common.h"
+#include "mt_messagebuffer.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static int available;
+static int num_sent;
+static byte last_sent;
+
+static int mock_send_message(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
+  (void)desc;
+  (void)type;
+  (void)size;
+  if(!available)
+    return MT_ERROR;
+  num_sent++;
+  last_sent = msg[0];
+  return MT_SUCCESS;
+}
+
+static void test_mt_messagebuffer(void *arg)
+{
+  (void) arg;
+
+  tor_libevent_postfork();
+  timers_initialize();
+  MOCK(mt_send_message, mock_send_message);
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorMsgBufPerDesc = 4;
+  options->MoneTorMsgBufReplayBurst = 2;
+  options->MoneTorMsgBufTTL = 60;
+  options->MoneTorMsgBufMaxBytes = 6 * 100;
+
+  mt_msgbuf_t* msgbuf = mt_messagebuffer_init();
+  mt_msgbuf_stats_t stats;
+  mt_desc_t desc1 = {.id = {1, 1}, .party = MT_PARTY_REL};
+  mt_desc_t desc2 = {.id = {2, 2}, .party = MT_PARTY_REL};
+  byte msg[100];
+  time_t now = 1000;
+  update_approx_time(now);
+
+  // messages go straight through while the descriptor is up
+  available = 1;
+  num_sent = 0;
+  msg[0] = 0;
+  tt_int_op(mt_buffer_message(msgbuf, &desc1, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ, MT_SUCCESS);
+  tt_int_op(num_sent, OP_EQ, 1);
+
+  // the ring keeps the newest messages of an unavailable descriptor
+  available = 0;
+  for(int i = 1; i <= 6; i++){
+    msg[0] = i;
+    tt_int_op(mt_buffer_message(msgbuf, &desc1, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ,
+	      MT_SUCCESS);
+  }
+  mt_messagebuffer_stats(msgbuf, &stats);
+  tt_int_op(stats.depth, OP_EQ, 4);
+  tt_int_op(stats.bytes, OP_EQ, 400);
+  tt_u64_op(stats.dropped_full, OP_EQ, 2);
+
+  // the global cap refuses what the other descriptor cannot fit
+  tt_int_op(mt_buffer_message(msgbuf, &desc2, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_buffer_message(msgbuf, &desc2, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_buffer_message(msgbuf, &desc2, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ, MT_ERROR);
+  mt_messagebuffer_stats(msgbuf, &stats);
+  tt_int_op(stats.depth, OP_EQ, 6);
+  tt_u64_op(stats.refused, OP_EQ, 1);
+
+  // coming back online only resends a burst right away
+  available = 1;
+  num_sent = 0;
+  tt_int_op(mt_set_desc_status(msgbuf, &desc1, 1), OP_EQ, 0);
+  tt_int_op(num_sent, OP_EQ, 2);
+  tt_int_op(last_sent, OP_EQ, 4);
+
+  // new messages wait behind the ones still being resent
+  msg[0] = 7;
+  tt_int_op(mt_buffer_message(msgbuf, &desc1, MT_NTYPE_NAN_CLI_PAY1, msg, 100), OP_EQ, MT_SUCCESS);
+  tt_int_op(num_sent, OP_EQ, 2);
+
+  // the rest goes out on later turns, in order
+  tt_int_op(mt_messagebuffer_replay(msgbuf), OP_EQ, 1);
+  tt_int_op(num_sent, OP_EQ, 4);
+  tt_int_op(last_sent, OP_EQ, 6);
+  tt_int_op(mt_messagebuffer_replay(msgbuf), OP_EQ, 0);
+  tt_int_op(num_sent, OP_EQ, 5);
+  tt_int_op(last_sent, OP_EQ, 7);
+
+  mt_messagebuffer_stats(msgbuf, &stats);
+  tt_int_op(stats.depth, OP_EQ, 2);
+  tt_u64_op(stats.replayed, OP_EQ, 5);
+
+  // messages that outlive the ttl are never resent
+  update_approx_time(now + 60);
+  mt_messagebuffer_expire(msgbuf, approx_time());
+  num_sent = 0;
+  tt_int_op(mt_set_desc_status(msgbuf, &desc2, 1), OP_EQ, 0);
+  tt_int_op(num_sent, OP_EQ, 0);
+  mt_messagebuffer_stats(msgbuf, &stats);
+  tt_int_op(stats.depth, OP_EQ, 0);
+  tt_int_op(stats.bytes, OP_EQ, 0);
+  tt_u64_op(stats.dropped_expired, OP_EQ, 2);
+
+ done:;
+  mt_messagebuffer_free(msgbuf);
+  UNMOCK(mt_send_message);
+}
+
+struct testcase_t mt_messagebuffer_tests[] = {
+  { "mt_messagebuffer", test_mt_messagebuffer, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -29,6 +29,7 @@
 #include "mt_ipay.h"
 #include "mt_cclient.h"
 #include "mt_messagebuffer.h"
+#include "mt_stats.h"
 #include "test.h"
 
 #define NON_NULL 1
@@ -41,6 +42,9 @@
 
 #define DISCONNECT_PERCENT 5
 
+// each payment call reveals between 1 and this many preimages at once
+#define MAX_PAY_UNITS 4
+
 typedef struct {
   mt_desc_t desc;
   byte* state;
@@ -57,6 +61,7 @@ typedef enum {
   SEND_INT,
   CPU_PROCESS,
   DESC_ACTIVATE,
+  NUM_EVENT_TYPES,
 } event_type_t;
 
 typedef struct {
@@ -103,6 +108,23 @@ static digestmap_t* statuses;
 int num_payment_messages;
 int num_other_messages;
 
+// when set, skip the narration and time every event instead
+static int bench_mode = 0;
+
+#define sim_log(...) STMT_BEGIN if(!bench_mode) printf(__VA_ARGS__); STMT_END
+
+static const char* event_names[NUM_EVENT_TYPES] = {
+  "call_estab", "call_pay", "call_close", "send_led", "send_cli", "send_rel",
+  "send_relmultidesc", "send_int", "cpu_process", "desc_activate",
+};
+
+// wall time of every event handled in bench mode, by event type
+static struct {
+  uint64_t* usec;
+  int num;
+  int cap;
+} bench_lat[NUM_EVENT_TYPES];
+
 static int mock_send_message(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
   byte digest[DIGEST_LEN];
   mt_desc2digest(desc, &digest);
@@ -122,7 +144,7 @@ static int mock_send_message(mt_desc_t *desc, mt_ntype_t type, byte* msg, int si
     else
       tor_assert(0);
 
-    event_t* activate = tor_malloc(sizeof(event_t));
+    event_t* activate = tor_malloc_zero(sizeof(event_t));
     activate->type = DESC_ACTIVATE;
     activate->src = cur_desc;
     activate->activate_desc = *desc;
@@ -151,7 +173,7 @@ static int mock_send_message(mt_desc_t *desc, mt_ntype_t type, byte* msg, int si
       return MT_ERROR;
   }
 
-  event_t* send = tor_malloc(sizeof(event_t));
+  event_t* send = tor_malloc_zero(sizeof(event_t));
   send->type = event_type;
   send->src = cur_desc;
 
@@ -214,7 +236,7 @@ static int mock_send_message_multidesc(mt_desc_t *desc1, mt_desc_t* desc2,  mt_n
     else
       tor_assert(0);
 
-    event_t* activate = tor_malloc(sizeof(event_t));
+    event_t* activate = tor_malloc_zero(sizeof(event_t));
     activate->type = DESC_ACTIVATE;
     activate->src = cur_desc;
     activate->activate_desc = *desc1;
@@ -225,7 +247,7 @@ static int mock_send_message_multidesc(mt_desc_t *desc1, mt_desc_t* desc2,  mt_n
   if(desc1->party != MT_PARTY_REL)
     return MT_ERROR;
 
-  event_t* send = tor_malloc(sizeof(event_t));
+  event_t* send = tor_malloc_zero(sizeof(event_t));
   send->type = SEND_RELMULTIDESC;
   send->src = cur_desc;
 
@@ -254,7 +276,7 @@ static workqueue_entry_t* mock_cpuworker_queue_work(workqueue_priority_t priorit
 						    workqueue_reply_t (*fn)(void*, void*),
 						    int (*reply_fn)(void*), void* arg){
   (void)priority;
-  event_t* event = tor_malloc(sizeof(event_t));
+  event_t* event = tor_malloc_zero(sizeof(event_t));
   event->type = CPU_PROCESS;
   event->src = cur_desc;
 
@@ -286,7 +308,7 @@ static int mock_paymod_signal(mt_signal_t signal, mt_desc_t* desc){
       // as long as there is still time keep making payments, otherwise close
       if(sim_time < max_time){
 
-	event_t* event = tor_malloc(sizeof(event_t));
+	event_t* event = tor_malloc_zero(sizeof(event_t));
 	event->type = CALL_PAY;
 	event->src = cur_desc;
 	event->desc1 = *desc;
@@ -294,7 +316,7 @@ static int mock_paymod_signal(mt_signal_t signal, mt_desc_t* desc){
 	smartlist_add(event_queue, event);
       }
       else {
-	event_t* event = tor_malloc(sizeof(event_t));
+	event_t* event = tor_malloc_zero(sizeof(event_t));
 	event->type = CALL_CLOSE;
 	event->src = cur_desc;
 	event->desc1 = *desc;
@@ -542,6 +564,9 @@ static char* type_string(mt_ntype_t type){
 }
 
 static void print_sent_message(mt_desc_t* src, mt_desc_t* dst, mt_ntype_t type){
+  if(bench_mode)
+    return;
+
   char* src_party = party_string(src);
   char* dst_party = party_string(dst);
   char* type_str = type_string(type);
@@ -584,7 +609,7 @@ static void set_up_main_loop(void){
 
     // make indirect payments
     for(int i = 0; i < REL_CONNS; i++){
-      event_t* event = tor_malloc(sizeof(event_t));
+      event_t* event = tor_malloc_zero(sizeof(event_t));
       event->type = CALL_ESTAB;
       event->src = ctx->desc;
       event->desc1 = unique_rel_descs[i];
@@ -594,7 +619,7 @@ static void set_up_main_loop(void){
 
     // Make direct payments
     if(DPAY_ON){
-      event_t* event = tor_malloc(sizeof(event_t));
+      event_t* event = tor_malloc_zero(sizeof(event_t));
       event->type = CALL_ESTAB;
       event->src = ctx->desc;
       event->desc1 = ((context_t*)digestmap_rand(int_ctx))->desc;
@@ -637,6 +662,7 @@ static int do_main_loop_once(void){
   context_t* ctx;
 
   int MT_NAN_TAX = MT_NAN_VAL * MT_TAX / 100;
+  byte pay_pid[DIGEST_LEN];
 
   // update expected balances for pay
   if(event->msg_type == MT_NTYPE_NAN_CLI_PAY1){
@@ -644,17 +670,27 @@ static int do_main_loop_once(void){
     digestmap_t* rel2int = digestmap_get(connections, (char*)src_digest);
     mt_desc2digest((mt_desc_t*)digestmap_get(rel2int, (char*)dst_digest), &int_digest);
 
-    *(int*)digestmap_get(exp_bal, (char*)src_digest) -= MT_NAN_VAL + MT_NAN_TAX;
-    *(int*)digestmap_get(exp_bal, (char*)dst_digest) += MT_NAN_VAL;
-    *(int*)digestmap_get(exp_bal, (char*)int_digest) += MT_NAN_TAX;
+    nan_cli_pay1_t pay_tkn;
+    tor_assert(unpack_nan_cli_pay1(event->msg, event->msg_size, &pay_tkn, &pay_pid) == MT_SUCCESS);
+    int units = pay_tkn.num_units;
+
+    *(int*)digestmap_get(exp_bal, (char*)src_digest) -= units * (MT_NAN_VAL + MT_NAN_TAX);
+    *(int*)digestmap_get(exp_bal, (char*)dst_digest) += units * MT_NAN_VAL;
+    *(int*)digestmap_get(exp_bal, (char*)int_digest) += units * MT_NAN_TAX;
   }
 
   // update expected balances for direct pay
   if(event->msg_type == MT_NTYPE_NAN_CLI_DPAY1){
-    *(int*)digestmap_get(exp_bal, (char*)src_digest) -= MT_NAN_VAL + MT_NAN_TAX;
-    *(int*)digestmap_get(exp_bal, (char*)dst_digest) += MT_NAN_VAL + MT_NAN_TAX;
+    nan_cli_dpay1_t dpay_tkn;
+    tor_assert(unpack_nan_cli_dpay1(event->msg, event->msg_size, &dpay_tkn, &pay_pid) == MT_SUCCESS);
+    int units = dpay_tkn.num_units;
+
+    *(int*)digestmap_get(exp_bal, (char*)src_digest) -= units * (MT_NAN_VAL + MT_NAN_TAX);
+    *(int*)digestmap_get(exp_bal, (char*)dst_digest) += units * (MT_NAN_VAL + MT_NAN_TAX);
   }
 
+  uint64_t start_usec = monotime_absolute_usec();
+
   switch(event->type){
 
     case CALL_ESTAB:
@@ -662,7 +698,7 @@ static int do_main_loop_once(void){
       mt_cpay_import(ctx->state);
       tor_free(ctx->state);
       cur_desc = event->src;
-      printf("cli (%02d) : call estab (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
+      sim_log("cli (%02d) : call estab (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
       result = mt_cpay_establish(&event->desc1, &event->desc2);
       mt_cpay_export(&ctx->state);
       break;
@@ -672,8 +708,8 @@ static int do_main_loop_once(void){
       mt_cpay_import(ctx->state);
       tor_free(ctx->state);
       cur_desc = event->src;
-      printf("cli (%02d) : call pay (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
-      result = mt_cpay_pay(&event->desc1, &event->desc2);
+      sim_log("cli (%02d) : call pay (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
+      result = mt_cpay_pay_units(&event->desc1, &event->desc2, 1 + rand() % MAX_PAY_UNITS);
       mt_cpay_export(&ctx->state);
       break;
 
@@ -682,7 +718,7 @@ static int do_main_loop_once(void){
       mt_cpay_import(ctx->state);
       tor_free(ctx->state);
       cur_desc = event->src;
-      printf("cli (%02d) : call close (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
+      sim_log("cli (%02d) : call close (%02d)\n", (int)event->src.id[0], (int)event->desc1.id[0]);
       result = mt_cpay_close(&event->desc1, &event->desc2);
       mt_cpay_export(&ctx->state);
       break;
@@ -741,7 +777,7 @@ static int do_main_loop_once(void){
 	tor_free(ctx->state);
 	event->fn(NULL, event->arg);
 	cur_desc = event->src;
-	printf("cli (%02d) : make zkp\n", (int)event->src.id[0]);
+	sim_log("cli (%02d) : make zkp\n", (int)event->src.id[0]);
 	result = event->reply_fn(event->arg);
 	mt_cpay_export(&ctx->state);
       }
@@ -751,10 +787,27 @@ static int do_main_loop_once(void){
 	tor_free(ctx->state);
 	event->fn(NULL, event->arg);
 	cur_desc = event->src;
-	printf("rel (%02d) : make zkp\n", (int)event->src.id[0]);
+	sim_log("rel (%02d) : make zkp\n", (int)event->src.id[0]);
 	result = event->reply_fn(event->arg);
 	mt_rpay_export(&ctx->state);
       }
+      else if(event->src.party == MT_PARTY_LED){
+	// only one ledger so we don't have to worry about context switching
+	event->fn(NULL, event->arg);
+	cur_desc = event->src;
+	sim_log("led (%02d) : run pipeline stage\n", (int)event->src.id[0]);
+	result = event->reply_fn(event->arg);
+      }
+      else if(event->src.party == MT_PARTY_INT){
+	ctx = digestmap_get(int_ctx, (char*)src_digest);
+	mt_ipay_import(ctx->state);
+	tor_free(ctx->state);
+	event->fn(NULL, event->arg);
+	cur_desc = event->src;
+	sim_log("int (%02d) : run shard job\n", (int)event->src.id[0]);
+	result = event->reply_fn(event->arg);
+	mt_ipay_export(&ctx->state);
+      }
       else{
 	printf("something went wrong\n");
 	result = MT_ERROR;
@@ -768,7 +821,7 @@ static int do_main_loop_once(void){
       tor_assert(status);
       *status = 1;
       cur_desc = event->src;
-      printf("desc (%02d) : activating (%02d) \n", (int)event->src.id[0],
+      sim_log("desc (%02d) : activating (%02d) \n", (int)event->src.id[0],
 	     (int)event->activate_desc.id[0]);
 
       if(cur_desc.party == MT_PARTY_LED){
@@ -807,24 +860,27 @@ static int do_main_loop_once(void){
       result = MT_ERROR;
   }
 
+  if(bench_mode){
+    tor_assert(event->type < NUM_EVENT_TYPES);
+    uint64_t usec = monotime_absolute_usec() - start_usec;
+    if(bench_lat[event->type].num == bench_lat[event->type].cap){
+      bench_lat[event->type].cap = bench_lat[event->type].cap * 2 + 64;
+      bench_lat[event->type].usec = tor_reallocarray(bench_lat[event->type].usec,
+						     bench_lat[event->type].cap,
+						     sizeof(uint64_t));
+    }
+    bench_lat[event->type].usec[bench_lat[event->type].num++] = usec;
+  }
+
   sim_time++;
   return result;
 }
 
-static void test_mt_paymulti(void *arg){
-  (void)arg;
-
-  typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
-					     workqueue_reply_t (*)(void*, void*),
-					     void (*)(void*), void*);
-
-  MOCK(mt_send_message, mock_send_message);
-  MOCK(mt_send_message_multidesc, mock_send_message_multidesc);
-  MOCK(mt_paymod_signal, mock_paymod_signal);
-  MOCK(mt_micro_sleep, mock_micro_sleep);
-  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
-  MOCK(mt_cclient_relay_type, mock_cclient_relay_type);
-
+/**
+ * Create the ledger and every client, relay and intermediary, saving their
+ * exported states in the _ctx maps with all parties marked offline
+ */
+static int set_up_parties(void){
 
   cli_ctx = digestmap_new();
   rel_ctx = digestmap_new();
@@ -838,10 +894,8 @@ static void test_mt_paymulti(void *arg){
   // seed random number so we get repeatable results
   srand(42);
 
-  // make sure we have enough relays to connect to
-  tt_assert(REL_NUM >= REL_CONNS);
-
-  /****************************** Setup **********************************/
+  // no event loop runs here, so resend held messages without the replay timer
+  get_options_mutable()->MoneTorMsgBufReplayBurst = INT_MAX;
 
   // setup all of the parties and add to _ctx maps
   uint64_t ids = 1;
@@ -872,10 +926,7 @@ static void test_mt_paymulti(void *arg){
   *aut_status = 1;
   digestmap_set(statuses, (char*)aut_digest, aut_status);
 
-  mt_crypt_keygen(&pp, &led_pk, &led_sk);
-
-  or_options_t* options = (or_options_t*)get_options();
-  options->MoneTorPublicMint = 1;
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &led_pk, &led_sk);
 
   byte* pp_temp;
   byte* aut_pk_temp;
@@ -897,7 +948,8 @@ static void test_mt_paymulti(void *arg){
   mt_pk2addr(&led_pk, &led_addr);
 
   // initialize ledger and save relevant "public" values
-  tt_assert(mt_lpay_init() == MT_SUCCESS);
+  if(mt_lpay_init() != MT_SUCCESS)
+    return MT_ERROR;
 
   // initialize clients
   for(int i = 0; i < CLI_NUM; i++){
@@ -906,7 +958,8 @@ static void test_mt_paymulti(void *arg){
     cli_desc.id[0] = ids++;
     cli_desc.id[1] = 0;
 
-    tt_assert(mt_cpay_init() == MT_SUCCESS);
+    if(mt_cpay_init() != MT_SUCCESS)
+      return MT_ERROR;
 
     byte digest[DIGEST_LEN];
     mt_desc2digest(&cli_desc, &digest);
@@ -916,7 +969,8 @@ static void test_mt_paymulti(void *arg){
     digestmap_set(statuses, (char*)digest, status);
 
     byte* pay_export;
-    tt_assert(mt_cpay_export(&pay_export) != MT_ERROR);
+    if(mt_cpay_export(&pay_export) == MT_ERROR)
+      return MT_ERROR;
     context_t* ctx = tor_malloc(sizeof(context_t));
     *ctx = (context_t){.desc = cli_desc, .state = pay_export};
     digestmap_set(cli_ctx, (char*)digest, ctx);
@@ -938,7 +992,8 @@ static void test_mt_paymulti(void *arg){
     rel_desc.id[0] = ids++;
     rel_desc.id[1] = 0;
 
-    tt_assert(mt_rpay_init() == MT_SUCCESS);
+    if(mt_rpay_init() != MT_SUCCESS)
+      return MT_ERROR;
 
     byte digest[DIGEST_LEN];
     mt_desc2digest(&rel_desc, &digest);
@@ -948,7 +1003,8 @@ static void test_mt_paymulti(void *arg){
     digestmap_set(statuses, (char*)digest, status);
 
     byte* pay_export;
-    tt_assert(mt_rpay_export(&pay_export) != MT_ERROR);
+    if(mt_rpay_export(&pay_export) == MT_ERROR)
+      return MT_ERROR;
     context_t* ctx = tor_malloc(sizeof(context_t));
     *ctx = (context_t){.desc = rel_desc, .state = pay_export};
     digestmap_set(rel_ctx, (char*)digest, ctx);
@@ -966,7 +1022,8 @@ static void test_mt_paymulti(void *arg){
     int_desc.id[0] = ids++;
     int_desc.id[1] = 0;
 
-    tt_assert(mt_ipay_init() == MT_SUCCESS);
+    if(mt_ipay_init() != MT_SUCCESS)
+      return MT_ERROR;
 
     byte digest[DIGEST_LEN];
     mt_desc2digest(&int_desc, &digest);
@@ -976,7 +1033,8 @@ static void test_mt_paymulti(void *arg){
     digestmap_set(statuses, (char*)digest, status);
 
     byte* pay_export;
-    tt_assert(mt_ipay_export(&pay_export) != MT_ERROR);
+    if(mt_ipay_export(&pay_export) == MT_ERROR)
+      return MT_ERROR;
     context_t* ctx = tor_malloc(sizeof(context_t));
     *ctx = (context_t){.desc = int_desc, .state = pay_export};
     digestmap_set(int_ctx, (char*)digest, ctx);
@@ -1004,6 +1062,35 @@ static void test_mt_paymulti(void *arg){
     *(int*)digestmap_get(statuses, (char*)int_digest) = 0;
   } MAP_FOREACH_END;
 
+  return MT_SUCCESS;
+}
+
+static void test_mt_paymulti(void *arg){
+  (void)arg;
+
+  typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
+					     workqueue_reply_t (*)(void*, void*),
+					     void (*)(void*), void*);
+
+  MOCK(mt_send_message, mock_send_message);
+  MOCK(mt_send_message_multidesc, mock_send_message_multidesc);
+  MOCK(mt_paymod_signal, mock_paymod_signal);
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+  MOCK(mt_cclient_relay_type, mock_cclient_relay_type);
+
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorPublicMint = 1;
+  options->MoneTorIntermediaryShards = 4;
+  options->MoneTorLedgerReceiptBatch = 8;
+  options->MoneTorChannelPool = 2;
+
+  // make sure we have enough relays to connect to
+  tt_assert(REL_NUM >= REL_CONNS);
+
+  tt_assert(set_up_parties() == MT_SUCCESS);
+
 
   /**************************** Protocol Tests ***************************/
 
@@ -1020,6 +1107,7 @@ static void test_mt_paymulti(void *arg){
   // mess with options for fun
   options->MoneTorSingleThread = 1;
   options->MoneTorAcknowledge = 0;
+  options->MoneTorLedgerReceiptBatch = 0;
 
   printf("\n restarting \n\n");
 
@@ -1031,16 +1119,49 @@ static void test_mt_paymulti(void *arg){
     tt_assert(do_main_loop_once() == MT_SUCCESS);
   }
 
+  // the ledger pipeline should have drained completely
+  mt_lpay_pipeline_stats_t stats;
+  mt_lpay_pipeline_stats(&stats);
+  tt_int_op(stats.depth[MT_LPAY_STAGE_VERIFY], OP_EQ, 0);
+  tt_int_op(stats.depth[MT_LPAY_STAGE_APPLY], OP_EQ, 0);
+  tt_int_op(stats.depth[MT_LPAY_STAGE_SIGN], OP_EQ, 0);
+  tt_assert(stats.completed[MT_LPAY_STAGE_VERIFY] > 0);
+  tt_assert(stats.completed[MT_LPAY_STAGE_APPLY] == stats.completed[MT_LPAY_STAGE_VERIFY]);
+  tt_assert(stats.completed[MT_LPAY_STAGE_SIGN] == stats.completed[MT_LPAY_STAGE_APPLY]);
+
   // assert final balances
 
+  uint64_t pool_hits = 0;
   MAP_FOREACH(digestmap_, cli_ctx, const char*, digest, context_t*, ctx){
     mt_cpay_import(ctx->state);
     int bal = mt_cpay_mac_bal() + mt_cpay_chn_bal();
     int exp = *(int*)digestmap_get(exp_bal, digest);
     exp += mt_cpay_chn_number() * MT_CHN_VAL_CLI;
     tor_assert(bal == exp);
+
+    mt_cpay_pool_stats_t pool_stats;
+    mt_cpay_pool_stats(&pool_stats);
+    tt_int_op(pool_stats.pending, OP_EQ, 0);
+    pool_hits += pool_stats.hits;
+
+    // every cpuworker job should have come back
+    mt_cpay_chn_stats_t chn_stats;
+    mt_cpay_chn_stats(&chn_stats);
+    tt_int_op(chn_stats.cpuworker_queued, OP_EQ, 0);
   } MAP_FOREACH_END;
 
+  // later establish calls should have found pooled channels waiting
+  tt_assert(pool_hits > 0);
+
+  // every role should have timed every phase of the channels' lives
+  for(int role = 0; role < MT_STATS_NUM_ROLES; role++){
+    for(int i = 0; i < MT_STATS_NUM_PHASES; i++){
+      mt_stats_hist_t hist;
+      mt_stats_get_hist(role, i, &hist);
+      tt_assert(hist.count > 0);
+    }
+  }
+
   MAP_FOREACH(digestmap_, rel_ctx, const char*, digest, context_t*, ctx){
     mt_rpay_import(ctx->state);
     int bal = mt_rpay_mac_bal() + mt_rpay_chn_bal();
@@ -1070,9 +1191,180 @@ static void test_mt_paymulti(void *arg){
   // free maps
 }
 
+/** Compare two uint64_t for qsort() */
+static int compare_uint64(const void* a, const void* b){
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Run the estab/pay/close flow of mt_paymulti once with the simulated crypto
+ * delays mocked out and report what it costs per event and per channel
+ * phase. Off by default; run it with "test +mt_paymulti/bench".
+ */
+static void test_mt_paymulti_bench(void *arg){
+  (void)arg;
+
+  typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
+					     workqueue_reply_t (*)(void*, void*),
+					     void (*)(void*), void*);
+
+  MOCK(mt_send_message, mock_send_message);
+  MOCK(mt_send_message_multidesc, mock_send_message_multidesc);
+  MOCK(mt_paymod_signal, mock_paymod_signal);
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+  MOCK(mt_cclient_relay_type, mock_cclient_relay_type);
+
+  static const char* role_names[MT_STATS_NUM_ROLES] = {
+    "cli", "rel", "int",
+  };
+  static const char* phase_names[MT_STATS_NUM_PHASES] = {
+    "establish", "pay", "close",
+  };
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorPublicMint = 1;
+  options->MoneTorIntermediaryShards = 4;
+
+  bench_mode = 1;
+  tt_assert(set_up_parties() == MT_SUCCESS);
+
+  uint64_t start_usec = monotime_absolute_usec();
+  set_up_main_loop();
+  while(smartlist_len(event_queue) > 0){
+    tt_assert(do_main_loop_once() == MT_SUCCESS);
+  }
+  uint64_t total_usec = monotime_absolute_usec() - start_usec;
+
+  printf("\n%-18s %8s %10s %8s %8s %8s\n", "event", "calls", "ops/sec",
+	 "p50us", "p90us", "p99us");
+  for(int i = 0; i < NUM_EVENT_TYPES; i++){
+    int num = bench_lat[i].num;
+    if(num == 0)
+      continue;
+
+    uint64_t* lat = bench_lat[i].usec;
+    uint64_t sum = 0;
+    qsort(lat, num, sizeof(uint64_t), compare_uint64);
+    for(int j = 0; j < num; j++)
+      sum += lat[j];
+
+    printf("%-18s %8d %10.0f %8"PRIu64" %8"PRIu64" %8"PRIu64"\n", event_names[i],
+	   num, sum ? num * 1000000.0 / sum : 0.0, lat[num * 50 / 100],
+	   lat[num * 90 / 100], lat[num * 99 / 100]);
+  }
+
+  printf("\n%-18s %8s %10s %10s\n", "phase", "done", "ops/sec", "mean us");
+  for(int role = 0; role < MT_STATS_NUM_ROLES; role++){
+    for(int i = 0; i < MT_STATS_NUM_PHASES; i++){
+      mt_stats_hist_t hist;
+      mt_stats_get_hist(role, i, &hist);
+      tt_assert(hist.count > 0);
+      printf("%s %-14s %8"PRIu64" %10.0f %10"PRIu64"\n", role_names[role], phase_names[i],
+	     hist.count, hist.count * 1000000.0 / total_usec, hist.total_usec / hist.count);
+    }
+  }
+
+  printf("\n%d events in %.3f sec\n", sim_time, total_usec / 1000000.0);
+
+ done:;
+
+  bench_mode = 0;
+  for(int i = 0; i < NUM_EVENT_TYPES; i++){
+    tor_free(bench_lat[i].usec);
+    bench_lat[i].num = 0;
+    bench_lat[i].cap = 0;
+  }
+
+  tor_assert(mt_lpay_clear() == MT_SUCCESS);
+
+  UNMOCK(mt_send_message);
+  UNMOCK(mt_send_message_multidesc);
+  UNMOCK(mt_paymod_signal);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(mt_micro_sleep);
+  UNMOCK(mt_cclient_relay_type);
+}
+
+static int pool_setups_sent;
+static byte pool_setup_pid[DIGEST_LEN];
+
+static int mock_send_pool_setup(mt_desc_t *desc, mt_ntype_t type, byte* msg, int size){
+  (void)desc;
+
+  if(type != MT_NTYPE_CHN_END_SETUP)
+    return MT_SUCCESS;
+
+  byte pk[MT_SZ_PK];
+  byte* raw;
+  int raw_size = mt_verify_signed_msg(msg, size, &pk, &raw);
+  chn_end_setup_t token;
+  tor_assert(raw_size != MT_ERROR);
+  tor_assert(unpack_chn_end_setup(raw, raw_size, &token, &pool_setup_pid) == MT_SUCCESS);
+  pool_setups_sent++;
+  return MT_SUCCESS;
+}
+
+/**
+ * Check that a pool channel whose setup is rejected by the ledger stops
+ * counting as pending
+ */
+static void test_mt_pool_failure(void *arg){
+  (void)arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorSingleThread = 1;
+  options->MoneTorPublicMint = 1;
+  options->MoneTorChannelPool = 1;
+
+  MOCK(mt_send_message, mock_send_pool_setup);
+  MOCK(mt_micro_sleep, mock_micro_sleep);
+
+  mt_desc_t idesc = {.id = {7, 7}, .party = MT_PARTY_INT};
+  mt_desc_t ldesc = {.id = {0, 0}, .party = MT_PARTY_LED};
+  mt_cpay_pool_stats_t stats;
+  byte* msg = NULL;
+
+  tt_int_op(mt_cpay_init(), OP_EQ, MT_SUCCESS);
+  pool_setups_sent = 0;
+  tt_int_op(mt_cpay_fill_pool(&idesc), OP_EQ, MT_SUCCESS);
+  tt_int_op(pool_setups_sent, OP_EQ, 1);
+  mt_cpay_pool_stats(&stats);
+  tt_int_op(stats.pending, OP_EQ, 1);
+
+  // the ledger turns the channel down
+  any_led_confirm_t confirm;
+  memset(&confirm, 0, sizeof(confirm));
+  confirm.success = MT_CODE_FAILURE;
+  int msg_size = pack_any_led_confirm(&confirm, &pool_setup_pid, &msg);
+  tt_int_op(mt_cpay_recv(&ldesc, MT_NTYPE_ANY_LED_CONFIRM, msg, msg_size), OP_EQ, MT_ERROR);
+  mt_cpay_pool_stats(&stats);
+  tt_int_op(stats.pending, OP_EQ, 0);
+
+  // so the pool tries again
+  tt_int_op(mt_cpay_fill_pool(&idesc), OP_EQ, MT_SUCCESS);
+  tt_int_op(pool_setups_sent, OP_EQ, 2);
+  mt_cpay_pool_stats(&stats);
+  tt_int_op(stats.pending, OP_EQ, 1);
+
+  mt_cpay_clear();
+  mt_cpay_pool_stats(&stats);
+  tt_int_op(stats.pending, OP_EQ, 0);
+  tt_int_op(stats.ready, OP_EQ, 0);
+
+ done:;
+  tor_free(msg);
+  UNMOCK(mt_send_message);
+  UNMOCK(mt_micro_sleep);
+}
+
 struct testcase_t mt_paymulti_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
   { "mt_paymulti", test_mt_paymulti, 0, NULL, NULL },
+  { "pool_failure", test_mt_pool_failure, TT_FORK, NULL, NULL },
+  { "bench", test_mt_paymulti_bench, TT_FORK|TT_OFF_BY_DEFAULT, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -0,0 +1,88 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "config.h"
+#include "mt_common.h"
+#include "mt_paywindow.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+/** Feed <b>pw</b> <b>rate</b> cells per second for <b>msec</b> from
+ * <b>*now</b> on */
+static void
+send_cells(mt_paywindow_t* pw, uint64_t* now, int rate, int msec)
+{
+  uint64_t end = *now + msec;
+  for(; *now < end; (*now)++){
+    for(int i = 0; i < rate / 1000; i++)
+      mt_paywindow_note_cell(pw, *now);
+  }
+}
+
+static void test_mt_paywindow(void *arg)
+{
+  (void) arg;
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorInitialWindow = 3000;
+  options->MoneTorPaymentRate = 2000;
+  options->MoneTorPaymentLatencyBudget = 2000;
+  options->MoneTorAdaptiveWindow = 1;
+
+  mt_paywindow_t* slow = mt_paywindow_new();
+  mt_paywindow_t* fast = mt_paywindow_new();
+  uint64_t now = 1000;
+
+  // without a throughput sample the fixed thresholds apply
+  tt_int_op(mt_paywindow_low(slow), OP_EQ, 1000);
+  tt_int_op(mt_paywindow_high(slow), OP_EQ, 1000);
+
+  uint64_t start = now;
+  send_cells(slow, &now, 1000, 1000);
+  now = start;
+  send_cells(fast, &now, 10000, 1000);
+
+  // the default round trip with headroom: 750 and 7500 cells
+  tt_int_op(mt_paywindow_low(slow), OP_GE, 740);
+  tt_int_op(mt_paywindow_low(slow), OP_LE, 760);
+  tt_int_op(mt_paywindow_low(fast), OP_GE, 7400);
+  tt_int_op(mt_paywindow_low(fast), OP_LE, 7600);
+
+  // slow hops top up by at least a unit, fast ones cover the whole budget
+  tt_int_op(mt_paywindow_high(slow), OP_EQ, mt_paywindow_low(slow) + 2000);
+  tt_int_op(mt_paywindow_high(fast), OP_GE, 19800);
+  tt_int_op(mt_paywindow_high(fast), OP_LE, 20200);
+
+  // a measured round trip replaces the default
+  mt_paywindow_note_pay_start(fast, now);
+  mt_paywindow_note_pay_done(fast, now + 100);
+  tt_int_op(mt_paywindow_low(fast), OP_GE, 1480);
+  tt_int_op(mt_paywindow_low(fast), OP_LE, 1520);
+
+  // completions without an outstanding payment are ignored
+  mt_paywindow_note_pay_done(fast, now + 5000);
+  tt_int_op(mt_paywindow_low(fast), OP_LE, 1520);
+
+  // later samples are smoothed rather than taken as they are
+  mt_paywindow_note_pay_start(fast, now);
+  mt_paywindow_note_pay_done(fast, now + 500);
+  tt_int_op(mt_paywindow_low(fast), OP_GT, 1520);
+  tt_int_op(mt_paywindow_low(fast), OP_LT, 7400);
+
+  // the fixed mode ignores what was measured
+  options->MoneTorAdaptiveWindow = 0;
+  tt_int_op(mt_paywindow_low(fast), OP_EQ, 1000);
+  tt_int_op(mt_paywindow_high(fast), OP_EQ, 1000);
+
+ done:;
+  mt_paywindow_free(slow);
+  mt_paywindow_free(fast);
+}
+
+struct testcase_t mt_paywindow_tests[] = {
+  { "mt_paywindow", test_mt_paywindow, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -0,0 +1,165 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "config.h"
+#include "workqueue.h"
+#include "cpuworker.h"
+#include "mt_crypto.h"
+#include "mt_common.h"
+#include "mt_reservoir.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+typedef struct {
+  workqueue_reply_t (*fn)(void*, void*);
+  int (*reply_fn)(void*);
+  void* arg;
+} queued_job_t;
+
+static smartlist_t* jobs;
+
+static workqueue_entry_t* mock_cpuworker_queue_work(workqueue_priority_t priority,
+						    workqueue_reply_t (*fn)(void*, void*),
+						    int (*reply_fn)(void*), void* arg){
+  (void)priority;
+  queued_job_t* job = tor_malloc(sizeof(queued_job_t));
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(jobs, job);
+  return (workqueue_entry_t*)job;
+}
+
+/** Run every queued job as the cpuworker and the main thread would */
+static void run_jobs(void){
+  smartlist_t* batch = jobs;
+  jobs = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(batch, queued_job_t*, job){
+    job->fn(NULL, job->arg);
+    job->reply_fn(job->arg);
+    tor_free(job);
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(batch);
+}
+
+static void test_mt_reservoir(void *arg)
+{
+  (void) arg;
+
+  typedef workqueue_entry_t* (*cpuworker_fn)(workqueue_priority_t,
+					     workqueue_reply_t (*)(void*, void*),
+					     void (*)(void*), void*);
+
+  or_options_t* options = get_options_mutable();
+  options->MoneTorReservoirSize = 4;
+  options->MoneTorSingleThread = 0;
+  options->MoneTorEd25519 = 1;
+
+  // start from an empty reservoir whatever earlier tests left behind
+  mt_reservoir_clear();
+  jobs = smartlist_new();
+  MOCK(cpuworker_queue_work, (cpuworker_fn)mock_cpuworker_queue_work);
+
+  byte* pp;
+  tor_assert(mt_hex2bytes(MT_PP_HEX, &pp) == MT_SZ_PP);
+  byte pk[MT_SZ_PK];
+  byte sk[MT_SZ_SK];
+  byte tail[MT_SZ_HASH];
+  byte preimage[MT_SZ_HASH];
+  mt_hc_t hc;
+  mt_reservoir_stats_t stats;
+
+  // filling queues one job per missing item of each kind
+  mt_reservoir_fill();
+  tt_int_op(smartlist_len(jobs), OP_EQ, 8);
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_int_op(stats.inflight, OP_EQ, 4);
+  tt_int_op(stats.ready, OP_EQ, 0);
+
+  // nothing more is queued while the stock is above the low watermark
+  mt_reservoir_fill();
+  tt_int_op(smartlist_len(jobs), OP_EQ, 8);
+
+  run_jobs();
+  mt_reservoir_get_stats(MT_RESERVOIR_HC, &stats);
+  tt_int_op(stats.ready, OP_EQ, 4);
+  tt_int_op(stats.inflight, OP_EQ, 0);
+  tt_u64_op(stats.produced, OP_EQ, 4);
+
+  // taken keys sign and chains verify like freshly generated ones
+  tt_int_op(mt_reservoir_keygen((byte (*)[MT_SZ_PP])pp, &pk, &sk), OP_EQ, MT_SUCCESS);
+  byte msg[] = "reservoir";
+  byte sig[MT_SZ_SIG];
+  tt_int_op(mt_sig_sign(msg, sizeof(msg), &sk, &sig), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_sig_verify(msg, sizeof(msg), &pk, &sig), OP_EQ, MT_SUCCESS);
+
+  tt_int_op(mt_reservoir_hc(&hc, MT_NAN_LEN, &tail), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_hc_get(&hc, 5, &preimage), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_hc_verify(&tail, &preimage, 5), OP_EQ, MT_SUCCESS);
+
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_int_op(stats.ready, OP_EQ, 3);
+  tt_u64_op(stats.hits, OP_EQ, 1);
+  tt_u64_op(stats.starved, OP_EQ, 0);
+
+  // falling to the low watermark tops the stock back up
+  tt_int_op(mt_reservoir_keygen((byte (*)[MT_SZ_PP])pp, &pk, &sk), OP_EQ, MT_SUCCESS);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 2);
+  run_jobs();
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_int_op(stats.ready, OP_EQ, 4);
+
+  // an empty reservoir computes inline and counts the starvation
+  for(int i = 0; i < 5; i++)
+    tt_int_op(mt_reservoir_keygen((byte (*)[MT_SZ_PP])pp, &pk, &sk), OP_EQ, MT_SUCCESS);
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_u64_op(stats.hits, OP_EQ, 6);
+  tt_u64_op(stats.starved, OP_EQ, 1);
+
+  // chains of other lengths are never taken from the reservoir
+  mt_reservoir_get_stats(MT_RESERVOIR_HC, &stats);
+  tt_int_op(mt_reservoir_hc(&hc, 10, &tail), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_hc_get(&hc, 9, &preimage), OP_EQ, MT_SUCCESS);
+  tt_int_op(mt_hc_verify(&tail, &preimage, 9), OP_EQ, MT_SUCCESS);
+  mt_reservoir_stats_t after;
+  mt_reservoir_get_stats(MT_RESERVOIR_HC, &after);
+  tt_int_op(after.ready, OP_EQ, stats.ready);
+
+  // keys of the other signature scheme are not handed out
+  run_jobs();
+  options->MoneTorEd25519 = 0;
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_int_op(mt_reservoir_keygen((byte (*)[MT_SZ_PP])pp, &pk, &sk), OP_EQ, MT_SUCCESS);
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &after);
+  tt_u64_op(after.starved, OP_EQ, stats.starved + 1);
+  tt_int_op(after.ready, OP_EQ, 0);
+
+  // items that come back after a clear are dropped
+  mt_reservoir_clear();
+  run_jobs();
+  mt_reservoir_get_stats(MT_RESERVOIR_KEY, &stats);
+  tt_int_op(stats.ready, OP_EQ, 0);
+  tt_int_op(stats.inflight, OP_EQ, 0);
+
+  // single-threaded mode queues nothing
+  options->MoneTorSingleThread = 1;
+  mt_reservoir_fill();
+  tt_int_op(smartlist_len(jobs), OP_EQ, 0);
+
+ done:;
+  UNMOCK(cpuworker_queue_work);
+  mt_reservoir_clear();
+  SMARTLIST_FOREACH(jobs, queued_job_t*, job, { tor_free(job->arg); tor_free(job); });
+  smartlist_free(jobs);
+  tor_free(pp);
+  options->MoneTorSingleThread = 0;
+  options->MoneTorEd25519 = 0;
+}
+
+struct testcase_t mt_reservoir_tests[] = {
+  { "mt_reservoir", test_mt_reservoir, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
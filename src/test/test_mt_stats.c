@@ -0,0 +1,124 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "or.h"
+#include "mt_common.h"
+#include "mt_reservoir.h"
+#include "mt_stats.h"
+
+#pragma GCC diagnostic ignored "-Wstack-protector"
+
+static void test_mt_stats(void *arg)
+{
+  (void) arg;
+
+  mt_desc_t rdesc = {.id = {1, 2}, .party = MT_PARTY_REL};
+  mt_desc_t idesc1 = {.id = {3, 4}, .party = MT_PARTY_INT};
+  mt_desc_t idesc2 = {.id = {5, 6}, .party = MT_PARTY_INT};
+  mt_desc_t cdesc = {.id = {7, 8}, .party = MT_PARTY_CLI};
+  mt_stats_hist_t hist;
+  mt_stats_result_t result;
+  char* answer = NULL;
+  const char* errmsg = NULL;
+
+  mt_stats_clear();
+
+  // latencies land in log2 millisecond buckets
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &rdesc, &idesc1, 500);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &rdesc, &idesc1, 1500);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &rdesc, &idesc1, 5000);
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_PAY, &rdesc, &idesc2, 3600ull * 1000000);
+  mt_stats_get_hist(MT_STATS_CLIENT, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 4);
+  tt_u64_op(hist.total_usec, OP_EQ, 7000 + 3600ull * 1000000);
+  tt_u64_op(hist.buckets[0], OP_EQ, 1);
+  tt_u64_op(hist.buckets[1], OP_EQ, 1);
+  tt_u64_op(hist.buckets[3], OP_EQ, 1);
+  tt_u64_op(hist.buckets[MT_STATS_HIST_BUCKETS - 1], OP_EQ, 1);
+  mt_stats_get_hist(MT_STATS_CLIENT, MT_STATS_ESTAB, &hist);
+  tt_u64_op(hist.count, OP_EQ, 0);
+
+  // each role keeps histograms of its own
+  mt_stats_note_done(MT_STATS_RELAY, MT_STATS_PAY, &cdesc, &idesc1, 2500);
+  mt_stats_note_done(MT_STATS_INTERMEDIARY, MT_STATS_PAY, &cdesc, NULL, 300);
+  mt_stats_get_hist(MT_STATS_RELAY, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 1);
+  tt_u64_op(hist.buckets[2], OP_EQ, 1);
+  mt_stats_get_hist(MT_STATS_INTERMEDIARY, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 1);
+  tt_u64_op(hist.buckets[0], OP_EQ, 1);
+  mt_stats_get_hist(MT_STATS_CLIENT, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 4);
+
+  // the phase of a message decides which outcome a failure counts against
+  tt_int_op(mt_stats_phase_of(MT_NTYPE_NAN_INT_ESTAB5), OP_EQ, MT_STATS_ESTAB);
+  tt_int_op(mt_stats_phase_of(MT_NTYPE_NAN_CLI_PAY1), OP_EQ, MT_STATS_PAY);
+  tt_int_op(mt_stats_phase_of(MT_NTYPE_NAN_END_CLOSE5), OP_EQ, MT_STATS_CLOSE);
+
+  // outcomes are counted per intermediary
+  mt_stats_note_done(MT_STATS_CLIENT, MT_STATS_ESTAB, &rdesc, &idesc1, 1000);
+  mt_stats_note_failed(MT_STATS_CLIENT, MT_STATS_CLOSE, &rdesc, &idesc1);
+  mt_stats_note_failed(MT_STATS_CLIENT, MT_STATS_ESTAB, &rdesc, &idesc2);
+  mt_stats_get_result(&idesc1, &result);
+  tt_u64_op(result.done[MT_STATS_ESTAB], OP_EQ, 1);
+  tt_u64_op(result.done[MT_STATS_PAY], OP_EQ, 4);
+  tt_u64_op(result.failed[MT_STATS_CLOSE], OP_EQ, 1);
+  tt_u64_op(result.failed[MT_STATS_ESTAB], OP_EQ, 0);
+  mt_stats_get_result(&idesc2, &result);
+  tt_u64_op(result.done[MT_STATS_PAY], OP_EQ, 1);
+  tt_u64_op(result.failed[MT_STATS_ESTAB], OP_EQ, 1);
+
+  // the control port sees the same numbers
+  tt_int_op(getinfo_helper_mt(NULL, "mt/latency/pay", &answer, &errmsg), OP_EQ, 0);
+  tt_str_op(answer, OP_EQ, "CLIENT COUNT=4 TOTAL-MS=3600007 HIST=1:1,2:1,4:0,8:1,16:0,32:0,"
+	    "64:0,128:0,256:0,512:0,1024:0,2048:0,4096:0,8192:0,16384:0,inf:1\n"
+	    "RELAY COUNT=1 TOTAL-MS=2 HIST=1:0,2:0,4:1,8:0,16:0,32:0,"
+	    "64:0,128:0,256:0,512:0,1024:0,2048:0,4096:0,8192:0,16384:0,inf:0\n"
+	    "INTERMEDIARY COUNT=1 TOTAL-MS=0 HIST=1:1,2:0,4:0,8:0,16:0,32:0,"
+	    "64:0,128:0,256:0,512:0,1024:0,2048:0,4096:0,8192:0,16384:0,inf:0");
+  tor_free(answer);
+
+  tt_int_op(getinfo_helper_mt(NULL, "mt/intermediaries", &answer, &errmsg), OP_EQ, 0);
+  tt_str_op(answer, OP_EQ, "3.4 ESTABLISH=1,0 PAY=4,0 CLOSE=0,1\n"
+	    "5.6 ESTABLISH=0,1 PAY=1,0 CLOSE=0,0");
+  tor_free(answer);
+
+  tt_int_op(getinfo_helper_mt(NULL, "mt/cpuworker", &answer, &errmsg), OP_EQ, 0);
+  tt_assert(!strcmpstart(answer, "QUEUED="));
+  tor_free(answer);
+
+  tt_int_op(getinfo_helper_mt(NULL, "mt/pool", &answer, &errmsg), OP_EQ, 0);
+  tt_assert(!strcmpstart(answer, "HITS="));
+  tor_free(answer);
+
+  mt_reservoir_clear();
+  tt_int_op(getinfo_helper_mt(NULL, "mt/reservoir", &answer, &errmsg), OP_EQ, 0);
+  tt_str_op(answer, OP_EQ, "KEY READY=0 INFLIGHT=0 HITS=0 STARVED=0 PRODUCED=0\n"
+	    "HC READY=0 INFLIGHT=0 HITS=0 STARVED=0 PRODUCED=0");
+  tor_free(answer);
+
+  tt_int_op(getinfo_helper_mt(NULL, "mt/nonsense", &answer, &errmsg), OP_EQ, 0);
+  tt_ptr_op(answer, OP_EQ, NULL);
+
+  // clearing forgets everything
+  mt_stats_clear();
+  mt_stats_get_hist(MT_STATS_CLIENT, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 0);
+  mt_stats_get_hist(MT_STATS_RELAY, MT_STATS_PAY, &hist);
+  tt_u64_op(hist.count, OP_EQ, 0);
+  mt_stats_get_result(&idesc1, &result);
+  tt_u64_op(result.done[MT_STATS_PAY], OP_EQ, 0);
+  tt_int_op(getinfo_helper_mt(NULL, "mt/intermediaries", &answer, &errmsg), OP_EQ, 0);
+  tt_str_op(answer, OP_EQ, "");
+
+ done:;
+  tor_free(answer);
+  mt_stats_clear();
+}
+
+struct testcase_t mt_stats_tests[] = {
+  { "mt_stats", test_mt_stats, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
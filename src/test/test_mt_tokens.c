@@ -6,6 +6,7 @@
 
 #include "test.h"
 #include "or.h"
+#include "config.h"
 #include "mt_crypto.h"
 #include "mt_tokens.h"
 
@@ -26,7 +27,7 @@ static void test_mt_tokens(void *arg)
   byte pk[MT_SZ_PK];
   byte sk[MT_SZ_SK];
   mt_crypt_setup(&pp);
-  mt_crypt_keygen(&pp, &pk, &sk);
+  mt_crypt_keygen(&pp, MT_KEY_RSA, &pk, &sk);
 
   byte proto_id[DIGEST_LEN];
   write_random_bytes(proto_id, DIGEST_LEN);
@@ -38,6 +39,7 @@ static void test_mt_tokens(void *arg)
 
   int signed_msg_size = mt_create_signed_msg(msg, strlen((char*)msg), &pk, &sk, &signed_msg);
   tt_assert(signed_msg_size != MT_ERROR);
+  tt_int_op(signed_msg_size, OP_EQ, 1 + strlen((char*)msg) + MT_SZ_WIRE_PK + MT_SZ_SIG);
 
   byte pk_out[MT_SZ_PK];
   byte* msg_out;
@@ -45,9 +47,53 @@ static void test_mt_tokens(void *arg)
   tt_assert(msg_size != MT_ERROR);
   tt_assert(memcmp(pk, pk_out, MT_SZ_PK) == 0);
   tt_assert(memcmp(msg, msg_out, msg_size) == 0);
+  tt_ptr_op(msg_out, OP_EQ, signed_msg + 1);
 
   free(signed_msg);
-  free(msg_out);
+
+  // a batch mixing RSA and Ed25519 signers, with one corrupted message
+  byte ed_pk[MT_SZ_PK];
+  byte ed_sk[MT_SZ_SK];
+  mt_crypt_keygen(&pp, MT_KEY_ED25519, &ed_pk, &ed_sk);
+
+  byte* batch_in[3];
+  int batch_sizes[3];
+  byte batch_pks[3][MT_SZ_PK];
+  byte* batch_out[3];
+  int batch_out_sizes[3];
+  int msg_len = strlen((char*)msg);
+
+  batch_sizes[0] = mt_create_signed_msg(msg, msg_len, &pk, &sk, &batch_in[0]);
+  batch_sizes[1] = mt_create_signed_msg(msg, msg_len, &ed_pk, &ed_sk, &batch_in[1]);
+  batch_sizes[2] = mt_create_signed_msg(msg, msg_len, &ed_pk, &ed_sk, &batch_in[2]);
+  // Ed25519 signers only send the 32-byte key and 64-byte signature
+  tt_int_op(batch_sizes[1], OP_EQ, 1 + msg_len + 32 + 64);
+  tt_int_op(batch_sizes[2], OP_EQ, batch_sizes[1]);
+  batch_in[2][1] ^= 1;
+
+  tt_int_op(mt_verify_signed_msgs(3, batch_in, batch_sizes, batch_pks, batch_out,
+				  batch_out_sizes), OP_EQ, MT_ERROR);
+  tt_int_op(batch_out_sizes[0], OP_EQ, msg_len);
+  tt_int_op(batch_out_sizes[1], OP_EQ, msg_len);
+  tt_int_op(batch_out_sizes[2], OP_EQ, MT_ERROR);
+  tt_mem_op(batch_out[1], OP_EQ, msg, msg_len);
+  tt_ptr_op(batch_out[2], OP_EQ, NULL);
+  tt_mem_op(batch_pks[0], OP_EQ, pk, MT_SZ_PK);
+  tt_mem_op(batch_pks[1], OP_EQ, ed_pk, MT_SZ_PK);
+
+  // the scheme byte sets the expected size of a signed message on the wire
+  size_t any_trans_size = mt_token_get_size_of(MT_NTYPE_MAC_ANY_TRANS);
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_MAC_ANY_TRANS, batch_in[0], 1), OP_EQ,
+	    any_trans_size);
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_MAC_ANY_TRANS, batch_in[1], 1), OP_EQ,
+	    any_trans_size - (batch_sizes[0] - batch_sizes[1]));
+  batch_in[2][0] = 0x7f;
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_MAC_ANY_TRANS, batch_in[2], 1), OP_EQ, 0);
+  tt_int_op(mt_verify_signed_msg(batch_in[2], batch_sizes[2], &pk_out, &msg_out), OP_EQ,
+	    MT_ERROR);
+
+  for(int i = 0; i < 3; i++)
+    tor_free(batch_in[i]);
 
   /**************************** Pack/Unpack Tokens *****************************/
 
@@ -73,6 +119,19 @@ static void test_mt_tokens(void *arg)
   write_random_bytes(&tk1_chn_end_cashout, sizeof(chn_end_cashout_t));
   write_random_bytes(&tk1_chn_int_cashout, sizeof(chn_int_cashout_t));
 
+  // public keys only go on the wire in their compact form
+  memcpy(tk1_mac_aut_mint.pk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_end_setup.chn_public.cpk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_int_setup.chn_public.cpk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_int_reqclose.pk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_end_close.refund_token.wpk, pk, MT_SZ_PK);
+  memset(tk1_chn_end_close.refund_token.conditional, 0, MT_SZ_PK);
+  memcpy(tk1_chn_end_close.pk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_int_close.revocation.msg + sizeof(byte), pk, MT_SZ_PK);
+  memcpy(tk1_chn_int_close.pk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_end_cashout.pk, pk, MT_SZ_PK);
+  memcpy(tk1_chn_int_cashout.pk, pk, MT_SZ_PK);
+
   // string pointers that will point to the network sendable strings
   byte* str_mac_aut_mint;
   byte* str_mac_any_trans;
@@ -117,16 +176,75 @@ static void test_mt_tokens(void *arg)
   unpack_chn_end_cashout(str_chn_end_cashout, size_chn_end_cashout, &tk2_chn_end_cashout, &proto_id);
   unpack_chn_int_cashout(str_chn_int_cashout, size_chn_int_cashout, &tk2_chn_int_cashout, &proto_id);
 
-  // tt_assert that the original tokens are identical to the new torkns
-  tt_assert(memcmp(&tk1_mac_aut_mint, &tk2_mac_aut_mint, sizeof(mac_aut_mint_t)) == 0);
-  tt_assert(memcmp(&tk1_mac_any_trans, &tk2_mac_any_trans, sizeof(mac_any_trans_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_end_setup, &tk2_chn_end_setup, sizeof(chn_end_setup_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_int_setup, &tk2_chn_int_setup, sizeof(chn_int_setup_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_int_reqclose, &tk2_chn_int_reqclose, sizeof(chn_int_reqclose_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_end_close, &tk2_chn_end_close, sizeof(chn_end_close_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_int_close, &tk2_chn_int_close, sizeof(chn_int_close_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_end_cashout, &tk2_chn_end_cashout, sizeof(chn_end_cashout_t)) == 0);
-  tt_assert(memcmp(&tk1_chn_int_cashout, &tk2_chn_int_cashout,   sizeof(chn_int_cashout_t)) == 0);
+  // every token has the fixed size that the cell reassembly expects
+  tt_int_op(size_mac_aut_mint, OP_EQ, mt_token_get_size_of(MT_NTYPE_MAC_AUT_MINT));
+  tt_int_op(size_chn_int_reqclose, OP_EQ, mt_token_get_size_of(MT_NTYPE_CHN_INT_REQCLOSE));
+  tt_int_op(size_chn_end_close, OP_EQ, mt_token_get_size_of(MT_NTYPE_CHN_END_CLOSE));
+  tt_int_op(size_chn_int_close, OP_EQ, mt_token_get_size_of(MT_NTYPE_CHN_INT_CLOSE));
+  tt_int_op(size_chn_end_cashout, OP_EQ, mt_token_get_size_of(MT_NTYPE_CHN_END_CASHOUT));
+  tt_int_op(size_chn_int_cashout, OP_EQ, mt_token_get_size_of(MT_NTYPE_CHN_INT_CASHOUT));
+  tt_int_op(size_mac_aut_mint, OP_LT, sizeof(mac_aut_mint_t));
+  tt_int_op(size_chn_end_close, OP_LT, sizeof(chn_end_close_t));
+
+  // spot check the fields of the new tokens
+  tt_int_op(tk1_mac_aut_mint.value, OP_EQ, tk2_mac_aut_mint.value);
+  tt_mem_op(tk1_mac_aut_mint.nonce, OP_EQ, tk2_mac_aut_mint.nonce, MT_SZ_HASH);
+  tt_mem_op(tk2_mac_aut_mint.pk, OP_EQ, pk, MT_SZ_PK);
+  tt_int_op(tk1_chn_end_setup.val_from, OP_EQ, tk2_chn_end_setup.val_from);
+  tt_int_op(tk1_chn_end_setup.chn_public.int_bal, OP_EQ, tk2_chn_end_setup.chn_public.int_bal);
+  tt_mem_op(tk2_chn_end_setup.chn_public.cpk, OP_EQ, pk, MT_SZ_PK);
+  tt_assert(tor_mem_is_zero((char*)tk2_chn_end_close.refund_token.conditional, MT_SZ_PK));
+  tt_int_op(tk1_chn_int_close.close_code, OP_EQ, tk2_chn_int_close.close_code);
+  tt_int_op(tk1_chn_int_close.last_pay_num, OP_EQ, tk2_chn_int_close.last_pay_num);
+  tt_mem_op(tk1_chn_int_close.revocation.msg, OP_EQ, tk2_chn_int_close.revocation.msg,
+	    sizeof(tk1_chn_int_close.revocation.msg));
+  tt_mem_op(tk1_chn_int_close.revocation.sig, OP_EQ, tk2_chn_int_close.revocation.sig, MT_SZ_SIG);
+
+  // the new tokens pack into exactly the same strings
+  byte* str2;
+  tt_int_op(pack_mac_aut_mint(&tk2_mac_aut_mint, &proto_id, &str2), OP_EQ, size_mac_aut_mint);
+  tt_mem_op(str2, OP_EQ, str_mac_aut_mint, size_mac_aut_mint);
+  tor_free(str2);
+  tt_int_op(pack_mac_any_trans(&tk2_mac_any_trans, &proto_id, &str2), OP_EQ, size_mac_any_trans);
+  tt_mem_op(str2, OP_EQ, str_mac_any_trans, size_mac_any_trans);
+  tor_free(str2);
+  tt_int_op(pack_chn_end_setup(&tk2_chn_end_setup, &proto_id, &str2), OP_EQ, size_chn_end_setup);
+  tt_mem_op(str2, OP_EQ, str_chn_end_setup, size_chn_end_setup);
+  tor_free(str2);
+  tt_int_op(pack_chn_int_setup(&tk2_chn_int_setup, &proto_id, &str2), OP_EQ, size_chn_int_setup);
+  tt_mem_op(str2, OP_EQ, str_chn_int_setup, size_chn_int_setup);
+  tor_free(str2);
+  tt_int_op(pack_chn_int_reqclose(&tk2_chn_int_reqclose, &proto_id, &str2), OP_EQ, size_chn_int_reqclose);
+  tt_mem_op(str2, OP_EQ, str_chn_int_reqclose, size_chn_int_reqclose);
+  tor_free(str2);
+  tt_int_op(pack_chn_end_close(&tk2_chn_end_close, &proto_id, &str2), OP_EQ, size_chn_end_close);
+  tt_mem_op(str2, OP_EQ, str_chn_end_close, size_chn_end_close);
+  tor_free(str2);
+  tt_int_op(pack_chn_int_close(&tk2_chn_int_close, &proto_id, &str2), OP_EQ, size_chn_int_close);
+  tt_mem_op(str2, OP_EQ, str_chn_int_close, size_chn_int_close);
+  tor_free(str2);
+  tt_int_op(pack_chn_end_cashout(&tk2_chn_end_cashout, &proto_id, &str2), OP_EQ, size_chn_end_cashout);
+  tt_mem_op(str2, OP_EQ, str_chn_end_cashout, size_chn_end_cashout);
+  tor_free(str2);
+  tt_int_op(pack_chn_int_cashout(&tk2_chn_int_cashout, &proto_id, &str2), OP_EQ, size_chn_int_cashout);
+  tt_mem_op(str2, OP_EQ, str_chn_int_cashout, size_chn_int_cashout);
+  tor_free(str2);
+
+  // a key with no compact form fails the pack instead of going out blank
+  tk2_chn_end_setup.chn_public.cpk[0] ^= 0xff;
+  str2 = NULL;
+  tt_int_op(pack_chn_end_setup(&tk2_chn_end_setup, &proto_id, &str2), OP_EQ, MT_ERROR);
+  tt_ptr_op(str2, OP_EQ, NULL);
+
+  // strings of another version, type or size are rejected
+  str_mac_aut_mint[0] = MT_WIRE_VERSION + 1;
+  tt_int_op(unpack_mac_aut_mint(str_mac_aut_mint, size_mac_aut_mint, &tk2_mac_aut_mint, &proto_id),
+	    OP_EQ, MT_ERROR);
+  tt_int_op(unpack_mac_any_trans(str_chn_int_cashout, size_chn_int_cashout, &tk2_mac_any_trans,
+				 &proto_id), OP_EQ, MT_ERROR);
+  str_chn_int_cashout[1] = MT_NTYPE_CHN_END_CASHOUT;
+  tt_int_op(unpack_chn_int_cashout(str_chn_int_cashout, size_chn_int_cashout, &tk2_chn_int_cashout,
+				   &proto_id), OP_EQ, MT_ERROR);
 
  done:
   tor_free(str_mac_aut_mint);
@@ -142,9 +260,68 @@ static void test_mt_tokens(void *arg)
   UNMOCK(mt_micro_sleep);
 }
 
+/**
+ * Check that receipts carry their Merkle path on the wire only when they are
+ * part of a batch, as told by the marker byte
+ */
+static void test_mt_tokens_receipt_batching(void *arg)
+{
+  (void) arg;
+
+  byte proto_id[DIGEST_LEN];
+  write_random_bytes(proto_id, DIGEST_LEN);
+
+  any_led_confirm_t tk1;
+  any_led_confirm_t tk2;
+  write_random_bytes(&tk1, sizeof(tk1));
+  tk1.success = MT_CODE_SUCCESS;
+  tk1.receipt.type = MT_NTYPE_CHN_INT_SETUP;
+  tk1.receipt.batch_size = 0;
+
+  byte* str = NULL;
+  byte pid[DIGEST_LEN];
+
+  size_t max_size = mt_token_get_size_of(MT_NTYPE_ANY_LED_CONFIRM);
+  size_t plain_size = max_size - 2 * sizeof(uint32_t) - sizeof(tk1.receipt.path);
+  tt_int_op(pack_any_led_confirm(&tk1, &proto_id, &str), OP_EQ, plain_size);
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_ANY_LED_CONFIRM, str, plain_size), OP_EQ,
+	    plain_size);
+  tt_int_op(unpack_any_led_confirm(str, plain_size, &tk2, &pid), OP_EQ, MT_SUCCESS);
+  tt_mem_op(tk2.receipt.sig, OP_EQ, tk1.receipt.sig, MT_SZ_SIG);
+  tt_int_op(tk2.receipt.batch_size, OP_EQ, 0);
+  tt_assert(tor_mem_is_zero((char*)tk2.receipt.path, sizeof(tk2.receipt.path)));
+
+  // a marker that claims batch fields the string does not have is rejected
+  str[plain_size - 1] = 1;
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_ANY_LED_CONFIRM, str, plain_size), OP_EQ,
+	    max_size);
+  tt_int_op(unpack_any_led_confirm(str, plain_size, &tk2, &pid), OP_EQ, MT_ERROR);
+  str[plain_size - 1] = 2;
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_ANY_LED_CONFIRM, str, plain_size), OP_EQ, 0);
+  tt_int_op(unpack_any_led_confirm(str, plain_size, &tk2, &pid), OP_EQ, MT_ERROR);
+  tor_free(str);
+
+  tk1.receipt.batch_size = 5;
+  tk1.receipt.index = 3;
+  tt_int_op(pack_any_led_confirm(&tk1, &proto_id, &str), OP_EQ, max_size);
+  tt_int_op(mt_token_get_size_of_msg(MT_NTYPE_ANY_LED_CONFIRM, str, RELAY_PPAYLOAD_SIZE),
+	    OP_EQ, max_size);
+  tt_int_op(unpack_any_led_confirm(str, max_size, &tk2, &pid), OP_EQ, MT_SUCCESS);
+  tt_int_op(tk2.receipt.batch_size, OP_EQ, 5);
+  tt_int_op(tk2.receipt.index, OP_EQ, 3);
+  tt_mem_op(tk2.receipt.path, OP_EQ, tk1.receipt.path, sizeof(tk1.receipt.path));
+
+  // a batched receipt cut short is rejected
+  tt_int_op(unpack_any_led_confirm(str, plain_size, &tk2, &pid), OP_EQ, MT_ERROR);
+
+ done:
+  tor_free(str);
+}
+
 struct testcase_t mt_tokens_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
   { "mt_tokens", test_mt_tokens, 0, NULL, NULL },
+  { "receipt_batching", test_mt_tokens_receipt_batching, 0, NULL, NULL },
   END_OF_TESTCASES
 };
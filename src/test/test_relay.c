@@ -16,6 +16,7 @@
 static or_circuit_t * new_fake_orcirc(channel_t *nchan, channel_t *pchan);
 
 static void test_relay_append_cell_to_circuit_queue(void *arg);
+static void test_relay_append_pcell_to_circuit_queue(void *arg);
 
 static or_circuit_t *
 new_fake_orcirc(channel_t *nchan, channel_t *pchan)
@@ -31,6 +32,7 @@ new_fake_orcirc(channel_t *nchan, channel_t *pchan)
   circ->n_circ_id = get_unique_circ_id_by_chan(nchan);
   circ->n_mux = NULL; /* ?? */
   cell_queue_init(&(circ->n_chan_cells));
+  cell_queue_init(&(circ->n_chan_pcells));
   circ->n_hop = NULL;
   circ->streams_blocked_on_n_chan = 0;
   circ->streams_blocked_on_p_chan = 0;
@@ -46,6 +48,7 @@ new_fake_orcirc(channel_t *nchan, channel_t *pchan)
   orcirc->p_chan = pchan;
   orcirc->p_circ_id = get_unique_circ_id_by_chan(pchan);
   cell_queue_init(&(orcirc->p_chan_cells));
+  cell_queue_init(&(orcirc->p_chan_pcells));
 
   return orcirc;
 }
@@ -126,9 +129,96 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_append_pcell_to_circuit_queue(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  circuit_t *circ = NULL;
+  cell_t *cell = NULL;
+  uint64_t old_flushed;
+
+  (void)arg;
+
+  nchan = new_fake_channel();
+  tt_assert(nchan);
+  pchan = new_fake_channel();
+  tt_assert(pchan);
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circ = TO_CIRCUIT(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, circ, CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, circ, CELL_DIRECTION_IN);
+
+  cell = tor_malloc_zero(sizeof(cell_t));
+  make_fake_cell(cell);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  /* A relay cell can take the payment queue while nothing is ahead of it */
+  append_pcell_to_circuit_queue(circ, nchan, cell, CELL_DIRECTION_OUT);
+  tt_int_op(circ->n_chan_pcells.n, OP_EQ, 1);
+  tt_int_op(circ->n_chan_cells.n, OP_EQ, 0);
+
+  /* Once data is queued, later relay cells must stay behind it */
+  append_cell_to_circuit_queue(circ, nchan, cell, CELL_DIRECTION_OUT, 0);
+  append_pcell_to_circuit_queue(circ, nchan, cell, CELL_DIRECTION_OUT);
+  tt_int_op(circ->n_chan_pcells.n, OP_EQ, 1);
+  tt_int_op(circ->n_chan_cells.n, OP_EQ, 2);
+
+  /* Direct payment cells always take the payment queue */
+  cell->command = CELL_PAYMENT;
+  append_pcell_to_circuit_queue(circ, nchan, cell, CELL_DIRECTION_OUT);
+  tt_int_op(circ->n_chan_pcells.n, OP_EQ, 2);
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 4);
+  tt_int_op(circuitmux_num_pcells(nchan->cmux), OP_EQ, 2);
+
+  append_pcell_to_circuit_queue(circ, pchan, cell, CELL_DIRECTION_IN);
+  tt_int_op(orcirc->p_chan_pcells.n, OP_EQ, 1);
+  tt_int_op(circuitmux_num_pcells(pchan->cmux), OP_EQ, 1);
+
+  /* Payment cells are flushed first and counted */
+  old_flushed = stats_n_pcells_flushed;
+  tt_int_op(channel_flush_from_first_active_circuit(nchan, 3), OP_EQ, 3);
+  tt_u64_op(stats_n_pcells_flushed, OP_EQ, old_flushed + 2);
+  tt_int_op(circ->n_chan_pcells.n, OP_EQ, 0);
+  tt_int_op(circ->n_chan_cells.n, OP_EQ, 1);
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 1);
+  tt_int_op(circuitmux_num_pcells(nchan->cmux), OP_EQ, 0);
+
+  UNMOCK(scheduler_channel_has_waiting_cells);
+
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  channel_mark_for_close(nchan);
+  channel_mark_for_close(pchan);
+  UNMOCK(scheduler_release_channel);
+
+  channel_free_all();
+
+ done:
+  tor_free(cell);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->base_.n_chan_pcells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_pcells);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "append_pcell_to_circuit_queue",
+    test_relay_append_pcell_to_circuit_queue, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -28,12 +28,29 @@
 #define tor_trace(subsystem, name, ...) \
   tor_trace_##subsystem(name, __VA_ARGS__)
 
+/* Every framework below redefines tor_trace(), so only one can be used. */
+#if (defined(USE_EVENT_TRACING_DEBUG) + defined(USE_EVENT_TRACING_USDT) + \
+     defined(USE_EVENT_TRACING_LTTNG)) > 1
+#error "Only one event tracing framework can be enabled."
+#endif
+
 /* Enable event tracing for the debug framework where all trace events are
  * mapped to a log_debug(). */
 #ifdef USE_EVENT_TRACING_DEBUG
 #include "trace/debug.h"
 #endif
 
+/* Enable event tracing through USDT probes that SystemTap, bpftrace or
+ * DTrace can attach to in a running tor. */
+#ifdef USE_EVENT_TRACING_USDT
+#include "trace/usdt.h"
+#endif
+
+/* Enable event tracing through LTTng-UST tracepoints. */
+#ifdef USE_EVENT_TRACING_LTTNG
+#include "trace/lttng.h"
+#endif
+
 #else /* TOR_EVENT_TRACING_ENABLED */
 
 /* Reaching this point, we NOP every event declaration because event tracing
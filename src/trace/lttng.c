@@ -0,0 +1,12 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file lttng.c
+ * \brief Instantiate the LTTng-UST tracepoint providers.
+ **/
+
+#define TRACEPOINT_CREATE_PROBES
+#define TRACEPOINT_DEFINE
+
+#include "trace/lttng_mt.h"
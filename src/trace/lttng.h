@@ -0,0 +1,21 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file lttng.h
+ * \brief Map trace events to LTTng-UST tracepoints.
+ **/
+
+#ifndef TOR_TRACE_LTTNG_H
+#define TOR_TRACE_LTTNG_H
+
+/* Every event becomes the tracepoint <b>name</b> of provider
+ * "tor_<subsystem>", which must be declared in trace/lttng_<subsystem>.h
+ * with the same arguments as its tor_trace() call. */
+#undef tor_trace
+#define tor_trace(subsystem, name, args...) \
+  tracepoint(tor_##subsystem, name, ## args)
+
+#include "trace/lttng_mt.h"
+
+#endif /* TOR_TRACE_LTTNG_H */
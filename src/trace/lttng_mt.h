@@ -0,0 +1,113 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file lttng_mt.h
+ * \brief LTTng-UST tracepoints of the moneTor payment layer.
+ *
+ * Descriptors are recorded as their two ids and party, tokens as their
+ * mt_ntype_t. The tracer timestamps every event, so the latency of a token is
+ * the distance between its recv_begin and recv_end events.
+ **/
+
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER tor_mt
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "trace/lttng_mt.h"
+
+#if !defined(TOR_TRACE_LTTNG_MT_H) || defined(TRACEPOINT_HEADER_MULTI_READ)
+#define TOR_TRACE_LTTNG_MT_H
+
+#include <stdint.h>
+#include <lttng/tracepoint.h>
+
+/* A message is handed to a controller to be sent. */
+TRACEPOINT_EVENT(tor_mt, send_message,
+  TP_ARGS(uint64_t, id0, uint64_t, id1, int, party, int, type, int, size),
+  TP_FIELDS(
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+    ctf_integer(int, party, party)
+    ctf_integer(int, type, type)
+    ctf_integer(int, size, size)
+  )
+)
+
+/* A payment cell arrives on a circuit, before reassembly. */
+TRACEPOINT_EVENT(tor_mt, recv_relaycell,
+  TP_ARGS(int, type, int, length, int, msg_len),
+  TP_FIELDS(
+    ctf_integer(int, type, type)
+    ctf_integer(int, length, length)
+    ctf_integer(int, msg_len, msg_len)
+  )
+)
+
+/* A message cannot be sent yet and is held in the message buffer. */
+TRACEPOINT_EVENT(tor_mt, buffer_hold,
+  TP_ARGS(uint64_t, id0, uint64_t, id1, int, party, int, type, int, size,
+          int, depth),
+  TP_FIELDS(
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+    ctf_integer(int, party, party)
+    ctf_integer(int, type, type)
+    ctf_integer(int, size, size)
+    ctf_integer(int, depth, depth)
+  )
+)
+
+/* The payment module of <b>role</b> starts handling a message. */
+TRACEPOINT_EVENT(tor_mt, recv_begin,
+  TP_ARGS(int, role, uint64_t, id0, uint64_t, id1, int, party, int, type,
+          int, size),
+  TP_FIELDS(
+    ctf_integer(int, role, role)
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+    ctf_integer(int, party, party)
+    ctf_integer(int, type, type)
+    ctf_integer(int, size, size)
+  )
+)
+
+/* The payment module of <b>role</b> is done handling a message. */
+TRACEPOINT_EVENT(tor_mt, recv_end,
+  TP_ARGS(int, role, uint64_t, id0, uint64_t, id1, int, type, int, result),
+  TP_FIELDS(
+    ctf_integer(int, role, role)
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+    ctf_integer(int, type, type)
+    ctf_integer(int, result, result)
+  )
+)
+
+/* A cpuworker thread starts an expensive crypto task for a channel. */
+TRACEPOINT_EVENT(tor_mt, zkp_begin,
+  TP_ARGS(int, role, const char *, task, uint64_t, id0, uint64_t, id1),
+  TP_FIELDS(
+    ctf_integer(int, role, role)
+    ctf_string(task, task)
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+  )
+)
+
+/* A cpuworker thread is done with an expensive crypto task. */
+TRACEPOINT_EVENT(tor_mt, zkp_end,
+  TP_ARGS(int, role, const char *, task, uint64_t, id0, uint64_t, id1,
+          int, result),
+  TP_FIELDS(
+    ctf_integer(int, role, role)
+    ctf_string(task, task)
+    ctf_integer(uint64_t, id0, id0)
+    ctf_integer(uint64_t, id1, id1)
+    ctf_integer(int, result, result)
+  )
+)
+
+#endif /* TOR_TRACE_LTTNG_MT_H */
+
+#include <lttng/tracepoint-event.h>
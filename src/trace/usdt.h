@@ -0,0 +1,23 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file usdt.h
+ * \brief Map trace events to USDT probes.
+ **/
+
+#ifndef TOR_TRACE_USDT_H
+#define TOR_TRACE_USDT_H
+
+/* Let sys/sdt.h pick the probe macro from the number of arguments. */
+#define SDT_USE_VARIADIC
+#include <sys/sdt.h>
+
+/* Every event becomes the probe <b>name</b> of provider "tor_<subsystem>".
+ * A probe nobody is attached to costs a single nop, so unlike the debug
+ * framework this one can stay compiled in production. */
+#undef tor_trace
+#define tor_trace(subsystem, name, args...) \
+  STAP_PROBEV(tor_##subsystem, name, ## args)
+
+#endif /* TOR_TRACE_USDT_H */